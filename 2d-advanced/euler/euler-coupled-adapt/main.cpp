@@ -2,13 +2,14 @@
 #include "hermes2d.h"
 
 using namespace Hermes;
+using namespace Hermes::Solvers;
 using namespace Hermes::Hermes2D;
 using namespace Hermes::Hermes2D::Views;
+using namespace Hermes::Hermes2D::RefinementSelectors;
 
-using namespace RefinementSelectors;
 // This example solves the compressible Euler equations coupled with an advection-diffution equation
-// using a basic piecewise-constant finite volume method for the flow and continuous FEM for the concentration
-// being advected by the flow.
+// using the semi-implicit DG method for the flow and continuous FEM for the concentration
+// being advected by the flow, both with adaptivity.
 //
 // Equations: Compressible Euler equations, perfect gas state equation, advection-diffusion equation.
 //
@@ -19,10 +20,8 @@ using namespace RefinementSelectors;
 // IC: Various.
 //
 // The following parameters can be changed:
-// Semi-implicit scheme.
-const bool SEMI_IMPLICIT = true;
 // Visualization.
-// Set to "true" to enable Hermes OpenGL visualization. 
+// Set to "true" to enable Hermes OpenGL visualization.
 const bool HERMES_VISUALIZATION = false;
 // Set to "true" to enable VTK output.
 const bool VTK_VISUALIZATION = true;
@@ -49,54 +48,44 @@ double ADVECTION_STABILITY_CONSTANT = 0.5;
 const double DIFFUSION_STABILITY_CONSTANT = 1.0;
 
 // Polynomial degree for the Euler equations (for the flow).
-const int P_INIT_FLOW = 0;                        
+const int P_INIT_FLOW = 0;
 // Polynomial degree for the concentration.
-const int P_INIT_CONCENTRATION = 1;               
+const int P_INIT_CONCENTRATION = 1;
 // CFL value.
-double CFL_NUMBER = 0.5;                          
-// Initial and utility time step.
-double time_step_n = 1E-5, util_time_step, time_step_after_adaptivity;          
+double CFL_NUMBER = 0.5;
+// Length of the time interval.
+const double TIME_INTERVAL_LENGTH = 10.0;
+
+// Multirate time stepping: the flow and the concentration are advanced with their own time steps (CFL_NUMBER,
+// resp. ADVECTION_STABILITY_CONSTANT and DIFFUSION_STABILITY_CONSTANT), the faster one in substeps within the time step
+// of the slower one. Set to "false" for the common (smaller) time step.
+const bool MULTIRATE = true;
+// Maximum number of substeps in one time step.
+const int MAX_SUBSTEPS = 100;
 
 // Adaptivity.
-// Every UNREF_FREQth time step the mesh is unrefined.
+// Every UNREF_FREQth time step the meshes are unrefined: the flow one where it is not needed anymore (the sons of an element
+// are merged if their error indicators relative to the average one sum below DEREFINEMENT_THRESHOLD), the concentration one globally.
 const int UNREF_FREQ = 5;
+const double DEREFINEMENT_THRESHOLD = 0.1;
 bool FORCE_UNREF = false;
 // Number of mesh refinements between two unrefinements.
 // The mesh is not unrefined unless there has been a refinement since
 // last unrefinement.
-int REFINEMENT_COUNT_FLOW = 0;                         
+int REFINEMENT_COUNT_FLOW = 0;
 // Number of mesh refinements between two unrefinements.
 // The mesh is not unrefined unless there has been a refinement since
 // last unrefinement.
-int REFINEMENT_COUNT_CONCENTRATION = 0;                         
+int REFINEMENT_COUNT_CONCENTRATION = 0;
 // This is a quantitative parameter of the adapt(...) function and
 // it has different meanings for various adaptive strategies.
-const double THRESHOLD = 0.3;                     
-// Adaptive strategy:
-// STRATEGY = 0 ... refine elements until sqrt(THRESHOLD) times total
-//  error is processed. If more elements have similar errors, refine
-//  all to keep the mesh symmetric.
-// STRATEGY = 1 ... refine all elements whose error is larger
-//  than THRESHOLD times maximum element error.
-// STRATEGY = 2 ... refine all elements whose error is larger
-//  than THRESHOLD.
-const int STRATEGY = 1;                           
+const double THRESHOLD = 0.3;
 // Predefined list of element refinement candidates. Possible values are
 // H2D_P_ISO, H2D_P_ANISO, H2D_H_ISO, H2D_H_ANISO, H2D_HP_ISO,
 // H2D_HP_ANISO_H, H2D_HP_ANISO_P, H2D_HP_ANISO.
-const CandList CAND_LIST_FLOW = H2D_HP_ANISO, CAND_LIST_CONCENTRATION = H2D_HP_ANISO;     
-// Maximum polynomial degree used. -1 for unlimited.
-const int MAX_P_ORDER = -1;
-// Maximum allowed level of hanging nodes:
-// MESH_REGULARITY = -1 ... arbitrary level hangning nodes (default),
-// MESH_REGULARITY = 1 ... at most one-level hanging nodes,
-// MESH_REGULARITY = 2 ... at most two-level hanging nodes, etc.
-// Note that regular meshes are not supported, this is due to
-// their notoriously bad performance.
-const int MESH_REGULARITY = -1;                   
-// This parameter influences the selection of
-// candidates in hp-adaptivity. Default value is 1.0. 
-const double CONV_EXP = 1;           
+const CandList CAND_LIST_FLOW = H2D_HP_ANISO, CAND_LIST_CONCENTRATION = H2D_HP_ANISO;
+// Maximum number of adaptivity steps in one time step.
+const int MAX_ADAPTIVITY_STEPS = 5;
 // Stopping criterion time steps with the higher tolerance.
 int ERR_STOP_REDUCE_TIME_STEP = 10;
 // Stopping criterion for adaptivity.
@@ -107,36 +96,33 @@ double ERR_STOP_INIT_CONCENTRATION = 15.0;
 double ERR_STOP_CONCENTRATION = 5.0;
 // Adaptivity process stops when the number of degrees of freedom grows over
 // this limit. This is mainly to prevent h-adaptivity to go on forever.
-const int NDOF_STOP = 3500;                     
-// Matrix solver for orthogonal projections: SOLVER_AMESOS, SOLVER_AZTECOO, SOLVER_MUMPS,
-// SOLVER_PETSC, SOLVER_SUPERLU, SOLVER_UMFPACK.
-MatrixSolverType matrix_solver = SOLVER_UMFPACK;  
+const int NDOF_STOP = 3500;
 
 // Number of initial uniform mesh refinements of the mesh for the flow.
-unsigned int INIT_REF_NUM_FLOW = 2;               
+unsigned int INIT_REF_NUM_FLOW = 2;
 // Number of initial uniform mesh refinements of the mesh for the concentration.
-unsigned int INIT_REF_NUM_CONCENTRATION = 2;      
-// Number of initial mesh refinements of the mesh for the concentration towards the 
+unsigned int INIT_REF_NUM_CONCENTRATION = 2;
+// Number of initial mesh refinements of the mesh for the concentration towards the
 // part of the boundary where the concentration is prescribed.
-unsigned int INIT_REF_NUM_CONCENTRATION_BDY = 1;  
+unsigned int INIT_REF_NUM_CONCENTRATION_BDY = 1;
 
 // Equation parameters.
 // Exterior pressure (dimensionless).
-const double P_EXT = 2.5;                               
-// Inlet density (dimensionless).   
-const double RHO_EXT = 1.0;                             
+const double P_EXT = 2.5;
+// Inlet density (dimensionless).
+const double RHO_EXT = 1.0;
 // Inlet x-velocity (dimensionless).
 const double V1_EXT = 1.25;
 // Inlet y-velocity (dimensionless).
-const double V2_EXT = 0.0;                            
+const double V2_EXT = 0.0;
 // Kappa.
-const double KAPPA = 1.4;                               
+const double KAPPA = 1.4;
 // Concentration on the boundary.
-const double CONCENTRATION_EXT = 0.01;                  
+const double CONCENTRATION_EXT = 0.01;
 // Start time of the concentration on the boundary.
-const double CONCENTRATION_EXT_STARTUP_TIME = 0.0;     
+const double CONCENTRATION_EXT_STARTUP_TIME = 0.0;
 // Diffusivity.
-const double EPSILON = 0.005;                           
+const double EPSILON = 0.005;
 
 // Boundary markers.
 const std::string BDY_INLET = "1";
@@ -153,26 +139,19 @@ const std::string BDY_DIRICHLET_CONCENTRATION = "3";
 
 int main(int argc, char* argv[])
 {
-  std::vector<std::string> BDY_NATURAL_CONCENTRATION;
-  BDY_NATURAL_CONCENTRATION.push_back("2");
-
   // Load the mesh.
-  Mesh basemesh;
+  MeshSharedPtr mesh_flow(new Mesh), mesh_concentration(new Mesh);
   MeshReaderH2D mloader;
-  mloader.load("GAMM-channel.mesh", &basemesh);
-
-  // Initialize the meshes.
-  MeshSharedPtr mesh_flow, mesh_concentration;
-  mesh_flow.copy(&basemesh);
-  mesh_concentration.copy(&basemesh);
+  mloader.load("GAMM-channel.mesh", mesh_flow);
+  mesh_concentration->copy(mesh_flow);
 
   for(unsigned int i = 0; i < INIT_REF_NUM_CONCENTRATION; i++)
-    mesh_concentration.refine_all_elements(0, true);
+    mesh_concentration->refine_all_elements(0, true);
 
-  mesh_concentration.refine_towards_boundary(BDY_DIRICHLET_CONCENTRATION, INIT_REF_NUM_CONCENTRATION_BDY, true, true);
+  mesh_concentration->refine_towards_boundary(BDY_DIRICHLET_CONCENTRATION, INIT_REF_NUM_CONCENTRATION_BDY, true, true);
 
   for(unsigned int i = 0; i < INIT_REF_NUM_FLOW; i++)
-    mesh_flow.refine_all_elements(0, true);
+    mesh_flow->refine_all_elements(0, true);
 
   // Initialize boundary condition types and spaces with default shapesets.
   // For the concentration.
@@ -182,57 +161,91 @@ int main(int argc, char* argv[])
   bcs_concentration.add_boundary_condition(new ConcentrationTimedepEssentialBC(BDY_SOLID_WALL_TOP, 0.0, CONCENTRATION_EXT_STARTUP_TIME));
   bcs_concentration.add_boundary_condition(new ConcentrationTimedepEssentialBC(BDY_INLET, 0.0, CONCENTRATION_EXT_STARTUP_TIME));
 
-SpaceSharedPtr<double>space_rho(mesh_flow, P_INIT_FLOW);
-  L2Space<double>space_rho_v_x(mesh_flow, P_INIT_FLOW);
-  L2Space<double>space_rho_v_y(mesh_flow, P_INIT_FLOW);
-  L2Space<double>space_e(mesh_flow, P_INIT_FLOW);
+  SpaceSharedPtr<double> space_rho(new L2Space<double>(mesh_flow, P_INIT_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_rho_v_x(new L2Space<double>(mesh_flow, P_INIT_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_rho_v_y(new L2Space<double>(mesh_flow, P_INIT_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_e(new L2Space<double>(mesh_flow, P_INIT_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  std::vector<SpaceSharedPtr<double> > flow_spaces({space_rho, space_rho_v_x, space_rho_v_y, space_e});
 
   // Space<double> for concentration.
-  H1Space<double> space_c(new L2Space<double>(mesh_concentration, &bcs_concentration, P_INIT_CONCENTRATION));
+  SpaceSharedPtr<double> space_c(new H1Space<double>(mesh_concentration, &bcs_concentration, P_INIT_CONCENTRATION));
+  std::vector<SpaceSharedPtr<double> > concentration_spaces({space_c});
 
-  int ndof = Space<double>::get_num_dofs({&space_rho, &space_rho_v_x, &space_rho_v_y, &space_e, &space_c});
-  Hermes::Mixins::Loggable::Static::info("ndof: %d", ndof);
+  Hermes::Mixins::Loggable::Static::info("ndof: %d", Space<double>::get_num_dofs({space_rho, space_rho_v_x, space_rho_v_y, space_e, space_c}));
 
   // Initialize solutions, set initial conditions.
-  ConstantSolution<double> sln_rho(mesh_flow, RHO_EXT);
-  ConstantSolution<double> sln_rho_v_x(mesh_flow, RHO_EXT * V1_EXT);
-  ConstantSolution<double> sln_rho_v_y(mesh_flow, RHO_EXT * V2_EXT);
-  ConstantSolution<double> sln_e(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA));
-  ConstantSolution<double> sln_c(mesh_concentration, 0.0);
-
-  ConstantSolution<double> prev_rho(mesh_flow, RHO_EXT);
-  ConstantSolution<double> prev_rho_stabilization(mesh_flow, RHO_EXT);
-  ConstantSolution<double> prev_rho_v_x(mesh_flow, RHO_EXT * V1_EXT);
-  ConstantSolution<double> prev_rho_v_y(mesh_flow, RHO_EXT * V2_EXT);
-  ConstantSolution<double> prev_e(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA));
-  ConstantSolution<double> prev_c(mesh_concentration, 0.0);
-
-  ConstantSolution<double> rsln_rho(mesh_flow, RHO_EXT);
-  ConstantSolution<double> rsln_rho_v_x(mesh_flow, RHO_EXT * V1_EXT);
-  ConstantSolution<double> rsln_rho_v_y(mesh_flow, RHO_EXT * V2_EXT);
-  ConstantSolution<double> rsln_e(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA));
-  ConstantSolution<double> rsln_c(mesh_concentration, 0.0);
+  // The previous time level solutions, on the reference meshes after the first time step.
+  MeshFunctionSharedPtr<double> prev_rho(new ConstantSolution<double>(mesh_flow, RHO_EXT));
+  MeshFunctionSharedPtr<double> prev_rho_v_x(new ConstantSolution<double>(mesh_flow, RHO_EXT * V1_EXT));
+  MeshFunctionSharedPtr<double> prev_rho_v_y(new ConstantSolution<double>(mesh_flow, RHO_EXT * V2_EXT));
+  MeshFunctionSharedPtr<double> prev_e(new ConstantSolution<double>(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA)));
+  MeshFunctionSharedPtr<double> prev_c(new ConstantSolution<double>(mesh_concentration, 0.0));
+  std::vector<MeshFunctionSharedPtr<double> > prev_flow_slns({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e});
+  std::vector<MeshFunctionSharedPtr<double> > prev_concentration_slns({prev_c});
+
+  // The flow at the start of the time step, the concentration sees the flow interpolated between it and the current one.
+  MeshFunctionSharedPtr<double> start_rho(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_rho_v_x(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_rho_v_y(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_e(new Solution<double>(mesh_flow));
+  std::vector<MeshFunctionSharedPtr<double> > start_flow_slns({start_rho, start_rho_v_x, start_rho_v_y, start_e});
+
+  // The reference solutions projected onto the coarse meshes.
+  MeshFunctionSharedPtr<double> sln_rho(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> sln_rho_v_x(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> sln_rho_v_y(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> sln_e(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> sln_c(new Solution<double>(mesh_concentration));
+  std::vector<MeshFunctionSharedPtr<double> > flow_slns({sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e});
+  std::vector<MeshFunctionSharedPtr<double> > concentration_slns({sln_c});
 
   // Initialize weak formulation.
-  WeakForm<double>* wf = NULL;
-  if(SEMI_IMPLICIT)
+  std::vector<std::string> solid_wall_markers({BDY_SOLID_WALL_BOTTOM, BDY_SOLID_WALL_TOP});
+  std::vector<std::string> inlet_markers({BDY_INLET});
+  std::vector<std::string> outlet_markers({BDY_OUTLET});
+
+  // The flow and the concentration, each one on its own mesh, with its own system.
+  WeakFormSharedPtr<double> wf_flow(new EulerEquationsWeakFormSemiImplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, P_INIT_FLOW == 0));
+  WeakFormSharedPtr<double> wf_concentration(new ConcentrationEquationWeakFormCoupledWithFlow(EPSILON, prev_c,
+    start_rho, start_rho_v_x, start_rho_v_y, prev_rho, prev_rho_v_x, prev_rho_v_y));
+  EulerEquationsWeakFormSemiImplicit* wf_flow_ptr = (EulerEquationsWeakFormSemiImplicit*)(wf_flow.get());
+  ConcentrationEquationWeakFormCoupledWithFlow* wf_concentration_ptr = (ConcentrationEquationWeakFormCoupledWithFlow*)(wf_concentration.get());
+
+  // Feistauer's indicator is calculated from the coefficient vector of the previous time level flow on the reference mesh,
+  // the weak form points to its flags, they are recalculated in place.
+  FeistauerShockIndicator shock_indicator;
+  if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
   {
-    wf = new EulerEquationsWeakFormSemiImplicitCoupled(KAPPA, RHO_EXT, V1_EXT, V2_EXT, P_EXT, BDY_SOLID_WALL_BOTTOM,
-      BDY_SOLID_WALL_TOP, BDY_INLET, BDY_OUTLET, BDY_NATURAL_CONCENTRATION, &prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c, EPSILON);
-
-    if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
-      static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_stabilization(&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, NU_1, NU_2);
+    wf_flow_ptr->set_stabilization(prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, NU_1, NU_2);
+    wf_flow_ptr->set_discreteIndicator(&shock_indicator.get_flags());
   }
-  else
-    wf = new EulerEquationsWeakFormExplicitCoupled(KAPPA, RHO_EXT, V1_EXT, V2_EXT, P_EXT, BDY_SOLID_WALL_BOTTOM,
-    BDY_SOLID_WALL_TOP, BDY_INLET, BDY_OUTLET, BDY_NATURAL_CONCENTRATION, &prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c, EPSILON);
 
-  EulerEquationsWeakFormStabilization wf_stabilization(&prev_rho_stabilization);
+  // Solvers, on the reference spaces.
+  LinearSolver<double> flow_solver(wf_flow, flow_spaces);
+  LinearSolver<double> concentration_solver(wf_concentration, space_c);
+
+  // The reference meshes and spaces, updated only where the coarse ones changed.
+  ReferenceSpaceUpdater ref_flow_updater(flow_spaces, CAND_LIST_FLOW == H2D_HP_ANISO ? 1 : 0);
+  ReferenceSpaceUpdater ref_concentration_updater(concentration_spaces, 1);
+
+  // The accepted solutions as the coefficient vectors in the reference spaces they are on. They are projected onto the new
+  // reference spaces, and the reference solutions onto the coarse ones (element by element for the L2 spaces of the flow).
+  std::vector<SpaceSharedPtr<double> > prev_ref_flow_spaces, prev_ref_concentration_spaces;
+  std::vector<double> prev_ref_flow_vector, prev_ref_concentration_vector;
+  LocalProjection ref_flow_projection, coarse_flow_projection;
+  LocalProjection ref_concentration_projection, coarse_concentration_projection;
+  std::vector<double> coarse_flow_vector, coarse_concentration_vector;
+
+  // Created once and re-used, the detector keeps its data as long as the reference mesh is the same.
+  FluxLimiter* flux_limiter = NULL;
+  // Writes the output files on a background thread, keeps its output points as long as the reference mesh is the same.
+  AsyncFlowQuantitiesOutput flow_output(KAPPA);
+  flow_output.set_time_series("Flow.pvd");
 
-  // Filters for visualization of Mach number, pressure and entropy.
-  MachNumberFilter Mach_number({&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e}, KAPPA);
-  PressureFilter pressure({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e}, KAPPA);
-  EntropyFilter entropy({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e}, KAPPA, RHO_EXT, P_EXT);
+  // Filters for visualization of Mach number and pressure.
+  MeshFunctionSharedPtr<double> Mach_number(new MachNumberFilter(prev_flow_slns, KAPPA));
+  MeshFunctionSharedPtr<double> pressure(new PressureFilter(prev_flow_slns, KAPPA));
 
   ScalarView pressure_view("Pressure", new WinGeom(0, 0, 600, 400));
   ScalarView Mach_number_view("Mach number", new WinGeom(700, 0, 600, 400));
@@ -241,9 +254,19 @@ SpaceSharedPtr<double>space_rho(mesh_flow, P_INIT_FLOW);
   OrderView order_view_flow("Orders - flow", new WinGeom(700, 350, 600, 400));
   OrderView order_view_conc("Orders - concentration", new WinGeom(700, 700, 600, 400));
 
-  // Initialize refinement selector.
-  L2ProjBasedSelector<double> l2selector_flow(CAND_LIST_FLOW, CONV_EXP, MAX_P_ORDER);
-  L2ProjBasedSelector<double> l2selector_concentration(CAND_LIST_CONCENTRATION, CONV_EXP, MAX_P_ORDER);
+  // Initialize refinement selectors.
+  L2ProjBasedSelector<double> selector_flow(CAND_LIST_FLOW);
+  H1ProjBasedSelector<double> selector_concentration(CAND_LIST_CONCENTRATION);
+
+  // Error calculation, each one with its own adaptivity.
+  DefaultErrorCalculator<double, HERMES_L2_NORM> error_calculator_flow(RelativeErrorToGlobalNorm, 4);
+  DefaultErrorCalculator<double, HERMES_H1_NORM> error_calculator_concentration(RelativeErrorToGlobalNorm, 1);
+  // Stopping criterion for an adaptivity step.
+  AdaptStoppingCriterionSingleElement<double> stopping_criterion(THRESHOLD);
+  Adapt<double> adaptivity_flow(flow_spaces, &error_calculator_flow, &stopping_criterion);
+  Adapt<double> adaptivity_concentration(space_c, &error_calculator_concentration, &stopping_criterion);
+  // Coarsening of the flow mesh where the error indicators are small.
+  SelectiveDerefinement derefinement_flow(flow_spaces, P_INIT_FLOW);
 
   // Set up CFL calculation class.
   CFLCalculation CFL(CFL_NUMBER, KAPPA);
@@ -251,320 +274,251 @@ SpaceSharedPtr<double>space_rho(mesh_flow, P_INIT_FLOW);
   // Set up Advection-Diffusion-Equation stability calculation class.
   ADEStabilityCalculation ADES(ADVECTION_STABILITY_CONSTANT, DIFFUSION_STABILITY_CONSTANT, EPSILON);
 
-  int iteration = 0; double t = 0; time_step_after_adaptivity = time_step_n;
-  for(t = 0.0; t < 10.0; t += time_step_after_adaptivity)
+  // The time steps of the flow and of the concentration, and the substeps.
+  MultirateTimeStepping multirate(MULTIRATE, MAX_SUBSTEPS);
+  double flow_time_step = 1E-5, concentration_time_step = 1E-5;
+
+  int iteration = 0; double t = 0;
+  for(; t < TIME_INTERVAL_LENGTH; t += multirate.get_time_step())
   {
-    Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
-    time_step_n = time_step_after_adaptivity;
-    
+    multirate.set_time_steps(flow_time_step, concentration_time_step);
+    Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f, time step %g.", iteration++, t, multirate.get_time_step());
+    Hermes::Mixins::Loggable::Static::info("Flow substeps: %d, concentration substeps: %d.", multirate.get_flow_substeps(), multirate.get_transport_substeps());
+
     // After some initial runs, begin really adapting.
     if(iteration == ERR_STOP_REDUCE_TIME_STEP)
     {
       ERR_STOP_INIT_FLOW = ERR_STOP_FLOW;
       ERR_STOP_INIT_CONCENTRATION = ERR_STOP_CONCENTRATION;
     }
-    
-    // Periodic global derefinements.
-    if ((iteration > 1 && iteration % UNREF_FREQ == 0 && (REFINEMENT_COUNT_FLOW > 0 || REFINEMENT_COUNT_CONCENTRATION > 0)) || FORCE_UNREF) 
+
+    // Periodic derefinements.
+    if((iteration > 1 && iteration % UNREF_FREQ == 0) || FORCE_UNREF)
     {
-      Hermes::Mixins::Loggable::Static::info("Global mesh derefinement.");
-      if(REFINEMENT_COUNT_FLOW > 0) 
+      FORCE_UNREF = false;
+      if(REFINEMENT_COUNT_FLOW > 0)
       {
+        Hermes::Mixins::Loggable::Static::info("Selective mesh derefinement - flow.");
         REFINEMENT_COUNT_FLOW = 0;
-        space_rho.unrefine_all_mesh_elements();
-        if(CAND_LIST_FLOW == H2D_HP_ANISO)
-        {
-          space_rho.adjust_element_order(-1, P_INIT_FLOW);
-          space_rho_v_x.adjust_element_order(-1, P_INIT_FLOW);
-          space_rho_v_y.adjust_element_order(-1, P_INIT_FLOW);
-          space_e.adjust_element_order(-1, P_INIT_FLOW);
-        }
+        int merged_count = derefinement_flow.derefine(DEREFINEMENT_THRESHOLD, CAND_LIST_FLOW == H2D_HP_ANISO);
+        Hermes::Mixins::Loggable::Static::info("Merged elements: %d, order changes: %d.", merged_count, derefinement_flow.get_order_change_count());
       }
-      if(REFINEMENT_COUNT_CONCENTRATION > 0) 
+      if(REFINEMENT_COUNT_CONCENTRATION > 0)
       {
+        Hermes::Mixins::Loggable::Static::info("Global mesh derefinement - concentration.");
         REFINEMENT_COUNT_CONCENTRATION = 0;
-        space_c.unrefine_all_mesh_elements();
-        space_c.adjust_element_order(-1, P_INIT_CONCENTRATION);
+        space_c->unrefine_all_mesh_elements();
+        space_c->adjust_element_order(-1, -1, P_INIT_CONCENTRATION, P_INIT_CONCENTRATION);
+        space_c->assign_dofs();
       }
     }
 
-    // Adaptivity loop:
-    int as = 1; 
+    // Adaptivity loop, every step repeats the whole time step (all substeps) from the accepted previous time level.
+    std::vector<SpaceSharedPtr<double> > ref_flow_spaces, ref_concentration_spaces;
+    std::vector<double> ref_flow_vector, ref_concentration_vector;
+    int as = 1;
     bool done = false;
     do
     {
       Hermes::Mixins::Loggable::Static::info("---- Adaptivity step %d:", as);
 
-      // Construct globally refined reference mesh and setup reference space.
-      int order_increase = 0;
-      if(CAND_LIST_FLOW == H2D_HP_ANISO)
-        order_increase = 1;
-
-      Mesh::ReferenceMeshCreator refMeshCreatorFlow(mesh_flow);
-      MeshSharedPtr ref_mesh_flow = refMeshCreatorFlow.create_ref_mesh();
-      Mesh::ReferenceMeshCreator refMeshCreatorConcentration(mesh_concentration);
-      MeshSharedPtr ref_mesh_concentration = refMeshCreatorConcentration.create_ref_mesh();
-
-      Space<double>::ReferenceSpaceCreator refSpaceCreatorRho(&space_rho, mesh_flow);
-SpaceSharedPtr<double>* ref_space_rho = refSpaceCreatorRho.create_ref_space(new     Space<double>());
-      Space<double>::ReferenceSpaceCreator refSpaceCreatorRhoVx(&space_rho_v_x, mesh_flow);
-SpaceSharedPtr<double>* ref_space_rho_v_x = refSpaceCreatorRhoVx.create_ref_space(new     Space<double>());
-      Space<double>::ReferenceSpaceCreator refSpaceCreatorRhoVy(&space_rho_v_y, mesh_flow);
-SpaceSharedPtr<double>* ref_space_rho_v_y = refSpaceCreatorRhoVy.create_ref_space(new     Space<double>());
-      Space<double>::ReferenceSpaceCreator refSpaceCreatorE(&space_e, mesh_flow);
-SpaceSharedPtr<double>* ref_space_e = refSpaceCreatorE.create_ref_space(new     Space<double>());
-      Space<double>::ReferenceSpaceCreator refSpaceCreatorConcentration(&space_c, mesh_concentration);
-SpaceSharedPtr<double>* ref_space_c = refSpaceCreatorConcentration.create_ref_space();
-
-      char filename[40];
-      sprintf(filename, "Flow-mesh-%i-%i.xml", iteration - 1, as - 1);
-      mloader.save(filename, ref_space_rho->get_mesh());
-      sprintf(filename, "Concentration-mesh-%i-%i.xml", iteration - 1, as - 1);
-      mloader.save(filename, ref_space_c->get_mesh());
-
-      Space<double>* ref_space_stabilization = refSpaceCreatorRho.create_ref_space();
-      ref_space_stabilization->set_uniform_order(0);
-
-      if(CAND_LIST_FLOW != H2D_HP_ANISO)
-        ref_space_c->adjust_element_order(new     Space<double>(+1, P_INIT_CONCENTRATION));
-
-      std::vector<const Space<double> *> ref_spaces(ref_space_rho, ref_space_rho_v_x, 
-        ref_space_rho_v_y, ref_space_e, ref_space_c);
-
-      // Project the previous time level solution onto the new fine mesh.
-      Hermes::Mixins::Loggable::Static::info("Projecting the previous time level solution onto the new fine mesh.");
-      OGProjection<double>::project_global(ref_spaces,{&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c}, 
-        std::vector<Solution<double>*>(&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c));
-
-      ogProjection.project_global(ref_space_stabilization, &prev_rho, &prev_rho_stabilization);
+      // Only the elements of the coarse meshes changed by the last adaptation (or derefinement) are updated.
+      bool flow_changed = ref_flow_updater.update();
+      bool concentration_changed = ref_concentration_updater.update();
+      ref_flow_spaces = ref_flow_updater.get_ref_spaces();
+      ref_concentration_spaces = ref_concentration_updater.get_ref_spaces();
+      flow_solver.set_spaces(ref_flow_spaces);
+      concentration_solver.set_spaces(ref_concentration_spaces);
 
       // Report NDOFs.
-      Hermes::Mixins::Loggable::Static::info("ndof_coarse: %d, ndof_fine: %d.", 
-        Space<double>::get_num_dofs({&space_rho, &space_rho_v_x, 
-        space_rho_v_y, &space_e, &space_c}), Space<double>::get_num_dofs(ref_spaces));
-
-      // Very important, set the meshes for the flow as the same.
-      ref_space_rho_v_x->get_mesh()->set_seq(ref_space_rho->get_mesh()->get_seq());
-      ref_space_rho_v_y->get_mesh()->set_seq(ref_space_rho->get_mesh()->get_seq());
-      ref_space_e->get_mesh()->set_seq(ref_space_rho->get_mesh()->get_seq());
-
-      // Set up the solver, matrix, and rhs according to the solver selection.
-      SparseMatrix<double>* matrix = create_matrix<double>();
-      Vector<double>* rhs = create_vector<double>();
-      Vector<double>* rhs_stabilization = create_vector<double>();
-      Hermes::Solvers::LinearMatrixSolver<double>* solver = create_linear_solver<double>( matrix, rhs);
-
-      // Initialize the FE problem.
-      DiscreteProblem<double> dp(wf, ref_spaces);
-      DiscreteProblem<double> dp_stabilization(wf_stabilization, ref_space_stabilization);
-      bool* discreteIndicator = NULL;
-
-      if(SEMI_IMPLICIT)
+      Hermes::Mixins::Loggable::Static::info("ndof_coarse: %d, ndof_fine: %d.",
+        Space<double>::get_num_dofs(flow_spaces) + Space<double>::get_num_dofs(concentration_spaces),
+        Space<double>::get_num_dofs(ref_flow_spaces) + Space<double>::get_num_dofs(ref_concentration_spaces));
+
+      // The previous time level solutions on the reference spaces, in the first time step the initial condition.
+      // If the reference spaces are those of the accepted solution, it is there already.
+      if(!flow_changed && prev_ref_flow_spaces == ref_flow_spaces)
+        ref_flow_vector = prev_ref_flow_vector;
+      else
       {
-        static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_current_time_step(time_step_n);
-        if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
-        {
-          Hermes::Mixins::Loggable::Static::info("Assembling the stabilization right-hand side vector.");
-          dp_stabilization.assemble(rhs_stabilization);
-          if(discreteIndicator != NULL)
-            delete [] discreteIndicator;
-          discreteIndicator = new bool[ref_space_stabilization->get_mesh()->get_max_element_id() + 1];
-          for(unsigned int i = 0; i < ref_space_stabilization->get_mesh()->get_max_element_id() + 1; i++)
-            discreteIndicator[i] = false;
-          Element* e;
-          for_all_active_elements(e, ref_space_stabilization->get_mesh())
-          {
-            AsmList<double> al;
-            ref_space_stabilization->get_element_assembly_list(e, &al);
-            if(rhs_stabilization->get(al.get_dof()[0]) >= 1)
-              discreteIndicator[e->id] = true;
-          }
-          static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_discreteIndicator(discreteIndicator, ref_space_stabilization->get_mesh()->get_max_element_id() + 1);
-        }
+        ref_flow_vector.resize(Space<double>::get_num_dofs(ref_flow_spaces));
+        if(prev_ref_flow_vector.empty())
+          OGProjection<double>::project_global(ref_flow_spaces, prev_flow_slns, &ref_flow_vector[0]);
+        else
+          ref_flow_projection.project(prev_ref_flow_spaces, &prev_ref_flow_vector[0], ref_flow_spaces, &ref_flow_vector[0]);
       }
+      if(!concentration_changed && prev_ref_concentration_spaces == ref_concentration_spaces)
+        ref_concentration_vector = prev_ref_concentration_vector;
       else
-        static_cast<EulerEquationsWeakFormExplicitCoupled*>(wf)->set_current_time_step(time_step_n);
-
-      // Assemble stiffness matrix and rhs.
-      Hermes::Mixins::Loggable::Static::info("Assembling the stiffness matrix and right-hand side vector.");
-      dp.assemble(matrix, rhs);
-
-      // Solve the matrix problem.
-      Hermes::Mixins::Loggable::Static::info("Solving the matrix problem.");
-      FluxLimiter* flux_limiter;
-      if(solver->solve())
       {
-        if(!SHOCK_CAPTURING || SHOCK_CAPTURING_TYPE == FEISTAUER)
-        {
-          Solution<double>::vector_to_solutions(solver->get_sln_vector(), ref_spaces, 
-            std::vector<Solution<double>*>(&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e, &rsln_c));
-SpaceSharedPtr<double>*> flow_spaces(new       }
+        ref_concentration_vector.resize(Space<double>::get_num_dofs(ref_concentration_spaces));
+        if(prev_ref_concentration_vector.empty())
+          OGProjection<double>::project_global(ref_concentration_spaces, prev_concentration_slns, &ref_concentration_vector[0]);
         else
+          ref_concentration_projection.project(prev_ref_concentration_spaces, &prev_ref_concentration_vector[0], ref_concentration_spaces, &ref_concentration_vector[0]);
+      }
+      Solution<double>::vector_to_solutions(&ref_flow_vector[0], ref_flow_spaces, prev_flow_slns);
+      Solution<double>::vector_to_solutions(&ref_flow_vector[0], ref_flow_spaces, start_flow_slns);
+      Solution<double>::vector_to_solutions(&ref_concentration_vector[0], ref_concentration_spaces, prev_concentration_slns);
+
+      try
+      {
+        // Advance the flow over the whole time step, with optional shock capturing.
+        wf_flow_ptr->set_current_time_step(multirate.get_flow_substep());
+        for(int substep_i = 0; substep_i < multirate.get_flow_substeps(); substep_i++)
         {
-          std::vector<const Space<double>(ref_space_rho, ref_space_rho_v_x, ref_space_rho_v_y, ref_space_e));
+          if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+            shock_indicator.calculate(ref_flow_spaces[0], &ref_flow_vector[0]);
 
-          double* flow_solution_vector = new double[Space<double>::get_num_dofs(flow_spaces)];
+          flow_solver.solve();
+          double* sln_vector = flow_solver.get_sln_vector();
 
-          OGProjection<double>::project_global(flow_spaces,{&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e}, flow_solution_vector);
+          // The limiters work in place on the solver's vector.
+          if(SHOCK_CAPTURING && P_INIT_FLOW > 0)
+          {
+            if(SHOCK_CAPTURING_TYPE == KRIVODONOVA)
+            {
+              if(!flux_limiter)
+                flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, sln_vector, ref_flow_spaces);
+              else
+                flux_limiter->set_solution_vector(sln_vector, ref_flow_spaces);
+              flux_limiter->limit_according_to_detector();
+            }
+
+            if(SHOCK_CAPTURING_TYPE == KUZMIN)
+            {
+              PostProcessing::VertexBasedLimiter limiter(ref_flow_spaces, sln_vector, 1);
+              limiter.get_solutions(prev_flow_slns);
+              memcpy(sln_vector, limiter.get_solution_vector(), Space<double>::get_num_dofs(ref_flow_spaces) * sizeof(double));
+            }
+          }
 
-          if(SHOCK_CAPTURING_TYPE == KUZMIN)
-            flux_limiter = new FluxLimiter(FluxLimiter::Kuzmin, flow_solution_vector, flow_spaces);
-          else
-            flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, flow_solution_vector, flow_spaces);
+          ref_flow_vector.assign(sln_vector, sln_vector + Space<double>::get_num_dofs(ref_flow_spaces));
+          Solution<double>::vector_to_solutions(sln_vector, ref_flow_spaces, prev_flow_slns);
+        }
 
-          flux_limiter->get_limited_solutions({&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e});
+        // Advance the concentration in its substeps, with the flow interpolated to their ends.
+        wf_concentration_ptr->set_current_time_step(multirate.get_transport_substep());
+        for(int substep_i = 0; substep_i < multirate.get_transport_substeps(); substep_i++)
+        {
+          wf_concentration_ptr->set_time_interpolation(multirate.get_time_interpolation(substep_i));
+          Space<double>::update_essential_bc_values(ref_concentration_spaces, t + (substep_i + 1) * multirate.get_transport_substep());
+
+          concentration_solver.solve();
+          double* sln_vector = concentration_solver.get_sln_vector();
+          ref_concentration_vector.assign(sln_vector, sln_vector + Space<double>::get_num_dofs(ref_concentration_spaces));
+          Solution<double>::vector_to_solutions(sln_vector, ref_concentration_spaces, prev_concentration_slns);
         }
       }
-      else
-        throw Hermes::Exceptions::Exception("Matrix solver failed.\n");
-
-      Mach_number.reinit();
-      char filenamea[40];
-      Linearizer lin_mach;
-      sprintf(filenamea, "Mach number-3D-%i-%i.vtk", iteration - 1, as);
-      lin_mach.save_solution_vtk(Mach_number, filenamea, "MachNumber", true);
-      
-      Linearizer lin_concentration;
-      sprintf(filenamea, "Concentration-%i-%i.vtk", iteration - 1, as);
-      lin_concentration.save_solution_vtk(prev_c, filenamea, "Concentration", true);
-
-      // Project the fine mesh solution onto the coarse mesh.
-      Hermes::Mixins::Loggable::Static::info("Projecting reference solution on coarse mesh.");
-      ogProjection.project_global({&space_rho, &space_rho_v_x,
-        &space_rho_v_y, &space_e, &space_c},{&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e, &rsln_c},
-        std::vector<Solution<double>*>(sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e, sln_c),
-        std::vector<NormType>(HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM));
-
-      util_time_step = time_step_n;
-      if(SEMI_IMPLICIT)
-        CFL.calculate_semi_implicit({rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e}, const_cast<MeshSharedPtr>(rsln_rho.get_mesh()), util_time_step);
-      else
-        CFL.calculate({rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e}, const_cast<MeshSharedPtr>(rsln_rho.get_mesh()), util_time_step);
-      
-      time_step_after_adaptivity = util_time_step;
-      
-      ADES.calculate({rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y}, const_cast<MeshSharedPtr>(rsln_rho.get_mesh()), util_time_step);
-      if(time_step_after_adaptivity > util_time_step)
-        time_step_after_adaptivity = util_time_step;
-
-      ADES.calculate({rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y}, const_cast<MeshSharedPtr>(rsln_c.get_mesh()), util_time_step);
-      if(time_step_after_adaptivity > util_time_step)
-        time_step_after_adaptivity = util_time_step;
-
-      // Calculate element errors and total error estimate.
-      Hermes::Mixins::Loggable::Static::info("Calculating error estimates.");
-      Adapt<double> adaptivity_flow({&space_rho, &space_rho_v_x,
-        &space_rho_v_y, &space_e},{HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM});
+      catch(std::exception& e)
+      {
+        std::cout << e.what();
+        return -1;
+      }
 
-      double err_est_rel_total_flow = adaptivity_flow.calc_err_est({sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e},
-        std::vector<Solution<double>*>(&rsln_rho, &rsln_rho_v_x, &rsln_rho_v_y, &rsln_e)) * 100;
+      // Project the fine mesh solutions onto the coarse meshes.
+      Hermes::Mixins::Loggable::Static::info("Projecting reference solutions on coarse meshes.");
+      coarse_flow_vector.resize(Space<double>::get_num_dofs(flow_spaces));
+      coarse_flow_projection.project(ref_flow_spaces, &ref_flow_vector[0], flow_spaces, &coarse_flow_vector[0]);
+      Solution<double>::vector_to_solutions(&coarse_flow_vector[0], flow_spaces, flow_slns);
+      coarse_concentration_vector.resize(Space<double>::get_num_dofs(concentration_spaces));
+      coarse_concentration_projection.project(ref_concentration_spaces, &ref_concentration_vector[0], concentration_spaces, &coarse_concentration_vector[0]);
+      Solution<double>::vector_to_solutions(&coarse_concentration_vector[0], concentration_spaces, concentration_slns);
 
-      Adapt<double> adaptivity_concentration(&space_c, HERMES_L2_NORM);
+      // Calculate element errors and total error estimate, the reference solutions are the new time level ones.
+      Hermes::Mixins::Loggable::Static::info("Calculating error estimates.");
+      error_calculator_flow.calculate_errors(flow_slns, prev_flow_slns);
+      double err_est_rel_total_flow = error_calculator_flow.get_total_error_squared() * 100;
+      derefinement_flow.set_indicators(&error_calculator_flow);
 
-      double err_est_rel_total_concentration = adaptivity_concentration.calc_err_est(sln_c, &rsln_c) * 100;
+      error_calculator_concentration.calculate_errors(concentration_slns, prev_concentration_slns);
+      double err_est_rel_total_concentration = error_calculator_concentration.get_total_error_squared() * 100;
 
       // Report results.
       Hermes::Mixins::Loggable::Static::info("Error estimate for the flow part: %g%%", err_est_rel_total_flow);
-
       Hermes::Mixins::Loggable::Static::info("Error estimate for the concentration part: %g%%", err_est_rel_total_concentration);
 
       // If err_est too large, adapt the mesh.
-      if (err_est_rel_total_flow < ERR_STOP_INIT_FLOW && err_est_rel_total_concentration < ERR_STOP_INIT_CONCENTRATION)
-      {
+      if(err_est_rel_total_flow < ERR_STOP_INIT_FLOW && err_est_rel_total_concentration < ERR_STOP_INIT_CONCENTRATION)
         done = true;
-        if(SHOCK_CAPTURING && (SHOCK_CAPTURING_TYPE == KUZMIN || SHOCK_CAPTURING_TYPE == KRIVODONOVA))
-        {
-          if(SHOCK_CAPTURING_TYPE == KUZMIN)
-            flux_limiter->limit_second_orders_according_to_detector();
-
-          flux_limiter->limit_according_to_detector();
-        }
-      }
-
       else
       {
         Hermes::Mixins::Loggable::Static::info("Adapting coarse meshes.");
+        done = true;
         if(err_est_rel_total_flow > ERR_STOP_INIT_FLOW)
         {
-          done = adaptivity_flow.adapt({&l2selector_flow, &l2selector_flow, &l2selector_flow, &l2selector_flow}, 
-            THRESHOLD, STRATEGY, MESH_REGULARITY);
+          if(!adaptivity_flow.adapt({&selector_flow, &selector_flow, &selector_flow, &selector_flow}))
+            done = false;
           REFINEMENT_COUNT_FLOW++;
         }
-        else
-          done = true;
         if(err_est_rel_total_concentration > ERR_STOP_INIT_CONCENTRATION)
         {
-          if(!adaptivity_concentration.adapt(&l2selector_concentration, THRESHOLD, STRATEGY, MESH_REGULARITY))
+          if(!adaptivity_concentration.adapt(&selector_concentration))
             done = false;
           REFINEMENT_COUNT_CONCENTRATION++;
         }
 
-        if (Space<double>::get_num_dofs({&space_rho, &space_rho_v_x, 
-          &space_rho_v_y, &space_e, &space_c}) >= NDOF_STOP)
+        int ndof_coarse = Space<double>::get_num_dofs(flow_spaces) + Space<double>::get_num_dofs(concentration_spaces);
+        if(ndof_coarse >= NDOF_STOP)
         {
           done = true;
-          Hermes::Mixins::Loggable::Static::info("Maximum number of dofs of the coarse meshes, %i, has been reached, adaptivity loop ends.", Space<double>::get_num_dofs({&space_rho, &space_rho_v_x, 
-          &space_rho_v_y, &space_e, &space_c}));
+          Hermes::Mixins::Loggable::Static::info("Maximum number of dofs of the coarse meshes, %i, has been reached, adaptivity loop ends.", ndof_coarse);
           FORCE_UNREF = true;
         }
         else
           // Increase the counter of performed adaptivity steps.
           as++;
       }
-
-      // Clean up.
-      delete solver;
-      delete matrix;
-      delete rhs;
     }
-    while (done == false && as < 5);
+    while(done == false && as < MAX_ADAPTIVITY_STEPS);
+
+    // The last reference solutions are the previous time level ones in the next time step.
+    prev_ref_flow_spaces = ref_flow_spaces;
+    prev_ref_flow_vector.swap(ref_flow_vector);
+    prev_ref_concentration_spaces = ref_concentration_spaces;
+    prev_ref_concentration_vector.swap(ref_concentration_vector);
 
-    // Copy the solutions into the previous time level ones.
-    prev_rho.copy(&rsln_rho);
-    prev_rho_v_x.copy(&rsln_rho_v_x);
-    prev_rho_v_y.copy(&rsln_rho_v_y);
-    prev_e.copy(&rsln_e);
-    prev_c.copy(&rsln_c);
+    // The stable time steps of the next time step, each one from the current flow on its reference mesh.
+    CFL.calculate_semi_implicit(prev_ref_flow_spaces, &prev_ref_flow_vector[0], flow_time_step);
+    ADES.calculate({prev_rho, prev_rho_v_x, prev_rho_v_y}, prev_ref_concentration_spaces[0]->get_mesh(), concentration_time_step);
 
     // Visualization.
-    if((iteration - 1) % EVERY_NTH_STEP == 0) 
+    if((iteration - 1) % EVERY_NTH_STEP == 0)
     {
       // Hermes visualization.
       if(HERMES_VISUALIZATION)
       {
-        Mach_number.reinit();
-        pressure.reinit();
+        Mach_number->reinit();
+        pressure->reinit();
 
         pressure_view.show_mesh(false);
-        pressure_view.show(&pressure);
         pressure_view.set_scale_format("%1.3f");
+        pressure_view.show(pressure);
 
         Mach_number_view.show_mesh(false);
         Mach_number_view.set_scale_format("%1.3f");
-        Mach_number_view.show(&Mach_number);
+        Mach_number_view.show(Mach_number);
 
         s5.show_mesh(false);
         s5.set_scale_format("%0.3f");
-        s5.show(&prev_c);
+        s5.show(prev_c);
 
-        pressure_view.save_numbered_screenshot("pressure%i.bmp", (int)(iteration / 5), true);
-        Mach_number_view.save_numbered_screenshot("Mach_number%i.bmp", (int)(iteration / 5), true);
-        s5.save_numbered_screenshot("concentration%i.bmp", (int)(iteration / 5), true);
+        order_view_flow.show(space_rho);
+        order_view_conc.show(space_c);
       }
-      // Output solution in VTK format.
+      // Output solution in VTK format, the flow quantities in one file indexed in Flow.pvd.
       if(VTK_VISUALIZATION)
       {
-        
+        char filename[40];
+        sprintf(filename, "Flow-%i.vtu", iteration - 1);
+        flow_output.save_vtu(prev_ref_flow_spaces, &prev_ref_flow_vector[0], filename, t + multirate.get_time_step());
+        Linearizer lin_concentration(FileExport);
+        sprintf(filename, "Concentration-%i.vtk", iteration - 1);
+        lin_concentration.save_solution_vtk(prev_c, filename, "Concentration", false);
       }
     }
   }
 
-  /*
-  pressure_view.close();
-  entropy_production_view.close();
-  Mach_number_view.close();
-  s5.close();
-  */
-
+  delete flux_limiter;
   return 0;
 }
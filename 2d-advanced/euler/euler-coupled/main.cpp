@@ -2,11 +2,12 @@
 #include "hermes2d.h"
 
 using namespace Hermes;
+using namespace Hermes::Solvers;
 using namespace Hermes::Hermes2D;
 using namespace Hermes::Hermes2D::Views;
 
 // This example solves the compressible Euler equations coupled with an advection-diffution equation
-// using a basic piecewise-constant finite volume method for the flow and continuous FEM for the concentration
+// using the semi-implicit DG method for the flow and continuous FEM for the concentration
 // being advected by the flow.
 //
 // Equations: Compressible Euler equations, perfect gas state equation, advection-diffusion equation.
@@ -18,10 +19,8 @@ using namespace Hermes::Hermes2D::Views;
 // IC: Various.
 //
 // The following parameters can be changed:
-// Semi-implicit scheme.
-const bool SEMI_IMPLICIT = true;
 // Visualization.
-// Set to "true" to enable Hermes OpenGL visualization. 
+// Set to "true" to enable Hermes OpenGL visualization.
 const bool HERMES_VISUALIZATION = false;
 // Set to "true" to enable VTK output.
 const bool VTK_VISUALIZATION = true;
@@ -48,30 +47,33 @@ double ADVECTION_STABILITY_CONSTANT = 0.05;
 const double DIFFUSION_STABILITY_CONSTANT = 0.1;
 
 // Polynomial degree for the Euler equations (for the flow).
-const int P_FLOW = 1;                        
+const int P_FLOW = 1;
 // Polynomial degree for the concentration.
-const int P_CONCENTRATION = 2;               
+const int P_CONCENTRATION = 2;
 // CFL value.
-double CFL_NUMBER = 0.1;                          
-// Initial and utility time step.
-double time_step_n = 1E-5, util_time_step;          
+double CFL_NUMBER = 0.1;
+// Length of the time interval.
+const double TIME_INTERVAL_LENGTH = 100.0;
 
-// Matrix solver for orthogonal projections: SOLVER_AMESOS, SOLVER_AZTECOO, SOLVER_MUMPS,
-// SOLVER_PETSC, SOLVER_SUPERLU, SOLVER_UMFPACK.
-MatrixSolverType matrix_solver = SOLVER_UMFPACK; 
+// Multirate time stepping: the flow and the concentration are advanced with their own time steps (CFL_NUMBER,
+// resp. ADVECTION_STABILITY_CONSTANT and DIFFUSION_STABILITY_CONSTANT), the faster one in substeps within the time step
+// of the slower one. Set to "false" for the common (smaller) time step.
+const bool MULTIRATE = true;
+// Maximum number of substeps in one time step.
+const int MAX_SUBSTEPS = 100;
 
 // Number of initial uniform mesh refinements of the mesh for the flow.
 unsigned int INIT_REF_NUM_FLOW = 3;
 // Number of initial uniform mesh refinements of the mesh for the concentration.
 unsigned int INIT_REF_NUM_CONCENTRATION = 3;
-// Number of initial mesh refinements of the mesh for the concentration towards the 
+// Number of initial mesh refinements of the mesh for the concentration towards the
 // part of the boundary where the concentration is prescribed.
 unsigned int INIT_REF_NUM_CONCENTRATION_BDY = 1;
 
 // Equation parameters.
 // Exterior pressure (dimensionless).
 const double P_EXT = 2.5;
-// Inlet density (dimensionless).   
+// Inlet density (dimensionless).
 const double RHO_EXT = 1.0;
 // Inlet x-velocity (dimensionless).
 const double V1_EXT = 1.0;
@@ -84,7 +86,7 @@ const double CONCENTRATION_EXT = 0.1;
 // Start time of the concentration on the boundary.
 const double CONCENTRATION_EXT_STARTUP_TIME = 0.0;
 // Diffusivity.
-const double EPSILON = 0.01;                           
+const double EPSILON = 0.01;
 
 // Boundary markers.
 const std::string BDY_INLET = "1";
@@ -101,27 +103,19 @@ const std::string BDY_DIRICHLET_CONCENTRATION = "3";
 
 int main(int argc, char* argv[])
 {
-  std::vector<std::string> BDY_NATURAL_CONCENTRATION;
-  BDY_NATURAL_CONCENTRATION.push_back("2");
-
   // Load the mesh.
-  Mesh basemesh;
+  MeshSharedPtr mesh_flow(new Mesh), mesh_concentration(new Mesh);
   MeshReaderH2D mloader;
-  mloader.load("GAMM-channel-serial.mesh", &basemesh);
-
-  // Initialize the meshes.
-  MeshSharedPtr mesh_flow, mesh_concentration;
-  mesh_flow.copy(&basemesh);
-  mesh_concentration.copy(&basemesh);
+  mloader.load("GAMM-channel-serial.mesh", mesh_flow);
+  mesh_concentration->copy(mesh_flow);
 
   for(unsigned int i = 0; i < INIT_REF_NUM_CONCENTRATION; i++)
-    mesh_concentration.refine_all_elements(0, true);
+    mesh_concentration->refine_all_elements(0, true);
 
-  mesh_concentration.refine_towards_boundary(BDY_DIRICHLET_CONCENTRATION, INIT_REF_NUM_CONCENTRATION_BDY, false);
-  //mesh_flow.refine_towards_boundary(BDY_DIRICHLET_CONCENTRATION, INIT_REF_NUM_CONCENTRATION_BDY);
+  mesh_concentration->refine_towards_boundary(BDY_DIRICHLET_CONCENTRATION, INIT_REF_NUM_CONCENTRATION_BDY, false);
 
   for(unsigned int i = 0; i < INIT_REF_NUM_FLOW; i++)
-    mesh_flow.refine_all_elements(0, true);
+    mesh_flow->refine_all_elements(0, true);
 
   // Initialize boundary condition types and spaces with default shapesets.
   // For the concentration.
@@ -131,107 +125,142 @@ int main(int argc, char* argv[])
   bcs_concentration.add_boundary_condition(new ConcentrationTimedepEssentialBC(BDY_SOLID_WALL_TOP, 0.0, CONCENTRATION_EXT_STARTUP_TIME));
   bcs_concentration.add_boundary_condition(new ConcentrationTimedepEssentialBC(BDY_INLET, 0.0, CONCENTRATION_EXT_STARTUP_TIME));
 
-SpaceSharedPtr<double>space_rho(mesh_flow, P_FLOW);
-  L2Space<double>space_rho_v_x(mesh_flow, P_FLOW);
-  L2Space<double>space_rho_v_y(mesh_flow, P_FLOW);
-  L2Space<double>space_e(mesh_flow, P_FLOW);
-  L2Space<double> space_stabilization(mesh_flow, 0);
-  
+  SpaceSharedPtr<double> space_rho(new L2Space<double>(mesh_flow, P_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_rho_v_x(new L2Space<double>(mesh_flow, P_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_rho_v_y(new L2Space<double>(mesh_flow, P_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  SpaceSharedPtr<double> space_e(new L2Space<double>(mesh_flow, P_FLOW, (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == KUZMIN ? (Shapeset*)new L2ShapesetTaylor : (Shapeset*)new L2Shapeset)));
+  std::vector<SpaceSharedPtr<double> > flow_spaces({space_rho, space_rho_v_x, space_rho_v_y, space_e});
+
   // Space<double> for concentration.
-  H1Space<double> space_c(new L2Space<double>(mesh_concentration, &bcs_concentration, P_CONCENTRATION));
+  SpaceSharedPtr<double> space_c(new H1Space<double>(mesh_concentration, &bcs_concentration, P_CONCENTRATION));
 
-  int ndof = Space<double>::get_num_dofs({&space_rho, &space_rho_v_x, &space_rho_v_y, &space_e, &space_c});
-  Hermes::Mixins::Loggable::Static::info("ndof: %d", ndof);
+  int ndof_flow = Space<double>::get_num_dofs(flow_spaces);
+  Hermes::Mixins::Loggable::Static::info("ndof: %d", ndof_flow + space_c->get_num_dofs());
 
   // Initialize solutions, set initial conditions.
-  ConstantSolution<double> sln_rho(mesh_flow, RHO_EXT);
-  ConstantSolution<double> sln_rho_v_x(mesh_flow, RHO_EXT * V1_EXT);
-  ConstantSolution<double> sln_rho_v_y(mesh_flow, RHO_EXT * V2_EXT);
-  ConstantSolution<double> sln_e(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA));
-  ConstantSolution<double> sln_c(mesh_concentration, 0.0);
-
-  ConstantSolution<double> prev_rho(mesh_flow, RHO_EXT);
-  ConstantSolution<double> prev_rho_v_x(mesh_flow, RHO_EXT * V1_EXT);
-  ConstantSolution<double> prev_rho_v_y(mesh_flow, RHO_EXT * V2_EXT);
-  ConstantSolution<double> prev_e(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA));
-  ConstantSolution<double> prev_c(mesh_concentration, 0.0);
+  MeshFunctionSharedPtr<double> prev_rho(new ConstantSolution<double>(mesh_flow, RHO_EXT));
+  MeshFunctionSharedPtr<double> prev_rho_v_x(new ConstantSolution<double>(mesh_flow, RHO_EXT * V1_EXT));
+  MeshFunctionSharedPtr<double> prev_rho_v_y(new ConstantSolution<double>(mesh_flow, RHO_EXT * V2_EXT));
+  MeshFunctionSharedPtr<double> prev_e(new ConstantSolution<double>(mesh_flow, QuantityCalculator::calc_energy(RHO_EXT, RHO_EXT * V1_EXT, RHO_EXT * V2_EXT, P_EXT, KAPPA)));
+  MeshFunctionSharedPtr<double> prev_c(new ConstantSolution<double>(mesh_concentration, 0.0));
+  std::vector<MeshFunctionSharedPtr<double> > prev_flow_slns({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e});
+
+  // The flow at the start of the time step, the concentration sees the flow interpolated between it and the current one.
+  MeshFunctionSharedPtr<double> start_rho(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_rho_v_x(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_rho_v_y(new Solution<double>(mesh_flow));
+  MeshFunctionSharedPtr<double> start_e(new Solution<double>(mesh_flow));
+  std::vector<MeshFunctionSharedPtr<double> > start_flow_slns({start_rho, start_rho_v_x, start_rho_v_y, start_e});
+
+  // The flow as the coefficient vector, the initial condition first.
+  std::vector<double> flow_vector(ndof_flow);
+  OGProjection<double> ogProjection;
+  ogProjection.project_global(flow_spaces, prev_flow_slns, &flow_vector[0]);
+  Solution<double>::vector_to_solutions(&flow_vector[0], flow_spaces, prev_flow_slns);
 
   // Initialize weak formulation.
-  WeakForm<double>* wf = NULL;
-  if(SEMI_IMPLICIT)
+  std::vector<std::string> solid_wall_markers({BDY_SOLID_WALL_BOTTOM, BDY_SOLID_WALL_TOP});
+  std::vector<std::string> inlet_markers({BDY_INLET});
+  std::vector<std::string> outlet_markers({BDY_OUTLET});
+
+  // The flow and the concentration, each one on its own mesh, with its own system.
+  WeakFormSharedPtr<double> wf_flow(new EulerEquationsWeakFormSemiImplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, P_FLOW == 0));
+  WeakFormSharedPtr<double> wf_concentration(new ConcentrationEquationWeakFormCoupledWithFlow(EPSILON, prev_c,
+    start_rho, start_rho_v_x, start_rho_v_y, prev_rho, prev_rho_v_x, prev_rho_v_y));
+  EulerEquationsWeakFormSemiImplicit* wf_flow_ptr = (EulerEquationsWeakFormSemiImplicit*)(wf_flow.get());
+  ConcentrationEquationWeakFormCoupledWithFlow* wf_concentration_ptr = (ConcentrationEquationWeakFormCoupledWithFlow*)(wf_concentration.get());
+
+  // Feistauer's indicator is calculated from the coefficient vector of the previous time level flow,
+  // the weak form points to its flags, they are recalculated in place.
+  FeistauerShockIndicator shock_indicator;
+  if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
   {
-    wf = new EulerEquationsWeakFormSemiImplicitCoupled(KAPPA, RHO_EXT, V1_EXT, V2_EXT, P_EXT, BDY_SOLID_WALL_BOTTOM,
-    BDY_SOLID_WALL_TOP, BDY_INLET, BDY_OUTLET, BDY_NATURAL_CONCENTRATION, &prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c, EPSILON, P_FLOW == 0);
-    
-    if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
-      static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_stabilization(&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, NU_1, NU_2);
+    wf_flow_ptr->set_stabilization(prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, NU_1, NU_2);
+    wf_flow_ptr->set_discreteIndicator(&shock_indicator.get_flags());
   }
-  else
-    wf = new EulerEquationsWeakFormExplicitCoupled(KAPPA, RHO_EXT, V1_EXT, V2_EXT, P_EXT, BDY_SOLID_WALL_BOTTOM,
-    BDY_SOLID_WALL_TOP, BDY_INLET, BDY_OUTLET, BDY_NATURAL_CONCENTRATION, &prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e, &prev_c, EPSILON, P_FLOW == 0);
-
-  EulerEquationsWeakFormStabilization wf_stabilization(&prev_rho);
-  
-  // Initialize the FE problem.
-  DiscreteProblem<double> dp(wf,{&space_rho, &space_rho_v_x, &space_rho_v_y, &space_e, &space_c});
-  DiscreteProblem<double> dp_stabilization(wf_stabilization, &space_stabilization);
-  bool* discreteIndicator = NULL;
- 
+
+  // Solvers.
+  LinearSolver<double> flow_solver(wf_flow, flow_spaces);
+  LinearSolver<double> concentration_solver(wf_concentration, space_c);
+
+  // Created in the first time step and re-used, the detector keeps its data about the mesh.
+  FluxLimiter* flux_limiter = NULL;
+  PrimitiveVertexBasedLimiter kuzmin_limiter;
+  // Writes the output files on a background thread, keeps its output points as long as the mesh is the same.
+  AsyncFlowQuantitiesOutput flow_output(KAPPA);
+  flow_output.set_time_series("Flow.pvd");
+
   // Filters for visualization of Mach number, pressure and entropy.
-  MachNumberFilter Mach_number({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e}, KAPPA);
-  PressureFilter pressure({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e}, KAPPA);
-  EntropyFilter entropy({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e}, KAPPA, RHO_EXT, P_EXT);
+  MeshFunctionSharedPtr<double> Mach_number(new MachNumberFilter(prev_flow_slns, KAPPA));
 
-  ScalarView pressure_view("Pressure", new WinGeom(0, 0, 600, 400));
   ScalarView Mach_number_view("Mach number", new WinGeom(700, 0, 600, 400));
   ScalarView s5("Concentration", new WinGeom(700, 400, 600, 400));
-  // Set up the solver, matrix, and rhs according to the solver selection.
-  SparseMatrix<double>* matrix = create_matrix<double>();
-  Vector<double>* rhs = create_vector<double>();
-  Vector<double>* rhs_stabilization = create_vector<double>();
-  Hermes::Solvers::LinearMatrixSolver<double>* solver = create_linear_solver<double>(matrix, rhs);
-  
+
   // Set up CFL calculation class.
   CFLCalculation CFL(CFL_NUMBER, KAPPA);
 
   // Set up Advection-Diffusion-Equation stability calculation class.
   ADEStabilityCalculation ADES(ADVECTION_STABILITY_CONSTANT, DIFFUSION_STABILITY_CONSTANT, EPSILON);
 
+  // The time steps of the flow and of the concentration, and the substeps.
+  MultirateTimeStepping multirate(MULTIRATE, MAX_SUBSTEPS);
+  double flow_time_step = 1E-5, concentration_time_step = 1E-5;
+  CFL.calculate_semi_implicit(flow_spaces, &flow_vector[0], flow_time_step);
+  ADES.calculate({prev_rho, prev_rho_v_x, prev_rho_v_y}, mesh_concentration, concentration_time_step);
+
   int iteration = 0; double t = 0;
-  for(t = 0.0; t < 100.0; t += time_step_n)
+  for(; t < TIME_INTERVAL_LENGTH; t += multirate.get_time_step())
   {
-    Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
+    multirate.set_time_steps(flow_time_step, concentration_time_step);
+    Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f, time step %g.", iteration++, t, multirate.get_time_step());
+    Hermes::Mixins::Loggable::Static::info("Flow substeps: %d, concentration substeps: %d.", multirate.get_flow_substeps(), multirate.get_transport_substeps());
 
-    if(SEMI_IMPLICIT)
+    try
     {
-      static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_current_time_step(time_step_n);
-      if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+      // The flow at the start of the time step.
+      Solution<double>::vector_to_solutions(&flow_vector[0], flow_spaces, start_flow_slns);
+
+      // Advance the flow over the whole time step, with optional shock capturing.
+      wf_flow_ptr->set_current_time_step(multirate.get_flow_substep());
+      for(int substep_i = 0; substep_i < multirate.get_flow_substeps(); substep_i++)
       {
-        dp_stabilization.assemble(rhs_stabilization);
-        if(discreteIndicator != NULL)
-          delete [] discreteIndicator;
-        discreteIndicator = new bool[space_stabilization.get_mesh()->get_max_element_id() + 1];
-        for(unsigned int i = 0; i < space_stabilization.get_mesh()->get_max_element_id() + 1; i++)
-          discreteIndicator[i] = false;
-        Element* e;
-        for_all_active_elements(e, space_stabilization.get_mesh())
+        if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+          shock_indicator.calculate(space_rho, &flow_vector[0]);
+
+        flow_solver.solve();
+        double* sln_vector = flow_solver.get_sln_vector();
+
+        // The limiters work in place on the solver's vector.
+        if(SHOCK_CAPTURING && P_FLOW > 0)
         {
-          AsmList<double> al;
-          space_stabilization.get_element_assembly_list(e, &al);
-          if(rhs_stabilization->get(al.get_dof()[0]) >= 1)
-            discreteIndicator[e->id] = true;
+          if(SHOCK_CAPTURING_TYPE == KRIVODONOVA)
+          {
+            if(!flux_limiter)
+              flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, sln_vector, flow_spaces);
+            else
+              flux_limiter->set_solution_vector(sln_vector);
+            flux_limiter->limit_according_to_detector();
+          }
+
+          if(SHOCK_CAPTURING_TYPE == KUZMIN)
+            kuzmin_limiter.limit(flow_spaces, sln_vector);
         }
-        static_cast<EulerEquationsWeakFormSemiImplicitCoupled*>(wf)->set_discreteIndicator(discreteIndicator, space_stabilization.get_num_dofs());
+
+        flow_vector.assign(sln_vector, sln_vector + ndof_flow);
+        Solution<double>::vector_to_solutions(sln_vector, flow_spaces, prev_flow_slns);
       }
-    }
-    else
-      static_cast<EulerEquationsWeakFormExplicitCoupled*>(wf)->set_current_time_step(time_step_n);
 
-    // Assemble stiffness matrix and rhs.
-    Hermes::Mixins::Loggable::Static::info("Assembling the stiffness matrix and right-hand side vector.");
-    try
-    {
-      dp.assemble(matrix, rhs);
+      // Advance the concentration in its substeps, with the flow interpolated to their ends.
+      wf_concentration_ptr->set_current_time_step(multirate.get_transport_substep());
+      for(int substep_i = 0; substep_i < multirate.get_transport_substeps(); substep_i++)
+      {
+        wf_concentration_ptr->set_time_interpolation(multirate.get_time_interpolation(substep_i));
+        Space<double>::update_essential_bc_values(space_c, t + (substep_i + 1) * multirate.get_transport_substep());
+
+        concentration_solver.solve();
+        Solution<double>::vector_to_solution(concentration_solver.get_sln_vector(), space_c, prev_c);
+      }
     }
     catch(std::exception& e)
     {
@@ -239,93 +268,33 @@ SpaceSharedPtr<double>space_rho(mesh_flow, P_FLOW);
       return -1;
     }
 
-    // Solve the matrix problem.
-    Hermes::Mixins::Loggable::Static::info("Solving the matrix problem.");
-    if(solver->solve())
-    {
-      if(!SHOCK_CAPTURING || SHOCK_CAPTURING_TYPE == FEISTAUER)
-      {
-        Solution<double>::vector_to_solutions(solver->get_sln_vector(),{&space_rho, &space_rho_v_x, &space_rho_v_y, &space_e, &space_c}, 
-          std::vector<Solution<double>*>(sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e, sln_c));
-      }
-      else
-      {
-        FluxLimiter* flux_limiter;
-        if(SHOCK_CAPTURING_TYPE == KUZMIN)
-          flux_limiter = new FluxLimiter(FluxLimiter::Kuzmin, solver->get_sln_vector(),{&space_rho, &space_rho_v_x, 
-          &space_rho_v_y, &space_e});
-        else
-          flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, solver->get_sln_vector(),{&space_rho, &space_rho_v_x, 
-          &space_rho_v_y, &space_e});
-
-        if(SHOCK_CAPTURING_TYPE == KUZMIN)
-          flux_limiter->limit_second_orders_according_to_detector();
-
-        flux_limiter->limit_according_to_detector();
-
-        flux_limiter->get_limited_solutions({&prev_rho, &prev_rho_v_x, &prev_rho_v_y, &prev_e});
-      }
-    }
-    else
-       throw Hermes::Exceptions::Exception("Matrix solver failed.\n");
-
-    util_time_step = time_step_n;
-    if(SEMI_IMPLICIT)
-      CFL.calculate_semi_implicit({sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e}, mesh_flow, util_time_step);
-    else
-      CFL.calculate({sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e}, mesh_flow, util_time_step);
-
-    time_step_n = util_time_step;
-
-    ADES.calculate({sln_rho, sln_rho_v_x, sln_rho_v_y}, mesh_concentration, util_time_step);
-
-    if(util_time_step < time_step_n)
-      time_step_n = util_time_step;
-
-    ADES.calculate({sln_rho, sln_rho_v_x, sln_rho_v_y}, mesh_flow, util_time_step);
-
-    if(util_time_step < time_step_n)
-      time_step_n = util_time_step;
-
-    // Copy the solutions into the previous time level ones.
-    prev_rho.copy(sln_rho);
-    prev_rho_v_x.copy(sln_rho_v_x);
-    prev_rho_v_y.copy(sln_rho_v_y);
-    prev_e.copy(sln_e);
-    prev_c.copy(sln_c);
+    // The stable time steps of the next time step, each one from the current flow.
+    CFL.calculate_semi_implicit(flow_spaces, &flow_vector[0], flow_time_step);
+    ADES.calculate({prev_rho, prev_rho_v_x, prev_rho_v_y}, mesh_concentration, concentration_time_step);
 
     // Visualization.
-    if((iteration - 1) % EVERY_NTH_STEP == 0) 
+    if((iteration - 1) % EVERY_NTH_STEP == 0)
     {
       // Hermes visualization.
       if(HERMES_VISUALIZATION)
       {
-        Mach_number.reinit();
-        Mach_number_view.show(&Mach_number);
-        Mach_number_view.save_numbered_screenshot("Mach_number%i.bmp", (int)(iteration / 5), true);
-
-        s5.show(&prev_c);
-        s5.save_numbered_screenshot("concentration%i.bmp", (int)(iteration / 5), true);
+        Mach_number->reinit();
+        Mach_number_view.show(Mach_number);
+        s5.show(prev_c);
       }
-      // Output solution in VTK format.
+      // Output solution in VTK format, the flow quantities in one file indexed in Flow.pvd.
       if(VTK_VISUALIZATION)
       {
-        pressure.reinit();
-        Mach_number.reinit();
-        Linearizer lin_pressure;
         char filename[40];
-        sprintf(filename, "pressure-3D-%i.vtk", iteration - 1);
-        lin_pressure.save_solution_vtk(pressure, filename, "Pressure", true);
-        Linearizer lin_mach;
-        sprintf(filename, "Mach number-3D-%i.vtk", iteration - 1);
-        lin_mach.save_solution_vtk(Mach_number, filename, "MachNumber", true);
-        Linearizer lin_concentration;
+        sprintf(filename, "Flow-%i.vtu", iteration - 1);
+        flow_output.save_vtu(flow_spaces, &flow_vector[0], filename, t + multirate.get_time_step());
+        Linearizer lin_concentration(FileExport);
         sprintf(filename, "Concentration-%i.vtk", iteration - 1);
-        lin_concentration.save_solution_vtk(prev_c, filename, "Concentration", true);
-
+        lin_concentration.save_solution_vtk(prev_c, filename, "Concentration", false);
       }
     }
-  } 
+  }
 
+  delete flux_limiter;
   return 0;
 }
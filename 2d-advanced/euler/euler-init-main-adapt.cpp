@@ -46,8 +46,6 @@
   // Set up CFL calculation class.
   CFLCalculation CFL(CFL_NUMBER, KAPPA);
   
-  Vector<double>* rhs_stabilization = create_vector<double>(HermesCommonApi.get_integral_param_value(matrixSolverType));
-  
   #pragma region 4. Adaptivity setup.
     // Initialize refinement selector.
     L2ProjBasedSelector<double> selector(CAND_LIST);
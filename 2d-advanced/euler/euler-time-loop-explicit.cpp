@@ -0,0 +1,122 @@
+#pragma region 4. Filters for visualization of Mach number, pressure + visualization setup.
+	MeshFunctionSharedPtr<double>  Mach_number(new MachNumberFilter(prev_slns, KAPPA));
+	MeshFunctionSharedPtr<double>  pressure(new PressureFilter(prev_slns, KAPPA));
+
+	ScalarView pressure_view("Pressure", new WinGeom(0, 0, 600, 300));
+	ScalarView Mach_number_view("Mach number", new WinGeom(650, 0, 600, 300));
+	VectorView V_view("Velocity", new WinGeom(650, 660, 600, 300));
+#pragma endregion
+
+#pragma region 5. Explicit time integration setup.
+	// The weak form wf is the residual (EulerEquationsWeakFormExplicit), evaluated on prev_slns.
+	// Only the inverse blocks of the mass matrix are calculated (once), no linear system is solved.
+	SSPRungeKutta time_integrator(wf, spaces, prev_slns, SSP_RK_ORDER);
+
+	if (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+		Hermes::Mixins::Loggable::Static::warn("Feistauer's shock capturing is a part of the semi-implicit scheme, it is not used with the explicit time integration.");
+
+	// The initial condition as a coefficient vector.
+	double* sln_vector = new double[Space<double>::get_num_dofs(spaces)];
+	OGProjection<double> ogProjection;
+	ogProjection.project_global(spaces, prev_slns, sln_vector);
+	Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+	CFL.calculate(spaces, sln_vector, time_step_n);
+
+	// Created in the first time step and re-used, the detector keeps its data about the mesh.
+	FluxLimiter* flux_limiter = NULL;
+	// Writes the output files on a background thread, keeps its output points as long as the mesh is the same.
+	AsyncFlowQuantitiesOutput flow_output(KAPPA);
+	flow_output.set_time_series("Flow.pvd");
+#ifdef WITH_ZLIB
+	flow_output.set_compression(true);
+#endif
+	// Written every CHECKPOINT_EVERY_NTH_STEP steps / CHECKPOINT_EVERY_N_SECONDS seconds.
+	Checkpoint checkpoint("checkpoint.dat", CHECKPOINT_EVERY_NTH_STEP, CHECKPOINT_EVERY_N_SECONDS);
+#pragma endregion
+
+#pragma region 6. Time stepping loop.
+	int iteration = 0;
+	double t = 0.0;
+	// Continue from the checkpoint.
+	if (CHECKPOINT_RESTART && checkpoint.read())
+	{
+		iteration = checkpoint.get_step();
+		t = checkpoint.get_time();
+		time_step_n = checkpoint.get_time_step();
+		checkpoint.restore(spaces, sln_vector);
+		Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+		Hermes::Mixins::Loggable::Static::info("Continuing from the checkpoint, time step %d, time %3.5f.", iteration, t);
+	}
+	for (; t < TIME_INTERVAL_LENGTH; t += time_step_n)
+	{
+		// Info.
+		Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
+
+#pragma region *. Get the solution with optional shock capturing.
+		try
+		{
+			time_integrator.step(sln_vector, time_step_n);
+
+			// Limiting of the new solution, the limiters are applied to the coefficient vector.
+			if (SHOCK_CAPTURING && P_INIT > 0)
+			{
+				if (SHOCK_CAPTURING_TYPE == KRIVODONOVA)
+				{
+					// The limiter works in place.
+					if (!flux_limiter)
+						flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, sln_vector, spaces);
+					else
+						flux_limiter->set_solution_vector(sln_vector);
+					flux_limiter->limit_according_to_detector();
+				}
+
+				if (SHOCK_CAPTURING_TYPE == KUZMIN)
+				{
+					PostProcessing::VertexBasedLimiter limiter(spaces, sln_vector, P_INIT);
+					limiter.get_solutions(prev_slns);
+					memcpy(sln_vector, limiter.get_solution_vector(), Space<double>::get_num_dofs(spaces) * sizeof(double));
+				}
+			}
+
+			Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+			CFL.calculate(spaces, sln_vector, time_step_n);
+		}
+		catch (std::exception& e) { std::cout << e.what(); }
+#pragma endregion
+
+#pragma region *. Visualization
+		if ((iteration - 1) % EVERY_NTH_STEP == 0)
+		{
+			// Hermes visualization.
+			if (HERMES_VISUALIZATION)
+			{
+				Mach_number->reinit();
+				pressure->reinit();
+				pressure_view.show(prev_rho, 1);
+				Mach_number_view.show(Mach_number, 1);
+				V_view.show(prev_rho_v_x, prev_rho_v_y, 1, 1);
+			}
+			// Output solution in VTK (binary VTU) format, all flow quantities in one file, indexed in Flow.pvd.
+			if (VTK_VISUALIZATION)
+			{
+				char filename[40];
+				sprintf(filename, "Flow-%i.vtu", iteration - 1);
+				flow_output.save_vtu(spaces, sln_vector, filename, t);
+			}
+		}
+#pragma endregion
+
+#pragma region *. Checkpoint
+		if (checkpoint.is_due(iteration))
+		{
+			// The loop continues from t + time_step_n.
+			checkpoint.begin(iteration, t + time_step_n, time_step_n);
+			checkpoint.add(spaces, sln_vector);
+			checkpoint.write();
+		}
+#pragma endregion
+	}
+#pragma endregion
+	delete flux_limiter;
+	delete[] sln_vector;
+	return 0;
@@ -0,0 +1,157 @@
+#pragma region 4. Filters for visualization of Mach number, pressure + visualization setup.
+	MeshFunctionSharedPtr<double>  Mach_number(new MachNumberFilter(prev_slns, KAPPA));
+	MeshFunctionSharedPtr<double>  pressure(new PressureFilter(prev_slns, KAPPA));
+
+	ScalarView pressure_view("Pressure", new WinGeom(0, 0, 600, 300));
+	ScalarView Mach_number_view("Mach number", new WinGeom(650, 0, 600, 300));
+	VectorView V_view("Velocity", new WinGeom(650, 660, 600, 300));
+#pragma endregion
+
+#pragma region 5. Implicit pseudo time stepping setup.
+	// The residual is wf_residual (EulerEquationsWeakFormExplicit), the semi-implicit weak form wf is only used
+	// for the preconditioner, both are evaluated on prev_slns.
+	NewtonKrylovSolver newton_krylov(wf_residual, wf, spaces, prev_slns);
+	newton_krylov.set_tolerances(NEWTON_TOLERANCE, NEWTON_MAX_ITER, GMRES_TOLERANCE);
+
+	if (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+		Hermes::Mixins::Loggable::Static::warn("Feistauer's shock capturing is a part of the semi-implicit scheme, it is not used with the Newton-Krylov solver.");
+
+	// The initial condition as a coefficient vector.
+	double* sln_vector = new double[Space<double>::get_num_dofs(spaces)];
+	OGProjection<double> ogProjection;
+	ogProjection.project_global(spaces, prev_slns, sln_vector);
+	Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+
+	// Every element has its own pseudo time step given by its CFL condition. The CFL number is ramped by switched
+	// evolution relaxation: CFL_{n+1} = CFL_n * r_{n-1} / r_n, r the norm of the density residual at the beginning of the step.
+	// It is not ramped below cfl_floor, which starts at NEWTON_KRYLOV_CFL_NUMBER and is lowered whenever Newton's method fails.
+	std::vector<double> element_time_steps;
+	double cfl_number = NEWTON_KRYLOV_CFL_NUMBER;
+	double cfl_floor = NEWTON_KRYLOV_CFL_NUMBER;
+	// The density residual of the initial condition and in the previous step.
+	double initial_residual = 0., last_residual = 0.;
+
+	// Created in the first time step and re-used, the detector keeps its data about the mesh.
+	FluxLimiter* flux_limiter = NULL;
+	// Writes the output files on a background thread, keeps its output points as long as the mesh is the same.
+	AsyncFlowQuantitiesOutput flow_output(KAPPA);
+	flow_output.set_time_series("Flow.pvd");
+#ifdef WITH_ZLIB
+	flow_output.set_compression(true);
+#endif
+	// Written every CHECKPOINT_EVERY_NTH_STEP steps / CHECKPOINT_EVERY_N_SECONDS seconds.
+	Checkpoint checkpoint("checkpoint.dat", CHECKPOINT_EVERY_NTH_STEP, CHECKPOINT_EVERY_N_SECONDS);
+#pragma endregion
+
+#pragma region 6. Pseudo time stepping loop.
+	int iteration = 0;
+	// Continue from the checkpoint, with the CFL number (and its floor) and the residual history.
+	if (CHECKPOINT_RESTART && checkpoint.read())
+	{
+		iteration = checkpoint.get_step();
+		cfl_number = checkpoint.get_time_step();
+		initial_residual = checkpoint.get_values()[0];
+		last_residual = checkpoint.get_values()[1];
+		if (checkpoint.get_values().size() > 2)
+			cfl_floor = checkpoint.get_values()[2];
+		checkpoint.restore(spaces, sln_vector);
+		Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+		Hermes::Mixins::Loggable::Static::info("Continuing from the checkpoint, pseudo time step %d.", iteration);
+	}
+	while (iteration < STEADY_STATE_MAX_STEPS)
+	{
+		// Info.
+		Hermes::Mixins::Loggable::Static::info("---- Pseudo time step %d, CFL number %g.", iteration++, cfl_number);
+
+#pragma region *. Get the solution with optional shock capturing.
+		try
+		{
+			CFL.set_number(cfl_number);
+			CFL.calculate_local_semi_implicit(spaces, sln_vector, element_time_steps);
+			bool converged = newton_krylov.step(sln_vector, element_time_steps);
+			double residual = newton_krylov.get_steady_residual_norm(0);
+			Hermes::Mixins::Loggable::Static::info("Newton iterations: %d, GMRES iterations: %d, density residual: %g.",
+				newton_krylov.get_newton_iterations(), newton_krylov.get_gmres_iterations(), residual);
+
+			if (initial_residual == 0.)
+				initial_residual = residual;
+			if (!converged)
+			{
+				// Too large a step for Newton's method: sln_vector is the old solution again, the step is repeated with half
+				// the CFL number, which is not to be ramped back above that by the lower bound.
+				Hermes::Mixins::Loggable::Static::warn("Newton's method did not converge in the pseudo time step.");
+				cfl_number /= 2.;
+				cfl_floor = std::min(cfl_floor, cfl_number);
+			}
+			else if (last_residual > 0.)
+				cfl_number = std::min(std::max(cfl_number * last_residual / residual, cfl_floor), NEWTON_KRYLOV_MAX_CFL_NUMBER);
+			last_residual = residual;
+
+			// Limiting of the new solution, the limiters are applied to the coefficient vector.
+			if (SHOCK_CAPTURING && P_INIT > 0)
+			{
+				if (SHOCK_CAPTURING_TYPE == KRIVODONOVA)
+				{
+					// The limiter works in place.
+					if (!flux_limiter)
+						flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, sln_vector, spaces);
+					else
+						flux_limiter->set_solution_vector(sln_vector);
+					flux_limiter->limit_according_to_detector();
+				}
+
+				if (SHOCK_CAPTURING_TYPE == KUZMIN)
+				{
+					PostProcessing::VertexBasedLimiter limiter(spaces, sln_vector, P_INIT);
+					limiter.get_solutions(prev_slns);
+					memcpy(sln_vector, limiter.get_solution_vector(), Space<double>::get_num_dofs(spaces) * sizeof(double));
+				}
+			}
+
+			Solution<double>::vector_to_solutions(sln_vector, spaces, prev_slns);
+		}
+		catch (std::exception& e) { std::cout << e.what(); }
+#pragma endregion
+
+#pragma region *. Visualization
+		if ((iteration - 1) % EVERY_NTH_STEP == 0)
+		{
+			// Hermes visualization.
+			if (HERMES_VISUALIZATION)
+			{
+				Mach_number->reinit();
+				pressure->reinit();
+				pressure_view.show(prev_rho, 1);
+				Mach_number_view.show(Mach_number, 1);
+				V_view.show(prev_rho_v_x, prev_rho_v_y, 1, 1);
+			}
+			// Output solution in VTK (binary VTU) format, all flow quantities in one file, indexed in Flow.pvd.
+			if (VTK_VISUALIZATION)
+			{
+				char filename[40];
+				sprintf(filename, "Flow-%i.vtu", iteration - 1);
+				flow_output.save_vtu(spaces, sln_vector, filename, iteration - 1);
+			}
+		}
+#pragma endregion
+
+#pragma region *. Checkpoint
+		if (checkpoint.is_due(iteration))
+		{
+			// The CFL number is stored as the time step.
+			checkpoint.begin(iteration, 0., cfl_number, std::vector<double>({ initial_residual, last_residual, cfl_floor }));
+			checkpoint.add(spaces, sln_vector);
+			checkpoint.write();
+		}
+#pragma endregion
+
+		if (last_residual < initial_residual * std::pow(10., -STEADY_STATE_RESIDUAL_ORDERS))
+		{
+			Hermes::Mixins::Loggable::Static::info("Steady state reached, the density residual dropped by %g orders of magnitude.", STEADY_STATE_RESIDUAL_ORDERS);
+			break;
+		}
+	}
+#pragma endregion
+	delete flux_limiter;
+	delete[] sln_vector;
+	return 0;
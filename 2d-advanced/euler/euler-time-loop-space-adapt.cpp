@@ -1,32 +1,109 @@
 std::vector<MeshFunctionSharedPtr<double> > prev_slns({ prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e });
-WeakFormSharedPtr<double> wf_stabilization(new EulerEquationsWeakFormStabilization(prev_rho));
 
+// Feistauer's indicator, calculated from the coefficient vector of the previous time level solution on the reference mesh.
+// The weak form points to its flags, they are recalculated in place.
+FeistauerShockIndicator shock_indicator;
 if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
-((EulerEquationsWeakFormSemiImplicit*)(wf.get()))->set_stabilization(prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, NU_1, NU_2);
+{
+  ((EulerEquationsWeakFormSemiImplicit*)(wf.get()))->set_stabilization(prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, NU_1, NU_2);
+  ((EulerEquationsWeakFormSemiImplicit*)(wf.get()))->set_discreteIndicator(&shock_indicator.get_flags());
+}
 
 // Solver.
 LinearSolver<double> solver(wf, spaces);
 EulerEquationsWeakFormSemiImplicit* wf_ptr = (EulerEquationsWeakFormSemiImplicit*)(wf.get());
 
+// Local time stepping (created below if LOCAL_TIME_STEPPING is set).
+LocalTimeStepping* local_time_stepping = NULL;
+double* ref_sln_vector = NULL;
+
+// The previous time level solution as the coefficient vector in the reference spaces it is on. It is projected onto
+// the new reference spaces, and the reference solution onto the coarse ones, element by element (the spaces are L2 ones).
+std::vector<SpaceSharedPtr<double> > prev_ref_spaces;
+std::vector<double> prev_ref_vector;
+LocalProjection ref_projection;
+LocalProjection coarse_projection;
+std::vector<double> coarse_vector;
+
+// Created once and re-used, the detector keeps its data as long as the reference mesh is the same.
+FluxLimiter* flux_limiter = NULL;
+// Writes the output files on a background thread, keeps its output points as long as the reference mesh is the same.
+AsyncFlowQuantitiesOutput flow_output(KAPPA);
+flow_output.set_time_series("Flow.pvd");
+#ifdef WITH_ZLIB
+flow_output.set_compression(true);
+#endif
+if(LOCAL_TIME_STEPPING)
+{
+  // The explicit residual of the same problem, each element advanced by its own time step.
+  // The substeps are evaluated on their own solutions, prev_slns stay untouched for the next adaptivity step.
+  MeshFunctionSharedPtr<double> lts_rho(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> lts_rho_v_x(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> lts_rho_v_y(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> lts_e(new Solution<double>(mesh));
+  std::vector<MeshFunctionSharedPtr<double> > lts_slns({ lts_rho, lts_rho_v_x, lts_rho_v_y, lts_e });
+  WeakFormSharedPtr<double> wf_explicit(new EulerEquationsWeakFormExplicit(KAPPA, wf_ptr->rho_ext, wf_ptr->v1_ext, wf_ptr->v2_ext, wf_ptr->pressure_ext,
+    wf_ptr->solid_wall_markers, wf_ptr->inlet_markers, wf_ptr->outlet_markers, lts_rho, lts_rho_v_x, lts_rho_v_y, lts_e));
+  local_time_stepping = new LocalTimeStepping(wf_explicit, spaces, lts_slns, CFL_NUMBER, KAPPA, LTS_LEVELS);
+  ((EulerEquationsWeakFormExplicit*)(wf_explicit.get()))->set_local_time_stepping(local_time_stepping);
+  if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+    Hermes::Mixins::Loggable::Static::warn("Feistauer's shock capturing is a part of the semi-implicit scheme, it is not used with the local time stepping.");
+}
+
+// The reference mesh and spaces, updated only where the coarse ones changed.
+// With the detector driven adaptivity, they are a copy of the coarse ones: the time step is made on the coarse mesh, the copy keeps
+// the solution while the coarse spaces are adapted.
+ReferenceSpaceUpdater ref_space_updater(spaces, DETECTOR_ADAPTIVITY ? 0 : (CAND_LIST == H2D_HP_ANISO ? 1 : 0), !DETECTOR_ADAPTIVITY);
+// Refinement of the elements marked by the discontinuity detector, orders by the smoothness of the solution (only if the candidates include them).
+bool p_adaptivity = (CAND_LIST != H2D_H_ISO && CAND_LIST != H2D_H_ANISO);
+bool h_adaptivity = (CAND_LIST != H2D_P_ISO && CAND_LIST != H2D_P_ANISO);
+DetectorAdaptivity detector_adaptivity(spaces, h_adaptivity ? MAX_REFINEMENT_LEVEL : 0, p_adaptivity ? 0 : P_INIT, p_adaptivity ? MAX_P_ORDER : P_INIT, DISCONTINUITY_DETECTOR_PARAM);
+// Coarsening of the mesh where the error (or the detector) indicators are small.
+SelectiveDerefinement derefinement(spaces, P_INIT);
+
+// Written every CHECKPOINT_EVERY_NTH_STEP steps / CHECKPOINT_EVERY_N_SECONDS seconds.
+Checkpoint checkpoint("checkpoint.dat", CHECKPOINT_EVERY_NTH_STEP, CHECKPOINT_EVERY_N_SECONDS);
+
 #pragma region 6. Time stepping loop.
 int iteration = 0;
-for(double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
+double t = 0.0;
+// Continue from the checkpoint: the coarse mesh and spaces, and the previous time level solution on their reference ones.
+if(CHECKPOINT_RESTART && checkpoint.read())
+{
+  iteration = checkpoint.get_step();
+  t = checkpoint.get_time();
+  time_step_n = checkpoint.get_time_step();
+  REFINEMENT_COUNT = (int)checkpoint.get_values()[0];
+  checkpoint.restore(spaces);
+
+  ref_space_updater.update();
+  std::vector<SpaceSharedPtr<double> > ref_spaces = ref_space_updater.get_ref_spaces();
+  double* restored_vector = new double[Space<double>::get_num_dofs(ref_spaces)];
+  checkpoint.restore(ref_spaces, restored_vector);
+  Solution<double>::vector_to_solutions(restored_vector, ref_spaces, rslns);
+  prev_ref_spaces = ref_spaces;
+  prev_ref_vector.assign(restored_vector, restored_vector + Space<double>::get_num_dofs(ref_spaces));
+  delete [] restored_vector;
+  prev_rho->copy(rsln_rho);
+  prev_rho_v_x->copy(rsln_rho_v_x);
+  prev_rho_v_y->copy(rsln_rho_v_y);
+  prev_e->copy(rsln_e);
+  Hermes::Mixins::Loggable::Static::info("Continuing from the checkpoint, time step %d, time %3.5f.", iteration, t);
+}
+for(; t < TIME_INTERVAL_LENGTH; t += time_step_n)
 {
   Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
 
-#pragma region 6.1. Periodic global derefinements.
+#pragma region 6.1. Periodic selective derefinements.
+  // Only where the indicators of the last accepted adaptivity step are small, the refinement elsewhere is kept.
   if (iteration > 1 && iteration % UNREF_FREQ == 0 && REFINEMENT_COUNT > 0) 
   {
-    Hermes::Mixins::Loggable::Static::info("Global mesh derefinement.");
+    Hermes::Mixins::Loggable::Static::info("Selective mesh derefinement.");
     REFINEMENT_COUNT = 0;
 
-    space_rho->unrefine_all_mesh_elements(true);
-
-    space_rho->adjust_element_order(-1, P_INIT);
-    space_rho_v_x->adjust_element_order(-1, P_INIT);
-    space_rho_v_y->adjust_element_order(-1, P_INIT);
-    space_e->adjust_element_order(-1, P_INIT);
-    Space<double>::assign_dofs(spaces);
+    // With the detector driven adaptivity, the orders follow the smoothness indicator, the sons of elements are merged if none is marked.
+    int merged_count = DETECTOR_ADAPTIVITY ? derefinement.derefine(0.5, false) : derefinement.derefine(DEREFINEMENT_THRESHOLD, true);
+    Hermes::Mixins::Loggable::Static::info("Merged elements: %d, order changes: %d.", merged_count, derefinement.get_order_change_count());
   }
 #pragma endregion
 
@@ -40,20 +117,11 @@ for(double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
     wf_ptr->set_current_time_step(time_step_n);
 
 #pragma region 7.1. Construct globally refined reference mesh and setup reference space.
-    int order_increase = CAND_LIST == H2D_HP_ANISO ? 1 : 0;
-
-    Mesh::ReferenceMeshCreator refMeshCreatorFlow(mesh);
-    MeshSharedPtr ref_mesh = refMeshCreatorFlow.create_ref_mesh();
-
-    Space<double>::ReferenceSpaceCreator refSpaceCreatorRho(space_rho, ref_mesh, order_increase);
-    SpaceSharedPtr<double> ref_space_rho = refSpaceCreatorRho.create_ref_space();
-    Space<double>::ReferenceSpaceCreator refSpaceCreatorRhoVx(space_rho_v_x, ref_mesh, order_increase);
-    SpaceSharedPtr<double> ref_space_rho_v_x = refSpaceCreatorRhoVx.create_ref_space();
-    Space<double>::ReferenceSpaceCreator refSpaceCreatorRhoVy(space_rho_v_y, ref_mesh, order_increase);
-    SpaceSharedPtr<double> ref_space_rho_v_y = refSpaceCreatorRhoVy.create_ref_space();
-    Space<double>::ReferenceSpaceCreator refSpaceCreatorE(space_e, ref_mesh, order_increase);
-    SpaceSharedPtr<double> ref_space_e = refSpaceCreatorE.create_ref_space();
-    std::vector<SpaceSharedPtr<double>  > ref_spaces({ ref_space_rho, ref_space_rho_v_x, ref_space_rho_v_y, ref_space_e });
+    // Only the elements of the coarse mesh changed by the last adaptation (or derefinement) are updated.
+    // With the detector driven adaptivity, it is the copy of the coarse mesh.
+    ref_space_updater.update();
+    MeshSharedPtr ref_mesh = ref_space_updater.get_ref_mesh();
+    std::vector<SpaceSharedPtr<double>  > ref_spaces = ref_space_updater.get_ref_spaces();
     solver.set_spaces(ref_spaces);
     
     if(ndofs_prev != 0)
@@ -64,82 +132,127 @@ for(double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
 
     ndofs_prev = Space<double>::get_num_dofs(ref_spaces);
 
-    // Project the previous time level solution onto the new fine mesh
-    Hermes::Mixins::Loggable::Static::info("Projecting the previous time level solution onto the new fine mesh.");
-    OGProjection<double>::project_global(ref_spaces, prev_slns, prev_slns);
-#pragma endregion
-
-    if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+    // Project the previous time level solution onto the new fine mesh.
+    // If the reference mesh did not change, the previous time level solution is already there (the result of the last time step).
+    if(prev_rho->get_mesh() == ref_mesh && (ref_sln_vector || !LOCAL_TIME_STEPPING))
+      Hermes::Mixins::Loggable::Static::info("The fine mesh did not change.");
+    else
     {
-      SpaceSharedPtr<double> ref_space_stabilization(new L2Space<double>(ref_mesh, 0));
-      int mesh_size = ref_mesh->get_num_active_elements();
-      DiscreteProblem<double> dp_stabilization(wf_stabilization, ref_space_stabilization);
-      dp_stabilization.set_space(ref_space_stabilization);
-      dp_stabilization.assemble(rhs_stabilization);
-      if(!wf_ptr->discreteIndicator)
-      {
-        wf_ptr->set_discreteIndicator(new bool[mesh_size], mesh_size);
-        memset(wf_ptr->discreteIndicator, 0, mesh_size * sizeof(bool));
-      }
-      Element* e;
-      for_all_active_elements(e, ref_space_stabilization->get_mesh())
+      Hermes::Mixins::Loggable::Static::info("Projecting the previous time level solution onto the new fine mesh.");
+      std::vector<double> projected_vector(Space<double>::get_num_dofs(ref_spaces));
+      // In the first time step, it is the initial condition.
+      if(prev_ref_vector.empty())
+        OGProjection<double>::project_global(ref_spaces, prev_slns, &projected_vector[0]);
+      else
+        ref_projection.project(prev_ref_spaces, &prev_ref_vector[0], ref_spaces, &projected_vector[0]);
+      // The solutions are moved as well, the other reference mesh they are on is updated in the next step.
+      Solution<double>::vector_to_solutions(&projected_vector[0], ref_spaces, prev_slns);
+      if(LOCAL_TIME_STEPPING)
       {
-        AsmList<double> al;
-        ref_space_stabilization->get_element_assembly_list(e, &al);
-        if(rhs_stabilization->get(al.get_dof()[0]) >= 1)
-          wf_ptr->discreteIndicator[e->id] = true;
+        // The explicit scheme works on the coefficient vector directly.
+        delete [] ref_sln_vector;
+        ref_sln_vector = new double[projected_vector.size()];
+        memcpy(ref_sln_vector, &projected_vector[0], projected_vector.size() * sizeof(double));
       }
+      prev_ref_spaces = ref_spaces;
+      prev_ref_vector.swap(projected_vector);
     }
+#pragma endregion
+
+    // The previous time level solution is on the reference spaces now.
+    if(SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER && !LOCAL_TIME_STEPPING)
+      shock_indicator.calculate(prev_ref_spaces[0], &prev_ref_vector[0]);
 
     // Solve the problem.
-    solver.solve();
+    double lts_time_step = time_step_n;
+    if(LOCAL_TIME_STEPPING)
+    {
+      local_time_stepping->set_spaces(ref_spaces);
+      local_time_stepping->step(ref_sln_vector, lts_time_step);
+    }
+    else
+      solver.solve();
+    double* sln_vector = LOCAL_TIME_STEPPING ? ref_sln_vector : solver.get_sln_vector();
 
 #pragma region *. Get the solution with optional shock capturing.
+    // The time step according to CFL condition is calculated from the element means of the (limited) solution vector.
     if(!SHOCK_CAPTURING)
-      Solution<double>::vector_to_solutions(solver.get_sln_vector(), ref_spaces, rslns);
+    {
+      Solution<double>::vector_to_solutions(sln_vector, ref_spaces, rslns);
+      CFL.calculate(ref_spaces, sln_vector, time_step_n);
+    }
     else
     {
       if(SHOCK_CAPTURING_TYPE == KRIVODONOVA)
       {
-        FluxLimiter* flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, solver.get_sln_vector(), ref_spaces);
+        // The limiter works in place on the solver's vector.
+        if(!flux_limiter)
+          flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, sln_vector, ref_spaces);
+        else
+          flux_limiter->set_solution_vector(sln_vector, ref_spaces);
         flux_limiter->limit_according_to_detector();
         flux_limiter->get_limited_solutions(rslns);
-        delete flux_limiter;
+        CFL.calculate(ref_spaces, sln_vector, time_step_n);
       }
 
       if(SHOCK_CAPTURING_TYPE == KUZMIN)
       {
-        PostProcessing::VertexBasedLimiter limiter(ref_spaces, solver.get_sln_vector(), 1);
+        PostProcessing::VertexBasedLimiter limiter(ref_spaces, sln_vector, 1);
         limiter.get_solutions(rslns);
+        // The limited vector is also the state the local time stepping continues from, and the one written out.
+        memcpy(sln_vector, limiter.get_solution_vector(), Space<double>::get_num_dofs(ref_spaces) * sizeof(double));
+        CFL.calculate(ref_spaces, sln_vector, time_step_n);
       }
     }
-#pragma endregion
 
-    // Calculate time step according to CFL condition.
-    CFL.calculate(rslns, (ref_spaces)[0]->get_mesh(), time_step_n);
+    // With local time stepping, the time step is the (global) one just made, not the CFL minimum.
+    if(LOCAL_TIME_STEPPING)
+      time_step_n = lts_time_step;
+#pragma endregion
 
 #pragma region 7.2. Project to coarse mesh -> error estimation -> space adaptivity
     // Project the fine mesh solution onto the coarse mesh.
     Hermes::Mixins::Loggable::Static::info("Projecting reference solution on coarse mesh.");
-    OGProjection<double>::project_global(spaces, rslns, slns, std::vector<NormType>({ HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM, HERMES_L2_NORM }));
-
-    // Calculate element errors and total error estimate.
-    Hermes::Mixins::Loggable::Static::info("Calculating error estimate.");
-    errorCalculator.calculate_errors(slns, rslns);
-    double err_est_rel_total = errorCalculator.get_total_error_squared() * 100;
+    coarse_vector.resize(Space<double>::get_num_dofs(spaces));
+    coarse_projection.project(ref_spaces, sln_vector, spaces, &coarse_vector[0]);
+    Solution<double>::vector_to_solutions(&coarse_vector[0], spaces, slns);
 
-    // Report results.
-    Hermes::Mixins::Loggable::Static::info("err_est_rel: %g%%", err_est_rel_total);
-
-    // If err_est too large, adapt the mesh.
-    if (err_est_rel_total < adaptivityErrorStop(iteration))
-      done = true;
+    if(DETECTOR_ADAPTIVITY)
+    {
+      // The marked elements are refined until none are left (or they are at the maximum level), the orders only in the first step.
+      Hermes::Mixins::Loggable::Static::info("Adapting coarse mesh according to the discontinuity detector.");
+      done = detector_adaptivity.adapt(&coarse_vector[0], as == 1);
+      // The flags are those of the current mesh only if it did not change.
+      if(done)
+        derefinement.set_indicators(detector_adaptivity.get_discontinuous_element_flags());
+      Hermes::Mixins::Loggable::Static::info("Refined elements: %d, order changes: %d.", detector_adaptivity.get_refined_count(), detector_adaptivity.get_order_change_count());
+      if(!done)
+      {
+        REFINEMENT_COUNT++;
+        as++;
+      }
+    }
     else
     {
-      Hermes::Mixins::Loggable::Static::info("Adapting coarse mesh.");
-      done = adaptivity.adapt({&selector, &selector, &selector, &selector});
-      REFINEMENT_COUNT++;
-      as++;
+      // Calculate element errors and total error estimate.
+      Hermes::Mixins::Loggable::Static::info("Calculating error estimate.");
+      errorCalculator.calculate_errors(slns, rslns);
+      double err_est_rel_total = errorCalculator.get_total_error_squared() * 100;
+      derefinement.set_indicators(&errorCalculator);
+
+      // Report results.
+      Hermes::Mixins::Loggable::Static::info("err_est_rel: %g%%", err_est_rel_total);
+
+      // If err_est too large, adapt the mesh.
+      if (err_est_rel_total < adaptivityErrorStop(iteration))
+        done = true;
+      else
+      {
+        Hermes::Mixins::Loggable::Static::info("Adapting coarse mesh.");
+        done = adaptivity.adapt({&selector, &selector, &selector, &selector});
+        REFINEMENT_COUNT++;
+        as++;
+      }
     }
 #pragma endregion
 
@@ -155,22 +268,30 @@ for(double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
         Mach_number_view.show(Mach_number, 1);
         order_view.show((ref_spaces)[0]);
       }
-      // Output solution in VTK format.
+      // Output solution in VTK (binary VTU) format, all flow quantities in one file, indexed in Flow.pvd.
       if(VTK_VISUALIZATION)
       {
-        pressure->reinit();
-        Linearizer lin(FileExport);
         char filename[40];
-        sprintf(filename, "Pressure-%i.vtk", iteration - 1);
-        lin.save_solution_vtk(pressure, filename, "Pressure", false);
-        sprintf(filename, "VelocityX-%i.vtk", iteration - 1);
-        lin.save_solution_vtk(prev_rho_v_x, filename, "VelocityX", false);
-        sprintf(filename, "VelocityY-%i.vtk", iteration - 1);
-        lin.save_solution_vtk(prev_rho_v_y, filename, "VelocityY", false);
-        sprintf(filename, "Rho-%i.vtk", iteration - 1);
-        lin.save_solution_vtk(prev_rho, filename, "Rho", false);
+        sprintf(filename, "Flow-%i.vtu", iteration - 1);
+        flow_output.save_vtu(ref_spaces, sln_vector, filename, t);
       }
     }
+
+    // The checkpoint of the accepted solution, the loop continues from t + time_step_n.
+    if(done && checkpoint.is_due(iteration))
+    {
+      checkpoint.begin(iteration, t + time_step_n, time_step_n, std::vector<double>({ (double)REFINEMENT_COUNT }));
+      checkpoint.add(spaces);
+      checkpoint.add(ref_spaces, sln_vector);
+      checkpoint.write();
+    }
+
+    // The accepted solution is the previous time level one in the next time step.
+    if(done)
+    {
+      prev_ref_spaces = ref_spaces;
+      prev_ref_vector.assign(sln_vector, sln_vector + Space<double>::get_num_dofs(ref_spaces));
+    }
 #pragma endregion
   }
   while (done == false);
@@ -187,4 +308,8 @@ for(double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
 pressure_view.close();
 Mach_number_view.close();
 
+delete local_time_stepping;
+delete flux_limiter;
+delete [] ref_sln_vector;
+
 return 0;
\ No newline at end of file
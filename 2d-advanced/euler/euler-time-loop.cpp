@@ -11,44 +11,56 @@
 #pragma endregion
 
 #pragma region 5. Some stabilization approaches.
-	WeakFormSharedPtr<double> wf_stabilization(new EulerEquationsWeakFormStabilization(prev_rho));
-	DiscreteProblem<double> dp_stabilization(wf_stabilization, space_stabilization);
-
 	LinearSolver<double> solver(wf, spaces);
 	EulerEquationsWeakFormSemiImplicit* wf_ptr = (EulerEquationsWeakFormSemiImplicit*)(wf.get());
 
-	Vector<double>* rhs_stabilization = create_vector<double>(HermesCommonApi.get_integral_param_value(matrixSolverType));
-
+	// Feistauer's indicator is calculated from the coefficient vector of the previous time level solution,
+	// there is none in the first time step (the initial condition is continuous, no element is marked).
+	FeistauerShockIndicator shock_indicator;
+	const double* prev_sln_vector = NULL;
+	std::vector<double> restored_vector;
 	if (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
+	{
 		wf_ptr->set_stabilization(prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, NU_1, NU_2);
+		wf_ptr->set_discreteIndicator(&shock_indicator.get_flags());
+	}
+
+	// Created in the first time step and re-used, the detector keeps its data about the mesh.
+	FluxLimiter* flux_limiter = NULL;
+	PrimitiveVertexBasedLimiter kuzmin_limiter;
+	// Writes the output files on a background thread, keeps its output points as long as the mesh is the same.
+	AsyncFlowQuantitiesOutput flow_output(KAPPA);
+	flow_output.set_time_series("Flow.pvd");
+#ifdef WITH_ZLIB
+	flow_output.set_compression(true);
+#endif
+	// Written every CHECKPOINT_EVERY_NTH_STEP steps / CHECKPOINT_EVERY_N_SECONDS seconds.
+	Checkpoint checkpoint("checkpoint.dat", CHECKPOINT_EVERY_NTH_STEP, CHECKPOINT_EVERY_N_SECONDS);
 #pragma endregion
 
 #pragma region 6. Time stepping loop.
 	int iteration = 0;
-	for (double t = 0.0; t < TIME_INTERVAL_LENGTH; t += time_step_n)
+	double t = 0.0;
+	// Continue from the checkpoint: the solution and the time step.
+	if (CHECKPOINT_RESTART && checkpoint.read())
+	{
+		iteration = checkpoint.get_step();
+		t = checkpoint.get_time();
+		time_step_n = checkpoint.get_time_step();
+		restored_vector.resize(Space<double>::get_num_dofs(spaces));
+		checkpoint.restore(spaces, &restored_vector[0]);
+		Solution<double>::vector_to_solutions(&restored_vector[0], spaces, prev_slns);
+		prev_sln_vector = &restored_vector[0];
+		Hermes::Mixins::Loggable::Static::info("Continuing from the checkpoint, time step %d, time %3.5f.", iteration, t);
+	}
+	for (; t < TIME_INTERVAL_LENGTH; t += time_step_n)
 	{
 		// Info.
 		Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
 
+		// The weak form points to the indicator's flags, they are recalculated in place.
 		if (SHOCK_CAPTURING && SHOCK_CAPTURING_TYPE == FEISTAUER)
-		{
-			int mesh_size = space_stabilization->get_num_dofs();
-			assert(mesh_size == space_stabilization->get_mesh()->get_num_active_elements());
-			dp_stabilization.assemble(rhs_stabilization);
-			if (!wf_ptr->discreteIndicator)
-			{
-				wf_ptr->set_discreteIndicator(new bool[mesh_size], mesh_size);
-				memset(wf_ptr->discreteIndicator, 0, mesh_size * sizeof(bool));
-			}
-			Element* e;
-			for_all_active_elements(e, space_stabilization->get_mesh())
-			{
-				AsmList<double> al;
-				space_stabilization->get_element_assembly_list(e, &al);
-				if (rhs_stabilization->get(al.get_dof()[0]) >= 1)
-					wf_ptr->discreteIndicator[e->id] = true;
-			}
-		}
+			shock_indicator.calculate(space_rho, prev_sln_vector);
 
 		// Set the current time step.
 		wf_ptr->set_current_time_step(time_step_n);
@@ -58,17 +70,26 @@
 		{
 			// Solve.
 			solver.solve();
+			prev_sln_vector = solver.get_sln_vector();
 
+			// The time step according to CFL condition is calculated from the element means of the (limited) solution vector.
 			if (!SHOCK_CAPTURING || (P_INIT == 0))
+			{
 				Solution<double>::vector_to_solutions(solver.get_sln_vector(), spaces, prev_slns);
+				CFL.calculate(spaces, solver.get_sln_vector(), time_step_n);
+			}
 			else
 			{
 				if (SHOCK_CAPTURING_TYPE == KRIVODONOVA)
 				{
-					FluxLimiter* flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, solver.get_sln_vector(), spaces);
+					// The limiter works in place on the solver's vector.
+					if (!flux_limiter)
+						flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, solver.get_sln_vector(), spaces);
+					else
+						flux_limiter->set_solution_vector(solver.get_sln_vector());
 					flux_limiter->limit_according_to_detector();
 					flux_limiter->get_limited_solutions(prev_slns);
-					delete flux_limiter;
+					CFL.calculate(spaces, solver.get_sln_vector(), time_step_n);
 				}
 
 				if (SHOCK_CAPTURING_TYPE == KUZMIN && P_INIT > 0)
@@ -76,59 +97,14 @@
 					if (P_INIT != 1)
 						throw new Hermes::Exceptions::Exception("P_INIT must be <= 1.");
 
-					// Limit conservative variables (in normal circumstances, might be enough).
-					PostProcessing::VertexBasedLimiter limiter(spaces, solver.get_sln_vector(), P_INIT);
-					limiter.get_solutions(prev_slns);
-
-					// The rest is limiting also the real variables (i.e. velocity, energy density)
-					int running_dofs = 0;
-					int ndof = spaces[0]->get_num_dofs();
-					double* density_sln_vector = limiter.get_solution_vector();
-					Element* e;
-					AsmList<double> al_density;
-					// We do not limit density anymore, it has been limited as a conservative variable already.
-					for (int component = 1; component < 4; component++)
-					{
-						if (spaces[component]->get_num_dofs() != ndof)
-							throw Exceptions::Exception("Euler code is supposed to be executed on a single mesh.");
-
-						double* conservative_vector = limiter.get_solution_vector() + component * ndof;
-						double* real_vector = new double[ndof];
-						memset(real_vector, 0, sizeof(double) * ndof);
-
-						// Now we put together the vector of real variables
-						for_all_active_elements(e, spaces[0]->get_mesh())
-						{
-							spaces[0]->get_element_assembly_list(e, &al_density);
-
-							// Do not get confused by the fact that we use density AsmList for indexing, it is just a technicality, the following three lines calculate the three coordinates for the actual component.
-							real_vector[al_density.dof[0]] = conservative_vector[al_density.dof[0]] / density_sln_vector[al_density.dof[0]];
-							real_vector[al_density.dof[1]] = (conservative_vector[al_density.dof[1]] - real_vector[al_density.dof[0]] * density_sln_vector[al_density.dof[1]]) / density_sln_vector[al_density.dof[0]];
-							real_vector[al_density.dof[2]] = (conservative_vector[al_density.dof[2]] - real_vector[al_density.dof[0]] * density_sln_vector[al_density.dof[2]]) / density_sln_vector[al_density.dof[0]];
-						}
-						
-						// Now we normally limit this particular component.
-						PostProcessing::VertexBasedLimiter real_component_limiter(spaces[0], real_vector, P_INIT);
-						real_component_limiter.get_solution();
-						real_vector = real_component_limiter.get_solution_vector();
-
-						// And now we just calculate back the conservative variables.
-						for_all_active_elements(e, spaces[0]->get_mesh())
-						{
-							spaces[0]->get_element_assembly_list(e, &al_density);
-
-							conservative_vector[al_density.dof[1]] = density_sln_vector[al_density.dof[0]] * real_vector[al_density.dof[1]]
-								+ density_sln_vector[al_density.dof[1]] * real_vector[al_density.dof[0]];
+					// Limit the conservative variables, then the real variables (i.e. velocity, specific energy) calculated from the limited density,
+					// all in one pass over the elements, in place on the solver's vector.
+					kuzmin_limiter.limit(spaces, solver.get_sln_vector());
+					Solution<double>::vector_to_solutions(solver.get_sln_vector(), spaces, prev_slns);
 
-							conservative_vector[al_density.dof[2]] = density_sln_vector[al_density.dof[0]] * real_vector[al_density.dof[2]]
-								+ density_sln_vector[al_density.dof[2]] * real_vector[al_density.dof[0]];
-						}
-
-						Solution<double>::vector_to_solution(conservative_vector, spaces[0], prev_slns[component]);
-					}
+					CFL.calculate(spaces, solver.get_sln_vector(), time_step_n);
 				}
 			}
-			CFL.calculate(prev_slns, mesh, time_step_n);
 		}
 		catch (std::exception& e) { std::cout << e.what(); }
 #pragma endregion
@@ -146,23 +122,26 @@
 				// order_view.show(space_rho);
 				V_view.show(prev_rho_v_x, prev_rho_v_y, 1, 1);
 			}
-			// Output solution in VTK format.
+			// Output solution in VTK (binary VTU) format, all flow quantities in one file, indexed in Flow.pvd.
 			if (VTK_VISUALIZATION)
 			{
-				pressure->reinit();
-				Linearizer lin(FileExport);
 				char filename[40];
-				sprintf(filename, "Pressure-%i.vtk", iteration - 1);
-				lin.save_solution_vtk(pressure, filename, "Pressure", false);
-				sprintf(filename, "VelocityX-%i.vtk", iteration - 1);
-				lin.save_solution_vtk(prev_rho_v_x, filename, "VelocityX", false);
-				sprintf(filename, "VelocityY-%i.vtk", iteration - 1);
-				lin.save_solution_vtk(prev_rho_v_y, filename, "VelocityY", false);
-				sprintf(filename, "Rho-%i.vtk", iteration - 1);
-				lin.save_solution_vtk(prev_rho, filename, "Rho", false);
+				sprintf(filename, "Flow-%i.vtu", iteration - 1);
+				flow_output.save_vtu(spaces, solver.get_sln_vector(), filename, t);
 			}
 		}
 #pragma endregion
+
+#pragma region *. Checkpoint
+		if (checkpoint.is_due(iteration))
+		{
+			// The loop continues from t + time_step_n.
+			checkpoint.begin(iteration, t + time_step_n, time_step_n);
+			checkpoint.add(spaces, solver.get_sln_vector());
+			checkpoint.write();
+		}
+#pragma endregion
 	}
 #pragma endregion
+	delete flux_limiter;
 	return 0;
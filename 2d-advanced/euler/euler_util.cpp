@@ -1,6 +1,13 @@
 #include "euler_util.h"
 #include "limits.h"
 #include <limits>
+#include <list>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 // Calculates energy from other quantities.
 double QuantityCalculator::calc_energy(double rho, double rho_v_x, double rho_v_y, double pressure, double kappa)
@@ -48,6 +55,8 @@ void CFLCalculation::calculate(std::vector<MeshFunctionSharedPtr<double> > solut
 
   // Determine the time step according to the CFL condition.
 
+  std::shared_ptr<const MeshGeometry> mesh_geometry = MeshGeometry::get(mesh);
+  const MeshGeometry& geometry = *mesh_geometry;
   double min_condition = 0;
   Element *e;
   for_all_active_elements(e, mesh)
@@ -62,8 +71,7 @@ void CFLCalculation::calculate(std::vector<MeshFunctionSharedPtr<double> > solut
     constant_energy_space->get_element_assembly_list(e, &al);
     double energy = sln_vector[al.get_dof()[0]];
 
-    e->calc_area();
-    double condition = e->area * CFL_number / (std::sqrt(v1*v1 + v2*v2) + QuantityCalculator::calc_sound_speed(rho, rho*v1, rho*v2, energy, kappa));
+    double condition = geometry.area[geometry.element_indices[e->id]] * CFL_number / (std::sqrt(v1*v1 + v2*v2) + QuantityCalculator::calc_sound_speed(rho, rho*v1, rho*v2, energy, kappa));
 
     if (condition < min_condition || min_condition == 0.)
       min_condition = condition;
@@ -89,6 +97,8 @@ void CFLCalculation::calculate_semi_implicit(std::vector<MeshFunctionSharedPtr<d
 
   // Determine the time step according to the CFL condition.
 
+  std::shared_ptr<const MeshGeometry> mesh_geometry = MeshGeometry::get(mesh);
+  const MeshGeometry& geometry = *mesh_geometry;
   double min_condition = 0;
   Element *e;
   double w[4];
@@ -106,111 +116,3291 @@ void CFLCalculation::calculate_semi_implicit(std::vector<MeshFunctionSharedPtr<d
 
     double edge_length_max_lambda = 0.0;
 
-    solutions[0]->set_active_element(e);
-    for (unsigned int edge_i = 0; edge_i < e->get_nvert(); edge_i++) {
-      // Initialization.
-      SurfPos surf_pos;
-      surf_pos.marker = e->marker;
-      surf_pos.surf_num = edge_i;
-      int eo = solutions[1]->get_quad_2d()->get_edge_points(surf_pos.surf_num, 20, e->get_mode());
-      double3* tan = NULL;
-      GeomSurf<double>* geom = init_geom_surf(solutions[0]->get_refmap(), surf_pos.surf_num, surf_pos.marker, eo, tan);
-      int np = solutions[1]->get_quad_2d()->get_num_points(eo, e->get_mode());
+    // The edge lengths and normals are those of the geometry, no RefMap is evaluated here.
+    int element_i = geometry.element_indices[e->id];
+    for (int edge_i = geometry.edge_offsets[element_i]; edge_i < geometry.edge_offsets[element_i + 1]; edge_i++) {
+      // Calculation of the maximum eigenvalue of the matrix P.
+      double max_eigen_value = 0.0;
+      for (int normal_i = geometry.edge_normal_offsets[edge_i]; normal_i < geometry.edge_normal_offsets[edge_i + 1]; normal_i++) {
+        // Transform to the local coordinates.
+        double transformed[4];
+        transformed[0] = w[0];
+        transformed[1] = geometry.normal_x[normal_i] * w[1] + geometry.normal_y[normal_i] * w[2];
+        transformed[2] = -geometry.normal_y[normal_i] * w[1] + geometry.normal_x[normal_i] * w[2];
+        transformed[3] = w[3];
+
+        // Calc sound speed.
+        double a = QuantityCalculator::calc_sound_speed(transformed[0], transformed[1], transformed[2], transformed[3], kappa);
+
+        // Calc max eigenvalue.
+        if (transformed[1] / transformed[0] - a > max_eigen_value || normal_i == geometry.edge_normal_offsets[edge_i])
+          max_eigen_value = transformed[1] / transformed[0] - a;
+        if (transformed[1] / transformed[0] > max_eigen_value)
+          max_eigen_value = transformed[1] / transformed[0];
+        if (transformed[1] / transformed[0] + a > max_eigen_value)
+          max_eigen_value = transformed[1] / transformed[0] + a;
+      }
+
+      if (geometry.edge_length[edge_i] * max_eigen_value > edge_length_max_lambda || edge_i == geometry.edge_offsets[element_i])
+        edge_length_max_lambda = geometry.edge_length[edge_i] * max_eigen_value;
+    }
+
+    double condition = geometry.area[element_i] * CFL_number / edge_length_max_lambda;
+
+    if (condition < min_condition || min_condition == 0.)
+      min_condition = condition;
+  }
+
+  time_step = min_condition;
+
+  delete[] sln_vector;
+}
+
+void CFLCalculation::calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step)
+{
+  element_means.update(spaces);
+  int num_elements = element_means.get_num_elements();
+  const MeshGeometry& geometry = element_means.get_geometry();
+
+  // Determine the time step according to the CFL condition.
+  double min_condition = std::numeric_limits<double>::max();
+#pragma omp parallel
+  {
+    double thread_min_condition = std::numeric_limits<double>::max();
+#pragma omp for
+    for (int element_i = 0; element_i < num_elements; element_i++)
+    {
+      double rho = element_means.get_mean(sln_vector, element_i, 0);
+      double v1 = element_means.get_mean(sln_vector, element_i, 1) / rho;
+      double v2 = element_means.get_mean(sln_vector, element_i, 2) / rho;
+      double energy = element_means.get_mean(sln_vector, element_i, 3);
+
+      double condition = geometry.area[element_i] * CFL_number / (std::sqrt(v1*v1 + v2*v2) + QuantityCalculator::calc_sound_speed(rho, rho*v1, rho*v2, energy, kappa));
+      if (condition < thread_min_condition)
+        thread_min_condition = condition;
+    }
+#pragma omp critical (CFLCalculation_min)
+    if (thread_min_condition < min_condition)
+      min_condition = thread_min_condition;
+  }
+
+  time_step = min_condition;
+}
+
+double CFLCalculation::element_time_step_semi_implicit(const double* sln_vector, int element_i) const
+{
+  double rho = element_means.get_mean(sln_vector, element_i, 0);
+  double rho_v_x = element_means.get_mean(sln_vector, element_i, 1);
+  double rho_v_y = element_means.get_mean(sln_vector, element_i, 2);
+  double energy = element_means.get_mean(sln_vector, element_i, 3);
+  double a = QuantityCalculator::calc_sound_speed(rho, rho_v_x, rho_v_y, energy, kappa);
+
+  // The maximum eigenvalue of P in the direction of the edge normal is v.n + a, maximized over the normals along a curved edge.
+  const MeshGeometry& geometry = element_means.get_geometry();
+  double edge_length_max_lambda = 0.0;
+  for (int edge_i = geometry.edge_offsets[element_i]; edge_i < geometry.edge_offsets[element_i + 1]; edge_i++)
+  {
+    double max_normal_flux = 0.0;
+    for (int normal_i = geometry.edge_normal_offsets[edge_i]; normal_i < geometry.edge_normal_offsets[edge_i + 1]; normal_i++)
+    {
+      double normal_flux = geometry.normal_x[normal_i] * rho_v_x + geometry.normal_y[normal_i] * rho_v_y;
+      if (normal_flux > max_normal_flux || normal_i == geometry.edge_normal_offsets[edge_i])
+        max_normal_flux = normal_flux;
+    }
+    double max_eigen_value = max_normal_flux / rho + a;
+    if (geometry.edge_length[edge_i] * max_eigen_value > edge_length_max_lambda || edge_i == geometry.edge_offsets[element_i])
+      edge_length_max_lambda = geometry.edge_length[edge_i] * max_eigen_value;
+  }
+
+  return geometry.area[element_i] * CFL_number / edge_length_max_lambda;
+}
+
+void CFLCalculation::calculate_semi_implicit(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step)
+{
+  element_means.update(spaces);
+  int num_elements = element_means.get_num_elements();
+
+  // Determine the time step according to the CFL condition.
+  double min_condition = std::numeric_limits<double>::max();
+#pragma omp parallel
+  {
+    double thread_min_condition = std::numeric_limits<double>::max();
+#pragma omp for
+    for (int element_i = 0; element_i < num_elements; element_i++)
+    {
+      double condition = element_time_step_semi_implicit(sln_vector, element_i);
+      if (condition < thread_min_condition)
+        thread_min_condition = condition;
+    }
+#pragma omp critical (CFLCalculation_min)
+    if (thread_min_condition < min_condition)
+      min_condition = thread_min_condition;
+  }
+
+  time_step = min_condition;
+}
+
+void CFLCalculation::calculate_local_semi_implicit(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, std::vector<double>& element_time_steps)
+{
+  element_means.update(spaces);
+  int num_elements = element_means.get_num_elements();
+
+  element_time_steps.assign(spaces[0]->get_mesh()->get_max_element_id() + 1, 0.);
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+    element_time_steps[element_means.get_geometry().element_ids[element_i]] = element_time_step_semi_implicit(sln_vector, element_i);
+}
+
+void CFLCalculation::set_number(double new_CFL_number)
+{
+  this->CFL_number = new_CFL_number;
+}
+
+ADEStabilityCalculation::ADEStabilityCalculation(double AdvectionRelativeConstant, double DiffusionRelativeConstant, double epsilon)
+  : AdvectionRelativeConstant(AdvectionRelativeConstant), DiffusionRelativeConstant(DiffusionRelativeConstant), epsilon(epsilon)
+{
+}
+
+void ADEStabilityCalculation::calculate(std::vector<MeshFunctionSharedPtr<double> > solutions, MeshSharedPtr mesh, double & time_step)
+{
+  // Create spaces of constant functions over the given mesh->
+  SpaceSharedPtr<double> constant_rho_space(new L2Space<double>(mesh, 0));
+  SpaceSharedPtr<double> constant_rho_v_x_space(new L2Space<double>(mesh, 0));
+  SpaceSharedPtr<double> constant_rho_v_y_space(new L2Space<double>(mesh, 0));
+
+  double* sln_vector = new double[constant_rho_space->get_num_dofs() * 3];
+
+  OGProjection<double> ogProjection;
+  ogProjection.project_global({ constant_rho_space, constant_rho_v_x_space, constant_rho_v_y_space }, solutions, sln_vector);
+
+  // Determine the time step according to the conditions.
+  std::shared_ptr<const MeshGeometry> mesh_geometry = MeshGeometry::get(mesh);
+  const MeshGeometry& geometry = *mesh_geometry;
+  double min_condition_advection = 0.;
+  double min_condition_diffusion = 0.;
+  Element *e;
+  for_all_active_elements(e, mesh)
+  {
+    AsmList<double> al;
+    constant_rho_space->get_element_assembly_list(e, &al);
+    double rho = sln_vector[al.get_dof()[0]];
+    constant_rho_v_x_space->get_element_assembly_list(e, &al);
+    double v1 = sln_vector[al.get_dof()[0] + constant_rho_space->get_num_dofs()] / rho;
+    constant_rho_v_y_space->get_element_assembly_list(e, &al);
+    double v2 = sln_vector[al.get_dof()[0] + 2 * constant_rho_space->get_num_dofs()] / rho;
+
+    int element_i = geometry.element_indices[e->id];
+    double condition_advection = AdvectionRelativeConstant * geometry.diameter[element_i] / std::sqrt(v1*v1 + v2*v2);
+    double condition_diffusion = DiffusionRelativeConstant * geometry.area[element_i] / epsilon;
+
+    if (condition_advection < min_condition_advection || min_condition_advection == 0.)
+      min_condition_advection = condition_advection;
+
+    if (condition_diffusion < min_condition_diffusion || min_condition_diffusion == 0.)
+      min_condition_diffusion = condition_diffusion;
+  }
+
+  time_step = std::min(min_condition_advection, min_condition_diffusion);
+
+  delete[] sln_vector;
+}
+
+void ADEStabilityCalculation::calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step)
+{
+  element_means.update(spaces);
+  int num_elements = element_means.get_num_elements();
+  const MeshGeometry& geometry = element_means.get_geometry();
+
+  // Determine the time step according to the conditions.
+  double min_condition = std::numeric_limits<double>::max();
+#pragma omp parallel
+  {
+    double thread_min_condition = std::numeric_limits<double>::max();
+#pragma omp for
+    for (int element_i = 0; element_i < num_elements; element_i++)
+    {
+      double rho = element_means.get_mean(sln_vector, element_i, 0);
+      double v1 = element_means.get_mean(sln_vector, element_i, 1) / rho;
+      double v2 = element_means.get_mean(sln_vector, element_i, 2) / rho;
+
+      double condition_advection = AdvectionRelativeConstant * geometry.diameter[element_i] / std::sqrt(v1*v1 + v2*v2);
+      double condition_diffusion = DiffusionRelativeConstant * geometry.area[element_i] / epsilon;
+
+      double condition = std::min(condition_advection, condition_diffusion);
+      if (condition < thread_min_condition)
+        thread_min_condition = condition;
+    }
+#pragma omp critical (ADEStabilityCalculation_min)
+    if (thread_min_condition < min_condition)
+      min_condition = thread_min_condition;
+  }
+
+  time_step = min_condition;
+}
+
+// Gauss-Legendre points and weights on [0, 1], for the edge integrals.
+static const int num_edge_points = 5;
+static const double edge_points[num_edge_points] = { 0.046910077030668, 0.230765344947158, 0.5, 0.769234655052842, 0.953089922969332 };
+static const double edge_weights[num_edge_points] = { 0.118463442528095, 0.239314335249683, 0.284444444444444, 0.239314335249683, 0.118463442528095 };
+
+// The part t_min, ..., t_max (of 0, ..., 1) of the edge edge_i of the Element e shared with the neighbor,
+// given by the vertices of the neighbor lying on the edge's line. Returns false if there is no such part.
+static bool get_shared_edge_part(Element* e, int edge_i, Element* neighbor, double& t_min, double& t_max)
+{
+  int nvert = e->get_nvert();
+  double x_0 = e->vn[edge_i]->x, y_0 = e->vn[edge_i]->y;
+  double dx = e->vn[(edge_i + 1) % nvert]->x - x_0, dy = e->vn[(edge_i + 1) % nvert]->y - y_0;
+  double length_squared = dx * dx + dy * dy;
+
+  t_min = 1.;
+  t_max = 0.;
+  for (int vertex_i = 0; vertex_i < neighbor->get_nvert(); vertex_i++)
+  {
+    double px = neighbor->vn[vertex_i]->x - x_0, py = neighbor->vn[vertex_i]->y - y_0;
+    if (std::abs(px * dy - py * dx) > 1E-10 * length_squared)
+      continue;
+    double t = (px * dx + py * dy) / length_squared;
+    t_min = std::min(t_min, t);
+    t_max = std::max(t_max, t);
+  }
+  t_min = std::max(t_min, 0.);
+  t_max = std::min(t_max, 1.);
+  return t_max - t_min >= 1E-12;
+}
+
+// Quadrature order of the edge points of curved edges, the Gauss rule with as many points as the one above on straight edges.
+static const int curved_edge_order = 2 * num_edge_points - 1;
+// Number of meshes whose geometry is kept (e.g. the coarse and the reference meshes of several fields).
+static const int max_cached_geometries = 8;
+
+MeshGeometry::MeshGeometry() : mesh_seq(-1)
+{
+}
+
+std::shared_ptr<const MeshGeometry> MeshGeometry::get(MeshSharedPtr mesh)
+{
+  // The most recently used geometry is the first one. The entries are identified by the mesh and its seq, so that
+  // neither a changed mesh nor a new mesh at the address of a deleted one gets an outdated geometry.
+  typedef std::pair<std::pair<const Mesh*, int>, std::shared_ptr<const MeshGeometry> > Entry;
+  static std::list<Entry> geometries;
+  static std::mutex geometries_mutex;
+  std::lock_guard<std::mutex> lock(geometries_mutex);
+
+  std::pair<const Mesh*, int> key(mesh.get(), mesh->get_seq());
+  std::list<Entry>::iterator it = geometries.begin();
+  while (it != geometries.end() && it->first != key)
+  {
+    // The geometry of the mesh before its last change is not needed any more.
+    if (it->first.first == key.first)
+      it = geometries.erase(it);
+    else
+      it++;
+  }
+  if (it != geometries.end())
+  {
+    geometries.splice(geometries.begin(), geometries, it);
+    return geometries.front().second;
+  }
+
+  std::shared_ptr<MeshGeometry> geometry(new MeshGeometry());
+  geometry->build(mesh);
+  geometries.push_front(Entry(key, geometry));
+  if ((int)geometries.size() > max_cached_geometries)
+    geometries.pop_back();
+  return geometry;
+}
+
+void MeshGeometry::build(MeshSharedPtr mesh)
+{
+  this->mesh_seq = mesh->get_seq();
+
+  element_ids.clear();
+  area.clear();
+  diameter.clear();
+  edge_offsets.clear();
+  edge_boundary.clear();
+  edge_length.clear();
+  edge_nx.clear();
+  edge_ny.clear();
+  edge_normal_offsets.clear();
+  normal_x.clear();
+  normal_y.clear();
+  point_offsets.clear();
+  point_x.clear();
+  point_y.clear();
+  point_weight.clear();
+  point_nx.clear();
+  point_ny.clear();
+  point_neighbor_ids.clear();
+  element_indices.assign(mesh->get_max_element_id() + 1, -1);
+
+  RefMap refmap, neighbor_refmap;
+  refmap.set_quad_2d(&g_quad_2d_std);
+  neighbor_refmap.set_quad_2d(&g_quad_2d_std);
+
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    element_indices[e->id] = element_ids.size();
+    element_ids.push_back(e->id);
+    e->calc_diameter();
+    diameter.push_back(e->diameter);
+
+    double orientation = 1.;
+    if (e->is_curved())
+    {
+      // The area is the integral of the Jacobian of the reference map.
+      refmap.set_active_element(e);
+      int order = g_quad_2d_std.get_max_order(e->get_mode());
+      double3* pt = g_quad_2d_std.get_points(order, e->get_mode());
+      double* jacobian = refmap.get_jacobian(order);
+      double element_area = 0.;
+      for (int point_i = 0; point_i < g_quad_2d_std.get_num_points(order, e->get_mode()); point_i++)
+        element_area += pt[point_i][2] * jacobian[point_i];
+      area.push_back(element_area);
+    }
+    else
+    {
+      e->calc_area();
+      area.push_back(e->area);
+
+      // Orientation of the vertices, to have the normals pointing outwards.
+      double signed_area = 0.0;
+      for (unsigned int vertex_i = 0; vertex_i < e->get_nvert(); vertex_i++)
+        signed_area += e->vn[vertex_i]->x * e->vn[(vertex_i + 1) % e->get_nvert()]->y - e->vn[(vertex_i + 1) % e->get_nvert()]->x * e->vn[vertex_i]->y;
+      orientation = signed_area > 0. ? 1. : -1.;
+    }
+
+    edge_offsets.push_back(edge_length.size());
+    for (int edge_i = 0; edge_i < e->get_nvert(); edge_i++)
+    {
+      edge_boundary.push_back(e->en[edge_i]->bnd ? 1 : 0);
+      edge_normal_offsets.push_back(normal_x.size());
+      point_offsets.push_back(point_x.size());
+      if (e->is_curved())
+        add_curved_edge(mesh, e, edge_i, &refmap, &neighbor_refmap);
+      else
+        add_straight_edge(mesh, e, edge_i, orientation);
+    }
+  }
+  edge_offsets.push_back(edge_length.size());
+  edge_normal_offsets.push_back(normal_x.size());
+  point_offsets.push_back(point_x.size());
+}
+
+void MeshGeometry::add_straight_edge(MeshSharedPtr mesh, Element* e, int edge_i, double orientation)
+{
+  int nvert = e->get_nvert();
+  double x_0 = e->vn[edge_i]->x, y_0 = e->vn[edge_i]->y;
+  double dx = e->vn[(edge_i + 1) % nvert]->x - x_0, dy = e->vn[(edge_i + 1) % nvert]->y - y_0;
+  double length = std::sqrt(dx * dx + dy * dy);
+  double nx = orientation * dy / length, ny = -orientation * dx / length;
+
+  edge_length.push_back(length);
+  edge_nx.push_back(nx);
+  edge_ny.push_back(ny);
+  normal_x.push_back(nx);
+  normal_y.push_back(ny);
+  if (e->en[edge_i]->bnd)
+    return;
+
+  NeighborSearch<double> ns(e, mesh);
+  ns.set_active_edge(edge_i);
+  for (int neighbor_i = 0; neighbor_i < ns.get_num_neighbors(); neighbor_i++)
+  {
+    ns.set_active_segment(neighbor_i);
+    Element* neighbor = ns.get_neighb_el();
+    double t_min, t_max;
+    if (!get_shared_edge_part(e, edge_i, neighbor, t_min, t_max))
+      continue;
+    for (int point_i = 0; point_i < num_edge_points; point_i++)
+    {
+      double t = t_min + (t_max - t_min) * edge_points[point_i];
+      add_point(x_0 + t * dx, y_0 + t * dy, edge_weights[point_i] * (t_max - t_min) * length, nx, ny, neighbor->id);
+    }
+  }
+}
+
+void MeshGeometry::add_curved_edge(MeshSharedPtr mesh, Element* e, int edge_i, RefMap* refmap, RefMap* neighbor_refmap)
+{
+  // The refmap is set to the Element e. The tangents are unit ones, with the Jacobian of the edge map as the third component,
+  // the elements are oriented counter-clockwise, so the outer normal is (t_y, -t_x).
+  int eo = g_quad_2d_std.get_edge_points(edge_i, curved_edge_order, e->get_mode());
+  int np = g_quad_2d_std.get_num_points(eo, e->get_mode());
+  double3* pt = g_quad_2d_std.get_points(eo, e->get_mode());
+  double3* tangent = refmap->get_tangent(edge_i, eo);
+
+  double length = 0., nx = 0., ny = 0.;
+  for (int point_i = 0; point_i < np; point_i++)
+  {
+    double weight = pt[point_i][2] * tangent[point_i][2];
+    length += weight;
+    nx += weight * tangent[point_i][1];
+    ny -= weight * tangent[point_i][0];
+    normal_x.push_back(tangent[point_i][1]);
+    normal_y.push_back(-tangent[point_i][0]);
+  }
+  double n_norm = std::sqrt(nx * nx + ny * ny);
+  edge_length.push_back(length);
+  edge_nx.push_back(nx / n_norm);
+  edge_ny.push_back(ny / n_norm);
+  if (e->en[edge_i]->bnd)
+    return;
+
+  NeighborSearch<double> ns(e, mesh);
+  ns.set_active_edge(edge_i);
+  if (ns.get_num_neighbors() == 1)
+  {
+    // The whole edge lies on the neighbor's edge.
+    ns.set_active_segment(0);
+    int neighbor_id = ns.get_neighb_el()->id;
+    double* x = refmap->get_phys_x(eo);
+    double* y = refmap->get_phys_y(eo);
+    for (int point_i = 0; point_i < np; point_i++)
+      add_point(x[point_i], y[point_i], pt[point_i][2] * tangent[point_i][2], tangent[point_i][1], -tangent[point_i][0], neighbor_id);
+    return;
+  }
+
+  // The neighbors are smaller, their edges lie on this one: their edge points are used, with the opposite normals.
+  for (int neighbor_i = 0; neighbor_i < ns.get_num_neighbors(); neighbor_i++)
+  {
+    ns.set_active_segment(neighbor_i);
+    Element* neighbor = ns.get_neighb_el();
+    int neighbor_edge_i = ns.get_neighbor_edge().local_num_of_edge;
+    neighbor_refmap->set_active_element(neighbor);
+    int neighbor_eo = g_quad_2d_std.get_edge_points(neighbor_edge_i, curved_edge_order, neighbor->get_mode());
+    double3* neighbor_pt = g_quad_2d_std.get_points(neighbor_eo, neighbor->get_mode());
+    double3* neighbor_tangent = neighbor_refmap->get_tangent(neighbor_edge_i, neighbor_eo);
+    double* x = neighbor_refmap->get_phys_x(neighbor_eo);
+    double* y = neighbor_refmap->get_phys_y(neighbor_eo);
+    for (int point_i = 0; point_i < g_quad_2d_std.get_num_points(neighbor_eo, neighbor->get_mode()); point_i++)
+      add_point(x[point_i], y[point_i], neighbor_pt[point_i][2] * neighbor_tangent[point_i][2], -neighbor_tangent[point_i][1], neighbor_tangent[point_i][0], neighbor->id);
+  }
+}
+
+void MeshGeometry::add_point(double x, double y, double weight, double nx, double ny, int neighbor_id)
+{
+  point_x.push_back(x);
+  point_y.push_back(y);
+  point_weight.push_back(weight);
+  point_nx.push_back(nx);
+  point_ny.push_back(ny);
+  point_neighbor_ids.push_back(neighbor_id);
+}
+
+// True if the mean of a DG function on the element is its constant-mode coefficient (times the constant shape function): with
+// the constant only, or with the (orthogonal) Legendre shapeset on a quad mapped affinely, i.e. a straight parallelogram.
+// The Legendre functions on triangles are not orthogonal, and the bilinear map of other quads does not keep the zero means.
+static bool constant_mode_mean(Element* e, Shapeset* shapeset, int num_shapes)
+{
+  if (num_shapes == 1)
+    return true;
+  if (!dynamic_cast<L2ShapesetLegendre*>(shapeset) || e->is_curved() || e->is_triangle())
+    return false;
+  double dx = e->vn[0]->x - e->vn[1]->x + e->vn[2]->x - e->vn[3]->x;
+  double dy = e->vn[0]->y - e->vn[1]->y + e->vn[2]->y - e->vn[3]->y;
+  e->calc_diameter();
+  return std::sqrt(dx * dx + dy * dy) < 1e-12 * e->diameter;
+}
+
+ElementMeanCache::ElementMeanCache() : num_components(0), mesh_seq(-1)
+{
+}
+
+void ElementMeanCache::update(const std::vector<SpaceSharedPtr<double> >& spaces)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+
+  bool up_to_date = (mesh->get_seq() == this->mesh_seq) && (spaces.size() == this->space_seqs.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return;
+
+  this->mesh_seq = mesh->get_seq();
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    if (spaces[space_i]->get_mesh()->get_seq() != this->mesh_seq)
+      throw Hermes::Exceptions::Exception("ElementMeanCache works only for spaces on a single mesh.");
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+  }
+  this->num_components = spaces.size();
+  this->geometry = MeshGeometry::get(mesh);
+
+  mean_offsets.clear();
+  mean_dofs.clear();
+  mean_weights.clear();
+
+  // The coefficient vector is the concatenation of the vectors of the spaces, whose dofs may be numbered
+  // either from zero, or already globally - find the first dof of every space.
+  std::vector<int> first_dofs(spaces.size(), std::numeric_limits<int>::max());
+  AsmList<double> al;
+  Element* e;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for_all_active_elements(e, mesh)
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al);
+      for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+        if (al.get_dof()[shape_i] >= 0 && al.get_dof()[shape_i] < first_dofs[space_i])
+          first_dofs[space_i] = al.get_dof()[shape_i];
+    }
+  }
+
+  RefMap refmap;
+  refmap.set_quad_2d(&g_quad_2d_std);
+
+  // In the order of the elements of the geometry.
+  for_all_active_elements(e, mesh)
+  {
+    int running_dofs = 0;
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al);
+      Shapeset* shapeset = spaces[space_i]->get_shapeset();
+      mean_offsets.push_back(mean_dofs.size());
+      if (constant_mode_mean(e, shapeset, al.get_cnt()))
+      {
+        mean_dofs.push_back(running_dofs + al.get_dof()[0] - first_dofs[space_i]);
+        mean_weights.push_back(al.get_coef()[0] * shapeset->get_fn_value(al.get_idx()[0], 0., 0., 0, e->get_mode()));
+      }
+      else
+      {
+        // The means of the shape functions, with the quadrature of the reference map (exact also on curved elements up to its order).
+        refmap.set_active_element(e);
+        int order = g_quad_2d_std.get_max_order(e->get_mode());
+        double3* pt = g_quad_2d_std.get_points(order, e->get_mode());
+        double* jacobian = refmap.get_jacobian(order);
+        int num_points = g_quad_2d_std.get_num_points(order, e->get_mode());
+        double element_area = 0.;
+        for (int point_i = 0; point_i < num_points; point_i++)
+          element_area += pt[point_i][2] * jacobian[point_i];
+        for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+        {
+          double integral = 0.;
+          for (int point_i = 0; point_i < num_points; point_i++)
+            integral += pt[point_i][2] * jacobian[point_i] * shapeset->get_fn_value(al.get_idx()[shape_i], pt[point_i][0], pt[point_i][1], 0, e->get_mode());
+          mean_dofs.push_back(running_dofs + al.get_dof()[shape_i] - first_dofs[space_i]);
+          mean_weights.push_back(al.get_coef()[shape_i] * integral / element_area);
+        }
+      }
+      running_dofs += spaces[space_i]->get_num_dofs();
+    }
+  }
+  mean_offsets.push_back(mean_dofs.size());
+}
+
+// Mass matrix form of one component, used for the inverse mass matrix blocks in SSPRungeKutta.
+class SSPRungeKuttaMassForm : public MatrixFormVol<double>
+{
+public:
+  SSPRungeKuttaMassForm(int i) : MatrixFormVol<double>(i, i) {}
+
+  double value(int n, double *wt, Func<double> *u_ext[], Func<double> *u, Func<double> *v,
+    GeomVol<double> *e, Func<double>* *ext) const
+  {
+    return int_u_v<double, double>(n, wt, u, v);
+  }
+
+  Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *u, Func<Ord> *v, GeomVol<Ord> *e,
+    Func<Ord>* *ext) const
+  {
+    return int_u_v<Ord, Ord>(n, wt, u, v);
+  }
+
+  MatrixFormVol<double>* clone() const { return new SSPRungeKuttaMassForm(this->i); }
+};
+
+SSPRungeKutta::SSPRungeKutta(WeakFormSharedPtr<double> wf, std::vector<SpaceSharedPtr<double> > spaces, std::vector<MeshFunctionSharedPtr<double> > ext_slns, int order)
+  : wf(wf), spaces(spaces), ext_slns(ext_slns), order(order), ndof(0), initial_vector(NULL), residual_vector(NULL), derivative(NULL)
+{
+  if (order < 1 || order > 3)
+    throw Hermes::Exceptions::Exception("SSPRungeKutta: only orders 1, 2, 3 are available.");
+
+  this->dp = new DiscreteProblem<double>(wf, spaces);
+  this->dp->set_linear();
+  this->residual = create_vector<double>();
+}
+
+SSPRungeKutta::~SSPRungeKutta()
+{
+  delete this->dp;
+  delete this->residual;
+  delete[] this->initial_vector;
+  delete[] this->residual_vector;
+  delete[] this->derivative;
+}
+
+void SSPRungeKutta::update_inverse_mass_matrix()
+{
+  bool up_to_date = (spaces.size() == this->space_seqs.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return;
+
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+
+  int new_ndof = Space<double>::get_num_dofs(spaces);
+  if (new_ndof != this->ndof)
+  {
+    delete[] this->initial_vector;
+    delete[] this->residual_vector;
+    delete[] this->derivative;
+    this->ndof = new_ndof;
+    this->initial_vector = new double[ndof];
+    this->residual_vector = new double[ndof];
+    this->derivative = new double[ndof];
+  }
+
+  // Assemble the (block diagonal) mass matrix once.
+  WeakFormSharedPtr<double> wf_mass(new WeakForm<double>(spaces.size()));
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    wf_mass->add_matrix_form(new SSPRungeKuttaMassForm(space_i));
+  DiscreteProblem<double> dp_mass(wf_mass, spaces);
+  dp_mass.set_linear();
+  SparseMatrix<double>* mass_matrix = create_matrix<double>();
+  Vector<double>* mass_rhs = create_vector<double>();
+  dp_mass.assemble(mass_matrix, mass_rhs);
+
+  block_dof_offsets.clear();
+  block_dofs.clear();
+  block_offsets.clear();
+  inverse_blocks.clear();
+  block_element_ids.clear();
+
+  AsmList<double> al;
+  std::vector<double> block;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    Element* e;
+    for_all_active_elements(e, spaces[space_i]->get_mesh())
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al);
+      int size = al.get_cnt();
+
+      block_dof_offsets.push_back(block_dofs.size());
+      block_offsets.push_back(inverse_blocks.size());
+      block_element_ids.push_back(e->id);
+      for (int a = 0; a < size; a++)
+        block_dofs.push_back(al.get_dof()[a]);
+
+      // Invert the block by Gauss-Jordan elimination with partial pivoting, [block | I] -> [I | block^-1].
+      block.assign(size * size, 0.0);
+      std::vector<double> inverse(size * size, 0.0);
+      for (int a = 0; a < size; a++)
+      {
+        inverse[a * size + a] = 1.0;
+        for (int b = 0; b < size; b++)
+          block[a * size + b] = mass_matrix->get(al.get_dof()[a], al.get_dof()[b]);
+      }
+      for (int col = 0; col < size; col++)
+      {
+        int pivot = col;
+        for (int row = col + 1; row < size; row++)
+          if (std::abs(block[row * size + col]) > std::abs(block[pivot * size + col]))
+            pivot = row;
+        if (pivot != col)
+          for (int k = 0; k < size; k++)
+          {
+            std::swap(block[col * size + k], block[pivot * size + k]);
+            std::swap(inverse[col * size + k], inverse[pivot * size + k]);
+          }
+        double diagonal = block[col * size + col];
+        for (int k = 0; k < size; k++)
+        {
+          block[col * size + k] /= diagonal;
+          inverse[col * size + k] /= diagonal;
+        }
+        for (int row = 0; row < size; row++)
+          if (row != col)
+          {
+            double factor = block[row * size + col];
+            for (int k = 0; k < size; k++)
+            {
+              block[row * size + k] -= factor * block[col * size + k];
+              inverse[row * size + k] -= factor * inverse[col * size + k];
+            }
+          }
+      }
+      inverse_blocks.insert(inverse_blocks.end(), inverse.begin(), inverse.end());
+    }
+  }
+  block_dof_offsets.push_back(block_dofs.size());
+  block_offsets.push_back(inverse_blocks.size());
+
+  delete mass_matrix;
+  delete mass_rhs;
+}
+
+void SSPRungeKutta::calculate_derivative(double* sln_vector, double* result)
+{
+  Solution<double>::vector_to_solutions(sln_vector, spaces, ext_slns);
+  dp->assemble(residual);
+  residual->extract(residual_vector);
+
+  int num_blocks = block_offsets.size() - 1;
+#pragma omp parallel for
+  for (int block_i = 0; block_i < num_blocks; block_i++)
+  {
+    const int* dofs = &block_dofs[block_dof_offsets[block_i]];
+    const double* inverse = &inverse_blocks[block_offsets[block_i]];
+    int size = block_dof_offsets[block_i + 1] - block_dof_offsets[block_i];
+    for (int a = 0; a < size; a++)
+    {
+      double value = 0.0;
+      for (int b = 0; b < size; b++)
+        value += inverse[a * size + b] * residual_vector[dofs[b]];
+      result[dofs[a]] = value;
+    }
+  }
+}
+
+void SSPRungeKutta::step(double* sln_vector, double time_step)
+{
+  update_inverse_mass_matrix();
+
+  // Shu-Osher form: w_s = alpha_s * w_0 + (1 - alpha_s) * (w_{s-1} + time_step * M^-1 R(w_{s-1})).
+  static const double alpha[3][3] = { { 0. }, { 0., 1. / 2. }, { 0., 3. / 4., 1. / 3. } };
+
+  memcpy(initial_vector, sln_vector, ndof * sizeof(double));
+  for (int stage_i = 0; stage_i < order; stage_i++)
+  {
+    calculate_derivative(sln_vector, derivative);
+    double a = alpha[order - 1][stage_i];
+    for (int dof_i = 0; dof_i < ndof; dof_i++)
+      sln_vector[dof_i] = a * initial_vector[dof_i] + (1. - a) * (sln_vector[dof_i] + time_step * derivative[dof_i]);
+  }
+}
+
+void SSPRungeKutta::set_spaces(std::vector<SpaceSharedPtr<double> > spaces)
+{
+  // The same spaces (e.g. an unchanged reference mesh in every time step): the inverse mass matrix is kept, unless their seqs
+  // changed, which update_inverse_mass_matrix() checks itself.
+  bool same_spaces = (spaces.size() == this->spaces.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && same_spaces; space_i++)
+    if (spaces[space_i].get() != this->spaces[space_i].get())
+      same_spaces = false;
+  if (same_spaces && this->space_seqs.size() == spaces.size())
+  {
+    bool up_to_date = true;
+    for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+      if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+        up_to_date = false;
+    if (up_to_date)
+      return;
+  }
+
+  this->spaces = spaces;
+  this->dp->set_spaces(spaces);
+  if (!same_spaces)
+    this->space_seqs.clear();
+}
+
+LocalTimeStepping::LocalTimeStepping(WeakFormSharedPtr<double> wf, std::vector<SpaceSharedPtr<double> > spaces, std::vector<MeshFunctionSharedPtr<double> > ext_slns,
+  double CFL_number, double kappa, int num_levels)
+  : SSPRungeKutta(wf, spaces, ext_slns, 1), CFL_number(CFL_number), kappa(kappa), num_levels(num_levels), global_time_step(0.), substep(0),
+  accumulated(NULL), accumulated_size(0), substep_fluxes(NULL), edge_conditions_seq(-1)
+{
+  if (num_levels < 1 || num_levels > 16)
+    throw Hermes::Exceptions::Exception("LocalTimeStepping: the number of levels has to be between 1 and 16.");
+}
+
+LocalTimeStepping::~LocalTimeStepping()
+{
+  delete[] this->accumulated;
+}
+
+void LocalTimeStepping::update_levels(const double* sln_vector)
+{
+  element_means.update(spaces);
+  int num_elements = element_means.get_num_elements();
+  const MeshGeometry& geometry = element_means.get_geometry();
+
+  // The time step each element allows, as in CFLCalculation::calculate().
+  std::vector<double> element_time_steps(num_elements);
+  double min_time_step = std::numeric_limits<double>::max();
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    double rho = element_means.get_mean(sln_vector, element_i, 0);
+    double v1 = element_means.get_mean(sln_vector, element_i, 1) / rho;
+    double v2 = element_means.get_mean(sln_vector, element_i, 2) / rho;
+    double energy = element_means.get_mean(sln_vector, element_i, 3);
+
+    element_time_steps[element_i] = geometry.area[element_i] * CFL_number / (std::sqrt(v1*v1 + v2*v2) + QuantityCalculator::calc_sound_speed(rho, rho*v1, rho*v2, energy, kappa));
+    if (element_time_steps[element_i] < min_time_step)
+      min_time_step = element_time_steps[element_i];
+  }
+
+  // The smallest element is on the finest level, every other element on the coarsest level its own condition allows.
+  this->global_time_step = min_time_step * (1 << (num_levels - 1));
+  this->levels.assign(spaces[0]->get_mesh()->get_max_element_id() + 1, num_levels - 1);
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    int level = 0;
+    while (level < num_levels - 1 && global_time_step / (1 << level) > element_time_steps[element_i])
+      level++;
+    levels[geometry.element_ids[element_i]] = level;
+  }
+
+  // The substeps are evaluated directly for finite volumes (one shape function per block) of the four components,
+  // the boundary fluxes are then constant along the (straight) boundary edges.
+  this->substep_fluxes = (spaces.size() == 4) ? dynamic_cast<LocalTimeSteppingFluxes*>(wf.get()) : NULL;
+  for (unsigned int block_i = 0; block_i + 1 < block_dof_offsets.size() && substep_fluxes; block_i++)
+    if (block_dof_offsets[block_i + 1] - block_dof_offsets[block_i] != 1)
+      substep_fluxes = NULL;
+  for (unsigned int edge_i = 0; edge_i < geometry.edge_length.size() && substep_fluxes; edge_i++)
+    if (geometry.edge_boundary[edge_i] && geometry.edge_normal_offsets[edge_i + 1] - geometry.edge_normal_offsets[edge_i] > 1)
+      substep_fluxes = NULL;
+  if (!substep_fluxes)
+    return;
+
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  if (mesh->get_seq() != this->edge_conditions_seq)
+  {
+    this->edge_conditions_seq = mesh->get_seq();
+    edge_conditions.assign(geometry.edge_length.size(), -1);
+    for (int element_i = 0; element_i < num_elements; element_i++)
+    {
+      Element* e = mesh->get_element(geometry.element_ids[element_i]);
+      for (int edge_i = geometry.edge_offsets[element_i]; edge_i < geometry.edge_offsets[element_i + 1]; edge_i++)
+        if (geometry.edge_boundary[edge_i])
+          edge_conditions[edge_i] = substep_fluxes->boundary_condition(mesh->get_boundary_markers_conversion().get_user_marker(e->en[edge_i - geometry.edge_offsets[element_i]]->marker).marker);
+    }
+  }
+
+  // An element is evaluated when it or any of its neighbors starts a step, sorted by the finest of these levels.
+  std::vector<int> neighborhood_levels(num_elements);
+  std::vector<int> level_counts(num_levels, 0);
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    int level = levels[geometry.element_ids[element_i]];
+    for (int point_i = geometry.point_offsets[geometry.edge_offsets[element_i]]; point_i < geometry.point_offsets[geometry.edge_offsets[element_i + 1]]; point_i++)
+      level = std::max(level, levels[geometry.point_neighbor_ids[point_i]]);
+    neighborhood_levels[element_i] = level;
+    level_counts[level]++;
+  }
+  substep_element_counts.assign(num_levels, 0);
+  for (int level = num_levels - 1, count = 0; level >= 0; level--)
+    substep_element_counts[level] = (count += level_counts[level]);
+  std::vector<int> positions(num_levels);
+  for (int level = 0; level < num_levels; level++)
+    positions[level] = substep_element_counts[level] - level_counts[level];
+  substep_elements.resize(num_elements);
+  for (int element_i = 0; element_i < num_elements; element_i++)
+    substep_elements[positions[neighborhood_levels[element_i]]++] = element_i;
+}
+
+void LocalTimeStepping::add_substep_residual(const double* sln_vector)
+{
+  const MeshGeometry& geometry = element_means.get_geometry();
+
+  // The finest level starts a step in every substep, the coarser ones in every 2nd, 4th, ...
+  int min_level = num_levels - 1;
+  while (min_level > 0 && substep % (1 << (num_levels - min_level)) == 0)
+    min_level--;
+
+  double w_L[4], w_R[4], flux[4];
+  for (int list_i = 0; list_i < substep_element_counts[min_level]; list_i++)
+  {
+    int element_i = substep_elements[list_i];
+    int element_id = geometry.element_ids[element_i];
+    for (int component = 0; component < 4; component++)
+      w_L[component] = element_means.get_mean(sln_vector, element_i, component);
+
+    // The weighted flux balance, as in the forms, with the constant states.
+    double balance[4] = { 0., 0., 0., 0. };
+    for (int edge_i = geometry.edge_offsets[element_i]; edge_i < geometry.edge_offsets[element_i + 1]; edge_i++)
+    {
+      if (geometry.edge_boundary[edge_i])
+      {
+        double weight = element_weight(element_id);
+        if (weight == 0. || edge_conditions[edge_i] < 0)
+          continue;
+        substep_fluxes->boundary_flux(flux, w_L, geometry.edge_nx[edge_i], geometry.edge_ny[edge_i], edge_conditions[edge_i]);
+        for (int component = 0; component < 4; component++)
+          balance[component] += weight * geometry.edge_length[edge_i] * flux[component];
+        continue;
+      }
+
+      for (int point_i = geometry.point_offsets[edge_i]; point_i < geometry.point_offsets[edge_i + 1]; point_i++)
+      {
+        int neighbor_id = geometry.point_neighbor_ids[point_i];
+        double weight = interface_weight(element_id, neighbor_id);
+        if (weight == 0.)
+          continue;
+        int neighbor_i = geometry.element_indices[neighbor_id];
+        for (int component = 0; component < 4; component++)
+          w_R[component] = element_means.get_mean(sln_vector, neighbor_i, component);
+        substep_fluxes->interface_flux(flux, w_L, w_R, geometry.point_nx[point_i], geometry.point_ny[point_i]);
+        for (int component = 0; component < 4; component++)
+          balance[component] += weight * geometry.point_weight[point_i] * flux[component];
+      }
+    }
+
+    // Minus the flux times the test function, the constant shape function of the element.
+    for (int component = 0; component < 4; component++)
+    {
+      int dof;
+      double shape_value;
+      element_means.get_mean_coefficient(element_i, component, dof, shape_value);
+      accumulated[dof] -= shape_value * balance[component];
+    }
+  }
+}
+
+void LocalTimeStepping::step(double* sln_vector, double & time_step)
+{
+  update_inverse_mass_matrix();
+  update_levels(sln_vector);
+
+  if (ndof > accumulated_size)
+  {
+    delete[] this->accumulated;
+    this->accumulated = new double[ndof];
+    this->accumulated_size = ndof;
+  }
+  memset(accumulated, 0, ndof * sizeof(double));
+
+  int num_blocks = block_offsets.size() - 1;
+  int num_substeps = 1 << (num_levels - 1);
+  for (substep = 0; substep < num_substeps; substep++)
+  {
+    if (substep_fluxes)
+      add_substep_residual(sln_vector);
+    else
+    {
+      // The residual weighted by the forms through element_weight() / interface_weight(), assembled over the whole mesh.
+      Solution<double>::vector_to_solutions(sln_vector, spaces, ext_slns);
+      dp->assemble(residual);
+      residual->extract(residual_vector);
+      for (int dof_i = 0; dof_i < ndof; dof_i++)
+        accumulated[dof_i] += residual_vector[dof_i];
+    }
+
+    // The elements whose step ends with this substep are updated by everything accumulated during the step.
+#pragma omp parallel for
+    for (int block_i = 0; block_i < num_blocks; block_i++)
+    {
+      if ((substep + 1) % (1 << (num_levels - 1 - levels[block_element_ids[block_i]])) != 0)
+        continue;
+
+      const int* dofs = &block_dofs[block_dof_offsets[block_i]];
+      const double* inverse = &inverse_blocks[block_offsets[block_i]];
+      int size = block_dof_offsets[block_i + 1] - block_dof_offsets[block_i];
+      for (int a = 0; a < size; a++)
+      {
+        double value = 0.0;
+        for (int b = 0; b < size; b++)
+          value += inverse[a * size + b] * accumulated[dofs[b]];
+        sln_vector[dofs[a]] += value;
+      }
+      for (int a = 0; a < size; a++)
+        accumulated[dofs[a]] = 0.;
+    }
+  }
+  substep = 0;
+
+  time_step = global_time_step;
+}
+
+static double dot_product(const double* a, const double* b, int n)
+{
+  double result = 0.;
+#pragma omp parallel for reduction(+:result)
+  for (int i = 0; i < n; i++)
+    result += a[i] * b[i];
+  return result;
+}
+
+NewtonKrylovSolver::NewtonKrylovSolver(WeakFormSharedPtr<double> wf, WeakFormSharedPtr<double> wf_preconditioner, std::vector<SpaceSharedPtr<double> > spaces,
+  std::vector<MeshFunctionSharedPtr<double> > ext_slns)
+  : SSPRungeKutta(wf, spaces, ext_slns, 1), wf_preconditioner(wf_preconditioner), newton_tolerance(1e-6), max_newton_iterations(10),
+  gmres_tolerance(1e-2), krylov_dimension(30), max_gmres_iterations(200), steady_residual_norm(0.), newton_iterations(0), gmres_iterations(0)
+{
+  this->dp_preconditioner = new DiscreteProblem<double>(wf_preconditioner, spaces);
+  this->dp_preconditioner->set_linear();
+}
+
+NewtonKrylovSolver::~NewtonKrylovSolver()
+{
+  delete this->dp_preconditioner;
+}
+
+void NewtonKrylovSolver::set_tolerances(double newton_tolerance, int max_newton_iterations, double gmres_tolerance, int krylov_dimension, int max_gmres_iterations)
+{
+  this->newton_tolerance = newton_tolerance;
+  this->max_newton_iterations = max_newton_iterations;
+  this->gmres_tolerance = gmres_tolerance;
+  this->krylov_dimension = krylov_dimension;
+  this->max_gmres_iterations = max_gmres_iterations;
+}
+
+void NewtonKrylovSolver::set_spaces(std::vector<SpaceSharedPtr<double> > spaces)
+{
+  SSPRungeKutta::set_spaces(spaces);
+  this->dp_preconditioner->set_spaces(spaces);
+}
+
+void NewtonKrylovSolver::update_preconditioner()
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  for (unsigned int space_i = 1; space_i < spaces.size(); space_i++)
+    if (spaces[space_i]->get_mesh()->get_seq() != mesh->get_seq())
+      throw Hermes::Exceptions::Exception("NewtonKrylovSolver: all spaces have to be on one mesh.");
+
+  // P(1) = M - (the linearized residual), the right hand side is not needed.
+  wf_preconditioner->set_current_time_step(1.);
+  SparseMatrix<double>* matrix = create_matrix<double>();
+  Vector<double>* rhs = create_vector<double>();
+  dp_preconditioner->assemble(matrix, rhs);
+
+  element_dof_offsets.clear();
+  element_dofs.clear();
+  element_factor_offsets.clear();
+  element_factors.clear();
+  element_pivots.clear();
+
+  // The inverse mass matrix blocks are per space (in the order of update_inverse_mass_matrix()), these per element.
+  int num_elements = (block_offsets.size() - 1) / spaces.size();
+  AsmList<double> al;
+  std::vector<int> component_offsets(spaces.size() + 1);
+  std::vector<double> block;
+  int element_i = 0;
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    int first_dof = element_dofs.size();
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    {
+      component_offsets[space_i] = element_dofs.size() - first_dof;
+      spaces[space_i]->get_element_assembly_list(e, &al);
+      for (int a = 0; a < al.get_cnt(); a++)
+        element_dofs.push_back(al.get_dof()[a]);
+    }
+    int size = element_dofs.size() - first_dof;
+    component_offsets[spaces.size()] = size;
+    const int* dofs = &element_dofs[first_dof];
+
+    block.resize(size * size);
+    for (int a = 0; a < size; a++)
+      for (int b = 0; b < size; b++)
+        block[a * size + b] = matrix->get(dofs[a], dofs[b]);
+
+    // M^-1 P, the rows of every component are multiplied by the inverse mass matrix block of that component.
+    // With P(1) = M - J: M^-1 P(time_step) = I + time_step * (M^-1 P(1) - I), row by row.
+    element_dof_offsets.push_back(first_dof);
+    element_factor_offsets.push_back(element_factors.size());
+    element_factors.resize(element_factors.size() + size * size, 0.);
+    double* factors = &element_factors[element_factor_offsets.back()];
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    {
+      int mass_block_i = space_i * num_elements + element_i;
+      const double* inverse = &inverse_blocks[block_offsets[mass_block_i]];
+      int offset = component_offsets[space_i];
+      int component_size = component_offsets[space_i + 1] - offset;
+      for (int a = 0; a < component_size; a++)
+        for (int c = 0; c < component_size; c++)
+          for (int b = 0; b < size; b++)
+            factors[(offset + a) * size + b] += inverse[a * component_size + c] * block[(offset + c) * size + b];
+    }
+    for (int a = 0; a < size; a++)
+    {
+      double time_step = dof_time_steps[dofs[a]];
+      for (int b = 0; b < size; b++)
+        factors[a * size + b] = (a == b ? 1. : 0.) + time_step * (factors[a * size + b] - (a == b ? 1. : 0.));
+    }
+
+    // LU factorization with partial pivoting, in place.
+    for (int a = 0; a < size; a++)
+      element_pivots.push_back(a);
+    int* pivots = &element_pivots[first_dof];
+    for (int col = 0; col < size; col++)
+    {
+      int pivot = col;
+      for (int row = col + 1; row < size; row++)
+        if (std::abs(factors[row * size + col]) > std::abs(factors[pivot * size + col]))
+          pivot = row;
+      if (pivot != col)
+      {
+        std::swap(pivots[col], pivots[pivot]);
+        for (int k = 0; k < size; k++)
+          std::swap(factors[col * size + k], factors[pivot * size + k]);
+      }
+      for (int row = col + 1; row < size; row++)
+      {
+        double factor = factors[row * size + col] /= factors[col * size + col];
+        for (int k = col + 1; k < size; k++)
+          factors[row * size + k] -= factor * factors[col * size + k];
+      }
+    }
+    element_i++;
+  }
+  element_dof_offsets.push_back(element_dofs.size());
+  element_factor_offsets.push_back(element_factors.size());
+
+  delete matrix;
+  delete rhs;
+}
+
+void NewtonKrylovSolver::apply_preconditioner(const double* vector, double* result)
+{
+  int num_elements = element_dof_offsets.size() - 1;
+#pragma omp parallel
+  {
+    std::vector<double> x;
+#pragma omp for
+    for (int element_i = 0; element_i < num_elements; element_i++)
+    {
+      const int* dofs = &element_dofs[element_dof_offsets[element_i]];
+      const int* pivots = &element_pivots[element_dof_offsets[element_i]];
+      const double* factors = &element_factors[element_factor_offsets[element_i]];
+      int size = element_dof_offsets[element_i + 1] - element_dof_offsets[element_i];
+
+      // Forward and back substitution, the dofs of the element are only read before they are written.
+      x.resize(size);
+      for (int a = 0; a < size; a++)
+      {
+        double value = vector[dofs[pivots[a]]];
+        for (int b = 0; b < a; b++)
+          value -= factors[a * size + b] * x[b];
+        x[a] = value;
+      }
+      for (int a = size - 1; a >= 0; a--)
+      {
+        double value = x[a];
+        for (int b = a + 1; b < size; b++)
+          value -= factors[a * size + b] * x[b];
+        x[a] = value / factors[a * size + a];
+      }
+      for (int a = 0; a < size; a++)
+        result[dofs[a]] = x[a];
+    }
+  }
+}
+
+void NewtonKrylovSolver::calculate_function(double* w, double* result, double* derivative_w)
+{
+  calculate_derivative(w, derivative_w);
+  for (int dof_i = 0; dof_i < ndof; dof_i++)
+    result[dof_i] = w[dof_i] - old_vector[dof_i] - dof_time_steps[dof_i] * derivative_w[dof_i];
+}
+
+void NewtonKrylovSolver::multiply_jacobian(const double* w, const double* derivative_w, const double* vector, double* result)
+{
+  // G'(w) v = v - time_step * (M^-1 R(w + epsilon v) - M^-1 R(w)) / epsilon, epsilon relative to the size of w and v.
+  double vector_norm = std::sqrt(dot_product(vector, vector, ndof));
+  if (vector_norm == 0.)
+  {
+    memset(result, 0, ndof * sizeof(double));
+    return;
+  }
+  double epsilon = std::sqrt(std::numeric_limits<double>::epsilon()) * (1. + std::sqrt(dot_product(w, w, ndof))) / vector_norm;
+
+  for (int dof_i = 0; dof_i < ndof; dof_i++)
+    perturbed[dof_i] = w[dof_i] + epsilon * vector[dof_i];
+  calculate_derivative(&perturbed[0], &perturbed_derivative[0]);
+  for (int dof_i = 0; dof_i < ndof; dof_i++)
+    result[dof_i] = vector[dof_i] - dof_time_steps[dof_i] * (perturbed_derivative[dof_i] - derivative_w[dof_i]) / epsilon;
+}
+
+int NewtonKrylovSolver::gmres(const double* w, const double* derivative_w, const double* rhs, double* dw)
+{
+  int m = krylov_dimension;
+  basis.resize((m + 1) * ndof);
+  std::vector<double> hessenberg((m + 1) * m), cosines(m), sines(m), g(m + 1), y(m);
+  std::vector<double> residual(ndof), preconditioned(ndof);
+
+  memset(dw, 0, ndof * sizeof(double));
+  double rhs_norm = std::sqrt(dot_product(rhs, rhs, ndof));
+  if (rhs_norm == 0.)
+    return 0;
+  memcpy(&residual[0], rhs, ndof * sizeof(double));
+  double residual_norm = rhs_norm;
+
+  int iterations = 0;
+  while (iterations < max_gmres_iterations && residual_norm > gmres_tolerance * rhs_norm)
+  {
+    for (int dof_i = 0; dof_i < ndof; dof_i++)
+      basis[dof_i] = residual[dof_i] / residual_norm;
+    std::fill(g.begin(), g.end(), 0.);
+    g[0] = residual_norm;
+
+    // Arnoldi process (modified Gram-Schmidt) for G'(w) Q^-1, the least squares problem is kept triangular by Givens rotations.
+    int k = 0;
+    for (; k < m && iterations < max_gmres_iterations; k++, iterations++)
+    {
+      double* v_k = &basis[k * ndof];
+      double* v_next = &basis[(k + 1) * ndof];
+      apply_preconditioner(v_k, &preconditioned[0]);
+      multiply_jacobian(w, derivative_w, &preconditioned[0], v_next);
+      for (int i = 0; i <= k; i++)
+      {
+        double h = dot_product(v_next, &basis[i * ndof], ndof);
+        hessenberg[i * m + k] = h;
+        for (int dof_i = 0; dof_i < ndof; dof_i++)
+          v_next[dof_i] -= h * basis[i * ndof + dof_i];
+      }
+      double h_next = std::sqrt(dot_product(v_next, v_next, ndof));
+      hessenberg[(k + 1) * m + k] = h_next;
+      if (h_next > 0.)
+        for (int dof_i = 0; dof_i < ndof; dof_i++)
+          v_next[dof_i] /= h_next;
+
+      for (int i = 0; i < k; i++)
+      {
+        double h_i = hessenberg[i * m + k], h_i_next = hessenberg[(i + 1) * m + k];
+        hessenberg[i * m + k] = cosines[i] * h_i + sines[i] * h_i_next;
+        hessenberg[(i + 1) * m + k] = -sines[i] * h_i + cosines[i] * h_i_next;
+      }
+      double h_k = hessenberg[k * m + k];
+      double radius = std::sqrt(h_k * h_k + h_next * h_next);
+      cosines[k] = radius > 0. ? h_k / radius : 1.;
+      sines[k] = radius > 0. ? h_next / radius : 0.;
+      hessenberg[k * m + k] = radius;
+      hessenberg[(k + 1) * m + k] = 0.;
+      g[k + 1] = -sines[k] * g[k];
+      g[k] = cosines[k] * g[k];
+
+      if (std::abs(g[k + 1]) <= gmres_tolerance * rhs_norm || h_next == 0.)
+      {
+        k++;
+        iterations++;
+        break;
+      }
+    }
+
+    // dw += Q^-1 (V y), H y = g.
+    for (int i = k - 1; i >= 0; i--)
+    {
+      double value = g[i];
+      for (int j = i + 1; j < k; j++)
+        value -= hessenberg[i * m + j] * y[j];
+      y[i] = value / hessenberg[i * m + i];
+    }
+    std::fill(residual.begin(), residual.end(), 0.);
+    for (int i = 0; i < k; i++)
+      for (int dof_i = 0; dof_i < ndof; dof_i++)
+        residual[dof_i] += y[i] * basis[i * ndof + dof_i];
+    apply_preconditioner(&residual[0], &preconditioned[0]);
+    for (int dof_i = 0; dof_i < ndof; dof_i++)
+      dw[dof_i] += preconditioned[dof_i];
+
+    // The true residual for the restart (the finite differences make the Givens estimate inexact).
+    multiply_jacobian(w, derivative_w, dw, &residual[0]);
+    for (int dof_i = 0; dof_i < ndof; dof_i++)
+      residual[dof_i] = rhs[dof_i] - residual[dof_i];
+    residual_norm = std::sqrt(dot_product(&residual[0], &residual[0], ndof));
+  }
+
+  return iterations;
+}
+
+bool NewtonKrylovSolver::step(double* sln_vector, double time_step)
+{
+  update_inverse_mass_matrix();
+  dof_time_steps.assign(ndof, time_step);
+  return solve(sln_vector);
+}
+
+bool NewtonKrylovSolver::step(double* sln_vector, const std::vector<double>& element_time_steps)
+{
+  update_inverse_mass_matrix();
+  dof_time_steps.resize(ndof);
+  int num_blocks = block_offsets.size() - 1;
+  for (int block_i = 0; block_i < num_blocks; block_i++)
+    for (int dof_i = block_dof_offsets[block_i]; dof_i < block_dof_offsets[block_i + 1]; dof_i++)
+      dof_time_steps[block_dofs[dof_i]] = element_time_steps[block_element_ids[block_i]];
+  return solve(sln_vector);
+}
+
+bool NewtonKrylovSolver::solve(double* sln_vector)
+{
+  old_vector.assign(sln_vector, sln_vector + ndof);
+  function.resize(ndof);
+  derivative_w.resize(ndof);
+  dw.resize(ndof);
+  trial_vector.resize(ndof);
+  trial_function.resize(ndof);
+  trial_derivative.resize(ndof);
+  perturbed.resize(ndof);
+  perturbed_derivative.resize(ndof);
+
+  calculate_function(sln_vector, &function[0], &derivative_w[0]);
+  steady_residual_norm = std::sqrt(dot_product(&derivative_w[0], &derivative_w[0], ndof));
+  // The blocks of one space are consecutive (see update_inverse_mass_matrix()).
+  int blocks_per_space = (block_offsets.size() - 1) / spaces.size();
+  steady_residual_norms.assign(spaces.size(), 0.);
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for (int dof_i = block_dof_offsets[space_i * blocks_per_space]; dof_i < block_dof_offsets[(space_i + 1) * blocks_per_space]; dof_i++)
+      steady_residual_norms[space_i] += derivative_w[block_dofs[dof_i]] * derivative_w[block_dofs[dof_i]];
+    steady_residual_norms[space_i] = std::sqrt(steady_residual_norms[space_i]);
+  }
+  double initial_norm = std::sqrt(dot_product(&function[0], &function[0], ndof));
+  double function_norm = initial_norm;
+
+  // ext_slns are now the old solution, the preconditioner is its linearization.
+  update_preconditioner();
+
+  newton_iterations = 0;
+  gmres_iterations = 0;
+  while (function_norm > newton_tolerance * initial_norm)
+  {
+    if (newton_iterations == max_newton_iterations)
+      break;
+    newton_iterations++;
+
+    for (int dof_i = 0; dof_i < ndof; dof_i++)
+      function[dof_i] = -function[dof_i];
+    gmres_iterations += gmres(sln_vector, &derivative_w[0], &function[0], &dw[0]);
+
+    // Backtracking: the Newton update is halved until the norm of G decreases. If it does not (e.g. the finite differences
+    // are no longer accurate enough to get below the current norm), the iterate is kept and the step reported as not converged.
+    bool decreased = false;
+    double trial_norm = 0.;
+    double factor = 1.;
+    for (int backtrack_i = 0; backtrack_i < 6 && !decreased; backtrack_i++, factor /= 2.)
+    {
+      for (int dof_i = 0; dof_i < ndof; dof_i++)
+        trial_vector[dof_i] = sln_vector[dof_i] + factor * dw[dof_i];
+      calculate_function(&trial_vector[0], &trial_function[0], &trial_derivative[0]);
+      trial_norm = std::sqrt(dot_product(&trial_function[0], &trial_function[0], ndof));
+      // (A NaN norm fails the comparison.)
+      decreased = trial_norm < (1. - 1e-4 * factor) * function_norm;
+    }
+    if (!decreased)
+      break;
+
+    memcpy(sln_vector, &trial_vector[0], ndof * sizeof(double));
+    function.swap(trial_function);
+    derivative_w.swap(trial_derivative);
+    function_norm = trial_norm;
+  }
+  if (function_norm <= newton_tolerance * initial_norm)
+    return true;
+
+  // Not converged: the step is to be repeated from the old solution (with a smaller time step).
+  memcpy(sln_vector, &old_vector[0], ndof * sizeof(double));
+  Solution<double>::vector_to_solutions(sln_vector, spaces, ext_slns);
+  return false;
+}
+
+PrimitiveVertexBasedLimiter::PrimitiveVertexBasedLimiter() : mesh_seq(-1)
+{
+}
+
+// The largest number of shape functions per element the limiter works with (linear and bilinear elements need 3 and 4).
+static const int primitive_limiter_max_shapes = 16;
+
+void PrimitiveVertexBasedLimiter::update(const std::vector<SpaceSharedPtr<double> >& spaces)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+
+  bool up_to_date = (mesh->get_seq() == this->mesh_seq) && (spaces.size() == this->space_seqs.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return;
+
+  if (spaces.size() != 4)
+    throw Hermes::Exceptions::Exception("PrimitiveVertexBasedLimiter works with the four Euler spaces.");
+  this->mesh_seq = mesh->get_seq();
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    if (spaces[space_i]->get_mesh()->get_seq() != this->mesh_seq)
+      throw Hermes::Exceptions::Exception("PrimitiveVertexBasedLimiter works only for spaces on a single mesh.");
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+  }
+
+  num_shapes.clear();
+  dof_offsets.clear();
+  dofs.clear();
+  vertex_value_offsets.clear();
+  vertex_values.clear();
+  constant_values.clear();
+  element_vertex_offsets.clear();
+  element_vertices.clear();
+
+  // Reference vertices of triangles and quads.
+  static const double reference_vertices[2][4][2] = { { { -1., -1. }, { 1., -1. }, { -1., 1. } }, { { -1., -1. }, { 1., -1. }, { 1., 1. }, { -1., 1. } } };
+
+  // The mesh vertices are numbered from zero in the order they are found.
+  std::vector<int> node_vertices(mesh->get_max_node_id() + 1, -1);
+  int num_vertices = 0;
+
+  AsmList<double> al[4];
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    for (int space_i = 0; space_i < 4; space_i++)
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al[space_i]);
+      if (al[space_i].get_cnt() != al[0].get_cnt())
+        throw Hermes::Exceptions::Exception("PrimitiveVertexBasedLimiter needs the same element orders in all spaces.");
+    }
+    int n = al[0].get_cnt();
+    if (n > primitive_limiter_max_shapes)
+      throw Hermes::Exceptions::Exception("PrimitiveVertexBasedLimiter is meant for linear elements.");
+
+    num_shapes.push_back(n);
+    dof_offsets.push_back(dofs.size());
+    for (int space_i = 0; space_i < 4; space_i++)
+      for (int shape_i = 0; shape_i < n; shape_i++)
+        dofs.push_back(al[space_i].get_dof()[shape_i]);
+
+    Shapeset* shapeset = spaces[0]->get_shapeset();
+    int mode = e->is_triangle() ? 0 : 1;
+    constant_values.push_back(al[0].get_coef()[0] * shapeset->get_fn_value(al[0].get_idx()[0], reference_vertices[mode][0][0], reference_vertices[mode][0][1], 0, e->get_mode()));
+
+    vertex_value_offsets.push_back(vertex_values.size());
+    element_vertex_offsets.push_back(element_vertices.size());
+    for (int vertex_i = 0; vertex_i < e->get_nvert(); vertex_i++)
+    {
+      for (int shape_i = 0; shape_i < n; shape_i++)
+        vertex_values.push_back(al[0].get_coef()[shape_i] * shapeset->get_fn_value(al[0].get_idx()[shape_i], reference_vertices[mode][vertex_i][0], reference_vertices[mode][vertex_i][1], 0, e->get_mode()));
+
+      if (node_vertices[e->vn[vertex_i]->id] < 0)
+        node_vertices[e->vn[vertex_i]->id] = num_vertices++;
+      element_vertices.push_back(node_vertices[e->vn[vertex_i]->id]);
+    }
+  }
+  int num_elements = num_shapes.size();
+  element_vertex_offsets.push_back(element_vertices.size());
+
+  // Transpose the element -> vertex relation.
+  vertex_element_offsets.assign(num_vertices + 1, 0);
+  for (unsigned int i = 0; i < element_vertices.size(); i++)
+    vertex_element_offsets[element_vertices[i] + 1]++;
+  for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++)
+    vertex_element_offsets[vertex_i + 1] += vertex_element_offsets[vertex_i];
+  vertex_elements.resize(element_vertices.size());
+  std::vector<int> fill(vertex_element_offsets.begin(), vertex_element_offsets.end() - 1);
+  for (int element_i = 0; element_i < num_elements; element_i++)
+    for (int i = element_vertex_offsets[element_i]; i < element_vertex_offsets[element_i + 1]; i++)
+      vertex_elements[fill[element_vertices[i]]++] = element_i;
+
+  means.resize(num_elements * num_fields);
+  vertex_min.resize(num_vertices * num_fields);
+  vertex_max.resize(num_vertices * num_fields);
+}
+
+void PrimitiveVertexBasedLimiter::limit_coefficients(int element_i, double* coefficients, int field) const
+{
+  int n = num_shapes[element_i];
+  const double* values = &vertex_values[vertex_value_offsets[element_i]];
+  double mean = coefficients[0] * constant_values[element_i];
+
+  // Kuzmin's correction factor, the smallest one over the vertices.
+  double alpha = 1.;
+  for (int i = element_vertex_offsets[element_i]; i < element_vertex_offsets[element_i + 1]; i++, values += n)
+  {
+    double vertex_value = 0.;
+    for (int shape_i = 0; shape_i < n; shape_i++)
+      vertex_value += coefficients[shape_i] * values[shape_i];
+
+    int vertex_i = element_vertices[i];
+    if (vertex_value > mean)
+      alpha = std::min(alpha, (vertex_max[vertex_i * num_fields + field] - mean) / (vertex_value - mean));
+    else if (vertex_value < mean)
+      alpha = std::min(alpha, (vertex_min[vertex_i * num_fields + field] - mean) / (vertex_value - mean));
+  }
+
+  for (int shape_i = 1; shape_i < n; shape_i++)
+    coefficients[shape_i] *= alpha;
+}
+
+void PrimitiveVertexBasedLimiter::limit(const std::vector<SpaceSharedPtr<double> >& spaces, double* sln_vector)
+{
+  update(spaces);
+  int num_elements = num_shapes.size();
+  int num_vertices = vertex_element_offsets.size() - 1;
+
+  // The means are not changed by the limiting, so they can be calculated first.
+  // Those of velocity and specific energy are the ratios of the means of the conservative variables.
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    double* element_means = &means[element_i * num_fields];
+    for (int component = 0; component < 4; component++)
+      element_means[component] = sln_vector[dofs[dof_offsets[element_i] + component * num_shapes[element_i]]] * constant_values[element_i];
+    for (int component = 1; component < 4; component++)
+      element_means[3 + component] = element_means[component] / element_means[0];
+  }
+
+#pragma omp parallel for
+  for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++)
+  {
+    for (int field = 0; field < num_fields; field++)
+    {
+      double min = std::numeric_limits<double>::max(), max = -std::numeric_limits<double>::max();
+      for (int i = vertex_element_offsets[vertex_i]; i < vertex_element_offsets[vertex_i + 1]; i++)
+      {
+        double mean = means[vertex_elements[i] * num_fields + field];
+        min = std::min(min, mean);
+        max = std::max(max, mean);
+      }
+      vertex_min[vertex_i * num_fields + field] = min;
+      vertex_max[vertex_i * num_fields + field] = max;
+    }
+  }
+
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    int n = num_shapes[element_i];
+    if (n < 2)
+      continue;
+    const int* element_dofs = &dofs[dof_offsets[element_i]];
+
+    double conservative[4][primitive_limiter_max_shapes];
+    for (int component = 0; component < 4; component++)
+    {
+      for (int shape_i = 0; shape_i < n; shape_i++)
+        conservative[component][shape_i] = sln_vector[element_dofs[component * n + shape_i]];
+      limit_coefficients(element_i, conservative[component], component);
+    }
+
+    // With the constant shape function equal to a, the product density * primitive = conservative gives
+    // c_0 = a * rho_0 * p_0 and c_i = a * (rho_0 * p_i + rho_i * p_0) in the linear terms.
+    // The products of the non-constant terms are neglected. On triangles these are only quadratic terms, on quads
+    // the bilinear coefficient gets the same first-order conversion although the products of the two linear terms
+    // contribute to it as well, so there the primitive variables are limited only approximately.
+    double a = constant_values[element_i];
+    const double* rho = conservative[0];
+    for (int component = 1; component < 4; component++)
+    {
+      double primitive[primitive_limiter_max_shapes];
+      primitive[0] = conservative[component][0] / (a * rho[0]);
+      for (int shape_i = 1; shape_i < n; shape_i++)
+        primitive[shape_i] = (conservative[component][shape_i] / a - primitive[0] * rho[shape_i]) / rho[0];
+
+      limit_coefficients(element_i, primitive, 3 + component);
+
+      for (int shape_i = 1; shape_i < n; shape_i++)
+        conservative[component][shape_i] = a * (rho[0] * primitive[shape_i] + rho[shape_i] * primitive[0]);
+    }
+
+    for (int component = 0; component < 4; component++)
+      for (int shape_i = 1; shape_i < n; shape_i++)
+        sln_vector[element_dofs[component * n + shape_i]] = conservative[component][shape_i];
+  }
+}
+
+FlowQuantitiesOutput::FlowQuantitiesOutput(double kappa, int subdivisions, double rho_ref, double p_ref) : kappa(kappa), subdivisions(subdivisions), rho_ref(rho_ref), p_ref(p_ref), mesh_seq(-1), num_dofs(0)
+{
+}
+
+const char* FlowQuantitiesOutput::get_name(Quantity quantity)
+{
+  static const char* names[NumQuantities] = { "Density", "VelocityX", "VelocityY", "Pressure", "MachNumber", "Entropy" };
+  return names[quantity];
+}
+
+// The image of the reference point (xi, eta) under the straight (affine / bilinear) map given by the vertices,
+// and the Jacobian matrix of that map.
+static void straight_element_point(Element* e, double xi, double eta, double& x, double& y, double jacobian[2][2])
+{
+  if (e->is_triangle())
+  {
+    double l1 = (xi + 1.) / 2., l2 = (eta + 1.) / 2.;
+    x = e->vn[0]->x + l1 * (e->vn[1]->x - e->vn[0]->x) + l2 * (e->vn[2]->x - e->vn[0]->x);
+    y = e->vn[0]->y + l1 * (e->vn[1]->y - e->vn[0]->y) + l2 * (e->vn[2]->y - e->vn[0]->y);
+    jacobian[0][0] = (e->vn[1]->x - e->vn[0]->x) / 2.;
+    jacobian[0][1] = (e->vn[2]->x - e->vn[0]->x) / 2.;
+    jacobian[1][0] = (e->vn[1]->y - e->vn[0]->y) / 2.;
+    jacobian[1][1] = (e->vn[2]->y - e->vn[0]->y) / 2.;
+    return;
+  }
+
+  double N[4] = { (1. - xi) * (1. - eta) / 4., (1. + xi) * (1. - eta) / 4., (1. + xi) * (1. + eta) / 4., (1. - xi) * (1. + eta) / 4. };
+  double dN_dxi[4] = { -(1. - eta) / 4., (1. - eta) / 4., (1. + eta) / 4., -(1. + eta) / 4. };
+  double dN_deta[4] = { -(1. - xi) / 4., -(1. + xi) / 4., (1. + xi) / 4., (1. - xi) / 4. };
+  x = y = 0.;
+  jacobian[0][0] = jacobian[0][1] = jacobian[1][0] = jacobian[1][1] = 0.;
+  for (int vertex_i = 0; vertex_i < 4; vertex_i++)
+  {
+    x += N[vertex_i] * e->vn[vertex_i]->x;
+    y += N[vertex_i] * e->vn[vertex_i]->y;
+    jacobian[0][0] += dN_dxi[vertex_i] * e->vn[vertex_i]->x;
+    jacobian[0][1] += dN_deta[vertex_i] * e->vn[vertex_i]->x;
+    jacobian[1][0] += dN_dxi[vertex_i] * e->vn[vertex_i]->y;
+    jacobian[1][1] += dN_deta[vertex_i] * e->vn[vertex_i]->y;
+  }
+}
+
+// The physical point of the reference point (xi, eta) of the Element e. For a curved element (e.g. along the arcs of
+// GAMM-channel.mesh or joukowski's domain-arcs.xml) the reference map is only available inverted (RefMap::untransform),
+// the point is found by correcting the straight image with the straight Jacobian until it maps back to (xi, eta).
+static void element_point(Element* e, double xi, double eta, double& x, double& y)
+{
+  double jacobian[2][2];
+  straight_element_point(e, xi, eta, x, y, jacobian);
+  if (!e->is_curved())
+    return;
+
+  for (int iteration = 0; iteration < 20; iteration++)
+  {
+    double xi_k, eta_k;
+    RefMap::untransform(e, x, y, xi_k, eta_k);
+    double d_xi = xi - xi_k, d_eta = eta - eta_k;
+    if (std::abs(d_xi) + std::abs(d_eta) < 1E-12)
+      break;
+    // The Jacobian of the straight map at the current reference point.
+    double x_k, y_k;
+    straight_element_point(e, xi_k, eta_k, x_k, y_k, jacobian);
+    x += jacobian[0][0] * d_xi + jacobian[0][1] * d_eta;
+    y += jacobian[1][0] * d_xi + jacobian[1][1] * d_eta;
+  }
+}
+
+void FlowQuantitiesOutput::update(const std::vector<SpaceSharedPtr<double> >& spaces)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+
+  bool up_to_date = (mesh->get_seq() == this->mesh_seq) && (spaces.size() == this->space_seqs.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return;
+
+  if (spaces.size() != 4)
+    throw Hermes::Exceptions::Exception("FlowQuantitiesOutput works with the four Euler spaces.");
+  this->mesh_seq = mesh->get_seq();
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    if (spaces[space_i]->get_mesh()->get_seq() != this->mesh_seq)
+      throw Hermes::Exceptions::Exception("FlowQuantitiesOutput works only for spaces on a single mesh.");
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+  }
+
+  num_shapes.clear();
+  dof_offsets.clear();
+  dofs.clear();
+  element_point_offsets.clear();
+  shape_value_offsets.clear();
+  shape_values.clear();
+  point_x.clear();
+  point_y.clear();
+  cell_offsets.clear();
+  cell_points.clear();
+  cell_types.clear();
+
+  // Points per element edge minus one.
+  int m = 1 << subdivisions;
+
+  AsmList<double> al[4];
+  Shapeset* shapeset = spaces[0]->get_shapeset();
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    for (int space_i = 0; space_i < 4; space_i++)
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al[space_i]);
+      if (al[space_i].get_cnt() != al[0].get_cnt())
+        throw Hermes::Exceptions::Exception("FlowQuantitiesOutput needs the same element orders in all spaces.");
+    }
+    int n = al[0].get_cnt();
+
+    num_shapes.push_back(n);
+    dof_offsets.push_back(dofs.size());
+    for (int space_i = 0; space_i < 4; space_i++)
+      for (int shape_i = 0; shape_i < n; shape_i++)
+        dofs.push_back(al[space_i].get_dof()[shape_i]);
+
+    int first_point = point_x.size();
+    element_point_offsets.push_back(first_point);
+    shape_value_offsets.push_back(shape_values.size());
+
+    // The points on the reference element and their physical images, see element_point().
+    // Triangle points are stored row by row, j-th row having m + 1 - j of them, quad points in m + 1 rows of m + 1.
+    bool triangle = e->is_triangle();
+    for (int j = 0; j <= m; j++)
+    {
+      for (int i = 0; i <= (triangle ? m - j : m); i++)
+      {
+        double xi = -1. + 2. * i / m, eta = -1. + 2. * j / m;
+        double x, y;
+        element_point(e, xi, eta, x, y);
+        point_x.push_back(x);
+        point_y.push_back(y);
+
+        for (int shape_i = 0; shape_i < n; shape_i++)
+          shape_values.push_back(al[0].get_coef()[shape_i] * shapeset->get_fn_value(al[0].get_idx()[shape_i], xi, eta, 0, e->get_mode()));
+      }
+    }
+
+    for (int j = 0; j < m; j++)
+    {
+      for (int i = 0; i < (triangle ? m - j : m); i++)
+      {
+        if (triangle)
+        {
+          // Index of the point (i, j) is the number of the points in the rows below, plus i.
+          int row = first_point + j * (m + 1) - j * (j - 1) / 2, next_row = row + m + 1 - j;
+          cell_offsets.push_back(cell_points.size());
+          cell_points.push_back(row + i);
+          cell_points.push_back(row + i + 1);
+          cell_points.push_back(next_row + i);
+          cell_types.push_back(5);
+          if (i < m - j - 1)
+          {
+            cell_offsets.push_back(cell_points.size());
+            cell_points.push_back(row + i + 1);
+            cell_points.push_back(next_row + i + 1);
+            cell_points.push_back(next_row + i);
+            cell_types.push_back(5);
+          }
+        }
+        else
+        {
+          int row = first_point + j * (m + 1), next_row = row + m + 1;
+          cell_offsets.push_back(cell_points.size());
+          cell_points.push_back(row + i);
+          cell_points.push_back(row + i + 1);
+          cell_points.push_back(next_row + i + 1);
+          cell_points.push_back(next_row + i);
+          cell_types.push_back(9);
+        }
+      }
+    }
+  }
+  element_point_offsets.push_back(point_x.size());
+  cell_offsets.push_back(cell_points.size());
+  num_dofs = Space<double>::get_num_dofs(spaces);
+
+  conserved_values.resize(4 * point_x.size());
+  quantity_values.resize(NumQuantities * point_x.size());
+}
+
+void FlowQuantitiesOutput::calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector)
+{
+  update(spaces);
+  calculate(sln_vector);
+}
+
+void FlowQuantitiesOutput::calculate(const double* sln_vector)
+{
+  int num_elements = num_shapes.size();
+  int num_points = point_x.size();
+
+  // The conserved variables, evaluated once per point.
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    int n = num_shapes[element_i];
+    const int* element_dofs = &dofs[dof_offsets[element_i]];
+    const double* values = &shape_values[shape_value_offsets[element_i]];
+    for (int point_i = element_point_offsets[element_i]; point_i < element_point_offsets[element_i + 1]; point_i++, values += n)
+    {
+      for (int component = 0; component < 4; component++)
+      {
+        double value = 0.;
+        for (int shape_i = 0; shape_i < n; shape_i++)
+          value += sln_vector[element_dofs[component * n + shape_i]] * values[shape_i];
+        conserved_values[component * num_points + point_i] = value;
+      }
+    }
+  }
+
+  // All quantities from the same loads, see QuantityCalculator.
+  const double* rho = &conserved_values[0];
+  const double* rho_v_x = &conserved_values[num_points];
+  const double* rho_v_y = &conserved_values[2 * num_points];
+  const double* energy = &conserved_values[3 * num_points];
+  double* density = &quantity_values[Density * num_points];
+  double* velocity_x = &quantity_values[VelocityX * num_points];
+  double* velocity_y = &quantity_values[VelocityY * num_points];
+  double* pressure = &quantity_values[Pressure * num_points];
+  double* mach_number = &quantity_values[MachNumber * num_points];
+  double* entropy = &quantity_values[Entropy * num_points];
+  double kappa = this->kappa, rho_ref = this->rho_ref, p_ref = this->p_ref;
+#pragma omp parallel for simd
+  for (int point_i = 0; point_i < num_points; point_i++)
+  {
+    double v_x = rho_v_x[point_i] / rho[point_i], v_y = rho_v_y[point_i] / rho[point_i];
+    double p = (kappa - 1.) * (energy[point_i] - rho[point_i] * (v_x * v_x + v_y * v_y) / 2.);
+    density[point_i] = rho[point_i];
+    velocity_x[point_i] = v_x;
+    velocity_y[point_i] = v_y;
+    pressure[point_i] = p;
+    mach_number[point_i] = std::sqrt((v_x * v_x + v_y * v_y) * rho[point_i] / (kappa * p));
+    entropy[point_i] = std::log(p / p_ref) - kappa * std::log(rho[point_i] / rho_ref);
+  }
+}
+
+void FlowQuantitiesOutput::save_vtk(const char* filename) const
+{
+  FILE* f = fopen(filename, "w");
+  if (f == NULL)
+    throw Hermes::Exceptions::Exception("Could not open %s for writing.", filename);
+
+  int num_points = point_x.size();
+  int num_cells = cell_types.size();
+
+  fprintf(f, "# vtk DataFile Version 2.0\nFlow quantities\nASCII\nDATASET UNSTRUCTURED_GRID\n");
+  fprintf(f, "POINTS %d double\n", num_points);
+  for (int point_i = 0; point_i < num_points; point_i++)
+    fprintf(f, "%.10g %.10g 0\n", point_x[point_i], point_y[point_i]);
+
+  fprintf(f, "CELLS %d %d\n", num_cells, num_cells + (int)cell_points.size());
+  for (int cell_i = 0; cell_i < num_cells; cell_i++)
+  {
+    fprintf(f, "%d", cell_offsets[cell_i + 1] - cell_offsets[cell_i]);
+    for (int i = cell_offsets[cell_i]; i < cell_offsets[cell_i + 1]; i++)
+      fprintf(f, " %d", cell_points[i]);
+    fprintf(f, "\n");
+  }
+  fprintf(f, "CELL_TYPES %d\n", num_cells);
+  for (int cell_i = 0; cell_i < num_cells; cell_i++)
+    fprintf(f, "%d\n", cell_types[cell_i]);
+
+  fprintf(f, "POINT_DATA %d\n", num_points);
+  for (int quantity = 0; quantity < NumQuantities; quantity++)
+  {
+    fprintf(f, "SCALARS %s double 1\nLOOKUP_TABLE default\n", get_name((Quantity)quantity));
+    const double* values = get_values((Quantity)quantity);
+    for (int point_i = 0; point_i < num_points; point_i++)
+      fprintf(f, "%.10g\n", values[point_i]);
+  }
+  fclose(f);
+}
+
+// Appends a data array to the appended data of a VTU file (UInt64 headers), returns its offset.
+// Compressed arrays are split into blocks with the header as written by vtkZLibDataCompressor.
+static unsigned long long append_vtu_array(std::vector<char>& appended, const void* data, size_t size, bool compress)
+{
+  unsigned long long offset = appended.size();
+  const char* bytes = (const char*)data;
+  if (!compress)
+  {
+    unsigned long long header = size;
+    appended.insert(appended.end(), (const char*)&header, (const char*)&header + sizeof(header));
+    appended.insert(appended.end(), bytes, bytes + size);
+    return offset;
+  }
+
+#ifdef WITH_ZLIB
+  const size_t block_size = 1 << 15;
+  size_t num_blocks = (size + block_size - 1) / block_size;
+  // Number of blocks, block size, size of the last block (zero if it is full), compressed block sizes.
+  std::vector<unsigned long long> header(3 + num_blocks);
+  header[0] = num_blocks;
+  header[1] = block_size;
+  header[2] = size % block_size;
+  size_t header_position = appended.size();
+  appended.resize(header_position + header.size() * sizeof(unsigned long long));
+  for (size_t block_i = 0; block_i < num_blocks; block_i++)
+  {
+    uLong block_bytes = std::min(block_size, size - block_i * block_size);
+    uLongf compressed_size = compressBound(block_bytes);
+    size_t position = appended.size();
+    appended.resize(position + compressed_size);
+    if (compress2((Bytef*)&appended[position], &compressed_size, (const Bytef*)bytes + block_i * block_size, block_bytes, Z_BEST_SPEED) != Z_OK)
+      throw Hermes::Exceptions::Exception("zlib compression failed.");
+    appended.resize(position + compressed_size);
+    header[3 + block_i] = compressed_size;
+  }
+  memcpy(&appended[header_position], &header[0], header.size() * sizeof(unsigned long long));
+#else
+  throw Hermes::Exceptions::Exception("Compressed VTU output needs zlib, build with WITH_ZLIB.");
+#endif
+  return offset;
+}
+
+void FlowQuantitiesOutput::save_vtu(const char* filename, bool compress) const
+{
+  int num_points = point_x.size();
+  int num_cells = cell_types.size();
+
+  std::vector<char> appended;
+  unsigned long long quantity_offsets[NumQuantities];
+  for (int quantity = 0; quantity < NumQuantities; quantity++)
+    quantity_offsets[quantity] = append_vtu_array(appended, get_values((Quantity)quantity), num_points * sizeof(double), compress);
+
+  std::vector<double> points(3 * num_points, 0.);
+  for (int point_i = 0; point_i < num_points; point_i++)
+  {
+    points[3 * point_i] = point_x[point_i];
+    points[3 * point_i + 1] = point_y[point_i];
+  }
+  unsigned long long points_offset = append_vtu_array(appended, points.data(), points.size() * sizeof(double), compress);
+  unsigned long long connectivity_offset = append_vtu_array(appended, cell_points.data(), cell_points.size() * sizeof(int), compress);
+  // VTK offsets are the ends of the cells.
+  unsigned long long offsets_offset = append_vtu_array(appended, cell_offsets.data() + 1, num_cells * sizeof(int), compress);
+  std::vector<unsigned char> types(cell_types.begin(), cell_types.end());
+  unsigned long long types_offset = append_vtu_array(appended, types.data(), types.size(), compress);
+
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL)
+    throw Hermes::Exceptions::Exception("Could not open %s for writing.", filename);
+
+  const int one = 1;
+  fprintf(f, "<?xml version=\"1.0\"?>\n");
+  fprintf(f, "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\"%s>\n",
+    *(const char*)&one ? "LittleEndian" : "BigEndian", compress ? " compressor=\"vtkZLibDataCompressor\"" : "");
+  fprintf(f, "  <UnstructuredGrid>\n    <Piece NumberOfPoints=\"%d\" NumberOfCells=\"%d\">\n", num_points, num_cells);
+  fprintf(f, "      <PointData Scalars=\"%s\">\n", get_name(Density));
+  for (int quantity = 0; quantity < NumQuantities; quantity++)
+    fprintf(f, "        <DataArray type=\"Float64\" Name=\"%s\" format=\"appended\" offset=\"%llu\"/>\n", get_name((Quantity)quantity), quantity_offsets[quantity]);
+  fprintf(f, "      </PointData>\n");
+  fprintf(f, "      <Points>\n        <DataArray type=\"Float64\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%llu\"/>\n      </Points>\n", points_offset);
+  fprintf(f, "      <Cells>\n");
+  fprintf(f, "        <DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\"%llu\"/>\n", connectivity_offset);
+  fprintf(f, "        <DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\"%llu\"/>\n", offsets_offset);
+  fprintf(f, "        <DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"%llu\"/>\n", types_offset);
+  fprintf(f, "      </Cells>\n    </Piece>\n  </UnstructuredGrid>\n");
+  fprintf(f, "  <AppendedData encoding=\"raw\">\n_");
+  fwrite(appended.data(), 1, appended.size(), f);
+  fprintf(f, "\n  </AppendedData>\n</VTKFile>\n");
+  fclose(f);
+}
+
+VtkTimeSeries::VtkTimeSeries(const char* filename)
+{
+  file = fopen(filename, "w");
+  if (file == NULL)
+    throw Hermes::Exceptions::Exception("Could not open %s for writing.", filename);
+  fprintf(file, "<?xml version=\"1.0\"?>\n<VTKFile type=\"Collection\" version=\"0.1\">\n  <Collection>\n");
+  end_position = ftell(file);
+  fprintf(file, "  </Collection>\n</VTKFile>\n");
+  fflush(file);
+}
+
+VtkTimeSeries::~VtkTimeSeries()
+{
+  fclose(file);
+}
+
+void VtkTimeSeries::add(double time, const char* filename)
+{
+  // The new entry overwrites the closing tags, which are written again after it.
+  fseek(file, end_position, SEEK_SET);
+  fprintf(file, "    <DataSet timestep=\"%.10g\" file=\"%s\"/>\n", time, filename);
+  end_position = ftell(file);
+  fprintf(file, "  </Collection>\n</VTKFile>\n");
+  fflush(file);
+}
+
+AsyncFlowQuantitiesOutput::AsyncFlowQuantitiesOutput(double kappa, int queue_length, int subdivisions, double rho_ref, double p_ref) : time_series(NULL), compress(false), coefficients(std::max(queue_length, 1)), pending(0), finish(false)
+{
+  for (int slot = 0; slot < (int)coefficients.size(); slot++)
+  {
+    outputs.push_back(new FlowQuantitiesOutput(kappa, subdivisions, rho_ref, p_ref));
+    free_slots.push_back(slot);
+  }
+  writer = std::thread(&AsyncFlowQuantitiesOutput::run, this);
+}
+
+AsyncFlowQuantitiesOutput::~AsyncFlowQuantitiesOutput()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    finish = true;
+  }
+  job_added.notify_one();
+  writer.join();
+  for (unsigned int slot = 0; slot < outputs.size(); slot++)
+    delete outputs[slot];
+  delete time_series;
+}
+
+void AsyncFlowQuantitiesOutput::save_vtk(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const char* filename)
+{
+  Job job;
+  job.filename = filename;
+  job.vtu = false;
+  job.compress = false;
+  job.time = 0.;
+  queue(spaces, sln_vector, job);
+}
+
+void AsyncFlowQuantitiesOutput::save_vtu(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const char* filename, double time)
+{
+  Job job;
+  job.filename = filename;
+  job.vtu = true;
+  job.compress = compress;
+  job.time = time;
+  queue(spaces, sln_vector, job);
+}
+
+void AsyncFlowQuantitiesOutput::set_time_series(const char* filename)
+{
+  // The previous index is finished by the writer first.
+  wait();
+  delete time_series;
+  time_series = new VtkTimeSeries(filename);
+}
+
+void AsyncFlowQuantitiesOutput::queue(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const Job& job)
+{
+  int slot;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (free_slots.empty())
+      job_done.wait(lock);
+    slot = free_slots.front();
+    free_slots.pop_front();
+  }
+
+  // The spaces are only touched here, on the calling thread.
+  outputs[slot]->set_spaces(spaces);
+  coefficients[slot].assign(sln_vector, sln_vector + outputs[slot]->get_num_dofs());
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.push_back(job);
+    jobs.back().slot = slot;
+    pending++;
+  }
+  job_added.notify_one();
+}
+
+void AsyncFlowQuantitiesOutput::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (pending > 0)
+    job_done.wait(lock);
+}
+
+void AsyncFlowQuantitiesOutput::run()
+{
+  while (true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (jobs.empty() && !finish)
+        job_added.wait(lock);
+      // All queued outputs are written before finishing.
+      if (jobs.empty())
+        return;
+      job = jobs.front();
+      jobs.pop_front();
+    }
+
+    try
+    {
+      outputs[job.slot]->calculate(coefficients[job.slot].data());
+      if (job.vtu)
+      {
+        outputs[job.slot]->save_vtu(job.filename.c_str(), job.compress);
+        if (time_series)
+          time_series->add(job.time, job.filename.c_str());
+      }
+      else
+        outputs[job.slot]->save_vtk(job.filename.c_str());
+    }
+    catch (std::exception& e)
+    {
+      Hermes::Mixins::Loggable::Static::warn("Output to %s failed: %s", job.filename.c_str(), e.what());
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      free_slots.push_back(job.slot);
+      pending--;
+    }
+    job_done.notify_all();
+  }
+}
+
+// The refinement of an element: 0 - active, 1 - into four sons, 2 - horizontally (sons 0, 1), 3 - vertically (sons 2, 3).
+// The refinement type for Mesh::refine_element_id() is one less.
+static char element_refinement_code(Element* e)
+{
+  if (e->active)
+    return 0;
+  if (e->is_triangle() || (e->sons[0] && e->sons[2]))
+    return 1;
+  return e->sons[0] ? 2 : 3;
+}
+
+// Unrefines an element with all its descendants.
+static void unrefine_element_tree(MeshSharedPtr mesh, Element* e)
+{
+  for (int son_i = 0; son_i < 4; son_i++)
+    if (e->sons[son_i] && !e->sons[son_i]->active)
+      unrefine_element_tree(mesh, e->sons[son_i]);
+  mesh->unrefine_element_id(e->id);
+}
+
+Checkpoint::Checkpoint(const char* filename, int every_nth_step, double every_n_seconds) : filename(filename), every_nth_step(every_nth_step), every_n_seconds(every_n_seconds),
+  last_write(std::chrono::steady_clock::now()), step(0), time(0.), time_step(0.), position(0)
+{
+}
+
+bool Checkpoint::is_due(int step) const
+{
+  if (every_nth_step > 0 && step % every_nth_step == 0)
+    return true;
+  return every_n_seconds > 0. && std::chrono::duration<double>(std::chrono::steady_clock::now() - last_write).count() >= every_n_seconds;
+}
+
+template<typename T> T Checkpoint::get()
+{
+  if (position + sizeof(T) > buffer.size())
+    throw Hermes::Exceptions::Exception("Checkpoint %s is corrupted.", filename.c_str());
+  T value;
+  memcpy(&value, &buffer[position], sizeof(T));
+  position += sizeof(T);
+  return value;
+}
+
+void Checkpoint::get_active_elements(Element* e, std::vector<Element*>& elements)
+{
+  if (e->active)
+    elements.push_back(e);
+  else
+    for (int son_i = 0; son_i < 4; son_i++)
+      if (e->sons[son_i])
+        get_active_elements(e->sons[son_i], elements);
+}
+
+void Checkpoint::get_active_elements(MeshSharedPtr mesh, std::vector<Element*>& elements)
+{
+  elements.clear();
+  Element* e;
+  for_all_base_elements(e, mesh)
+    get_active_elements(e, elements);
+}
+
+void Checkpoint::save_tree(Element* e)
+{
+  put<char>(element_refinement_code(e));
+  if (!e->active)
+    for (int son_i = 0; son_i < 4; son_i++)
+      if (e->sons[son_i])
+        save_tree(e->sons[son_i]);
+}
+
+void Checkpoint::restore_tree(MeshSharedPtr mesh, Element* e)
+{
+  char code = get<char>();
+  if (!e->active && element_refinement_code(e) != code)
+    unrefine_element_tree(mesh, e);
+  if (code == 0)
+    return;
+  if (e->active)
+    mesh->refine_element_id(e->id, code - 1);
+  for (int son_i = 0; son_i < 4; son_i++)
+    if (e->sons[son_i])
+      restore_tree(mesh, e->sons[son_i]);
+}
+
+void Checkpoint::begin(int step, double time, double time_step, const std::vector<double>& values)
+{
+  buffer.clear();
+  const char magic[8] = { 'H', 'E', 'R', 'M', 'C', 'K', 'P', 'T' };
+  buffer.insert(buffer.end(), magic, magic + 8);
+  put<int>(step);
+  put<double>(time);
+  put<double>(time_step);
+  put<int>(values.size());
+  for (unsigned int i = 0; i < values.size(); i++)
+    put<double>(values[i]);
+}
+
+void Checkpoint::add(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    if (spaces[space_i]->get_mesh()->get_seq() != mesh->get_seq())
+      throw Hermes::Exceptions::Exception("Checkpoint works only for spaces on a single mesh.");
+  put<int>(spaces.size());
+
+  int num_base_elements = 0;
+  Element* e;
+  for_all_base_elements(e, mesh)
+    num_base_elements++;
+  put<int>(num_base_elements);
+  for_all_base_elements(e, mesh)
+    save_tree(e);
+
+  std::vector<Element*> elements;
+  get_active_elements(mesh, elements);
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    put<int>(elements.size());
+    for (unsigned int i = 0; i < elements.size(); i++)
+      put<int>(spaces[space_i]->get_element_order(elements[i]->id));
+  }
+
+  // The dofs in the order of the active elements, the restored spaces may number them differently.
+  std::vector<int> dofs;
+  AsmList<double> al;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for (unsigned int i = 0; i < elements.size(); i++)
+    {
+      spaces[space_i]->get_element_assembly_list(elements[i], &al);
+      for (int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+        if (al.get_dof()[shape_i] >= 0)
+          dofs.push_back(al.get_dof()[shape_i]);
+    }
+  }
+  put<int>(dofs.size());
+  for (unsigned int i = 0; i < dofs.size(); i++)
+    put<int>(dofs[i]);
+
+  put<char>(sln_vector != NULL);
+  if (sln_vector)
+  {
+    int ndofs = Space<double>::get_num_dofs(spaces);
+    put<int>(ndofs);
+    const char* bytes = (const char*)sln_vector;
+    buffer.insert(buffer.end(), bytes, bytes + ndofs * sizeof(double));
+  }
+}
+
+void Checkpoint::write()
+{
+  std::string temporary_filename = filename + ".tmp";
+  FILE* f = fopen(temporary_filename.c_str(), "wb");
+  if (f == NULL)
+    throw Hermes::Exceptions::Exception("Could not open %s for writing.", temporary_filename.c_str());
+  bool written = fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size() && fflush(f) == 0;
+#ifndef _WIN32
+  // On the disk before the rename.
+  written = written && fsync(fileno(f)) == 0;
+#endif
+  written = (fclose(f) == 0) && written;
+  if (!written)
+    throw Hermes::Exceptions::Exception("Writing the checkpoint %s failed.", temporary_filename.c_str());
+#ifdef _WIN32
+  // rename() does not replace an existing file here.
+  remove(filename.c_str());
+#endif
+  if (rename(temporary_filename.c_str(), filename.c_str()) != 0)
+    throw Hermes::Exceptions::Exception("Could not rename %s to %s.", temporary_filename.c_str(), filename.c_str());
+  last_write = std::chrono::steady_clock::now();
+}
+
+bool Checkpoint::read()
+{
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buffer.resize(size);
+  bool complete = fread(buffer.data(), 1, size, f) == (size_t)size;
+  fclose(f);
+  if (!complete || size < 8 || memcmp(buffer.data(), "HERMCKPT", 8) != 0)
+    throw Hermes::Exceptions::Exception("%s is not a checkpoint.", filename.c_str());
+
+  position = 8;
+  step = get<int>();
+  time = get<double>();
+  time_step = get<double>();
+  values.resize(get<int>());
+  for (unsigned int i = 0; i < values.size(); i++)
+    values[i] = get<double>();
+  return true;
+}
+
+void Checkpoint::restore(const std::vector<SpaceSharedPtr<double> >& spaces, double* sln_vector)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  if (get<int>() != (int)spaces.size())
+    throw Hermes::Exceptions::Exception("Checkpoint %s was saved for a different number of spaces.", filename.c_str());
+
+  int num_base_elements = 0;
+  Element* e;
+  for_all_base_elements(e, mesh)
+    num_base_elements++;
+  if (get<int>() != num_base_elements)
+    throw Hermes::Exceptions::Exception("Checkpoint %s was saved for a different mesh.", filename.c_str());
+  for_all_base_elements(e, mesh)
+    restore_tree(mesh, e);
+
+  std::vector<Element*> elements;
+  get_active_elements(mesh, elements);
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    if (get<int>() != (int)elements.size())
+      throw Hermes::Exceptions::Exception("Checkpoint %s is corrupted.", filename.c_str());
+    for (unsigned int i = 0; i < elements.size(); i++)
+      spaces[space_i]->set_element_order(elements[i]->id, get<int>());
+  }
+  Space<double>::assign_dofs(spaces);
+
+  std::vector<int> dofs;
+  AsmList<double> al;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for (unsigned int i = 0; i < elements.size(); i++)
+    {
+      spaces[space_i]->get_element_assembly_list(elements[i], &al);
+      for (int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+        if (al.get_dof()[shape_i] >= 0)
+          dofs.push_back(al.get_dof()[shape_i]);
+    }
+  }
+  if (get<int>() != (int)dofs.size())
+    throw Hermes::Exceptions::Exception("Checkpoint %s does not match the spaces.", filename.c_str());
+  std::vector<int> saved_dofs(dofs.size());
+  for (unsigned int i = 0; i < dofs.size(); i++)
+    saved_dofs[i] = get<int>();
+
+  if (get<char>())
+  {
+    int ndofs = get<int>();
+    if (ndofs != Space<double>::get_num_dofs(spaces))
+      throw Hermes::Exceptions::Exception("Checkpoint %s does not match the spaces.", filename.c_str());
+    std::vector<double> saved_vector(ndofs);
+    for (int i = 0; i < ndofs; i++)
+      saved_vector[i] = get<double>();
+    if (sln_vector)
+      for (unsigned int i = 0; i < dofs.size(); i++)
+        sln_vector[dofs[i]] = saved_vector[saved_dofs[i]];
+  }
+}
+
+ReferenceSpaceUpdater::ReferenceSpaceUpdater(std::vector<SpaceSharedPtr<double> > coarse_spaces, int order_increase, bool refine) : coarse_spaces(coarse_spaces), order_increase(order_increase),
+  refine(refine), current(0), coarse_mesh_seq(-1)
+{
+}
+
+bool ReferenceSpaceUpdater::update()
+{
+  MeshSharedPtr coarse_mesh = coarse_spaces[0]->get_mesh();
+
+  bool up_to_date = ref_meshes[current] && (coarse_mesh->get_seq() == this->coarse_mesh_seq);
+  for (unsigned int space_i = 0; space_i < coarse_spaces.size() && up_to_date; space_i++)
+    if (coarse_spaces[space_i]->get_seq() != this->coarse_space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return false;
+
+  this->coarse_mesh_seq = coarse_mesh->get_seq();
+  this->coarse_space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < coarse_spaces.size(); space_i++)
+  {
+    if (coarse_spaces[space_i]->get_mesh()->get_seq() != this->coarse_mesh_seq)
+      throw Hermes::Exceptions::Exception("ReferenceSpaceUpdater works only for spaces on a single mesh.");
+    this->coarse_space_seqs.push_back(coarse_spaces[space_i]->get_seq());
+  }
+
+  // The other reference mesh, the current one may still be in use.
+  if (ref_meshes[current])
+    current = 1 - current;
+
+  if (!ref_meshes[current])
+  {
+    if (refine)
+    {
+      Mesh::ReferenceMeshCreator ref_mesh_creator(coarse_mesh);
+      ref_meshes[current] = ref_mesh_creator.create_ref_mesh();
+    }
+    else
+    {
+      ref_meshes[current] = MeshSharedPtr(new Mesh);
+      ref_meshes[current]->copy(coarse_mesh);
+    }
+    for (unsigned int space_i = 0; space_i < coarse_spaces.size(); space_i++)
+    {
+      Space<double>::ReferenceSpaceCreator ref_space_creator(coarse_spaces[space_i], ref_meshes[current], order_increase);
+      ref_spaces[current].push_back(ref_space_creator.create_ref_space());
+    }
+    if (refine)
+      return true;
+  }
+
+  // Both meshes are refinements of the same base mesh, its elements have the same ids.
+  MeshSharedPtr ref_mesh = ref_meshes[current];
+  Element* coarse_e;
+  for_all_base_elements(coarse_e, coarse_mesh)
+    update_tree(ref_mesh, coarse_e, ref_mesh->get_element(coarse_e->id));
+  Space<double>::assign_dofs(ref_spaces[current]);
+  return true;
+}
+
+void ReferenceSpaceUpdater::update_tree(MeshSharedPtr ref_mesh, Element* coarse_e, Element* ref_e)
+{
+  // A copy of the coarse element, which is active.
+  if (coarse_e->active && !refine)
+  {
+    if (!ref_e->active)
+      unrefine_element_tree(ref_mesh, ref_e);
+    set_orders(coarse_e, ref_e);
+    return;
+  }
+
+  // The reference element is refined into four sons, which are active.
+  if (coarse_e->active)
+  {
+    if (!ref_e->active && element_refinement_code(ref_e) != 1)
+      unrefine_element_tree(ref_mesh, ref_e);
+    if (ref_e->active)
+      ref_mesh->refine_element_id(ref_e->id, 0);
+    else
+    {
+      for (int son_i = 0; son_i < 4; son_i++)
+        if (!ref_e->sons[son_i]->active)
+          unrefine_element_tree(ref_mesh, ref_e->sons[son_i]);
+    }
+    set_orders(coarse_e, ref_e);
+    return;
+  }
+
+  char code = element_refinement_code(coarse_e);
+  if (!ref_e->active && element_refinement_code(ref_e) != code)
+    unrefine_element_tree(ref_mesh, ref_e);
+  if (ref_e->active)
+    ref_mesh->refine_element_id(ref_e->id, code - 1);
+  for (int son_i = 0; son_i < 4; son_i++)
+    if (coarse_e->sons[son_i])
+      update_tree(ref_mesh, coarse_e->sons[son_i], ref_e->sons[son_i]);
+}
+
+void ReferenceSpaceUpdater::set_orders(Element* coarse_e, Element* ref_e)
+{
+  for (unsigned int space_i = 0; space_i < coarse_spaces.size(); space_i++)
+  {
+    int max_order = coarse_spaces[space_i]->get_shapeset()->get_max_order();
+    int coarse_order = coarse_spaces[space_i]->get_element_order(coarse_e->id);
+    int order_h = std::min(H2D_GET_H_ORDER(coarse_order) + order_increase, max_order);
+    int order_v = std::min(H2D_GET_V_ORDER(coarse_order) + order_increase, max_order);
+    int order = coarse_e->is_triangle() ? order_h : H2D_MAKE_QUAD_ORDER(order_h, order_v);
+    if (!refine)
+      ref_spaces[current][space_i]->set_element_order(ref_e->id, order);
+    else
+      for (int son_i = 0; son_i < 4; son_i++)
+        ref_spaces[current][space_i]->set_element_order(ref_e->sons[son_i]->id, order);
+  }
+}
+
+// The regions of the sons in their father: quad sons 0 - 3 of a refinement into four (lower left, lower right, upper right, upper left),
+// sons 0, 1 of a horizontal refinement (lower and upper half) and sons 2, 3 of a vertical one (left and right half).
+static const double quad_son_regions[8][4] =
+{
+  { 0.5, 0.5, -0.5, -0.5 }, { 0.5, 0.5, 0.5, -0.5 }, { 0.5, 0.5, 0.5, 0.5 }, { 0.5, 0.5, -0.5, 0.5 },
+  { 1.0, 0.5, 0.0, -0.5 }, { 1.0, 0.5, 0.0, 0.5 }, { 0.5, 1.0, -0.5, 0.0 }, { 0.5, 1.0, 0.5, 0.0 }
+};
+// Triangle sons at the vertices 0, 1, 2 and the middle one (turned by 180 degrees).
+static const double triangle_son_regions[4][4] =
+{
+  { 0.5, 0.5, -0.5, -0.5 }, { 0.5, 0.5, 0.5, -0.5 }, { 0.5, 0.5, -0.5, 0.5 }, { -0.5, -0.5, -0.5, -0.5 }
+};
+
+// The Jacobian of the reference map of a straight element in the reference point (xi, eta).
+static double reference_map_jacobian(Element* e, double xi, double eta)
+{
+  if (e->is_triangle())
+    return std::abs((e->vn[1]->x - e->vn[0]->x) * (e->vn[2]->y - e->vn[0]->y) - (e->vn[2]->x - e->vn[0]->x) * (e->vn[1]->y - e->vn[0]->y)) / 4.;
+
+  double dN_dxi[4] = { -(1. - eta) / 4., (1. - eta) / 4., (1. + eta) / 4., -(1. + eta) / 4. };
+  double dN_deta[4] = { -(1. - xi) / 4., -(1. + xi) / 4., (1. + xi) / 4., (1. - xi) / 4. };
+  double x_xi = 0., x_eta = 0., y_xi = 0., y_eta = 0.;
+  for (int vertex_i = 0; vertex_i < 4; vertex_i++)
+  {
+    x_xi += dN_dxi[vertex_i] * e->vn[vertex_i]->x;
+    x_eta += dN_deta[vertex_i] * e->vn[vertex_i]->x;
+    y_xi += dN_dxi[vertex_i] * e->vn[vertex_i]->y;
+    y_eta += dN_deta[vertex_i] * e->vn[vertex_i]->y;
+  }
+  return std::abs(x_xi * y_eta - x_eta * y_xi);
+}
+
+LocalProjection::LocalProjection()
+{
+}
+
+bool LocalProjection::is_local(const std::vector<SpaceSharedPtr<double> >& source_spaces, const std::vector<SpaceSharedPtr<double> >& target_spaces)
+{
+  if (source_spaces.empty() || source_spaces.size() != target_spaces.size())
+    return false;
+
+  for (int side = 0; side < 2; side++)
+  {
+    const std::vector<SpaceSharedPtr<double> >& spaces = (side == 0) ? source_spaces : target_spaces;
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+      if (spaces[space_i]->get_type() != HERMES_L2_SPACE || spaces[space_i]->get_mesh()->get_seq() != spaces[0]->get_mesh()->get_seq())
+        return false;
+    Element* e;
+    for_all_active_elements(e, spaces[0]->get_mesh())
+      if (e->is_curved())
+        return false;
+  }
+
+  // The same base mesh.
+  MeshSharedPtr source_mesh = source_spaces[0]->get_mesh();
+  MeshSharedPtr target_mesh = target_spaces[0]->get_mesh();
+  if (source_mesh->get_num_base_elements() != target_mesh->get_num_base_elements())
+    return false;
+  Element* e;
+  for_all_base_elements(e, target_mesh)
+  {
+    Element* source_e = source_mesh->get_element(e->id);
+    if (!source_e->used || source_e->get_nvert() != e->get_nvert())
+      return false;
+    for (int vertex_i = 0; vertex_i < e->get_nvert(); vertex_i++)
+      if (source_e->vn[vertex_i]->x != e->vn[vertex_i]->x || source_e->vn[vertex_i]->y != e->vn[vertex_i]->y)
+        return false;
+  }
+  return true;
+}
+
+void LocalProjection::project(const std::vector<SpaceSharedPtr<double> >& source_spaces, const double* source_vector,
+  const std::vector<SpaceSharedPtr<double> >& target_spaces, double* target_vector)
+{
+  if (!is_local(source_spaces, target_spaces))
+  {
+    std::vector<MeshFunctionSharedPtr<double> > source_slns;
+    for (unsigned int space_i = 0; space_i < source_spaces.size(); space_i++)
+      source_slns.push_back(MeshFunctionSharedPtr<double>(new Solution<double>(source_spaces[space_i]->get_mesh())));
+    Solution<double>::vector_to_solutions(source_vector, source_spaces, source_slns);
+    OGProjection<double>::project_global(target_spaces, source_slns, target_vector);
+    return;
+  }
+
+  source.update(source_spaces);
+  if (target.update(target_spaces))
+    update_target();
+  add_gauss_rules(source.max_order + target.max_order + 1);
+
+  MeshSharedPtr source_mesh = source_spaces[0]->get_mesh();
+  int num_elements = elements.size();
+  int num_entries = target_spaces.size() * num_elements;
+
+#pragma omp parallel for
+  for (int entry = 0; entry < num_entries; entry++)
+  {
+    int space_i = entry / num_elements, element_i = entry % num_elements;
+    int index = space_i * target.num_ids + elements[element_i]->id;
+    int n = target.count[index];
+
+    std::vector<double> rhs(n, 0.);
+    Region base_region = { 1., 1., 0., 0. };
+    integrate(space_i, element_i, source_mesh->get_element(base_ids[element_i]), base_region, source_vector, &rhs[0]);
+
+    // L L^T c = rhs.
+    const double* factor = &factors[factor_offsets[entry]];
+    for (int i = 0; i < n; i++)
+    {
+      for (int j = 0; j < i; j++)
+        rhs[i] -= factor[i * n + j] * rhs[j];
+      rhs[i] /= factor[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+      for (int j = i + 1; j < n; j++)
+        rhs[i] -= factor[j * n + i] * rhs[j];
+      rhs[i] /= factor[i * n + i];
+    }
+
+    for (int i = 0; i < n; i++)
+      target_vector[target.dofs[target.first[index] + i]] = rhs[i];
+  }
+}
+
+void LocalProjection::update_target()
+{
+  MeshSharedPtr mesh = target.spaces[0]->get_mesh();
+  elements.clear();
+  base_ids.clear();
+  regions.clear();
+  Element* e;
+  for_all_base_elements(e, mesh)
+  {
+    Region base_region = { 1., 1., 0., 0. };
+    add_elements(e, e->id, base_region);
+  }
+
+  int num_elements = elements.size();
+  int num_entries = target.spaces.size() * num_elements;
+  factor_offsets.resize(num_entries);
+  int size = 0;
+  for (int entry = 0; entry < num_entries; entry++)
+  {
+    factor_offsets[entry] = size;
+    int n = target.count[(entry / num_elements) * target.num_ids + elements[entry % num_elements]->id];
+    size += n * n;
+  }
+  factors.resize(size);
+  add_gauss_rules(2 * target.max_order + 1);
+
+#pragma omp parallel for
+  for (int entry = 0; entry < num_entries; entry++)
+  {
+    int space_i = entry / num_elements;
+    Element* e = elements[entry % num_elements];
+    int index = space_i * target.num_ids + e->id;
+    int n = target.count[index];
+    const int* idx = &target.idx[target.first[index]];
+    const double* coef = &target.coef[target.first[index]];
+    Shapeset* shapeset = target.spaces[space_i]->get_shapeset();
+    bool triangle = e->is_triangle();
+
+    int num_points = get_num_points(2 * target.order[index] + (triangle ? 0 : 1));
+    const std::vector<double>& points = gauss_points[num_points - 1];
+    const std::vector<double>& weights = gauss_weights[num_points - 1];
+
+    double* mass = &factors[factor_offsets[entry]];
+    std::fill(mass, mass + n * n, 0.);
+    std::vector<double> values(n);
+    for (int i = 0; i < num_points; i++)
+    {
+      for (int j = 0; j < num_points; j++)
+      {
+        double xi = points[i], eta = points[j], weight = weights[i] * weights[j];
+        // Triangles: the square collapsed onto the reference triangle.
+        if (triangle)
+        {
+          xi = (1. + xi) * (1. - eta) / 2. - 1.;
+          weight *= (1. - eta) / 2.;
+        }
+        weight *= reference_map_jacobian(e, xi, eta);
+        for (int k = 0; k < n; k++)
+          values[k] = coef[k] * shapeset->get_fn_value(idx[k], xi, eta, 0, e->get_mode());
+        for (int k = 0; k < n; k++)
+          for (int l = 0; l <= k; l++)
+            mass[k * n + l] += weight * values[k] * values[l];
+      }
+    }
+
+    // Cholesky factorization in place, the lower triangle.
+    for (int k = 0; k < n; k++)
+    {
+      for (int l = 0; l < k; l++)
+      {
+        for (int m = 0; m < l; m++)
+          mass[k * n + l] -= mass[k * n + m] * mass[l * n + m];
+        mass[k * n + l] /= mass[l * n + l];
+      }
+      for (int m = 0; m < k; m++)
+        mass[k * n + k] -= mass[k * n + m] * mass[k * n + m];
+      mass[k * n + k] = std::sqrt(mass[k * n + k]);
+    }
+  }
+}
+
+void LocalProjection::add_elements(Element* e, int base_id, const Region& region)
+{
+  if (e->active)
+  {
+    elements.push_back(e);
+    base_ids.push_back(base_id);
+    regions.push_back(region);
+    return;
+  }
+  bool four_sons = e->is_triangle() || (e->sons[0] && e->sons[2]);
+  for (int son_i = 0; son_i < 4; son_i++)
+  {
+    if (!e->sons[son_i])
+      continue;
+    const double* son = e->is_triangle() ? triangle_son_regions[son_i] : quad_son_regions[four_sons ? son_i : son_i + 4];
+    Region son_region = { region.mx * son[0], region.my * son[1], region.mx * son[2] + region.tx, region.my * son[3] + region.ty };
+    add_elements(e->sons[son_i], base_id, son_region);
+  }
+}
+
+void LocalProjection::integrate(int space_i, int element_i, Element* source_e, const Region& source_region, const double* source_vector, double* rhs) const
+{
+  const Region& region = regions[element_i];
+  bool triangle = source_e->is_triangle();
+  // Triangles are only refined into four sons, so the source and target elements are nested, this one contains the target one if it is larger.
+  bool larger = std::abs(source_region.mx) > 1.5 * std::abs(region.mx);
+
+  if (!triangle)
+  {
+    // The overlap of the (rectangular) regions of the source and target elements.
+    double x_min = std::max(region.tx - std::abs(region.mx), source_region.tx - std::abs(source_region.mx));
+    double x_max = std::min(region.tx + std::abs(region.mx), source_region.tx + std::abs(source_region.mx));
+    double y_min = std::max(region.ty - std::abs(region.my), source_region.ty - std::abs(source_region.my));
+    double y_max = std::min(region.ty + std::abs(region.my), source_region.ty + std::abs(source_region.my));
+    if (x_max - x_min < 1E-12 || y_max - y_min < 1E-12)
+      return;
+    if (source_e->active)
+    {
+      Region piece = { (x_max - x_min) / 2., (y_max - y_min) / 2., (x_max + x_min) / 2., (y_max + y_min) / 2. };
+      integrate_piece(space_i, element_i, source_e, source_region, piece, source_vector, rhs);
+      return;
+    }
+  }
+  else if (source_e->active)
+  {
+    integrate_piece(space_i, element_i, source_e, source_region, larger ? region : source_region, source_vector, rhs);
+    return;
+  }
+
+  bool four_sons = triangle || (source_e->sons[0] && source_e->sons[2]);
+  for (int son_i = 0; son_i < 4; son_i++)
+  {
+    if (!source_e->sons[son_i])
+      continue;
+    const double* son = triangle ? triangle_son_regions[son_i] : quad_son_regions[four_sons ? son_i : son_i + 4];
+    Region son_region = { source_region.mx * son[0], source_region.my * son[1], source_region.mx * son[2] + source_region.tx, source_region.my * son[3] + source_region.ty };
+    if (triangle && larger)
+    {
+      // Only the son containing the target element, the one with its center (-1/3, -1/3).
+      double xi = (region.tx - region.mx / 3. - son_region.tx) / son_region.mx;
+      double eta = (region.ty - region.my / 3. - son_region.ty) / son_region.my;
+      if (xi < -1. - 1E-12 || eta < -1. - 1E-12 || xi + eta > 1E-12)
+        continue;
+    }
+    integrate(space_i, element_i, source_e->sons[son_i], son_region, source_vector, rhs);
+  }
+}
+
+void LocalProjection::integrate_piece(int space_i, int element_i, Element* source_e, const Region& source_region, const Region& piece, const double* source_vector, double* rhs) const
+{
+  Element* e = elements[element_i];
+  const Region& region = regions[element_i];
+  int index = space_i * target.num_ids + e->id;
+  int n = target.count[index];
+  const int* idx = &target.idx[target.first[index]];
+  const double* coef = &target.coef[target.first[index]];
+  Shapeset* shapeset = target.spaces[space_i]->get_shapeset();
+  bool triangle = e->is_triangle();
+
+  int source_order = source.order[space_i * source.num_ids + source_e->id];
+  int num_points = get_num_points(target.order[index] + source_order + (triangle ? 0 : 1));
+  const std::vector<double>& points = gauss_points[num_points - 1];
+  const std::vector<double>& weights = gauss_weights[num_points - 1];
+  // The weights are relative to the reference domain of the target element.
+  double scale = std::abs(piece.mx * piece.my / (region.mx * region.my));
+
+  for (int i = 0; i < num_points; i++)
+  {
+    for (int j = 0; j < num_points; j++)
+    {
+      double u = points[i], v = points[j], weight = scale * weights[i] * weights[j];
+      if (triangle)
+      {
+        u = (1. + u) * (1. - v) / 2. - 1.;
+        weight *= (1. - v) / 2.;
+      }
+      double x_base = piece.mx * u + piece.tx, y_base = piece.my * v + piece.ty;
+      double xi = (x_base - region.tx) / region.mx, eta = (y_base - region.ty) / region.my;
+      double value = source.evaluate(space_i, source_e, source_vector, (x_base - source_region.tx) / source_region.mx, (y_base - source_region.ty) / source_region.my);
+      weight *= value * reference_map_jacobian(e, xi, eta);
+      for (int k = 0; k < n; k++)
+        rhs[k] += weight * coef[k] * shapeset->get_fn_value(idx[k], xi, eta, 0, e->get_mode());
+    }
+  }
+}
+
+// The Gauss-Legendre rule with n points on [-1, 1].
+static void gauss_legendre_rule(int n, std::vector<double>& points, std::vector<double>& weights)
+{
+  points.resize(n);
+  weights.resize(n);
+  for (int i = 0; i < n; i++)
+  {
+    // Newton's method for the i-th root of the Legendre polynomial P_n.
+    double x = std::cos(M_PI * (i + 0.75) / (n + 0.5)), derivative = 1.;
+    for (int iteration = 0; iteration < 100; iteration++)
+    {
+      double p_previous = 1., p = x;
+      for (int k = 2; k <= n; k++)
+      {
+        double p_next = ((2 * k - 1) * x * p - (k - 1) * p_previous) / k;
+        p_previous = p;
+        p = p_next;
+      }
+      derivative = n * (x * p - p_previous) / (x * x - 1.);
+      double step = p / derivative;
+      x -= step;
+      if (std::abs(step) < 1E-15)
+        break;
+    }
+    points[i] = x;
+    weights[i] = 2. / ((1. - x * x) * derivative * derivative);
+  }
+}
+
+void LocalProjection::add_gauss_rules(int degree)
+{
+  for (int n = gauss_points.size() + 1; n <= get_num_points(degree); n++)
+  {
+    std::vector<double> points, weights;
+    gauss_legendre_rule(n, points, weights);
+    gauss_points.push_back(points);
+    gauss_weights.push_back(weights);
+  }
+}
+
+bool LocalProjection::ElementShapes::update(const std::vector<SpaceSharedPtr<double> >& spaces)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+
+  bool up_to_date = (mesh->get_seq() == this->mesh_seq) && (spaces == this->spaces);
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return false;
+
+  this->spaces = spaces;
+  this->mesh_seq = mesh->get_seq();
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+
+  num_ids = mesh->get_max_element_id() + 1;
+  max_order = 0;
+  first.assign(spaces.size() * num_ids, 0);
+  count.assign(spaces.size() * num_ids, 0);
+  order.assign(spaces.size() * num_ids, 0);
+  idx.clear();
+  coef.clear();
+  dofs.clear();
+
+  AsmList<double> al;
+  Element* e;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for_all_active_elements(e, mesh)
+    {
+      spaces[space_i]->get_element_assembly_list(e, &al);
+      int index = space_i * num_ids + e->id;
+      int element_order = spaces[space_i]->get_element_order(e->id);
+      first[index] = idx.size();
+      count[index] = al.get_cnt();
+      order[index] = std::max(H2D_GET_H_ORDER(element_order), H2D_GET_V_ORDER(element_order));
+      max_order = std::max(max_order, order[index]);
+      for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+      {
+        idx.push_back(al.get_idx()[shape_i]);
+        coef.push_back(al.get_coef()[shape_i]);
+        dofs.push_back(al.get_dof()[shape_i]);
+      }
+    }
+  }
+  return true;
+}
+
+double LocalProjection::ElementShapes::evaluate(int space_i, Element* e, const double* vector, double xi, double eta) const
+{
+  int index = space_i * num_ids + e->id;
+  Shapeset* shapeset = spaces[space_i]->get_shapeset();
+  double value = 0.;
+  for (int shape_i = first[index]; shape_i < first[index] + count[index]; shape_i++)
+    value += vector[dofs[shape_i]] * coef[shape_i] * shapeset->get_fn_value(idx[shape_i], xi, eta, 0, e->get_mode());
+  return value;
+}
+
+DetectorAdaptivity::DetectorAdaptivity(std::vector<SpaceSharedPtr<double> > spaces, int max_refinement_level, int min_order, int max_order, double detector_threshold) :
+  spaces(spaces), max_refinement_level(max_refinement_level), min_order(min_order), max_order(max_order), detector_threshold(detector_threshold),
+  increase_threshold(0.1), decrease_threshold(10.), refined_count(0), order_change_count(0)
+{
+  // Unlimited (max_order < 0) up to the maximum order of the shapeset.
+  if (max_order < 0)
+    this->max_order = spaces[0]->get_shapeset()->get_max_order();
+  this->detector = new KrivodonovaDiscontinuityDetector(spaces, NULL);
+  this->num_initial_ids = spaces[0]->get_mesh()->get_max_element_id() + 1;
+  // Exact for the products of two shape functions, also on the collapsed square of a triangle.
+  gauss_legendre_rule(spaces[0]->get_shapeset()->get_max_order() + 2, gauss_points, gauss_weights);
+}
+
+DetectorAdaptivity::~DetectorAdaptivity()
+{
+  delete this->detector;
+}
+
+void DetectorAdaptivity::set_smoothness_thresholds(double increase_threshold, double decrease_threshold)
+{
+  this->increase_threshold = increase_threshold;
+  this->decrease_threshold = decrease_threshold;
+}
+
+int DetectorAdaptivity::get_refinement_level(Element* e) const
+{
+  int level = 0;
+  for (; e->id >= num_initial_ids && e->parent; e = e->parent)
+    level++;
+  return level;
+}
+
+double DetectorAdaptivity::get_shape_norm(Shapeset* shapeset, int index, ElementMode2D mode)
+{
+  std::vector<double>& norms = shape_norms[mode == HERMES_MODE_TRIANGLE ? 0 : 1];
+  if (index >= (int)norms.size())
+    norms.resize(index + 1, -1.);
+  if (norms[index] >= 0.)
+    return norms[index];
+
+  double norm = 0.;
+  int num_points = gauss_points.size();
+  for (int i = 0; i < num_points; i++)
+  {
+    for (int j = 0; j < num_points; j++)
+    {
+      double xi = gauss_points[i], eta = gauss_points[j], weight = gauss_weights[i] * gauss_weights[j];
+      // Triangles: the square collapsed onto the reference triangle.
+      if (mode == HERMES_MODE_TRIANGLE)
+      {
+        xi = (1. + xi) * (1. - eta) / 2. - 1.;
+        weight *= (1. - eta) / 2.;
+      }
+      double value = shapeset->get_fn_value(index, xi, eta, 0, mode);
+      norm += weight * value * value;
+    }
+  }
+  return norms[index] = norm;
+}
 
-      // Calculation of the edge length.
-      double edge_length = std::sqrt(std::pow(e->vn[(edge_i + 1) % e->get_nvert()]->x - e->vn[edge_i]->x, 2) + std::pow(e->vn[(edge_i + 1) % e->get_nvert()]->y - e->vn[edge_i]->y, 2));
+double DetectorAdaptivity::calculate_smoothness(Element* e, const double* sln_vector)
+{
+  double indicator = 0.;
+  AsmList<double> al;
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    spaces[space_i]->get_element_assembly_list(e, &al);
+    Shapeset* shapeset = spaces[space_i]->get_shapeset();
+    int element_order = spaces[space_i]->get_element_order(e->id);
+    int order = std::max(H2D_GET_H_ORDER(element_order), H2D_GET_V_ORDER(element_order));
 
-      // Calculation of the maximum eigenvalue of the matrix P.
-      double max_eigen_value = 0.0;
-      for (int point_i = 0; point_i < np; point_i++) {
-        // Transform to the local coordinates.
-        double transformed[4];
-        transformed[0] = w[0];
-        transformed[1] = geom->nx[point_i] * w[1] + geom->ny[point_i] * w[2];
-        transformed[2] = -geom->ny[point_i] * w[1] + geom->nx[point_i] * w[2];
-        transformed[3] = w[3];
+    double highest = 0., total = 0.;
+    for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+    {
+      double coefficient = sln_vector[al.get_dof()[shape_i]] * al.get_coef()[shape_i];
+      double part = coefficient * coefficient * get_shape_norm(shapeset, al.get_idx()[shape_i], e->get_mode());
+      int shape_order = shapeset->get_order(al.get_idx()[shape_i], e->get_mode());
+      if (std::max(H2D_GET_H_ORDER(shape_order), H2D_GET_V_ORDER(shape_order)) == order)
+        highest += part;
+      total += part;
+    }
+    if (total > 0.)
+      indicator = std::max(indicator, highest / total * std::pow((double)order, 4.));
+  }
+  return indicator;
+}
 
-        // Calc sound speed.
-        double a = QuantityCalculator::calc_sound_speed(transformed[0], transformed[1], transformed[2], transformed[3], kappa);
+bool DetectorAdaptivity::adapt(const double* sln_vector, bool adapt_orders)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  detector->set_solution_vector(sln_vector);
+  detector->get_discontinuous_element_ids(detector_threshold);
+  const std::vector<char>& discontinuous = detector->get_discontinuous_element_flags();
+  adapt_orders = adapt_orders && (min_order < max_order);
+
+  // Decided on the current mesh, then applied: the elements to refine with the orders of their sons, the elements with new orders.
+  std::vector<std::pair<int, int> > refinements;
+  std::vector<std::pair<int, int> > order_changes;
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    int element_order = spaces[0]->get_element_order(e->id);
+    int order = std::max(H2D_GET_H_ORDER(element_order), H2D_GET_V_ORDER(element_order));
+    int new_order = order;
+    if (discontinuous[e->id])
+    {
+      if (adapt_orders)
+        new_order = std::max(order - 1, min_order);
+      if (get_refinement_level(e) < max_refinement_level)
+      {
+        refinements.push_back(std::pair<int, int>(e->id, new_order));
+        continue;
+      }
+    }
+    else if (adapt_orders && !(e->id < (int)order_changed.size() && order_changed[e->id]))
+    {
+      if (order == 0)
+        new_order = 1;
+      else
+      {
+        double indicator = calculate_smoothness(e, sln_vector);
+        if (indicator < increase_threshold)
+          new_order = order + 1;
+        else if (indicator > decrease_threshold)
+          new_order = order - 1;
+      }
+      new_order = std::min(std::max(new_order, min_order), max_order);
+    }
+    if (new_order != order)
+      order_changes.push_back(std::pair<int, int>(e->id, new_order));
+  }
 
-        // Calc max eigenvalue.
-        if (transformed[1] / transformed[0] - a > max_eigen_value || point_i == 0)
-          max_eigen_value = transformed[1] / transformed[0] - a;
-        if (transformed[1] / transformed[0] > max_eigen_value)
-          max_eigen_value = transformed[1] / transformed[0];
-        if (transformed[1] / transformed[0] + a > max_eigen_value)
-          max_eigen_value = transformed[1] / transformed[0] + a;
+  this->refined_count = refinements.size();
+  this->order_change_count = order_changes.size();
+  if (refinements.empty() && order_changes.empty())
+    return true;
+
+  for (unsigned int i = 0; i < refinements.size(); i++)
+    mesh->refine_element_id(refinements[i].first, 0);
+
+  if (adapt_orders)
+    order_changed.assign(mesh->get_max_element_id() + 1, 0);
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+  {
+    for (unsigned int i = 0; i < refinements.size(); i++)
+    {
+      Element* parent = mesh->get_element(refinements[i].first);
+      int order = refinements[i].second;
+      for (int son_i = 0; son_i < 4; son_i++)
+      {
+        spaces[space_i]->set_element_order(parent->sons[son_i]->id, parent->is_triangle() ? order : H2D_MAKE_QUAD_ORDER(order, order));
+        if (adapt_orders)
+          order_changed[parent->sons[son_i]->id] = 1;
       }
+    }
+    for (unsigned int i = 0; i < order_changes.size(); i++)
+    {
+      Element* element = mesh->get_element(order_changes[i].first);
+      int order = order_changes[i].second;
+      spaces[space_i]->set_element_order(element->id, element->is_triangle() ? order : H2D_MAKE_QUAD_ORDER(order, order));
+      if (adapt_orders)
+        order_changed[element->id] = 1;
+    }
+  }
+  Space<double>::assign_dofs(spaces);
+  return false;
+}
+
+SelectiveDerefinement::SelectiveDerefinement(std::vector<SpaceSharedPtr<double> > spaces, int min_order) : spaces(spaces), min_order(min_order),
+  indicators_mesh_seq(-1), order_change_count(0)
+{
+  this->num_initial_ids = spaces[0]->get_mesh()->get_max_element_id() + 1;
+}
+
+void SelectiveDerefinement::set_indicators(ErrorCalculator<double>* error_calculator)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  indicators.assign(mesh->get_max_element_id() + 1, 0.);
+  indicators_mesh_seq = mesh->get_seq();
+
+  double total = 0.;
+  int num_elements = 0;
+  Element* e;
+  for_all_active_elements(e, mesh)
+  {
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+      indicators[e->id] += error_calculator->get_element_error_squared(space_i, e->id);
+    total += indicators[e->id];
+    num_elements++;
+  }
+  if (total > 0.)
+    for (unsigned int i = 0; i < indicators.size(); i++)
+      indicators[i] *= num_elements / total;
+}
 
-      if (edge_length * max_eigen_value > edge_length_max_lambda || edge_i == 0)
-        edge_length_max_lambda = edge_length * max_eigen_value;
+void SelectiveDerefinement::set_indicators(const std::vector<char>& flags)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  indicators.assign(mesh->get_max_element_id() + 1, 0.);
+  indicators_mesh_seq = mesh->get_seq();
+  for (unsigned int i = 0; i < indicators.size() && i < flags.size(); i++)
+    indicators[i] = flags[i] ? 1. : 0.;
+}
 
-      delete geom;
+int SelectiveDerefinement::derefine(double threshold, bool lower_orders)
+{
+  MeshSharedPtr mesh = spaces[0]->get_mesh();
+  this->order_change_count = 0;
+  if (mesh->get_seq() != indicators_mesh_seq)
+    return 0;
+
+  // Decided on the current mesh, then applied: the elements whose sons are merged, with the highest orders of the sons per space.
+  std::vector<int> merged_ids;
+  std::vector<int> merged_orders;
+  std::vector<char> merged(mesh->get_max_element_id() + 1, 0);
+  Element* e;
+  for_all_inactive_elements(e, mesh)
+  {
+    bool mergeable = true;
+    double indicator = 0.;
+    for (int son_i = 0; son_i < 4 && mergeable; son_i++)
+    {
+      Element* son = e->sons[son_i];
+      if (!son)
+        continue;
+      if (!son->active || son->id < num_initial_ids)
+        mergeable = false;
+      else
+        indicator += indicators[son->id];
     }
+    if (!mergeable || indicator >= threshold)
+      continue;
 
-    e->calc_area();
-    double condition = e->area * CFL_number / edge_length_max_lambda;
+    merged_ids.push_back(e->id);
+    merged[e->id] = 1;
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    {
+      int order_h = 0, order_v = 0;
+      for (int son_i = 0; son_i < 4; son_i++)
+      {
+        if (!e->sons[son_i])
+          continue;
+        int son_order = spaces[space_i]->get_element_order(e->sons[son_i]->id);
+        order_h = std::max(order_h, H2D_GET_H_ORDER(son_order));
+        order_v = std::max(order_v, H2D_GET_V_ORDER(son_order));
+      }
+      merged_orders.push_back(e->is_triangle() ? order_h : H2D_MAKE_QUAD_ORDER(order_h, order_v));
+    }
+  }
 
-    if (condition < min_condition || min_condition == 0.)
-      min_condition = condition;
+  // The other elements with small indicators, whose orders are lowered.
+  std::vector<int> lowered_ids;
+  if (lower_orders)
+  {
+    for_all_active_elements(e, mesh)
+    {
+      if (indicators[e->id] >= threshold || (e->parent && merged[e->parent->id]))
+        continue;
+      int order = spaces[0]->get_element_order(e->id);
+      if (std::max(H2D_GET_H_ORDER(order), H2D_GET_V_ORDER(order)) > min_order)
+        lowered_ids.push_back(e->id);
+    }
   }
 
-  time_step = min_condition;
+  if (merged_ids.empty() && lowered_ids.empty())
+    return 0;
 
-  delete[] sln_vector;
+  for (unsigned int i = 0; i < merged_ids.size(); i++)
+  {
+    mesh->unrefine_element_id(merged_ids[i]);
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+      spaces[space_i]->set_element_order(merged_ids[i], merged_orders[i * spaces.size() + space_i]);
+  }
+  for (unsigned int i = 0; i < lowered_ids.size(); i++)
+  {
+    bool triangle = mesh->get_element(lowered_ids[i])->is_triangle();
+    for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    {
+      int order = spaces[space_i]->get_element_order(lowered_ids[i]);
+      int order_h = std::max(H2D_GET_H_ORDER(order) - 1, min_order);
+      int order_v = std::max(H2D_GET_V_ORDER(order) - 1, min_order);
+      spaces[space_i]->set_element_order(lowered_ids[i], triangle ? order_h : H2D_MAKE_QUAD_ORDER(order_h, order_v));
+    }
+  }
+  this->order_change_count = lowered_ids.size();
+  Space<double>::assign_dofs(spaces);
+  return merged_ids.size();
 }
 
-void CFLCalculation::set_number(double new_CFL_number)
+PartitionedCoupling::PartitionedCoupling(WeakFormSharedPtr<double> wf_1, std::vector<SpaceSharedPtr<double> > spaces_1, std::vector<MeshFunctionSharedPtr<double> > slns_1,
+  WeakFormSharedPtr<double> wf_2, std::vector<SpaceSharedPtr<double> > spaces_2, std::vector<MeshFunctionSharedPtr<double> > slns_2) :
+  max_sub_iterations(0), tolerance(0.), change(0.), concurrent(true)
 {
-  this->CFL_number = new_CFL_number;
+  wfs[0] = wf_1;
+  wfs[1] = wf_2;
+  spaces[0] = spaces_1;
+  spaces[1] = spaces_2;
+  slns[0] = slns_1;
+  slns[1] = slns_2;
+  for (int problem_i = 0; problem_i < 2; problem_i++)
+    solvers[problem_i] = new LinearSolver<double>(wfs[problem_i], spaces[problem_i]);
 }
 
-ADEStabilityCalculation::ADEStabilityCalculation(double AdvectionRelativeConstant, double DiffusionRelativeConstant, double epsilon)
-  : AdvectionRelativeConstant(AdvectionRelativeConstant), DiffusionRelativeConstant(DiffusionRelativeConstant), epsilon(epsilon)
+PartitionedCoupling::~PartitionedCoupling()
 {
+  delete solvers[0];
+  delete solvers[1];
 }
 
-void ADEStabilityCalculation::calculate(std::vector<MeshFunctionSharedPtr<double> > solutions, MeshSharedPtr mesh, double & time_step)
+void PartitionedCoupling::set_sub_iterations(int max_sub_iterations, double tolerance)
 {
-  // Create spaces of constant functions over the given mesh->
-  SpaceSharedPtr<double> constant_rho_space(new L2Space<double>(mesh, 0));
-  SpaceSharedPtr<double> constant_rho_v_x_space(new L2Space<double>(mesh, 0));
-  SpaceSharedPtr<double> constant_rho_v_y_space(new L2Space<double>(mesh, 0));
+  this->max_sub_iterations = max_sub_iterations;
+  this->tolerance = tolerance;
+}
 
-  double* sln_vector = new double[constant_rho_space->get_num_dofs() * 3];
+void PartitionedCoupling::set_concurrent(bool concurrent)
+{
+  this->concurrent = concurrent;
+}
 
-  OGProjection<double> ogProjection;
-  ogProjection.project_global({ constant_rho_space, constant_rho_v_x_space, constant_rho_v_y_space }, solutions, sln_vector);
+int PartitionedCoupling::solve(double time_step)
+{
+  wfs[0]->set_current_time_step(time_step);
+  wfs[1]->set_current_time_step(time_step);
 
-  // Determine the time step according to the conditions.
-  double min_condition_advection = 0.;
-  double min_condition_diffusion = 0.;
-  Element *e;
-  for_all_active_elements(e, mesh)
-  {
-    AsmList<double> al;
-    constant_rho_space->get_element_assembly_list(e, &al);
-    double rho = sln_vector[al.get_dof()[0]];
-    constant_rho_v_x_space->get_element_assembly_list(e, &al);
-    double v1 = sln_vector[al.get_dof()[0] + constant_rho_space->get_num_dofs()] / rho;
-    constant_rho_v_y_space->get_element_assembly_list(e, &al);
-    double v2 = sln_vector[al.get_dof()[0] + 2 * constant_rho_space->get_num_dofs()] / rho;
+  // The backend may only be changed (through HermesCommonApi) between the solves.
+  bool solve_concurrently = concurrent && (Hermes::HermesCommonApi.get_integral_param_value(Hermes::matrixSolverType) == Hermes::SOLVER_UMFPACK);
 
-    e->calc_area();
-    e->calc_diameter();
-    double condition_advection = AdvectionRelativeConstant * e->diameter / std::sqrt(v1*v1 + v2*v2);
-    double condition_diffusion = DiffusionRelativeConstant * e->area / epsilon;
+  int sub_iteration = 0;
+  for (;; sub_iteration++)
+  {
+    // Both read only the coupling fields of the previous sub-iteration.
+    if (solve_concurrently)
+    {
+      // The second problem on its own thread.
+      std::exception_ptr exceptions[2];
+      std::thread second_thread([&]()
+      {
+        try { solvers[1]->solve(); }
+        catch (...) { exceptions[1] = std::current_exception(); }
+      });
+      try { solvers[0]->solve(); }
+      catch (...) { exceptions[0] = std::current_exception(); }
+      second_thread.join();
+      for (int problem_i = 0; problem_i < 2; problem_i++)
+        if (exceptions[problem_i])
+          std::rethrow_exception(exceptions[problem_i]);
+    }
+    else
+    {
+      solvers[0]->solve();
+      solvers[1]->solve();
+    }
 
-    if (condition_advection < min_condition_advection || min_condition_advection == 0.)
-      min_condition_advection = condition_advection;
+    // The largest relative change of the two solution vectors, then the coupling fields are updated.
+    change = 0.;
+    for (int problem_i = 0; problem_i < 2; problem_i++)
+    {
+      int ndof = Space<double>::get_num_dofs(spaces[problem_i]);
+      const double* sln_vector = solvers[problem_i]->get_sln_vector();
+      if ((int)sln_vectors[problem_i].size() == ndof)
+      {
+        double difference = 0., norm = 0.;
+        for (int i = 0; i < ndof; i++)
+        {
+          difference += (sln_vector[i] - sln_vectors[problem_i][i]) * (sln_vector[i] - sln_vectors[problem_i][i]);
+          norm += sln_vector[i] * sln_vector[i];
+        }
+        if (norm > 0.)
+          change = std::max(change, std::sqrt(difference / norm));
+      }
+      else
+        change = std::numeric_limits<double>::max();
+      sln_vectors[problem_i].assign(sln_vector, sln_vector + ndof);
+      Solution<double>::vector_to_solutions(sln_vector, spaces[problem_i], slns[problem_i]);
+    }
 
-    if (condition_diffusion < min_condition_diffusion || min_condition_diffusion == 0.)
-      min_condition_diffusion = condition_diffusion;
+    if (sub_iteration >= max_sub_iterations || change < tolerance)
+      break;
   }
+  return sub_iteration;
+}
 
-  time_step = std::min(min_condition_advection, min_condition_diffusion);
+MultirateTimeStepping::MultirateTimeStepping(bool multirate, int max_substeps) : multirate(multirate), max_substeps(max_substeps),
+  time_step(0.), flow_substeps(1), transport_substeps(1)
+{
+}
 
-  delete[] sln_vector;
+double MultirateTimeStepping::set_time_steps(double flow_time_step, double transport_time_step)
+{
+  flow_substeps = transport_substeps = 1;
+  double fast_time_step = std::min(flow_time_step, transport_time_step);
+  if (!multirate)
+    return time_step = fast_time_step;
+
+  // A ratio only a rounding error above an integer does not cost another substep.
+  double ratio = std::max(flow_time_step, transport_time_step) / fast_time_step;
+  int substeps = std::max((int)std::ceil(ratio - 1e-9), 1);
+  if (substeps > max_substeps)
+    substeps = max_substeps;
+  // The substeps are at most the fast time step.
+  time_step = std::min(std::max(flow_time_step, transport_time_step), substeps * fast_time_step);
+
+  if (flow_time_step < transport_time_step)
+    flow_substeps = substeps;
+  else
+    transport_substeps = substeps;
+  return time_step;
 }
 
 DiscontinuityDetector::DiscontinuityDetector(std::vector<SpaceSharedPtr<double>  > spaces,
@@ -224,18 +3414,29 @@ DiscontinuityDetector::~DiscontinuityDetector()
 {};
 
 KrivodonovaDiscontinuityDetector::KrivodonovaDiscontinuityDetector(std::vector<SpaceSharedPtr<double>  > spaces,
-  std::vector<MeshFunctionSharedPtr<double> > solutions) : DiscontinuityDetector(spaces, solutions)
+  const double* solution_vector) : DiscontinuityDetector(spaces, std::vector<MeshFunctionSharedPtr<double> >()), solution_vector(solution_vector), mesh_seq(-1)
+{
+  set_spaces(spaces);
+};
+
+KrivodonovaDiscontinuityDetector::~KrivodonovaDiscontinuityDetector()
+{};
+
+void KrivodonovaDiscontinuityDetector::set_solution_vector(const double* solution_vector)
+{
+  this->solution_vector = solution_vector;
+}
+
+void KrivodonovaDiscontinuityDetector::set_spaces(std::vector<SpaceSharedPtr<double> > spaces)
 {
   // A check that all meshes are the same in the spaces.
   unsigned int mesh0_seq = spaces[0]->get_mesh()->get_seq();
   for (unsigned int i = 0; i < spaces.size(); i++)
     if (spaces[i]->get_mesh()->get_seq() != mesh0_seq)
       throw Hermes::Exceptions::Exception("So far DiscontinuityDetector works only for single mesh->");
+  this->spaces = spaces;
   mesh = spaces[0]->get_mesh();
-};
-
-KrivodonovaDiscontinuityDetector::~KrivodonovaDiscontinuityDetector()
-{};
+}
 
 double KrivodonovaDiscontinuityDetector::calculate_h(Element* e, int polynomial_order)
 {
@@ -251,234 +3452,134 @@ double KrivodonovaDiscontinuityDetector::calculate_h(Element* e, int polynomial_
     + 1) / 2);
 }
 
-std::set<int>& KrivodonovaDiscontinuityDetector::get_discontinuous_element_ids()
-{
-  return get_discontinuous_element_ids(1.0);
-};
-
-std::set<int>& KrivodonovaDiscontinuityDetector::get_discontinuous_element_ids(double threshold)
+void KrivodonovaDiscontinuityDetector::update_edge_data()
 {
-  Element* e;
-  for_all_active_elements(e, mesh)
+  bool up_to_date = (mesh->get_seq() == this->mesh_seq) && (spaces.size() == this->space_seqs.size());
+  for (unsigned int space_i = 0; space_i < spaces.size() && up_to_date; space_i++)
+    if (spaces[space_i]->get_seq() != this->space_seqs[space_i])
+      up_to_date = false;
+  if (up_to_date)
+    return;
+
+  this->mesh_seq = mesh->get_seq();
+  this->space_seqs.clear();
+  for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
+    this->space_seqs.push_back(spaces[space_i]->get_seq());
+
+  element_ids.clear();
+  h_indicators.clear();
+  element_edge_offsets.clear();
+  edge_lengths.clear();
+  edge_point_offsets.clear();
+  point_weights.clear();
+  point_nx.clear();
+  point_ny.clear();
+  trace_offsets.clear();
+  trace_dofs.clear();
+  trace_values.clear();
+
+  // The edges and their points are those of the geometry of the mesh.
+  std::shared_ptr<const MeshGeometry> mesh_geometry = MeshGeometry::get(mesh);
+  const MeshGeometry& geometry = *mesh_geometry;
+  trace_offsets.push_back(0);
+  for (int element_i = 0; element_i < geometry.get_num_elements(); element_i++)
   {
-    bool element_inserted = false;
-    for (int edge_i = 0; edge_i < e->get_nvert() && !element_inserted; edge_i++)
-      if (calculate_relative_flow_direction(e, edge_i) < 0 && !e->en[edge_i]->bnd)
+    Element* e = mesh->get_element(geometry.element_ids[element_i]);
+    element_ids.push_back(e->id);
+    h_indicators.push_back(calculate_h(e, spaces[0]->get_element_order(e->id)));
+    element_edge_offsets.push_back(edge_lengths.size());
+
+    for (int edge_i = geometry.edge_offsets[element_i]; edge_i < geometry.edge_offsets[element_i + 1]; edge_i++)
+    {
+      if (geometry.edge_boundary[edge_i])
+        continue;
+
+      edge_lengths.push_back(geometry.edge_length[edge_i]);
+      edge_point_offsets.push_back(point_weights.size());
+      for (int point_i = geometry.point_offsets[edge_i]; point_i < geometry.point_offsets[edge_i + 1]; point_i++)
       {
-      double jumps[4];
-      calculate_jumps(e, edge_i, jumps);
-      double diameter_indicator = calculate_h(e, spaces[0]->get_element_order(e->id));
-      double edge_length = std::sqrt(std::pow(e->vn[(edge_i + 1) % e->get_nvert()]->x - e->vn[edge_i]->x, 2) + std::pow(e->vn[(edge_i + 1) % e->get_nvert()]->y - e->vn[edge_i]->y, 2));
-      double norms[4];
-      calculate_norms(e, edge_i, norms);
-
-      // Number of component jumps tested.
-      unsigned int component_checked_number = 1;
-      for (unsigned int component_i = 0; component_i < component_checked_number; component_i++) {
-        if (norms[component_i] < 1E-8)
-          continue;
-        double discontinuity_detector = jumps[component_i] / (diameter_indicator * edge_length * norms[component_i]);
-        if (discontinuity_detector > threshold)
-        {
-          discontinuous_element_ids.insert(e->id);
-          element_inserted = true;
-          break;
-        }
-      }
+        double x = geometry.point_x[point_i], y = geometry.point_y[point_i];
+        point_weights.push_back(geometry.point_weight[point_i]);
+        point_nx.push_back(geometry.point_nx[point_i]);
+        point_ny.push_back(geometry.point_ny[point_i]);
+
+        add_trace(spaces[0], e, x, y);
+        add_trace(spaces[1], e, x, y);
+        add_trace(spaces[2], e, x, y);
+        add_trace(spaces[0], mesh->get_element(geometry.point_neighbor_ids[point_i]), x, y);
       }
+    }
   }
-  return discontinuous_element_ids;
-};
-
-double KrivodonovaDiscontinuityDetector::calculate_relative_flow_direction(Element* e, int edge_i)
-{
-  // Set active element to the two solutions (density_vel_x, density_vel_y).
-  solutions[1]->set_active_element(e);
-  solutions[2]->set_active_element(e);
+  element_edge_offsets.push_back(edge_lengths.size());
+  edge_point_offsets.push_back(point_weights.size());
 
-  // Set Geometry.
-  SurfPos surf_pos;
-  surf_pos.marker = e->marker;
-  surf_pos.surf_num = edge_i;
-
-  int eo = solutions[1]->get_quad_2d()->get_edge_points(surf_pos.surf_num, 20, e->get_mode());
-  double3* pt = solutions[1]->get_quad_2d()->get_points(eo, e->get_mode());
-  int np = solutions[1]->get_quad_2d()->get_num_points(eo, e->get_mode());
-
-  double3* tan;
-  GeomSurf<double>* geom = init_geom_surf(solutions[1]->get_refmap(), surf_pos.surf_num, surf_pos.marker, eo, tan);
-
-  double* jwt = new double[np];
-  for (int i = 0; i < np; i++)
-    jwt[i] = pt[i][2] * tan[i][2];
+  discontinuous_flags.assign(mesh->get_max_element_id() + 1, 0);
+}
 
-  // Calculate.
-  Func<double>* density_vel_x = init_fn(solutions[1].get(), eo);
-  Func<double>* density_vel_y = init_fn(solutions[2].get(), eo);
+// Appends the values of the shape functions of the space on the Element e in the physical point (x, y) and their dofs.
+static void add_shape_function_values(SpaceSharedPtr<double> space, Element* e, double x, double y, std::vector<int>& dofs, std::vector<double>& values)
+{
+  double x_reference, y_reference;
+  RefMap::untransform(e, x, y, x_reference, y_reference);
 
-  double result = 0.0;
-  for (int point_i = 0; point_i < np; point_i++)
-    result += jwt[point_i] * density_vel_x->val[point_i] * geom->nx[point_i] + density_vel_y->val[point_i] * geom->ny[point_i];
+  AsmList<double> al;
+  space->get_element_assembly_list(e, &al);
+  for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
+  {
+    if (al.get_dof()[shape_i] < 0)
+      continue;
+    dofs.push_back(al.get_dof()[shape_i]);
+    values.push_back(al.get_coef()[shape_i] * space->get_shapeset()->get_fn_value(al.get_idx()[shape_i], x_reference, y_reference, 0, e->get_mode()));
+  }
+}
 
-  delete geom;
-  delete[] jwt;
-  delete density_vel_x;
-  delete density_vel_y;
+void KrivodonovaDiscontinuityDetector::add_trace(SpaceSharedPtr<double> space, Element* e, double x, double y)
+{
+  add_shape_function_values(space, e, x, y, trace_dofs, trace_values);
+  trace_offsets.push_back(trace_dofs.size());
+}
 
-  return result;
+std::set<int>& KrivodonovaDiscontinuityDetector::get_discontinuous_element_ids()
+{
+  return get_discontinuous_element_ids(1.0);
 };
 
-void KrivodonovaDiscontinuityDetector::calculate_jumps(Element* e, int edge_i, double result[4])
+std::set<int>& KrivodonovaDiscontinuityDetector::get_discontinuous_element_ids(double threshold)
 {
-  // Set Geometry.
-  SurfPos surf_pos;
-  surf_pos.marker = e->marker;
-  surf_pos.surf_num = edge_i;
-
-  int eo = solutions[0]->get_quad_2d()->get_edge_points(surf_pos.surf_num, 8, e->get_mode());
-  double3* pt = solutions[0]->get_quad_2d()->get_points(eo, e->get_mode());
-  int np = solutions[0]->get_quad_2d()->get_num_points(eo, e->get_mode());
-
-  // Initialize the NeighborSearch.
-  NeighborSearch<double> ns(e, mesh);
-  ns.set_active_edge(edge_i);
-
-  // The values to be returned.
-  result[0] = 0.0;
-  result[1] = 0.0;
-  result[2] = 0.0;
-  result[3] = 0.0;
+  update_edge_data();
 
-  // Go through all neighbors.
-  for (int neighbor_i = 0; neighbor_i < ns.get_num_neighbors(); neighbor_i++) {
-    ns.set_active_segment(neighbor_i);
+  // Only the density jump is tested, on the inflow edges.
+  int num_elements = element_ids.size();
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    char discontinuous = 0;
+    for (int edge_i = element_edge_offsets[element_i]; edge_i < element_edge_offsets[element_i + 1] && !discontinuous; edge_i++)
+    {
+      double inflow = 0., jump = 0., norm = 0.;
+      for (int point_i = edge_point_offsets[edge_i]; point_i < edge_point_offsets[edge_i + 1]; point_i++)
+      {
+        double density = get_trace_value(4 * point_i);
+        double density_vel_x = get_trace_value(4 * point_i + 1);
+        double density_vel_y = get_trace_value(4 * point_i + 2);
+        double density_neighbor = get_trace_value(4 * point_i + 3);
+
+        inflow += point_weights[point_i] * (density_vel_x * point_nx[point_i] + density_vel_y * point_ny[point_i]);
+        jump += point_weights[point_i] * std::abs(density - density_neighbor);
+        norm = std::max(norm, std::abs(density));
+      }
 
-    // Set active element to the solutions.
-    solutions[0]->set_active_element(e);
-    solutions[1]->set_active_element(e);
-    solutions[2]->set_active_element(e);
-    solutions[3]->set_active_element(e);
-
-    // Push all the necessary transformations.
-    for (unsigned int trf_i = 0; trf_i < ns.get_central_n_trans(neighbor_i); trf_i++) {
-      solutions[0]->push_transform(ns.get_central_transformations(neighbor_i, trf_i));
-      solutions[1]->push_transform(ns.get_central_transformations(neighbor_i, trf_i));
-      solutions[2]->push_transform(ns.get_central_transformations(neighbor_i, trf_i));
-      solutions[3]->push_transform(ns.get_central_transformations(neighbor_i, trf_i));
-    }
-
-    double3* tan;
-    GeomSurf<double>* geom = init_geom_surf(solutions[0]->get_refmap(), surf_pos.surf_num, surf_pos.marker, eo, tan);
-    double* jwt = new double[np];
-    for (int i = 0; i < np; i++)
-      jwt[i] = pt[i][2] * tan[i][2];
-
-    // Prepare functions on the central element.
-    Func<double>* density = init_fn(solutions[0].get(), eo);
-    Func<double>* density_vel_x = init_fn(solutions[1].get(), eo);
-    Func<double>* density_vel_y = init_fn(solutions[2].get(), eo);
-    Func<double>* energy = init_fn(solutions[3].get(), eo);
-
-    // Set neighbor element to the solutions.
-    solutions[0]->set_active_element(ns.get_neighb_el());
-    solutions[1]->set_active_element(ns.get_neighb_el());
-    solutions[2]->set_active_element(ns.get_neighb_el());
-    solutions[3]->set_active_element(ns.get_neighb_el());
-
-    // Push all the necessary transformations.
-    for (unsigned int trf_i = 0; trf_i < ns.get_neighbor_n_trans(neighbor_i); trf_i++) {
-      solutions[0]->push_transform(ns.get_neighbor_transformations(neighbor_i, trf_i));
-      solutions[1]->push_transform(ns.get_neighbor_transformations(neighbor_i, trf_i));
-      solutions[2]->push_transform(ns.get_neighbor_transformations(neighbor_i, trf_i));
-      solutions[3]->push_transform(ns.get_neighbor_transformations(neighbor_i, trf_i));
-    }
-
-    // Prepare functions on the neighbor element.
-    Func<double>* density_neighbor = init_fn(solutions[0].get(), eo);
-    Func<double>* density_vel_x_neighbor = init_fn(solutions[1].get(), eo);
-    Func<double>* density_vel_y_neighbor = init_fn(solutions[2].get(), eo);
-    Func<double>* energy_neighbor = init_fn(solutions[3].get(), eo);
-
-    DiscontinuousFunc<double> density_discontinuous(density, density_neighbor, true);
-    DiscontinuousFunc<double> density_vel_x_discontinuous(density_vel_x, density_vel_x_neighbor, true);
-    DiscontinuousFunc<double> density_vel_y_discontinuous(density_vel_y, density_vel_y_neighbor, true);
-    DiscontinuousFunc<double> energy_discontinuous(energy, energy_neighbor, true);
-
-    for (int point_i = 0; point_i < np; point_i++) {
-      result[0] += jwt[point_i] * std::abs(density_discontinuous.val[point_i] - density_discontinuous.val_neighbor[point_i]);
-      result[1] += jwt[point_i] * std::abs(density_vel_x_discontinuous.val[point_i] - density_vel_x_discontinuous.val_neighbor[point_i]);
-      result[2] += jwt[point_i] * std::abs(density_vel_y_discontinuous.val[point_i] - density_vel_y_discontinuous.val_neighbor[point_i]);
-      result[3] += jwt[point_i] * std::abs(energy_discontinuous.val[point_i] - energy_discontinuous.val_neighbor[point_i]);
-    }
-
-    delete geom;
-    delete[] jwt;
-
-    delete density;
-    delete density_vel_x;
-    delete density_vel_y;
-    delete energy;
-    delete density_neighbor;
-    delete density_vel_x_neighbor;
-    delete density_vel_y_neighbor;
-    delete energy_neighbor;
-  }
-
-  result[0] = std::abs(result[0]);
-  result[1] = std::abs(result[1]);
-  result[2] = std::abs(result[2]);
-  result[3] = std::abs(result[3]);
-};
+      if (inflow < 0 && norm >= 1E-8 && jump / (h_indicators[element_i] * edge_lengths[edge_i] * norm) > threshold)
+        discontinuous = 1;
+    }
+    discontinuous_flags[element_ids[element_i]] = discontinuous;
+  }
 
-void KrivodonovaDiscontinuityDetector::calculate_norms(Element* e, int edge_i, double result[4])
-{
-  // Set active element to the solutions.
-  solutions[0]->set_active_element(e);
-  solutions[1]->set_active_element(e);
-  solutions[2]->set_active_element(e);
-  solutions[3]->set_active_element(e);
-
-  // The values to be returned.
-  result[0] = 0.0;
-  result[1] = 0.0;
-  result[2] = 0.0;
-  result[3] = 0.0;
-
-  // Set Geometry.
-  SurfPos surf_pos;
-  surf_pos.marker = e->marker;
-  surf_pos.surf_num = edge_i;
-
-  int eo = solutions[0]->get_quad_2d()->get_edge_points(surf_pos.surf_num, 8, e->get_mode());
-  double3* pt = solutions[0]->get_quad_2d()->get_points(eo, e->get_mode());
-  int np = solutions[0]->get_quad_2d()->get_num_points(eo, e->get_mode());
-
-  double3* tan;
-  GeomSurf<double>* geom = init_geom_surf(solutions[0]->get_refmap(), surf_pos.surf_num, surf_pos.marker, eo, tan);
-  double* jwt = new double[np];
-  for (int i = 0; i < np; i++)
-    jwt[i] = pt[i][2] * tan[i][2];
-
-  // Calculate.
-  Func<double>* density = init_fn(solutions[0].get(), eo);
-  Func<double>* density_vel_x = init_fn(solutions[1].get(), eo);
-  Func<double>* density_vel_y = init_fn(solutions[2].get(), eo);
-  Func<double>* energy = init_fn(solutions[3].get(), eo);
-
-  for (int point_i = 0; point_i < np; point_i++) {
-    result[0] = std::max(result[0], std::abs(density->val[point_i]));
-    result[1] = std::max(result[1], std::abs(density_vel_x->val[point_i]));
-    result[2] = std::max(result[2], std::abs(density_vel_y->val[point_i]));
-    result[3] = std::max(result[3], std::abs(energy->val[point_i]));
-  }
-
-  delete geom;
-  delete[] jwt;
-
-  delete density;
-  delete density_vel_x;
-  delete density_vel_y;
-  delete energy;
+  discontinuous_element_ids.clear();
+  for (int element_i = 0; element_i < num_elements; element_i++)
+    if (discontinuous_flags[element_ids[element_i]])
+      discontinuous_element_ids.insert(discontinuous_element_ids.end(), element_ids[element_i]);
+  return discontinuous_element_ids;
 };
 
 KuzminDiscontinuityDetector::KuzminDiscontinuityDetector(std::vector<SpaceSharedPtr<double>  > spaces,
@@ -1015,24 +4116,25 @@ void KuzminDiscontinuityDetector::find_alpha_i_second_order_real(Hermes::Hermes2
     }
 }
 
-FluxLimiter::FluxLimiter(FluxLimiter::LimitingType type, double* solution_vector, std::vector<SpaceSharedPtr<double>  > spaces, bool Kuzmin_limit_all_orders_independently) : solution_vector(solution_vector), spaces(spaces), limitOscillations(false)
+FluxLimiter::FluxLimiter(FluxLimiter::LimitingType type, double* solution_vector, std::vector<SpaceSharedPtr<double>  > spaces, bool Kuzmin_limit_all_orders_independently) : solution_vector(solution_vector), spaces(spaces), limitOscillations(false), limited_solutions_up_to_date(false)
 {
   for (unsigned int sol_i = 0; sol_i < spaces.size(); sol_i++)
     limited_solutions.push_back(new Hermes::Hermes2D::Solution<double>(spaces[sol_i]->get_mesh()));
 
-  Solution<double>::vector_to_solutions(solution_vector, spaces, limited_solutions);
   switch (type)
   {
   case Krivodonova:
-    this->detector = new KrivodonovaDiscontinuityDetector(spaces, limited_solutions);
+    this->detector = new KrivodonovaDiscontinuityDetector(spaces, solution_vector);
     break;
   case Kuzmin:
+    Solution<double>::vector_to_solutions(solution_vector, spaces, limited_solutions);
+    this->limited_solutions_up_to_date = true;
     this->detector = new KuzminDiscontinuityDetector(spaces, limited_solutions, Kuzmin_limit_all_orders_independently);
     break;
   }
 };
 
-FluxLimiter::FluxLimiter(FluxLimiter::LimitingType type, std::vector<MeshFunctionSharedPtr<double> > solutions, std::vector<SpaceSharedPtr<double>  > spaces, bool Kuzmin_limit_all_orders_independently) : spaces(spaces), limitOscillations(false)
+FluxLimiter::FluxLimiter(FluxLimiter::LimitingType type, std::vector<MeshFunctionSharedPtr<double> > solutions, std::vector<SpaceSharedPtr<double>  > spaces, bool Kuzmin_limit_all_orders_independently) : spaces(spaces), limitOscillations(false), limited_solutions_up_to_date(true)
 {
   for (unsigned int sol_i = 0; sol_i < spaces.size(); sol_i++)
     limited_solutions.push_back(new Hermes::Hermes2D::Solution<double>(spaces[sol_i]->get_mesh()));
@@ -1046,7 +4148,7 @@ FluxLimiter::FluxLimiter(FluxLimiter::LimitingType type, std::vector<MeshFunctio
   switch (type)
   {
   case Krivodonova:
-    this->detector = new KrivodonovaDiscontinuityDetector(spaces, limited_solutions);
+    this->detector = new KrivodonovaDiscontinuityDetector(spaces, solution_vector);
     break;
   case Kuzmin:
     this->detector = new KuzminDiscontinuityDetector(spaces, limited_solutions, Kuzmin_limit_all_orders_independently);
@@ -1061,26 +4163,55 @@ FluxLimiter::~FluxLimiter()
 
 void FluxLimiter::get_limited_solutions(std::vector<MeshFunctionSharedPtr<double> > solutions_to_limit)
 {
+  if (!this->limited_solutions_up_to_date)
+  {
+    Solution<double>::vector_to_solutions(solution_vector, spaces, limited_solutions);
+    this->limited_solutions_up_to_date = true;
+  }
   for (unsigned int i = 0; i < solutions_to_limit.size(); i++)
     solutions_to_limit[i]->copy(this->limited_solutions[i]);
 }
 
+void FluxLimiter::set_solution_vector(double* solution_vector, std::vector<SpaceSharedPtr<double> > spaces)
+{
+  this->solution_vector = solution_vector;
+  if (spaces != std::vector<SpaceSharedPtr<double> >())
+    this->spaces = spaces;
+
+  KrivodonovaDiscontinuityDetector* krivodonova_detector = dynamic_cast<KrivodonovaDiscontinuityDetector*>(this->detector);
+  if (krivodonova_detector)
+  {
+    krivodonova_detector->set_solution_vector(solution_vector);
+    krivodonova_detector->set_spaces(this->spaces);
+    this->limited_solutions_up_to_date = false;
+  }
+  else
+  {
+    // Kuzmin's detector works on the solutions.
+    Solution<double>::vector_to_solutions(solution_vector, this->spaces, limited_solutions);
+    this->limited_solutions_up_to_date = true;
+    bool Kuzmin_limit_all_orders_independently = static_cast<KuzminDiscontinuityDetector*>(this->detector)->get_limit_all_orders_independently();
+    delete detector;
+    this->detector = new KuzminDiscontinuityDetector(this->spaces, limited_solutions, Kuzmin_limit_all_orders_independently);
+  }
+}
+
 int FluxLimiter::limit_according_to_detector(std::vector<SpaceSharedPtr<double> > coarse_spaces_to_limit)
 {
-  std::set<int> discontinuous_elements = this->detector->get_discontinuous_element_ids();
-  std::set<std::pair<int, double> > oscillatory_element_idsRho = this->detector->get_oscillatory_element_idsRho();
-  std::set<std::pair<int, double> > oscillatory_element_idsRhoVX = this->detector->get_oscillatory_element_idsRhoVX();
-  std::set<std::pair<int, double> > oscillatory_element_idsRhoVY = this->detector->get_oscillatory_element_idsRhoVY();
-  std::set<std::pair<int, double> > oscillatory_element_idsRhoE = this->detector->get_oscillatory_element_idsRhoE();
+  std::set<int>& discontinuous_elements = this->detector->get_discontinuous_element_ids();
+  std::set<std::pair<int, double> >& oscillatory_element_idsRho = this->detector->get_oscillatory_element_idsRho();
+  std::set<std::pair<int, double> >& oscillatory_element_idsRhoVX = this->detector->get_oscillatory_element_idsRhoVX();
+  std::set<std::pair<int, double> >& oscillatory_element_idsRhoVY = this->detector->get_oscillatory_element_idsRhoVY();
+  std::set<std::pair<int, double> >& oscillatory_element_idsRhoE = this->detector->get_oscillatory_element_idsRhoE();
 
   // First adjust the solution_vector.
   int running_dofs = 0;
+  AsmList<double> al;
   for (unsigned int space_i = 0; space_i < spaces.size(); space_i++)
   {
     for (std::set<int>::iterator it = discontinuous_elements.begin(); it != discontinuous_elements.end(); it++)
     {
       Element* e = spaces[space_i]->get_mesh()->get_element(*it);
-      AsmList<double> al;
       spaces[space_i]->get_element_assembly_list(spaces[space_i]->get_mesh()->get_element(*it), &al);
       for (unsigned int shape_i = 0; shape_i < al.get_cnt(); shape_i++)
         if (H2D_GET_H_ORDER(spaces[space_i]->get_shapeset()->get_order(al.get_idx()[shape_i], e->get_mode())) > 0 || H2D_GET_V_ORDER(spaces[space_i]->get_shapeset()->get_order(al.get_idx()[shape_i], e->get_mode())) > 0)
@@ -1145,8 +4276,8 @@ int FluxLimiter::limit_according_to_detector(std::vector<SpaceSharedPtr<double>
     }
   }
 
-  // Now adjust the solutions.
-  Solution<double>::vector_to_solutions(solution_vector, spaces, limited_solutions);
+  // The solutions are adjusted when they are asked for.
+  this->limited_solutions_up_to_date = false;
 
   if (coarse_spaces_to_limit != std::vector<SpaceSharedPtr<double> >())
   {
@@ -1210,6 +4341,7 @@ void FluxLimiter::limit_second_orders_according_to_detector(std::vector<SpaceSha
   }
   // Now adjust the solutions.
   Solution<double>::vector_to_solutions(solution_vector, spaces, limited_solutions);
+  this->limited_solutions_up_to_date = true;
   if (dynamic_cast<KuzminDiscontinuityDetector*>(this->detector))
   {
     bool Kuzmin_limit_all_orders_independently = dynamic_cast<KuzminDiscontinuityDetector*>(this->detector)->get_limit_all_orders_independently();
@@ -1217,10 +4349,7 @@ void FluxLimiter::limit_second_orders_according_to_detector(std::vector<SpaceSha
     this->detector = new KuzminDiscontinuityDetector(spaces, limited_solutions, Kuzmin_limit_all_orders_independently);
   }
   else
-  {
-    delete detector;
-    this->detector = new KrivodonovaDiscontinuityDetector(spaces, limited_solutions);
-  }
+    static_cast<KrivodonovaDiscontinuityDetector*>(this->detector)->set_solution_vector(solution_vector);
 
   if (coarse_spaces_to_limit != std::vector<SpaceSharedPtr<double> >()) {
     // Now set the element order to zero.
@@ -1256,29 +4385,105 @@ void FluxLimiter::limit_second_orders_according_to_detector(std::vector<SpaceSha
   }
 };
 
+FeistauerShockIndicator::FeistauerShockIndicator() : mesh_seq(-1), space_seq(-1)
+{
+}
+
+void FeistauerShockIndicator::update(SpaceSharedPtr<double> density_space)
+{
+  MeshSharedPtr mesh = density_space->get_mesh();
+  if (mesh->get_seq() == this->mesh_seq && density_space->get_seq() == this->space_seq)
+    return;
+  this->mesh_seq = mesh->get_seq();
+  this->space_seq = density_space->get_seq();
+
+  element_ids.clear();
+  scales.clear();
+  element_point_offsets.clear();
+  point_weights.clear();
+  trace_offsets.clear();
+  trace_dofs.clear();
+  trace_values.clear();
+
+  // The inner edge points are those of the geometry of the mesh.
+  std::shared_ptr<const MeshGeometry> mesh_geometry = MeshGeometry::get(mesh);
+  const MeshGeometry& geometry = *mesh_geometry;
+  trace_offsets.push_back(0);
+  for (int element_i = 0; element_i < geometry.get_num_elements(); element_i++)
+  {
+    Element* e = mesh->get_element(geometry.element_ids[element_i]);
+    element_ids.push_back(e->id);
+    scales.push_back(1. / (geometry.diameter[element_i] * std::pow(geometry.area[element_i], 0.75)));
+    element_point_offsets.push_back(point_weights.size());
+
+    for (int point_i = geometry.point_offsets[geometry.edge_offsets[element_i]]; point_i < geometry.point_offsets[geometry.edge_offsets[element_i + 1]]; point_i++)
+    {
+      double x = geometry.point_x[point_i], y = geometry.point_y[point_i];
+      point_weights.push_back(geometry.point_weight[point_i]);
+      add_shape_function_values(density_space, e, x, y, trace_dofs, trace_values);
+      trace_offsets.push_back(trace_dofs.size());
+      add_shape_function_values(density_space, mesh->get_element(geometry.point_neighbor_ids[point_i]), x, y, trace_dofs, trace_values);
+      trace_offsets.push_back(trace_dofs.size());
+    }
+  }
+  element_point_offsets.push_back(point_weights.size());
+
+  flags.assign(mesh->get_max_element_id() + 1, 0);
+}
+
+void FeistauerShockIndicator::calculate(SpaceSharedPtr<double> density_space, const double* sln_vector)
+{
+  update(density_space);
+  std::fill(flags.begin(), flags.end(), 0);
+  if (!sln_vector)
+    return;
+
+  int num_elements = element_ids.size();
+#pragma omp parallel for
+  for (int element_i = 0; element_i < num_elements; element_i++)
+  {
+    double indicator = 0.;
+    for (int point_i = element_point_offsets[element_i]; point_i < element_point_offsets[element_i + 1]; point_i++)
+    {
+      double jump = 0.;
+      for (int k = trace_offsets[2 * point_i]; k < trace_offsets[2 * point_i + 1]; k++)
+        jump += sln_vector[trace_dofs[k]] * trace_values[k];
+      for (int k = trace_offsets[2 * point_i + 1]; k < trace_offsets[2 * point_i + 2]; k++)
+        jump -= sln_vector[trace_dofs[k]] * trace_values[k];
+      indicator += point_weights[point_i] * jump * jump;
+    }
+    flags[element_ids[element_i]] = (indicator * scales[element_i] >= 1.) ? 1 : 0;
+  }
+}
+
 void MachNumberFilter::filter_fn(int n, const std::vector<const double*>& values, double* result)
 {
+  const double* rho = values.at(0), *rho_v_x = values.at(1), *rho_v_y = values.at(2), *energy = values.at(3);
   for (int i = 0; i < n; i++)
-    result[i] = std::sqrt((values.at(1)[i] / values.at(0)[i])*(values.at(1)[i] / values.at(0)[i]) + (values.at(2)[i] / values.at(0)[i])*(values.at(2)[i] / values.at(0)[i]))
-    / std::sqrt(kappa * QuantityCalculator::calc_pressure(values.at(0)[i], values.at(1)[i], values.at(2)[i], values.at(3)[i], kappa) / values.at(0)[i]);
+    result[i] = std::sqrt((rho_v_x[i] / rho[i])*(rho_v_x[i] / rho[i]) + (rho_v_y[i] / rho[i])*(rho_v_y[i] / rho[i]))
+    / std::sqrt(kappa * QuantityCalculator::calc_pressure(rho[i], rho_v_x[i], rho_v_y[i], energy[i], kappa) / rho[i]);
 }
 
 void PressureFilter::filter_fn(int n, const std::vector<const double*>& values, double* result)
 {
+  const double* rho = values.at(0), *rho_v_x = values.at(1), *rho_v_y = values.at(2), *energy = values.at(3);
+#pragma omp simd
   for (int i = 0; i < n; i++)
-    result[i] = (kappa - 1.) * (values.at(3)[i] - (values.at(1)[i] * values.at(1)[i] + values.at(2)[i] * values.at(2)[i]) / (2 * values.at(0)[i]));
+    result[i] = (kappa - 1.) * (energy[i] - (rho_v_x[i] * rho_v_x[i] + rho_v_y[i] * rho_v_y[i]) / (2 * rho[i]));
 }
 
 void VelocityFilter::filter_fn(int n, const std::vector<const double*>& values, double* result)
 {
+  const double* rho = values.at(0), *rho_v = values.at(1);
+#pragma omp simd
   for (int i = 0; i < n; i++)
-    result[i] = values.at(1)[i] / values.at(0)[i];
+    result[i] = rho_v[i] / rho[i];
 }
 
 void EntropyFilter::filter_fn(int n, const std::vector<const double*>& values, double* result)
 {
+  const double* rho = values.at(0), *rho_v_x = values.at(1), *rho_v_y = values.at(2), *energy = values.at(3);
   for (int i = 0; i < n; i++)
-    for (int i = 0; i < n; i++)
-      result[i] = std::log((QuantityCalculator::calc_pressure(values.at(0)[i], values.at(1)[i], values.at(2)[i], values.at(3)[i], kappa) / p_ext)
-      / Hermes::pow((values.at(0)[i] / rho_ext), kappa));
-}
\ No newline at end of file
+    result[i] = std::log((QuantityCalculator::calc_pressure(rho[i], rho_v_x[i], rho_v_y[i], energy[i], kappa) / p_ext)
+    / Hermes::pow((rho[i] / rho_ext), kappa));
+}
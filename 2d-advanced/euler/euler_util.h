@@ -2,6 +2,12 @@
 #define EULER_UTIL_H
 
 #include "hermes2d.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 using namespace Hermes;
 using namespace Hermes::Hermes2D;
@@ -20,6 +26,108 @@ public:
   static double calc_sound_speed(double rho, double rho_v_x, double rho_v_y, double energy, double kappa);
 };
 
+// Geometry of the active elements of a mesh, shared by the time step calculations, the discontinuity detectors and the shock indicator:
+// the areas and diameters of the elements, their edges with the outer normals, and quadrature points on the inner edges, split into
+// the parts shared with the neighbors. Straight elements are calculated from the vertices, curved ones (e.g. the arcs of joukowski-profile)
+// through their RefMap. The geometry is calculated once per mesh and only again after the mesh changed (refinement).
+class MeshGeometry
+{
+public:
+  MeshGeometry();
+
+  // The geometry of the mesh in its current state, shared by all callers. The geometries of the last few meshes are kept,
+  // a caller holding the pointer keeps its geometry alive regardless.
+  static std::shared_ptr<const MeshGeometry> get(MeshSharedPtr mesh);
+
+  int get_num_elements() const { return (int)element_ids.size(); }
+
+  // Ids of the elements, element_ids[element_i] is the id of the element_i-th active element, element_indices[id] is element_i (-1 if not active).
+  std::vector<int> element_ids;
+  std::vector<int> element_indices;
+  std::vector<double> area;
+  std::vector<double> diameter;
+
+  // Edges of the element_i-th element are edge_offsets[element_i], ..., edge_offsets[element_i + 1] - 1, in the order of the element's edges.
+  // The normal of an edge is its mean outer normal.
+  std::vector<int> edge_offsets;
+  std::vector<char> edge_boundary;
+  std::vector<double> edge_length;
+  std::vector<double> edge_nx;
+  std::vector<double> edge_ny;
+  // Outer normals along the edge_i-th edge are edge_normal_offsets[edge_i], ..., edge_normal_offsets[edge_i + 1] - 1,
+  // one for a straight edge, one per quadrature point for a curved one.
+  std::vector<int> edge_normal_offsets;
+  std::vector<double> normal_x;
+  std::vector<double> normal_y;
+
+  // Quadrature points of the edge_i-th edge (inner edges only) are point_offsets[edge_i], ..., point_offsets[edge_i + 1] - 1.
+  // Per point: the physical coordinates, the weight (the edge length included), the outer normal and the id of the neighbor it lies on.
+  std::vector<int> point_offsets;
+  std::vector<double> point_x;
+  std::vector<double> point_y;
+  std::vector<double> point_weight;
+  std::vector<double> point_nx;
+  std::vector<double> point_ny;
+  std::vector<int> point_neighbor_ids;
+
+protected:
+  void build(MeshSharedPtr mesh);
+  void add_straight_edge(MeshSharedPtr mesh, Element* e, int edge_i, double orientation);
+  void add_curved_edge(MeshSharedPtr mesh, Element* e, int edge_i, RefMap* refmap, RefMap* neighbor_refmap);
+  void add_point(double x, double y, double weight, double nx, double ny, int neighbor_id);
+
+  int mesh_seq;
+};
+
+// Element data needed by the time step calculations (CFL, ADE), gathered once per mesh and spaces and reused in all time steps.
+// The element means of a DG solution are read from the coefficient vector directly: where the other shape functions have zero mean
+// (order 0, or L2ShapesetLegendre on an affine quad), the mean is the coefficient of the constant shape function (the first one
+// in the element assembly list of an L2 space). Otherwise the mean is the sum of all coefficients weighted by the means of their
+// shape functions, which are integrated through RefMap once per mesh and spaces.
+// The geometry of the elements is the shared MeshGeometry of the mesh.
+class ElementMeanCache
+{
+public:
+  ElementMeanCache();
+
+  // Rebuilds the data if the mesh or any of the spaces changed since the last call.
+  void update(const std::vector<SpaceSharedPtr<double> >& spaces);
+
+  int get_num_elements() const { return geometry->get_num_elements(); }
+
+  // Geometry of the mesh of the spaces in the last update(), element_i is the index of the active element there.
+  const MeshGeometry& get_geometry() const { return *geometry; }
+
+  // Mean of the component-th quantity over the element_i-th active element.
+  // Where the mean is a single coefficient (always for finite volumes, i.e. order 0): mean = weight * sln_vector[dof].
+  void get_mean_coefficient(int element_i, int component, int& dof, double& weight) const
+  {
+    int k = mean_offsets[element_i * num_components + component];
+    dof = mean_dofs[k];
+    weight = mean_weights[k];
+  }
+
+  double get_mean(const double* sln_vector, int element_i, int component) const
+  {
+    int entry = element_i * num_components + component;
+    double mean = 0.;
+    for (int k = mean_offsets[entry]; k < mean_offsets[entry + 1]; k++)
+      mean += mean_weights[k] * sln_vector[mean_dofs[k]];
+    return mean;
+  }
+
+protected:
+  std::shared_ptr<const MeshGeometry> geometry;
+  int num_components;
+  // Positions of the coefficients in the coefficient vector and their weights in the mean, for the entry element_i * num_components
+  // + component they are those from mean_offsets[entry] to mean_offsets[entry + 1] (a single one - the constant mode - where possible).
+  std::vector<int> mean_offsets;
+  std::vector<int> mean_dofs;
+  std::vector<double> mean_weights;
+  int mesh_seq;
+  std::vector<int> space_seqs;
+};
+
 class CFLCalculation
 {
 public:
@@ -29,11 +137,25 @@ public:
   void calculate(std::vector<MeshFunctionSharedPtr<double> > solutions, MeshSharedPtr mesh, double & time_step) const;
   void calculate_semi_implicit(std::vector<MeshFunctionSharedPtr<double> > solutions, MeshSharedPtr mesh, double & time_step) const;
 
+  // The same, with the solutions given by their coefficient vector in the (L2) spaces, typically the solver's one.
+  // No projection is done, and apart from the first call (or a call after the mesh changes) nothing is allocated.
+  void calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step);
+  void calculate_semi_implicit(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step);
+
+  // Local time steps (e.g. pseudo time steps towards a steady state): every element gets the time step its own condition allows,
+  // element_time_steps[id] for the element with the given id.
+  void calculate_local_semi_implicit(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, std::vector<double>& element_time_steps);
+
   void set_number(double new_CFL_number);
+  double get_number() const { return CFL_number; }
   
 protected:
+  // The time step the CFL condition of calculate_semi_implicit() allows in the element_i-th element of element_means.
+  double element_time_step_semi_implicit(const double* sln_vector, int element_i) const;
+
   double CFL_number;
   double kappa;
+  ElementMeanCache element_means;
 };
 
 class ADEStabilityCalculation
@@ -43,11 +165,304 @@ public:
 
   // If the time step is necessary to decrease / possible to increase, the value time_step will be rewritten.
   void calculate(std::vector<MeshFunctionSharedPtr<double> > solutions, MeshSharedPtr mesh, double & time_step);
+
+  // The same, with the solutions (density, density * velocity) given by their coefficient vector in the (L2) spaces.
+  // See CFLCalculation::calculate().
+  void calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, double & time_step);
   
 protected:
   double AdvectionRelativeConstant;
   double DiffusionRelativeConstant;
   double epsilon;
+  ElementMeanCache element_means;
+};
+
+// Explicit strong-stability-preserving Runge-Kutta time stepping (order 2 or 3, in the Shu-Osher form) of a DG discretization.
+// The weak form wf is the residual R(w) in M dw/dt = R(w) (see EulerEquationsWeakFormExplicit), evaluated on the ext functions ext_slns.
+// The mass matrix M of L2 spaces is block diagonal, its inverse blocks are calculated once per mesh (and spaces) and cached,
+// so a stage is just an assembling of R and a block-diagonal multiplication - no matrix is assembled or factorized.
+class SSPRungeKutta
+{
+public:
+  SSPRungeKutta(WeakFormSharedPtr<double> wf, std::vector<SpaceSharedPtr<double> > spaces, std::vector<MeshFunctionSharedPtr<double> > ext_slns, int order = 3);
+  ~SSPRungeKutta();
+
+  // Advances sln_vector (the coefficients of the solution in the spaces) by time_step.
+  // ext_slns are used for the stages, on return they hold the last stage, not the new solution.
+  void step(double* sln_vector, double time_step);
+
+  // For new (e.g. reference) spaces, the inverse mass matrix is then recalculated in the next step.
+  // Nothing is done for the same, unchanged spaces.
+  void set_spaces(std::vector<SpaceSharedPtr<double> > spaces);
+
+protected:
+  // (Re)calculates the inverse mass matrix blocks if the spaces changed.
+  void update_inverse_mass_matrix();
+
+  // result = M^-1 R(sln_vector).
+  void calculate_derivative(double* sln_vector, double* result);
+
+  WeakFormSharedPtr<double> wf;
+  std::vector<SpaceSharedPtr<double> > spaces;
+  std::vector<MeshFunctionSharedPtr<double> > ext_slns;
+  int order;
+
+  DiscreteProblem<double>* dp;
+  Vector<double>* residual;
+
+  // Work vectors, reallocated only if the number of dofs changes.
+  int ndof;
+  double* initial_vector;
+  double* residual_vector;
+  double* derivative;
+
+  // The blocks, one per element and space: the dofs of the block_i-th block are
+  // block_dofs[block_dof_offsets[block_i]], ..., block_dofs[block_dof_offsets[block_i + 1] - 1]
+  // and its inverse (row by row) starts at inverse_blocks[block_offsets[block_i]].
+  std::vector<int> block_dof_offsets;
+  std::vector<int> block_dofs;
+  std::vector<int> block_offsets;
+  std::vector<double> inverse_blocks;
+  // Id of the element of the block_i-th block.
+  std::vector<int> block_element_ids;
+  std::vector<int> space_seqs;
+};
+
+// The fluxes of the weak form of a LocalTimeStepping, for finite volume (order 0) spaces: the states are constant on the elements
+// and the residual of an element is its flux balance, so a substep evaluates only the elements (and interfaces) active in it,
+// directly on the MeshGeometry, instead of assembling the residual over the whole mesh. They have to be the fluxes of the forms
+// (EulerEquationsWeakFormExplicit implements this).
+class LocalTimeSteppingFluxes
+{
+public:
+  virtual ~LocalTimeSteppingFluxes() {}
+
+  // The numerical flux through an inner edge with the outer normal (nx, ny), w_L the state of the element, w_R of the neighbor.
+  virtual void interface_flux(double result[4], double w_L[4], double w_R[4], double nx, double ny) = 0;
+
+  // The boundary condition (an index passed to boundary_flux()) on the boundary marker, -1 if there is none (no flux).
+  virtual int boundary_condition(const std::string& marker) const = 0;
+
+  // The flux through a boundary edge with the boundary condition.
+  virtual void boundary_flux(double result[4], double w_L[4], double nx, double ny, int condition) = 0;
+};
+
+// Local (multirate) time stepping with the explicit Euler method, for meshes where a few small elements would dictate
+// a tiny global time step. Every element gets a level l, 0 <= l < num_levels, from its own CFL condition and is advanced
+// by time_step / 2^l, so that the elements of the finest level make 2^(num_levels - 1) substeps in one (global) time step.
+// An interface is evaluated whenever the finer of its two elements starts a step, with that element's time step,
+// and these contributions are accumulated on both sides - a coarse element is updated at the end of its step
+// with the sum of the fluxes its finer neighbors saw, so the scheme stays conservative.
+// For finite volume spaces (on meshes with straight boundary edges) and a weak form implementing LocalTimeSteppingFluxes,
+// a substep evaluates only the elements starting a step in it and their neighbors, so the fine levels do not cost
+// the traversal of the whole mesh. Otherwise every substep assembles the weak form, which has to weight its terms
+// by element_weight() / interface_weight() (EulerEquationsWeakFormExplicit does that after set_local_time_stepping());
+// a term with a zero weight is not evaluated in the current substep.
+// The method is first order in time, it is meant for the finite volume (P_INIT = 0) computations.
+class LocalTimeStepping : public SSPRungeKutta
+{
+public:
+  LocalTimeStepping(WeakFormSharedPtr<double> wf, std::vector<SpaceSharedPtr<double> > spaces, std::vector<MeshFunctionSharedPtr<double> > ext_slns,
+    double CFL_number, double kappa, int num_levels = 4);
+  ~LocalTimeStepping();
+
+  // Assigns the levels according to the CFL condition of the current sln_vector and advances it by one global time step,
+  // which is returned in time_step.
+  void step(double* sln_vector, double & time_step);
+
+  // Weight (time step) of the volume and boundary terms of the element in the current substep, zero if the element does not start a step now.
+  double element_weight(int element_id) const
+  {
+    return get_weight(levels[element_id]);
+  }
+
+  // Weight of the interface between the two elements in the current substep.
+  double interface_weight(int element_id, int neighbor_id) const
+  {
+    return get_weight(std::max(levels[element_id], levels[neighbor_id]));
+  }
+
+  int get_level(int element_id) const { return levels[element_id]; }
+
+protected:
+  double get_weight(int level) const
+  {
+    return (substep % (1 << (num_levels - 1 - level)) == 0) ? global_time_step / (1 << level) : 0.;
+  }
+
+  // Sets the levels and global_time_step, and the elements evaluated in the substeps.
+  void update_levels(const double* sln_vector);
+
+  // Adds the residual of the current substep to accumulated, evaluated directly on the elements active in it (substep_fluxes).
+  void add_substep_residual(const double* sln_vector);
+
+  double CFL_number;
+  double kappa;
+  int num_levels;
+  ElementMeanCache element_means;
+
+  // Level of the element with the given id.
+  std::vector<int> levels;
+  double global_time_step;
+  int substep;
+
+  // The weighted residuals not yet applied, per dof.
+  double* accumulated;
+  int accumulated_size;
+
+  // The fluxes of the weak form if the substeps are evaluated directly (finite volumes), NULL otherwise.
+  LocalTimeSteppingFluxes* substep_fluxes;
+  // The elements (indices in the geometry) sorted by the finest level among them and their neighbors, from the finest one:
+  // a substep where the levels l and finer start a step evaluates the first substep_element_counts[l] of them.
+  std::vector<int> substep_elements;
+  std::vector<int> substep_element_counts;
+  // The boundary condition on the edge_i-th edge of the geometry, for the mesh with the seq edge_conditions_seq.
+  std::vector<int> edge_conditions;
+  int edge_conditions_seq;
+};
+
+// Implicit (backward Euler) time stepping of the DG discretization M dw/dt = R(w) by the Jacobian-free Newton-Krylov method,
+// meant for steady states, where very large time steps can be taken (with time_step -> infinity it is Newton's method for R(w) = 0).
+// Each step solves G(w) = w - w_0 - time_step * M^-1 R(w) = 0, the residual R is the weak form wf as in SSPRungeKutta.
+// The time step may also be local (pseudo time stepping), a diagonal matrix with one time step per element.
+// The Jacobian of G is never assembled, its products with a vector are finite differences of G, and the linear systems
+// are solved by restarted GMRES. GMRES is right-preconditioned by the element blocks (all components of an element together)
+// of the semi-implicit matrix wf_preconditioner (EulerEquationsWeakFormSemiImplicit), i.e. of the linearized step,
+// assembled and factorized once per step. Both weak forms are evaluated on ext_slns, all spaces have to be on one mesh.
+class NewtonKrylovSolver : public SSPRungeKutta
+{
+public:
+  NewtonKrylovSolver(WeakFormSharedPtr<double> wf, WeakFormSharedPtr<double> wf_preconditioner, std::vector<SpaceSharedPtr<double> > spaces,
+    std::vector<MeshFunctionSharedPtr<double> > ext_slns);
+  ~NewtonKrylovSolver();
+
+  // Newton's method stops when the norm of G drops by newton_tolerance, or after max_newton_iterations.
+  // GMRES is restarted after krylov_dimension iterations and stops when the linear residual drops by gmres_tolerance,
+  // or after max_gmres_iterations (in total).
+  void set_tolerances(double newton_tolerance, int max_newton_iterations, double gmres_tolerance, int krylov_dimension = 30, int max_gmres_iterations = 200);
+
+  // Advances sln_vector by one backward Euler step of the size time_step.
+  // Returns false if Newton's method did not converge, sln_vector (and ext_slns) are then restored to the old solution.
+  bool step(double* sln_vector, double time_step);
+
+  // The same with local time steps, element_time_steps[id] for the element with the given id (see CFLCalculation::calculate_local_semi_implicit()).
+  bool step(double* sln_vector, const std::vector<double>& element_time_steps);
+
+  // For new (e.g. reference) spaces.
+  void set_spaces(std::vector<SpaceSharedPtr<double> > spaces);
+
+  // The norm of M^-1 R of the solution at the beginning of the last step, i.e. how far it was from the steady state,
+  // or of its component-th component only (e.g. 0 for the density).
+  double get_steady_residual_norm() const { return steady_residual_norm; }
+  double get_steady_residual_norm(int component) const { return steady_residual_norms[component]; }
+  int get_newton_iterations() const { return newton_iterations; }
+  int get_gmres_iterations() const { return gmres_iterations; }
+
+protected:
+  // The step with the time steps in dof_time_steps.
+  bool solve(double* sln_vector);
+
+  // Assembles the semi-implicit matrix P in the state ext_slns and LU-factorizes the blocks M^-1 P of all elements.
+  // P is linear in the time step, it is assembled with the time step 1 and the rows are then scaled by dof_time_steps.
+  void update_preconditioner();
+
+  // result = (M^-1 P)^-1 vector, element by element.
+  void apply_preconditioner(const double* vector, double* result);
+
+  // result = G(w) = w - w_0 - time_step * M^-1 R(w), M^-1 R(w) is stored in derivative_w.
+  void calculate_function(double* w, double* result, double* derivative_w);
+
+  // result = G'(w) vector, approximately, by a finite difference.
+  void multiply_jacobian(const double* w, const double* derivative_w, const double* vector, double* result);
+
+  // Approximately solves G'(w) dw = rhs by restarted GMRES, returns the number of iterations.
+  int gmres(const double* w, const double* derivative_w, const double* rhs, double* dw);
+
+  WeakFormSharedPtr<double> wf_preconditioner;
+  DiscreteProblem<double>* dp_preconditioner;
+
+  double newton_tolerance;
+  int max_newton_iterations;
+  double gmres_tolerance;
+  int krylov_dimension;
+  int max_gmres_iterations;
+
+  double steady_residual_norm;
+  std::vector<double> steady_residual_norms;
+  int newton_iterations;
+  int gmres_iterations;
+
+  // The state of the step and the work vectors.
+  std::vector<double> dof_time_steps;
+  std::vector<double> old_vector;
+  std::vector<double> function;
+  std::vector<double> derivative_w;
+  std::vector<double> dw;
+  std::vector<double> trial_vector;
+  std::vector<double> trial_function;
+  std::vector<double> trial_derivative;
+  std::vector<double> perturbed;
+  std::vector<double> perturbed_derivative;
+  // The Krylov basis (krylov_dimension + 1 vectors of the size ndof).
+  std::vector<double> basis;
+
+  // The element blocks of the preconditioner: the dofs of the element_i-th one are
+  // element_dofs[element_dof_offsets[element_i]], ..., element_dofs[element_dof_offsets[element_i + 1] - 1],
+  // the LU factors of M^-1 P (row by row) start at element_factors[element_factor_offsets[element_i]],
+  // and the row permutation at element_pivots[element_dof_offsets[element_i]].
+  std::vector<int> element_dof_offsets;
+  std::vector<int> element_dofs;
+  std::vector<int> element_factor_offsets;
+  std::vector<double> element_factors;
+  std::vector<int> element_pivots;
+};
+
+// Vertex-based (Kuzmin) limiting of a linear DG solution of the Euler equations in a single parallel pass over the elements:
+// in every element the conservative variables are limited, then velocity and specific energy (calculated from the limited
+// density) are limited as well and converted back (to first order, which on quads is approximate for the bilinear term).
+// Works in place on the coefficient vector.
+// The mesh data (vertex neighbors, shape function values) and the work buffers are kept until the mesh or the spaces change.
+class PrimitiveVertexBasedLimiter
+{
+public:
+  PrimitiveVertexBasedLimiter();
+
+  void limit(const std::vector<SpaceSharedPtr<double> >& spaces, double* sln_vector);
+
+protected:
+  // Rebuilds the mesh data if the mesh or any of the spaces changed.
+  void update(const std::vector<SpaceSharedPtr<double> >& spaces);
+
+  // Limits the coefficients (the constant one first) so that the vertex values stay within [vertex_min, vertex_max].
+  void limit_coefficients(int element_i, double* coefficients, int field) const;
+
+  // Limited fields: the four conservative variables, then velocity_x, velocity_y and specific energy.
+  static const int num_fields = 7;
+
+  int mesh_seq;
+  std::vector<int> space_seqs;
+  int num_dofs;
+
+  // Per element: the number of shape functions (the same in all spaces), their dofs (num_shapes per component)
+  // starting at dof_offsets[element_i] and their values in the vertices (num_shapes per vertex) starting at vertex_value_offsets[element_i].
+  std::vector<int> num_shapes;
+  std::vector<int> dof_offsets;
+  std::vector<int> dofs;
+  std::vector<int> vertex_value_offsets;
+  std::vector<double> vertex_values;
+  // Value of the constant shape function.
+  std::vector<double> constant_values;
+  // Vertices of the element_i-th element are element_vertices[element_vertex_offsets[element_i]], ...
+  std::vector<int> element_vertex_offsets;
+  std::vector<int> element_vertices;
+  // Elements sharing the vertex_i-th vertex are vertex_elements[vertex_element_offsets[vertex_i]], ...
+  std::vector<int> vertex_element_offsets;
+  std::vector<int> vertex_elements;
+
+  // Work buffers: element means and their minima / maxima over the elements sharing a vertex, num_fields per element / vertex.
+  std::vector<double> means;
+  std::vector<double> vertex_min;
+  std::vector<double> vertex_max;
 };
 
 class DiscontinuityDetector
@@ -84,28 +499,67 @@ class KrivodonovaDiscontinuityDetector : public DiscontinuityDetector
 {
 public:
   /// Constructor.
+  /// The detector works directly on the coefficient vector of the solution in the spaces.
   KrivodonovaDiscontinuityDetector(std::vector<SpaceSharedPtr<double> > spaces, 
-                        std::vector<MeshFunctionSharedPtr<double> > solutions);
+                        const double* solution_vector);
 
   /// Destructor.
    ~KrivodonovaDiscontinuityDetector();
 
+  /// For the next detection (e.g. in the next time step), the edge data are kept as long as the mesh and the spaces are the same.
+  void set_solution_vector(const double* solution_vector);
+  void set_spaces(std::vector<SpaceSharedPtr<double> > spaces);
+
   /// Return a reference to the inner structures.
   std::set<int>& get_discontinuous_element_ids();
   std::set<int>& get_discontinuous_element_ids(double threshold);
 
+  /// The result of the last detection as flags indexed by element id (non-zero for discontinuous elements).
+  const std::vector<char>& get_discontinuous_element_flags() const { return this->discontinuous_flags; }
+
 protected:
-  /// Calculates relative (w.r.t. the boundary edge_i of the Element e).
-  double calculate_relative_flow_direction(Element* e, int edge_i);
+  /// Rebuilds the edge data if the mesh or the spaces changed, the edge points are those of the MeshGeometry of the mesh.
+  void update_edge_data();
 
-  /// Calculates jumps of all solution components across the edge edge_i of the Element e.
-  void calculate_jumps(Element* e, int edge_i, double result[4]);
+  /// Adds the values of the shape functions of the space on the Element e in the physical point (x, y) as a new trace.
+  void add_trace(SpaceSharedPtr<double> space, Element* e, double x, double y);
+
+  /// Value of the trace_i-th trace of the solution.
+  double get_trace_value(int trace_i) const
+  {
+    double value = 0.;
+    for (int k = trace_offsets[trace_i]; k < trace_offsets[trace_i + 1]; k++)
+      value += solution_vector[trace_dofs[k]] * trace_values[k];
+    return value;
+  }
 
   /// Calculates h.
   double calculate_h(Element* e, int polynomial_order);
 
-  /// Calculates the norm of the solution on the central element.
-  void calculate_norms(Element* e, int edge_i, double result[4]);
+  const double* solution_vector;
+
+  /// Edge data, built once per mesh (and spaces).
+  int mesh_seq;
+  std::vector<int> space_seqs;
+  /// Per active element: its id, h, and its inner edges element_edge_offsets[element_i], ..., element_edge_offsets[element_i + 1] - 1.
+  std::vector<int> element_ids;
+  std::vector<double> h_indicators;
+  std::vector<int> element_edge_offsets;
+  /// Per inner edge: its length and its points edge_point_offsets[edge_i], ..., edge_point_offsets[edge_i + 1] - 1.
+  std::vector<double> edge_lengths;
+  std::vector<int> edge_point_offsets;
+  /// Per point: the quadrature weight and the outer normal.
+  std::vector<double> point_weights;
+  std::vector<double> point_nx;
+  std::vector<double> point_ny;
+  /// Four traces per edge point point_i, the traces 4 * point_i, ..., 4 * point_i + 3: the density, density * velocity_x
+  /// and density * velocity_y on the element, and the density on the neighbor.
+  /// The trace_i-th trace is the sum of trace_values[k] * solution_vector[trace_dofs[k]] over k = trace_offsets[trace_i], ..., trace_offsets[trace_i + 1] - 1.
+  std::vector<int> trace_offsets;
+  std::vector<int> trace_dofs;
+  std::vector<double> trace_values;
+
+  std::vector<char> discontinuous_flags;
 };
 
 class KuzminDiscontinuityDetector : public DiscontinuityDetector
@@ -177,15 +631,538 @@ public:
   virtual void limit_second_orders_according_to_detector(std::vector<SpaceSharedPtr<double> > coarse_spaces_to_limit = std::vector<SpaceSharedPtr<double> >());
   
   void get_limited_solutions(std::vector<MeshFunctionSharedPtr<double> > solutions_to_limit);
+
+  /// Re-uses the limiter for another solution vector (typically in the next time step), so that the detector's data
+  /// calculated for the mesh are kept. The spaces are only to be passed if they changed.
+  void set_solution_vector(double* solution_vector, std::vector<SpaceSharedPtr<double> > spaces = std::vector<SpaceSharedPtr<double> >());
+
   bool limitOscillations;
 protected:
   /// Members.
   double* solution_vector;
+  /// limited_solutions are only calculated from solution_vector when they are needed.
+  bool limited_solutions_up_to_date;
   std::vector<SpaceSharedPtr<double> > spaces;
   DiscontinuityDetector* detector;
   std::vector<MeshFunctionSharedPtr<double> > limited_solutions;
 };
 
+// Feistauer's shock indicator: an element K is marked for the artificial viscosity if the integral of the squared density jump
+// over its inner edges, divided by diam(K) * |K|^(3/4), is at least one.
+// It is calculated directly from the coefficient vector of the density in a parallel sweep over the elements,
+// the density traces in the edge points of the MeshGeometry are built once per mesh (and space), as in KrivodonovaDiscontinuityDetector
+// (which keeps four traces per point, here it is only the two densities).
+class FeistauerShockIndicator
+{
+public:
+  FeistauerShockIndicator();
+
+  /// Marks the elements for the density given by sln_vector in density_space, the flags of the previous call are reset.
+  /// Without a coefficient vector (the initial condition, which is continuous), no element is marked.
+  void calculate(SpaceSharedPtr<double> density_space, const double* sln_vector);
+
+  /// Flags indexed by element id of the current mesh (non-zero for the marked elements).
+  const std::vector<char>& get_flags() const { return this->flags; }
+
+protected:
+  /// Rebuilds the edge data if the mesh or the space changed.
+  void update(SpaceSharedPtr<double> density_space);
+
+  int mesh_seq;
+  int space_seq;
+  /// Per active element: its id, 1 / (diam(K) * |K|^(3/4)) and its points element_point_offsets[element_i], ..., element_point_offsets[element_i + 1] - 1.
+  std::vector<int> element_ids;
+  std::vector<double> scales;
+  std::vector<int> element_point_offsets;
+  /// Per point: the quadrature weight, and two traces - the density on the element and on the neighbor.
+  /// The trace_i-th trace is the sum of trace_values[k] * sln_vector[trace_dofs[k]] over k = trace_offsets[trace_i], ..., trace_offsets[trace_i + 1] - 1.
+  std::vector<double> point_weights;
+  std::vector<int> trace_offsets;
+  std::vector<int> trace_dofs;
+  std::vector<double> trace_values;
+
+  std::vector<char> flags;
+};
+
+// Output of the flow quantities of a DG solution for visualization. All quantities are calculated together in one pass over
+// the elements, with the conserved variables evaluated only once per point, and they are written into one VTK file.
+// Every element is split into 4^subdivisions sub-elements (with their points on the curved edges of curved elements), the point values are discontinuous across the elements.
+// The points and the shape function values in them are calculated once per mesh (and spaces).
+class FlowQuantitiesOutput
+{
+public:
+  // The entropy is relative to the reference state (rho_ref, p_ref), see EntropyFilter.
+  FlowQuantitiesOutput(double kappa, int subdivisions = 1, double rho_ref = 1., double p_ref = 1.);
+
+  enum Quantity
+  {
+    Density,
+    VelocityX,
+    VelocityY,
+    Pressure,
+    MachNumber,
+    Entropy,
+    NumQuantities
+  };
+
+  // Calculates all quantities of the solution given by its coefficient vector in the four Euler spaces.
+  void calculate(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector);
+
+  // The same in two steps: set_spaces() reads the mesh and the spaces, calculate() then only needs the coefficient vector
+  // (and may run on another thread, see AsyncFlowQuantitiesOutput).
+  void set_spaces(const std::vector<SpaceSharedPtr<double> >& spaces) { update(spaces); }
+  void calculate(const double* sln_vector);
+  int get_num_dofs() const { return num_dofs; }
+
+  // Writes the last calculated quantities as a (legacy format) VTK unstructured grid, one point data array per quantity.
+  void save_vtk(const char* filename) const;
+
+  // The same as a binary VTU file (appended raw data), the arrays are zlib compressed if compress is set (needs WITH_ZLIB).
+  void save_vtu(const char* filename, bool compress = false) const;
+
+  int get_num_points() const { return (int)point_x.size(); }
+  const double* get_values(Quantity quantity) const { return &quantity_values[quantity * point_x.size()]; }
+  static const char* get_name(Quantity quantity);
+
+protected:
+  // Rebuilds the points and the shape function values if the mesh or any of the spaces changed.
+  void update(const std::vector<SpaceSharedPtr<double> >& spaces);
+
+  double kappa;
+  int subdivisions;
+  double rho_ref;
+  double p_ref;
+
+  int mesh_seq;
+  std::vector<int> space_seqs;
+
+  // Per element: the number of shape functions, their dofs (num_shapes per component) starting at dof_offsets[element_i],
+  // its points element_point_offsets[element_i], ..., element_point_offsets[element_i + 1] - 1,
+  // and the values of the shape functions in them (num_shapes per point) starting at shape_value_offsets[element_i].
+  std::vector<int> num_shapes;
+  std::vector<int> dof_offsets;
+  std::vector<int> dofs;
+  std::vector<int> element_point_offsets;
+  std::vector<int> shape_value_offsets;
+  std::vector<double> shape_values;
+
+  std::vector<double> point_x;
+  std::vector<double> point_y;
+  // Sub-elements: the points of the cell_i-th one are cell_points[cell_offsets[cell_i]], ..., its VTK type is cell_types[cell_i].
+  std::vector<int> cell_offsets;
+  std::vector<int> cell_points;
+  std::vector<int> cell_types;
+
+  // Conserved variables in the points (component-major) and the quantities (quantity-major).
+  std::vector<double> conserved_values;
+  std::vector<double> quantity_values;
+};
+
+// ParaView time series index (.pvd) of the files written in a time loop.
+// Every added file is written to the index immediately, so that the index is valid also when the computation is interrupted.
+class VtkTimeSeries
+{
+public:
+  VtkTimeSeries(const char* filename);
+  ~VtkTimeSeries();
+
+  void add(double time, const char* filename);
+
+protected:
+  FILE* file;
+  // The position of the closing tags, where the next file is written.
+  long end_position;
+};
+
+// FlowQuantitiesOutput writing on a background thread, so that the time loop continues while the files are written.
+// save_vtk() only copies the coefficient vector (and reads the spaces if they changed) and queues the output.
+// At most queue_length outputs are pending, save_vtk() waits for the writer if there are more (backpressure).
+class AsyncFlowQuantitiesOutput
+{
+public:
+  AsyncFlowQuantitiesOutput(double kappa, int queue_length = 2, int subdivisions = 1, double rho_ref = 1., double p_ref = 1.);
+  // Waits for all pending outputs.
+  ~AsyncFlowQuantitiesOutput();
+
+  void save_vtk(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const char* filename);
+
+  // Binary VTU output, see FlowQuantitiesOutput::save_vtu(). If set_time_series() was called, the file is added to the index with the given time.
+  void save_vtu(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const char* filename, double time = 0.);
+
+  // The written VTU files are indexed in the .pvd file filename.
+  void set_time_series(const char* filename);
+  void set_compression(bool compress) { this->compress = compress; }
+
+  // Waits until all queued outputs are written.
+  void wait();
+
+protected:
+  struct Job
+  {
+    int slot;
+    std::string filename;
+    bool vtu;
+    bool compress;
+    double time;
+  };
+
+  void queue(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector, const Job& job);
+  void run();
+
+  // Used by the writer thread.
+  VtkTimeSeries* time_series;
+  bool compress;
+
+  // One output (with its own copy of the points) and coefficient buffer per queue slot, re-used.
+  std::vector<FlowQuantitiesOutput*> outputs;
+  std::vector<std::vector<double> > coefficients;
+  std::deque<int> free_slots;
+  std::deque<Job> jobs;
+  // Number of jobs not yet written, including the one being written.
+  int pending;
+  bool finish;
+
+  std::mutex mutex;
+  std::condition_variable job_added;
+  std::condition_variable job_done;
+  std::thread writer;
+};
+
+// Binary checkpoint of a time dependent computation, so that a long run can be continued.
+// It contains the step number, time, time step, further values of the time stepping (its controllers etc.),
+// and parts added by add(): the refinement tree of the mesh of a set of spaces, their element orders and dof numbering,
+// and the coefficient vector in them.
+// The file is written to a temporary one which then replaces the previous checkpoint, an interrupted write does not destroy it.
+class Checkpoint
+{
+public:
+  // A checkpoint is due every every_nth_step-th step and / or every_n_seconds seconds (zero switches either off).
+  Checkpoint(const char* filename, int every_nth_step, double every_n_seconds = 0.);
+
+  bool is_due(int step) const;
+
+  // Writing: begin(), add() the parts, write().
+  void begin(int step, double time, double time_step, const std::vector<double>& values = std::vector<double>());
+  // The spaces have to be on one mesh, sln_vector (may be NULL) is the coefficient vector in all of them.
+  void add(const std::vector<SpaceSharedPtr<double> >& spaces, const double* sln_vector = NULL);
+  void write();
+
+  // Reading: read() returns false if there is no checkpoint, the parts are then restored in the order they were added.
+  bool read();
+  int get_step() const { return step; }
+  double get_time() const { return time; }
+  double get_time_step() const { return time_step; }
+  const std::vector<double>& get_values() const { return values; }
+  // Refines / unrefines the mesh of the spaces to the saved state, sets the element orders and assigns the dofs.
+  // If a coefficient vector was saved, it is stored into sln_vector (of the size Space::get_num_dofs(spaces)) in the new dof numbering.
+  void restore(const std::vector<SpaceSharedPtr<double> >& spaces, double* sln_vector = NULL);
+
+protected:
+  // Active elements in the order of the refinement trees (independent of the element ids).
+  static void get_active_elements(MeshSharedPtr mesh, std::vector<Element*>& elements);
+  static void get_active_elements(Element* e, std::vector<Element*>& elements);
+  void save_tree(Element* e);
+  void restore_tree(MeshSharedPtr mesh, Element* e);
+
+  template<typename T> void put(const T& value) { const char* bytes = (const char*)&value; buffer.insert(buffer.end(), bytes, bytes + sizeof(T)); }
+  template<typename T> T get();
+
+  std::string filename;
+  int every_nth_step;
+  double every_n_seconds;
+  std::chrono::steady_clock::time_point last_write;
+
+  int step;
+  double time;
+  double time_step;
+  std::vector<double> values;
+
+  std::vector<char> buffer;
+  size_t position;
+};
+
+// Reference mesh (the coarse one refined once) and reference spaces (the coarse orders + order_increase) kept between
+// the adaptivity steps. They are created only once, afterwards only the elements whose coarse counterparts changed
+// are refined / unrefined and only their orders are set.
+// There are two reference meshes and sets of spaces used alternately, so that the solutions on the current ones
+// (e.g. the previous time level solutions) can still be projected onto the updated ones.
+// With refine = false, the reference mesh is a copy of the coarse one, i.e. the solution on it is kept while the coarse
+// spaces are adapted (DetectorAdaptivity).
+class ReferenceSpaceUpdater
+{
+public:
+  ReferenceSpaceUpdater(std::vector<SpaceSharedPtr<double> > coarse_spaces, int order_increase, bool refine = true);
+
+  // Brings the reference mesh and spaces in line with the coarse ones.
+  // Returns false if the coarse mesh and spaces did not change since the last update, the same reference ones are then used.
+  bool update();
+
+  MeshSharedPtr get_ref_mesh() const { return ref_meshes[current]; }
+  const std::vector<SpaceSharedPtr<double> >& get_ref_spaces() const { return ref_spaces[current]; }
+
+protected:
+  // Refines the reference element ref_e of the coarse element coarse_e as the coarse one, or once more if coarse_e is active (and refine is set).
+  void update_tree(MeshSharedPtr ref_mesh, Element* coarse_e, Element* ref_e);
+  // The reference orders of the sons of ref_e (of ref_e itself if refine is not set), a refinement of the active coarse element coarse_e.
+  void set_orders(Element* coarse_e, Element* ref_e);
+
+  std::vector<SpaceSharedPtr<double> > coarse_spaces;
+  int order_increase;
+  bool refine;
+
+  int current;
+  MeshSharedPtr ref_meshes[2];
+  std::vector<SpaceSharedPtr<double> > ref_spaces[2];
+
+  int coarse_mesh_seq;
+  std::vector<int> coarse_space_seqs;
+};
+
+// L2 projection of a solution given by its coefficient vector onto other spaces, element by element for L2 spaces.
+// Their mass matrix is block diagonal, so the global system of OGProjection splits into small systems per element,
+// which are solved in parallel with the Cholesky factors of the element mass matrices, kept as long as the target mesh and spaces are the same.
+// The source and target meshes have to be refinements of the same base mesh with straight elements, the source solution
+// is integrated over the parts of its elements overlapping the target one, so the projection onto coarser elements is exact as well.
+// For other spaces (H1, Hcurl) or curved elements, OGProjection::project_global() is used.
+class LocalProjection
+{
+public:
+  LocalProjection();
+
+  // Projects the solution given by source_vector in source_spaces onto target_spaces (the same number), the coefficients are stored in target_vector.
+  void project(const std::vector<SpaceSharedPtr<double> >& source_spaces, const double* source_vector,
+    const std::vector<SpaceSharedPtr<double> >& target_spaces, double* target_vector);
+
+  // True if the projection between these spaces is done element by element.
+  static bool is_local(const std::vector<SpaceSharedPtr<double> >& source_spaces, const std::vector<SpaceSharedPtr<double> >& target_spaces);
+
+protected:
+  // The part of the base element an element covers, in the reference coordinates of both: x_base = mx * x + tx, y_base = my * y + ty.
+  struct Region
+  {
+    double mx, my, tx, ty;
+  };
+
+  // The shape functions of the active elements in a set of spaces on one mesh, rebuilt if the mesh or any of the spaces changed.
+  struct ElementShapes
+  {
+    ElementShapes() : mesh_seq(-1), num_ids(0), max_order(0) {}
+
+    // Returns false if nothing changed since the last call.
+    bool update(const std::vector<SpaceSharedPtr<double> >& spaces);
+    // The value of the solution given by vector in the space_i-th space, in the reference point (xi, eta) of the element e.
+    double evaluate(int space_i, Element* e, const double* vector, double xi, double eta) const;
+
+    std::vector<SpaceSharedPtr<double> > spaces;
+    int mesh_seq;
+    std::vector<int> space_seqs;
+
+    // The element with the id element_id in the space_i-th space has count[space_i * num_ids + element_id] shape functions,
+    // starting at first[space_i * num_ids + element_id] in idx, coef and dofs. order is its (maximum directional) polynomial order.
+    int num_ids;
+    int max_order;
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<int> order;
+    std::vector<int> idx;
+    std::vector<double> coef;
+    std::vector<int> dofs;
+  };
+
+  // Collects the active target elements with their regions, calculates the element mass matrices and their Cholesky factors.
+  void update_target();
+  void add_elements(Element* e, int base_id, const Region& region);
+  // Adds the integrals of the source solution times the target shape functions over the part of source_e overlapping
+  // the element_i-th target element to rhs, source_e and its descendants are visited recursively.
+  void integrate(int space_i, int element_i, Element* source_e, const Region& source_region, const double* source_vector, double* rhs) const;
+  // The same over the part piece of the base element, where source_e is active.
+  void integrate_piece(int space_i, int element_i, Element* source_e, const Region& source_region, const Region& piece, const double* source_vector, double* rhs) const;
+  // Gauss-Legendre rules (on [-1, 1]) with up to the number of points needed for the given polynomial degree.
+  void add_gauss_rules(int degree);
+  static int get_num_points(int degree) { return (degree + 3) / 2; }
+
+  ElementShapes source;
+  ElementShapes target;
+
+  // The active target elements, the ids of their base elements and their regions in them.
+  std::vector<Element*> elements;
+  std::vector<int> base_ids;
+  std::vector<Region> regions;
+  // The Cholesky factor of the mass matrix of the element_i-th element in the space_i-th space is at factor_offsets[space_i * elements.size() + element_i].
+  std::vector<int> factor_offsets;
+  std::vector<double> factors;
+
+  // The rule with n points is gauss_points[n - 1], gauss_weights[n - 1].
+  std::vector<std::vector<double> > gauss_points;
+  std::vector<std::vector<double> > gauss_weights;
+};
+
+// h/p adaptivity of the coarse spaces driven by the coarse solution alone, without a reference solution.
+// The elements marked by KrivodonovaDiscontinuityDetector are refined (up to max_refinement_level refinements of the elements
+// the spaces were created on) and get one order less. The orders of the other elements are raised / lowered according to
+// the smoothness of the solution: the part of its (squared) L2 norm in the shape functions of the highest degree p, the largest
+// one of the components, times p^4 - for a smooth solution, the coefficients decay at least as 1 / p^4 (Persson, Peraire).
+// A constant solution (p = 0) on an unmarked element is taken as smooth. The orders are the same in all spaces.
+// With ReferenceSpaceUpdater(coarse_spaces, 0, false), the solution is calculated on a copy of the coarse spaces, which are adapted.
+class DetectorAdaptivity
+{
+public:
+  // The orders are adapted between min_order and max_order (-1 for unlimited), min_order == max_order switches the order changes off.
+  DetectorAdaptivity(std::vector<SpaceSharedPtr<double> > spaces, int max_refinement_level, int min_order, int max_order, double detector_threshold = 1.);
+  ~DetectorAdaptivity();
+
+  // The order of an element is raised if its indicator is below increase_threshold, lowered if it is above decrease_threshold.
+  void set_smoothness_thresholds(double increase_threshold, double decrease_threshold);
+
+  // Adapts the spaces to the solution given by sln_vector in them, the orders only if adapt_orders is set (once per time step,
+  // the elements whose orders were changed the last time are skipped, their new highest degree coefficients are not settled yet).
+  // Returns true if nothing changed, as Adapt::adapt().
+  bool adapt(const double* sln_vector, bool adapt_orders = true);
+
+  int get_refined_count() const { return this->refined_count; }
+  int get_order_change_count() const { return this->order_change_count; }
+
+  // The result of the last detection as flags indexed by element id (non-zero for the marked elements).
+  const std::vector<char>& get_discontinuous_element_flags() const { return this->detector->get_discontinuous_element_flags(); }
+
+protected:
+  // The indicator of the solution on the active element e, of order > 0.
+  double calculate_smoothness(Element* e, const double* sln_vector);
+  // The squared L2 norm of the shape function on the reference element, calculated once.
+  double get_shape_norm(Shapeset* shapeset, int index, ElementMode2D mode);
+  // The number of refinements of e from an element of the initial mesh.
+  int get_refinement_level(Element* e) const;
+
+  std::vector<SpaceSharedPtr<double> > spaces;
+  int max_refinement_level;
+  int min_order;
+  int max_order;
+  double detector_threshold;
+  double increase_threshold;
+  double decrease_threshold;
+
+  KrivodonovaDiscontinuityDetector* detector;
+  // The elements with ids below this one are the initial ones.
+  int num_initial_ids;
+  // Flags by element id, the orders changed in the last order adaptation.
+  std::vector<char> order_changed;
+  // Per element mode, by shape function index, -1 if not calculated yet. The Gauss rule for the reference element integrals.
+  std::vector<double> shape_norms[2];
+  std::vector<double> gauss_points;
+  std::vector<double> gauss_weights;
+
+  int refined_count;
+  int order_change_count;
+};
+
+// Coarsening of the spaces where the refinement is not needed anymore (e.g. the shock moved away), instead of unrefining
+// the whole mesh: the sons of an element (all active, created by the adaptivity) are merged if the sum of their indicators
+// is below the threshold, the merged element gets their highest orders. The orders of the other elements with indicators below
+// the threshold can be lowered by one. The indicators are those of the last error calculation / detection on the current mesh.
+class SelectiveDerefinement
+{
+public:
+  SelectiveDerefinement(std::vector<SpaceSharedPtr<double> > spaces, int min_order);
+
+  // The element errors (the sum over the components) relative to the average one.
+  void set_indicators(ErrorCalculator<double>* error_calculator);
+  // One for the marked elements, zero for the others.
+  void set_indicators(const std::vector<char>& flags);
+
+  // Returns the number of merged elements, nothing is done if the mesh changed since the indicators were set.
+  int derefine(double threshold, bool lower_orders);
+
+  int get_order_change_count() const { return this->order_change_count; }
+
+protected:
+  std::vector<SpaceSharedPtr<double> > spaces;
+  int min_order;
+  // The elements with ids below this one are the initial ones, which are not merged.
+  int num_initial_ids;
+
+  // By element id, and the mesh they belong to.
+  std::vector<double> indicators;
+  int indicators_mesh_seq;
+
+  int order_change_count;
+};
+
+// Partitioned coupling of two linear problems on their own meshes (e.g. the flow and the heat transfer): each one has its own
+// weak form, matrix and factorization (LinearSolver), and the two are solved one after the other. Each weak form has the
+// solutions of the other problem (its coupling fields) among its ext functions. Within a time step, both problems use the coupling
+// fields of the previous sub-iteration (of the previous time step in the first one), which are updated after both have been solved.
+// Without sub-iterations, this is the staggered scheme; with them, the time step is repeated until the relative change of both
+// solution vectors is below the tolerance, i.e. the coupled system is solved by the block Jacobi iteration.
+// The two solves are independent, so they run concurrently on two threads. This is only safe if the matrix solver backend
+// allows two factorizations at once: UMFPACK keeps its factorization per solver, whereas MUMPS, PETSc and PARALUTION have
+// global state, so with any backend other than UMFPACK the two are solved sequentially regardless of set_concurrent().
+class PartitionedCoupling
+{
+public:
+  // The solutions of the problems are stored in slns_1, slns_2, which are the coupling fields of the other weak form.
+  PartitionedCoupling(WeakFormSharedPtr<double> wf_1, std::vector<SpaceSharedPtr<double> > spaces_1, std::vector<MeshFunctionSharedPtr<double> > slns_1,
+    WeakFormSharedPtr<double> wf_2, std::vector<SpaceSharedPtr<double> > spaces_2, std::vector<MeshFunctionSharedPtr<double> > slns_2);
+  ~PartitionedCoupling();
+
+  // At most max_sub_iterations sub-iterations after the first solve.
+  void set_sub_iterations(int max_sub_iterations, double tolerance);
+
+  // Solve the two problems concurrently on two threads (default: true, effective only with UMFPACK, see above).
+  void set_concurrent(bool concurrent);
+
+  // Solves both problems with the time step, returns the number of sub-iterations made.
+  int solve(double time_step);
+
+  // The solution vector of the problem_i-th problem (0 or 1) from the last solve.
+  double* get_sln_vector(int problem_i) { return &this->sln_vectors[problem_i][0]; }
+  // The relative change of the solution vectors in the last sub-iteration.
+  double get_change() const { return this->change; }
+
+protected:
+  WeakFormSharedPtr<double> wfs[2];
+  std::vector<SpaceSharedPtr<double> > spaces[2];
+  std::vector<MeshFunctionSharedPtr<double> > slns[2];
+  LinearSolver<double>* solvers[2];
+
+  int max_sub_iterations;
+  double tolerance;
+  double change;
+  bool concurrent;
+
+  std::vector<double> sln_vectors[2];
+};
+
+// Multirate time stepping of the flow and a field transported by it (the concentration), each with its own stable time step
+// (CFLCalculation, ADEStabilityCalculation). The slower one makes one step over the macro time step (its own time step), the faster
+// one subcycles: it makes as many equal substeps as are needed to cover the macro time step, at most max_substeps (the macro time
+// step is shortened if more would be needed). The flow is always advanced over the whole macro time step first, the transport
+// substeps then see the flow interpolated linearly in time between its states at the start and at the end of the macro time step
+// (see ConcentrationEquationWeakFormCoupledWithFlow::set_time_interpolation()).
+// Without multirate, both make one step with the smaller of the two time steps.
+class MultirateTimeStepping
+{
+public:
+  MultirateTimeStepping(bool multirate = true, int max_substeps = 100);
+
+  // Sets the macro time step and the substeps from the two stable time steps, returns the macro time step.
+  double set_time_steps(double flow_time_step, double transport_time_step);
+
+  double get_time_step() const { return this->time_step; }
+  int get_flow_substeps() const { return this->flow_substeps; }
+  double get_flow_substep() const { return this->time_step / this->flow_substeps; }
+  int get_transport_substeps() const { return this->transport_substeps; }
+  double get_transport_substep() const { return this->time_step / this->transport_substeps; }
+  // The time interpolation parameter of the flow at the end of the substep_i-th transport substep.
+  double get_time_interpolation(int substep_i) const { return (substep_i + 1.) / this->transport_substeps; }
+
+protected:
+  bool multirate;
+  int max_substeps;
+  double time_step;
+  int flow_substeps;
+  int transport_substeps;
+};
+
 // Filters.
 class MachNumberFilter : public Hermes::Hermes2D::SimpleFilter<double>
 {
@@ -284,7 +1261,76 @@ class EulerFluxes
 public:
   EulerFluxes(double kappa) : kappa(kappa) {}
 
-  
+  /// Both flux Jacobians in one state, A_1[4 * i + j] is the same as A_1_i_j(...), A_2 likewise.
+  /// The velocities, the kinetic energy and the kappa products are calculated only once.
+  /// Templated so that it can also be used for the order calculation (Scalar = Ord).
+  template<typename Scalar>
+  void jacobians(Scalar A_1[16], Scalar A_2[16], Scalar rho, Scalar rho_v_x, Scalar rho_v_y, Scalar energy) const
+  {
+    Scalar v_x = rho_v_x / rho;
+    Scalar v_y = rho_v_y / rho;
+    Scalar v_x_v_y = v_x * v_y;
+    Scalar v_x_v_x = v_x * v_x;
+    Scalar v_y_v_y = v_y * v_y;
+    Scalar V = v_x_v_x + v_y_v_y;
+    // 0.5 * (kappa - 1) * |v|^2, kappa * e / rho.
+    Scalar half_V = V * (0.5 * (kappa - 1.0));
+    Scalar kappa_e = (energy / rho) * kappa;
+    Scalar energy_coeff = V * (kappa - 1.0) - kappa_e;
+
+    A_1[0] = Scalar(0.0);
+    A_1[1] = Scalar(1.0);
+    A_1[2] = Scalar(0.0);
+    A_1[3] = Scalar(0.0);
+    A_1[4] = half_V - v_x_v_x;
+    A_1[5] = v_x * (3.0 - kappa);
+    A_1[6] = v_y * (1.0 - kappa);
+    A_1[7] = Scalar(kappa - 1.0);
+    A_1[8] = -v_x_v_y;
+    A_1[9] = v_y;
+    A_1[10] = v_x;
+    A_1[11] = Scalar(0.0);
+    A_1[12] = v_x * energy_coeff;
+    A_1[13] = kappa_e - half_V - v_x_v_x * (kappa - 1.0);
+    A_1[14] = v_x_v_y * (1.0 - kappa);
+    A_1[15] = v_x * kappa;
+
+    A_2[0] = Scalar(0.0);
+    A_2[1] = Scalar(0.0);
+    A_2[2] = Scalar(1.0);
+    A_2[3] = Scalar(0.0);
+    A_2[4] = -v_x_v_y;
+    A_2[5] = v_y;
+    A_2[6] = v_x;
+    A_2[7] = Scalar(0.0);
+    A_2[8] = half_V - v_y_v_y;
+    A_2[9] = v_x * (1.0 - kappa);
+    A_2[10] = v_y * (3.0 - kappa);
+    A_2[11] = Scalar(kappa - 1.0);
+    A_2[12] = v_y * energy_coeff;
+    A_2[13] = v_x_v_y * (1.0 - kappa);
+    A_2[14] = kappa_e - half_V - v_y_v_y * (kappa - 1.0);
+    A_2[15] = v_y * kappa;
+  }
+
+  /// jacobians() for n points, in the layout of NumericalFlux::numerical_flux_batch():
+  /// A_1[4 * i + j][point] is A_1_i_j(...) in the point point, A_2 likewise.
+  template<typename Scalar>
+  void jacobians_batch(int n, Scalar* A_1[16], Scalar* A_2[16], const Scalar* rho, const Scalar* rho_v_x, const Scalar* rho_v_y, const Scalar* energy) const
+  {
+    for (int point = 0; point < n; point++)
+    {
+      Scalar A_1_point[16], A_2_point[16];
+      jacobians(A_1_point, A_2_point, rho[point], rho_v_x[point], rho_v_y[point], energy[point]);
+      for (int k = 0; k < 16; k++)
+      {
+        A_1[k][point] = A_1_point[k];
+        A_2[k][point] = A_2_point[k];
+      }
+    }
+  }
+
+
   double A_1_0_0(double rho, double rho_v_x, double rho_v_y, double energy) {
 
     return double(0.0);
@@ -44,6 +44,54 @@ public:
 	};
 };
 
+/// Numerical flux in all quadrature points of the edge being assembled, computed by the first of the four (per-component)
+/// vector forms on the edge and reused by the others. Every assembling thread works with its own copy of the weak form (see clone()),
+/// so it also has its own caches.
+class EdgeFluxCache
+{
+public:
+	EdgeFluxCache() : ready(false), n(0), capacity(0), buffer(NULL)
+	{
+		flux[0] = flux[1] = flux[2] = flux[3] = NULL;
+	}
+	~EdgeFluxCache()
+	{
+		delete[] buffer;
+	}
+
+	/// Called when the assembling moves to another edge.
+	void invalidate() { ready = false; }
+
+	/// True if the flux for the current edge (with n points) has already been calculated.
+	bool is_ready(int n) const { return ready && this->n == n; }
+
+	/// Makes room for n points, the flux is then calculated by the caller, which finally sets ready.
+	void reserve(int n)
+	{
+		if (n > capacity)
+		{
+			delete[] buffer;
+			buffer = new double[4 * n];
+			capacity = n;
+		}
+		for (int k = 0; k < 4; k++)
+			flux[k] = buffer + k * n;
+		this->n = n;
+	}
+
+	/// flux[k][point_i] is the k-th component of the flux in the point point_i (the layout of NumericalFlux::numerical_flux_batch()).
+	double* flux[4];
+	bool ready;
+
+private:
+	EdgeFluxCache(const EdgeFluxCache&);
+	EdgeFluxCache& operator=(const EdgeFluxCache&);
+
+	int n;
+	int capacity;
+	double* buffer;
+};
+
 class EulerEquationsWeakFormSemiImplicit : public WeakForm < double >
 {
 public:
@@ -68,19 +116,116 @@ public:
 	// Fluxes for calculation.
 	EulerFluxes* euler_fluxes;
 
-	// Discrete indicator in the case of Feistauer limiting.
-	bool* discreteIndicator;
-	int discreteIndicatorSize;
+	// Discrete indicator in the case of Feistauer limiting, flags indexed by element id (see FeistauerShockIndicator).
+	// The weak form only points to them, they are recalculated in place.
+	const std::vector<char>* discreteIndicator;
 
 	// For cache handling.
 	class EulerEquationsMatrixFormSurfSemiImplicit;
 	class EulerEquationsMatrixFormSemiImplicitInletOutlet;
-	bool cacheReadyDG;
-	bool cacheReadySurf;
-	double** P_plus_cache_DG;
-	double** P_minus_cache_DG;
-	double** P_plus_cache_surf;
-	double** P_minus_cache_surf;
+
+	/// Matrices P^+, P^- in all quadrature points of the edge being assembled, computed by the first of the matrix forms
+	/// and reused by the others. Every assembling thread works with its own copy of the weak form (see clone()),
+	/// so it also has its own caches. The storage grows with the number of quadrature points.
+	class EdgeJacobianCache
+	{
+	public:
+		EdgeJacobianCache() : ready(false), n(0), capacity(0), P_plus(NULL), P_minus(NULL) {}
+		~EdgeJacobianCache()
+		{
+			delete[] P_plus;
+			delete[] P_minus;
+		}
+
+		/// Called when the assembling moves to another edge.
+		void invalidate() { ready = false; }
+
+		/// True if the matrices for the current edge (with n points) have already been calculated.
+		bool is_ready(int n) const { return ready && this->n == n; }
+
+		/// Makes room for n points, the matrices are then calculated by the caller, which finally sets ready.
+		void reserve(int n)
+		{
+			if (n > capacity)
+			{
+				delete[] P_plus;
+				delete[] P_minus;
+				P_plus = new double[16 * n];
+				P_minus = new double[16 * n];
+				capacity = n;
+			}
+			this->n = n;
+		}
+
+		/// The matrices in the point point_i, stored column by column (see StegerWarmingNumericalFlux::P_plus_matrix()).
+		double* P_plus_at(int point_i) { return P_plus + 16 * point_i; }
+		double* P_minus_at(int point_i) { return P_minus + 16 * point_i; }
+
+		bool ready;
+
+	private:
+		EdgeJacobianCache(const EdgeJacobianCache&);
+		EdgeJacobianCache& operator=(const EdgeJacobianCache&);
+
+		int n;
+		int capacity;
+		double* P_plus;
+		double* P_minus;
+	};
+
+	/// Flux Jacobians A_1, A_2 in all quadrature points of the element being assembled, computed by the first
+	/// of the 16 convective volume forms (EulerEquationsBilinearForm) and reused by the others, so that the state
+	/// is evaluated once per point instead of sixteen times.
+	class VolumeJacobianCache
+	{
+	public:
+		VolumeJacobianCache() : ready(false), n(0), capacity(0), buffer(NULL) {}
+		~VolumeJacobianCache()
+		{
+			delete[] buffer;
+		}
+
+		/// Called when the assembling moves to another element.
+		void invalidate() { ready = false; }
+
+		/// True if the Jacobians for the current element (with n points) have already been calculated.
+		bool is_ready(int n) const { return ready && this->n == n; }
+
+		/// Makes room for n points, the Jacobians are then calculated by the caller, which finally sets ready.
+		void reserve(int n)
+		{
+			if (n > capacity)
+			{
+				delete[] buffer;
+				buffer = new double[32 * n];
+				capacity = n;
+			}
+			for (int k = 0; k < 16; k++)
+			{
+				A_1[k] = buffer + k * n;
+				A_2[k] = buffer + (16 + k) * n;
+			}
+			this->n = n;
+		}
+
+		/// A_1[4 * i + j][point_i] is EulerFluxes::A_1_i_j() in the point point_i (the layout of EulerFluxes::jacobians_batch()).
+		double* A_1[16];
+		double* A_2[16];
+		bool ready;
+
+	private:
+		VolumeJacobianCache(const VolumeJacobianCache&);
+		VolumeJacobianCache& operator=(const VolumeJacobianCache&);
+
+		int n;
+		int capacity;
+		double* buffer;
+	};
+
+	EdgeJacobianCache cacheDG;
+	EdgeJacobianCache cacheSurf;
+	EdgeFluxCache cacheSurfVector;
+	VolumeJacobianCache cacheVol;
 
 	EulerEquationsWeakFormSemiImplicit(double kappa,
 		std::vector<double> rho_ext, std::vector<double> v1_ext, std::vector<double> v2_ext, std::vector<double> pressure_ext,
@@ -97,19 +242,6 @@ public:
 		for (unsigned int inlet_i = 0; inlet_i < inlet_markers.size(); inlet_i++)
 			energy_ext.push_back(QuantityCalculator::calc_energy(rho_ext[inlet_i], rho_ext[inlet_i] * v1_ext[inlet_i], rho_ext[inlet_i] * v2_ext[inlet_i], pressure_ext[inlet_i], kappa));
 
-		P_plus_cache_DG = new double*[13];
-		P_minus_cache_DG = new double*[13];
-		P_plus_cache_surf = new double*[13];
-		P_minus_cache_surf = new double*[13];
-
-		for (int coordinate_i = 0; coordinate_i < 13; coordinate_i++)
-		{
-			P_plus_cache_DG[coordinate_i] = new double[16];
-			P_minus_cache_DG[coordinate_i] = new double[16];
-			P_plus_cache_surf[coordinate_i] = new double[16];
-			P_minus_cache_surf[coordinate_i] = new double[16];
-		}
-
 		for (int form_i = 0; form_i < 4; form_i++)
 		{
 			add_matrix_form(new EulerEquationsBilinearFormTime(form_i));
@@ -134,21 +266,21 @@ public:
 				if (!fvm_only)
 					add_matrix_form(new EulerEquationsBilinearForm(form_i, form_j, euler_fluxes));
 
-				add_matrix_form_DG(new EulerEquationsMatrixFormSurfSemiImplicit(form_i, form_j, kappa, euler_fluxes, &this->cacheReadyDG, this->P_plus_cache_DG, this->P_minus_cache_DG));
+				add_matrix_form_DG(new EulerEquationsMatrixFormSurfSemiImplicit(form_i, form_j, kappa, euler_fluxes));
 
 				for (unsigned int inlet_i = 0; inlet_i < inlet_markers.size(); inlet_i++)
 				{
-					add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[inlet_i], v1_ext[inlet_i], v2_ext[inlet_i], energy_ext[inlet_i], inlet_markers[inlet_i], kappa, &this->cacheReadySurf, this->P_plus_cache_surf, this->P_minus_cache_surf));
+					add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[inlet_i], v1_ext[inlet_i], v2_ext[inlet_i], energy_ext[inlet_i], inlet_markers[inlet_i], kappa));
 				}
 
 				for (unsigned int outlet_i = 0; outlet_i < outlet_markers.size(); outlet_i++)
 				{
 					// If we specified ext values also for outlets.
 					if (rho_ext.size() >= outlet_markers.size() + inlet_markers.size())
-						add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[outlet_i + inlet_markers.size()], v1_ext[outlet_i + inlet_markers.size()], v2_ext[outlet_i + inlet_markers.size()], energy_ext[outlet_i + inlet_markers.size()], outlet_markers[outlet_i], kappa, &this->cacheReadySurf, this->P_plus_cache_surf, this->P_minus_cache_surf));
+						add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[outlet_i + inlet_markers.size()], v1_ext[outlet_i + inlet_markers.size()], v2_ext[outlet_i + inlet_markers.size()], energy_ext[outlet_i + inlet_markers.size()], outlet_markers[outlet_i], kappa));
 					// Otherwise take the first ext value.
 					else
-						add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[0], v1_ext[0], v2_ext[0], energy_ext[0], outlet_markers[outlet_i], kappa, &this->cacheReadySurf, this->P_plus_cache_surf, this->P_minus_cache_surf));
+						add_matrix_form_surf(new EulerEquationsMatrixFormSemiImplicitInletOutlet(form_i, form_j, rho_ext[0], v1_ext[0], v2_ext[0], energy_ext[0], outlet_markers[outlet_i], kappa));
 				}
 
 				add_matrix_form_surf(new EulerEquationsMatrixFormSolidWall(form_i, form_j, solid_wall_markers, kappa));
@@ -161,29 +293,22 @@ public:
 	virtual ~EulerEquationsWeakFormSemiImplicit()
 	{
 		delete this->euler_fluxes;
+	}
 
-		for (int coordinate_i = 0; coordinate_i < 13; coordinate_i++)
-		{
-			delete[] P_plus_cache_DG[coordinate_i];
-			delete[] P_minus_cache_DG[coordinate_i];
-			delete[] P_plus_cache_surf[coordinate_i];
-			delete[] P_minus_cache_surf[coordinate_i];
-		}
-
-		delete[] P_plus_cache_DG;
-		delete[] P_minus_cache_DG;
-		delete[] P_plus_cache_surf;
-		delete[] P_minus_cache_surf;
+	void set_active_state(Element** e)
+	{
+		this->cacheVol.invalidate();
 	}
 
 	void set_active_edge_state(Element** e, unsigned char isurf)
 	{
-		this->cacheReadySurf = false;
+		this->cacheSurf.invalidate();
+		this->cacheSurfVector.invalidate();
 	}
 
 	void set_active_DG_state(Element** e, unsigned char isurf)
 	{
-		this->cacheReadyDG = false;
+		this->cacheDG.invalidate();
 	}
 
 	WeakForm<double>* clone() const
@@ -206,6 +331,7 @@ public:
 		}
 
 		wf->set_current_time_step(this->get_current_time_step());
+		wf->discreteIndicator = this->discreteIndicator;
 
 		return wf;
 	}
@@ -252,10 +378,9 @@ public:
 		}
 	}
 
-	void set_discreteIndicator(bool* discreteIndicator, int size)
+	void set_discreteIndicator(const std::vector<char>* discreteIndicator)
 	{
 		this->discreteIndicator = discreteIndicator;
-		this->discreteIndicatorSize = size;
 	}
 
 	class EulerEquationsBilinearFormTime : public MatrixFormVol < double >
@@ -287,86 +412,20 @@ public:
 		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *u, Func<double> *v, GeomVol<double> *e,
 			Func<double>* *ext) const
 		{
-			double result = 0.;
-			for (int point_i = 0; point_i < n; point_i++)
+			VolumeJacobianCache& cache = static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->cacheVol;
+			if (!cache.is_ready(n))
 			{
-				double rho = ext[0]->val[point_i];
-				double rho_v_x = ext[1]->val[point_i];
-				double rho_v_y = ext[2]->val[point_i];
-				double rho_e = ext[3]->val[point_i];
-
-				switch (i)
-				{
-				case 0:
-					switch (j)
-					{
-					case 0:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_0_0(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_0_0(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 1:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_0_1(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_0_1(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 2:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_0_2(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_0_2(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 3:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_0_3(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_0_3(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					}
-					break;
-				case 1:
-					switch (j)
-					{
-					case 0:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_1_0(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_1_0(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 1:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_1_1(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_1_1(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 2:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_1_2(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_1_2(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 3:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_1_3(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_1_3(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					}
-					break;
-				case 2:
-					switch (j)
-					{
-					case 0:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_2_0(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_2_0(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 1:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_2_1(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_2_1(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 2:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_2_2(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_2_2(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					case 3:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_2_3(rho, rho_v_x, rho_v_y, 0) * v->dx[point_i] + fluxes->A_2_2_3(rho, rho_v_x, rho_v_y, 0) * v->dy[point_i]);
-						break;
-					}
-					break;
-				case 3:
-					switch (j)
-					{
-					case 0:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_3_0(rho, rho_v_x, rho_v_y, rho_e) * v->dx[point_i] + fluxes->A_2_3_0(rho, rho_v_x, rho_v_y, rho_e) * v->dy[point_i]);
-						break;
-					case 1:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_3_1(rho, rho_v_x, rho_v_y, rho_e) * v->dx[point_i] + fluxes->A_2_3_1(rho, rho_v_x, rho_v_y, rho_e) * v->dy[point_i]);
-						break;
-					case 2:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_3_2(rho, rho_v_x, rho_v_y, rho_e) * v->dx[point_i] + fluxes->A_2_3_2(rho, rho_v_x, rho_v_y, rho_e) * v->dy[point_i]);
-						break;
-					case 3:
-						result += wt[point_i] * u->val[point_i] * (fluxes->A_1_3_3(rho, rho_v_x, rho_v_y, rho_e) * v->dx[point_i] + fluxes->A_2_3_3(rho, rho_v_x, rho_v_y, rho_e) * v->dy[point_i]);
-						break;
-					}
-				}
+				cache.reserve(n);
+				fluxes->jacobians_batch(n, cache.A_1, cache.A_2, ext[0]->val, ext[1]->val, ext[2]->val, ext[3]->val);
+				cache.ready = true;
 			}
 
+			const double* A_1 = cache.A_1[4 * i + j];
+			const double* A_2 = cache.A_2[4 * i + j];
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * u->val[point_i] * (A_1[point_i] * v->dx[point_i] + A_2[point_i] * v->dy[point_i]);
+
 			return -result * wf->get_current_time_step();
 		}
 
@@ -386,8 +445,8 @@ public:
 	class EulerEquationsMatrixFormSurfSemiImplicit : public MatrixFormDG < double >
 	{
 	public:
-		EulerEquationsMatrixFormSurfSemiImplicit(unsigned int i, unsigned int j, double kappa, EulerFluxes* fluxes, bool* cacheReady, double** P_plus_cache, double** P_minus_cache)
-			: MatrixFormDG<double>(i, j), num_flux(new StegerWarmingNumericalFlux(kappa)), cacheReady(cacheReady), P_plus_cache(P_plus_cache), P_minus_cache(P_minus_cache), fluxes(fluxes)
+		EulerEquationsMatrixFormSurfSemiImplicit(unsigned int i, unsigned int j, double kappa, EulerFluxes* fluxes)
+			: MatrixFormDG<double>(i, j), num_flux(new StegerWarmingNumericalFlux(kappa)), fluxes(fluxes)
 		{
 		}
 
@@ -399,46 +458,29 @@ public:
 		double value(int n, double *wt, DiscontinuousFunc<double> **u_ext, DiscontinuousFunc<double> *u,
 			DiscontinuousFunc<double> *v, InterfaceGeom<double> *e, DiscontinuousFunc<double>* *ext) const
 		{
-			double w[4];
+			double w_L[4], w_R[4];
 			double result = 0.;
 
-			if (!(*this->cacheReady))
+			EdgeJacobianCache& cache = static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->cacheDG;
+			if (!cache.is_ready(n))
 			{
+				cache.reserve(n);
 				for (int point_i = 0; point_i < n; point_i++)
 				{
-					{
-						w[0] = ext[0]->val[point_i];
-						w[1] = ext[1]->val[point_i];
-						w[2] = ext[2]->val[point_i];
-						w[3] = ext[3]->val[point_i];
-
-						double e_1_1[4] = { 1, 0, 0, 0 };
-						double e_2_1[4] = { 0, 1, 0, 0 };
-						double e_3_1[4] = { 0, 0, 1, 0 };
-						double e_4_1[4] = { 0, 0, 0, 1 };
-
-						num_flux->P_plus(this->P_plus_cache[point_i], w, e_1_1, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_plus(this->P_plus_cache[point_i] + 4, w, e_2_1, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_plus(this->P_plus_cache[point_i] + 8, w, e_3_1, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_plus(this->P_plus_cache[point_i] + 12, w, e_4_1, e->nx[point_i], e->ny[point_i]);
-
-						w[0] = ext[0]->val_neighbor[point_i];
-						w[1] = ext[1]->val_neighbor[point_i];
-						w[2] = ext[2]->val_neighbor[point_i];
-						w[3] = ext[3]->val_neighbor[point_i];
-
-						double e_1_2[4] = { 1, 0, 0, 0 };
-						double e_2_2[4] = { 0, 1, 0, 0 };
-						double e_3_2[4] = { 0, 0, 1, 0 };
-						double e_4_2[4] = { 0, 0, 0, 1 };
-
-						num_flux->P_minus(this->P_minus_cache[point_i], w, e_1_2, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_minus(this->P_minus_cache[point_i] + 4, w, e_2_2, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_minus(this->P_minus_cache[point_i] + 8, w, e_3_2, e->nx[point_i], e->ny[point_i]);
-						num_flux->P_minus(this->P_minus_cache[point_i] + 12, w, e_4_2, e->nx[point_i], e->ny[point_i]);
-					}
+					w_L[0] = ext[0]->val[point_i];
+					w_L[1] = ext[1]->val[point_i];
+					w_L[2] = ext[2]->val[point_i];
+					w_L[3] = ext[3]->val[point_i];
+
+					w_R[0] = ext[0]->val_neighbor[point_i];
+					w_R[1] = ext[1]->val_neighbor[point_i];
+					w_R[2] = ext[2]->val_neighbor[point_i];
+					w_R[3] = ext[3]->val_neighbor[point_i];
+
+					// P^+ of the central state and P^- of the neighbor state, both as whole matrices.
+					num_flux->P_matrices(cache.P_plus_at(point_i), w_L, cache.P_minus_at(point_i), w_R, e->nx[point_i], e->ny[point_i]);
 				}
-				*(const_cast<EulerEquationsMatrixFormSurfSemiImplicit*>(this))->cacheReady = true;
+				cache.ready = true;
 			}
 
 			int index = j * 4 + i;
@@ -446,31 +488,28 @@ public:
 			if (u->val == NULL)
 				if (v->val == NULL)
 					for (int point_i = 0; point_i < n; point_i++)
-						result -= wt[point_i] * (this->P_minus_cache[point_i][index] * u->val_neighbor[point_i]) * v->val_neighbor[point_i];
+						result -= wt[point_i] * (cache.P_minus_at(point_i)[index] * u->val_neighbor[point_i]) * v->val_neighbor[point_i];
 				else
 					for (int point_i = 0; point_i < n; point_i++)
-						result += wt[point_i] * (this->P_minus_cache[point_i][index] * u->val_neighbor[point_i]) * v->val[point_i];
+						result += wt[point_i] * (cache.P_minus_at(point_i)[index] * u->val_neighbor[point_i]) * v->val[point_i];
 			else
 				if (v->val == NULL)
 					for (int point_i = 0; point_i < n; point_i++)
-						result -= wt[point_i] * (this->P_plus_cache[point_i][index] * u->val[point_i]) * v->val_neighbor[point_i];
+						result -= wt[point_i] * (cache.P_plus_at(point_i)[index] * u->val[point_i]) * v->val_neighbor[point_i];
 				else
 					for (int point_i = 0; point_i < n; point_i++)
-						result += wt[point_i] * (this->P_plus_cache[point_i][index] * u->val[point_i]) * v->val[point_i];
+						result += wt[point_i] * (cache.P_plus_at(point_i)[index] * u->val[point_i]) * v->val[point_i];
 
 			return result * wf->get_current_time_step();
 		}
 
 		MatrixFormDG<double>* clone()  const
 		{
-			EulerEquationsMatrixFormSurfSemiImplicit* form = new EulerEquationsMatrixFormSurfSemiImplicit(this->i, this->j, this->num_flux->kappa, this->fluxes, this->cacheReady, this->P_plus_cache, this->P_minus_cache);
+			EulerEquationsMatrixFormSurfSemiImplicit* form = new EulerEquationsMatrixFormSurfSemiImplicit(this->i, this->j, this->num_flux->kappa, this->fluxes);
 			form->wf = this->wf;
 			return form;
 		}
 
-		bool* cacheReady;
-		double** P_plus_cache;
-		double** P_minus_cache;
 		StegerWarmingNumericalFlux* num_flux;
 		EulerFluxes* fluxes;
 	};
@@ -478,13 +517,13 @@ public:
 	class EulerEquationsMatrixFormSemiImplicitInletOutlet : public MatrixFormSurf < double >
 	{
 	public:
-		EulerEquationsMatrixFormSemiImplicitInletOutlet(unsigned int i, unsigned int j, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::string marker, double kappa, bool* cacheReady, double** P_plus_cache, double** P_minus_cache)
-			: MatrixFormSurf<double>(i, j), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext), num_flux(new StegerWarmingNumericalFlux(kappa)), cacheReady(cacheReady), P_plus_cache(P_plus_cache), P_minus_cache(P_minus_cache)
+		EulerEquationsMatrixFormSemiImplicitInletOutlet(unsigned int i, unsigned int j, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::string marker, double kappa)
+			: MatrixFormSurf<double>(i, j), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext), num_flux(new StegerWarmingNumericalFlux(kappa))
 		{
 			set_area(marker);
 		}
-		EulerEquationsMatrixFormSemiImplicitInletOutlet(unsigned int i, unsigned int j, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::vector<std::string> markers, double kappa, bool* cacheReady, double** P_plus_cache, double** P_minus_cache)
-			: MatrixFormSurf<double>(i, j), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext), num_flux(new StegerWarmingNumericalFlux(kappa)), cacheReady(cacheReady), P_plus_cache(P_plus_cache), P_minus_cache(P_minus_cache)
+		EulerEquationsMatrixFormSemiImplicitInletOutlet(unsigned int i, unsigned int j, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::vector<std::string> markers, double kappa)
+			: MatrixFormSurf<double>(i, j), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext), num_flux(new StegerWarmingNumericalFlux(kappa))
 		{
 			set_areas(markers);
 		}
@@ -499,8 +538,10 @@ public:
 		{
 			double result = 0.;
 
-			if (!(*this->cacheReady))
+			EdgeJacobianCache& cache = static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->cacheSurf;
+			if (!cache.is_ready(n))
 			{
+				cache.reserve(n);
 				for (int point_i = 0; point_i < n; point_i++)
 				{
 					double w_B[4], w_L[4], eigenvalues[4], alpha[4], q_ji_star[4], beta[4], q_ji[4], w_ji[4];
@@ -573,24 +614,16 @@ public:
 					w_temp[2] = (w_ji[2] + w_L[2]) / 2;
 					w_temp[3] = (w_ji[3] + w_L[3]) / 2;
 
-					double e_1[4] = { 1, 0, 0, 0 };
-					double e_2[4] = { 0, 1, 0, 0 };
-					double e_3[4] = { 0, 0, 1, 0 };
-					double e_4[4] = { 0, 0, 0, 1 };
-
-					num_flux->P_plus(this->P_plus_cache[point_i], w_temp, e_1, e->nx[point_i], e->ny[point_i]);
-					num_flux->P_plus(this->P_plus_cache[point_i] + 4, w_temp, e_2, e->nx[point_i], e->ny[point_i]);
-					num_flux->P_plus(this->P_plus_cache[point_i] + 8, w_temp, e_3, e->nx[point_i], e->ny[point_i]);
-					num_flux->P_plus(this->P_plus_cache[point_i] + 12, w_temp, e_4, e->nx[point_i], e->ny[point_i]);
+					num_flux->P_plus_matrix(cache.P_plus_at(point_i), w_temp, e->nx[point_i], e->ny[point_i]);
 				}
 
-				*(const_cast<EulerEquationsMatrixFormSemiImplicitInletOutlet*>(this))->cacheReady = true;
+				cache.ready = true;
 			}
 
 			int index = j * 4 + i;
 			for (int point_i = 0; point_i < n; point_i++)
 			{
-				result += wt[point_i] * P_plus_cache[point_i][index] * u->val[point_i] * v->val[point_i];
+				result += wt[point_i] * cache.P_plus_at(point_i)[index] * u->val[point_i] * v->val[point_i];
 			}
 
 			return result * wf->get_current_time_step();
@@ -604,7 +637,7 @@ public:
 
 		MatrixFormSurf<double>* clone()  const
 		{
-			EulerEquationsMatrixFormSemiImplicitInletOutlet* form = new EulerEquationsMatrixFormSemiImplicitInletOutlet(this->i, this->j, this->rho_ext, this->v1_ext, this->v2_ext, this->energy_ext, this->areas, this->num_flux->kappa, this->cacheReady, this->P_plus_cache, this->P_minus_cache);
+			EulerEquationsMatrixFormSemiImplicitInletOutlet* form = new EulerEquationsMatrixFormSemiImplicitInletOutlet(this->i, this->j, this->rho_ext, this->v1_ext, this->v2_ext, this->energy_ext, this->areas, this->num_flux->kappa);
 			form->wf = this->wf;
 			return form;
 		}
@@ -613,9 +646,6 @@ public:
 		double v1_ext;
 		double v2_ext;
 		double energy_ext;
-		bool* cacheReady;
-		double** P_plus_cache;
-		double** P_minus_cache;
 		StegerWarmingNumericalFlux* num_flux;
 	};
 
@@ -645,85 +675,95 @@ public:
 		{
 			double result = 0.;
 
-			double w_B[4], w_L[4], eigenvalues[4], alpha[4], q_ji_star[4], beta[4], q_ji[4], w_ji[4];
-
-			for (int point_i = 0; point_i < n; point_i++)
+			// The boundary flux (all four components) is calculated by the first of the four forms on the edge.
+			EdgeFluxCache& cache = static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->cacheSurfVector;
+			if (!cache.is_ready(n))
 			{
-				// Inner state.
-				w_L[0] = ext[0]->val[point_i];
-				w_L[1] = ext[1]->val[point_i];
-				w_L[2] = ext[2]->val[point_i];
-				w_L[3] = ext[3]->val[point_i];
-
-				// Transformation of the inner state to the local coordinates.
-				num_flux->Q(num_flux->get_q(), w_L, e->nx[point_i], e->ny[point_i]);
-
-				// Initialize the matrices.
-				double T[4][4];
-				double T_inv[4][4];
-				for (unsigned int ai = 0; ai < 4; ai++)
+				cache.reserve(n);
+				double w_B[4], w_L[4], eigenvalues[4], alpha[4], q_ji_star[4], beta[4], q_ji[4], w_ji[4];
+
+				for (int point_i = 0; point_i < n; point_i++)
 				{
-					for (unsigned int aj = 0; aj < 4; aj++)
+					// Inner state.
+					w_L[0] = ext[0]->val[point_i];
+					w_L[1] = ext[1]->val[point_i];
+					w_L[2] = ext[2]->val[point_i];
+					w_L[3] = ext[3]->val[point_i];
+
+					// Transformation of the inner state to the local coordinates.
+					num_flux->Q(num_flux->get_q(), w_L, e->nx[point_i], e->ny[point_i]);
+
+					// Initialize the matrices.
+					double T[4][4];
+					double T_inv[4][4];
+					for (unsigned int ai = 0; ai < 4; ai++)
 					{
-						T[ai][aj] = 0.0;
-						T_inv[ai][aj] = 0.0;
+						for (unsigned int aj = 0; aj < 4; aj++)
+						{
+							T[ai][aj] = 0.0;
+							T_inv[ai][aj] = 0.0;
+						}
+						alpha[ai] = 0;
+						beta[ai] = 0;
+						q_ji[ai] = 0;
+						w_ji[ai] = 0;
+						eigenvalues[ai] = 0;
 					}
-					alpha[ai] = 0;
-					beta[ai] = 0;
-					q_ji[ai] = 0;
-					w_ji[ai] = 0;
-					eigenvalues[ai] = 0;
-				}
 
-				// Calculate Lambda^-.
-				num_flux->Lambda(eigenvalues);
-				num_flux->T_1(T);
-				num_flux->T_2(T);
-				num_flux->T_3(T);
-				num_flux->T_4(T);
-				num_flux->T_inv_1(T_inv);
-				num_flux->T_inv_2(T_inv);
-				num_flux->T_inv_3(T_inv);
-				num_flux->T_inv_4(T_inv);
-
-				// "Prescribed" boundary state.
-				w_B[0] = this->rho_ext;
-				w_B[1] = this->rho_ext * this->v1_ext;
-				w_B[2] = this->rho_ext * this->v2_ext;
-				w_B[3] = this->energy_ext;
+					// Calculate Lambda^-.
+					num_flux->Lambda(eigenvalues);
+					num_flux->T_1(T);
+					num_flux->T_2(T);
+					num_flux->T_3(T);
+					num_flux->T_4(T);
+					num_flux->T_inv_1(T_inv);
+					num_flux->T_inv_2(T_inv);
+					num_flux->T_inv_3(T_inv);
+					num_flux->T_inv_4(T_inv);
 
-				num_flux->Q(q_ji_star, w_B, e->nx[point_i], e->ny[point_i]);
+					// "Prescribed" boundary state.
+					w_B[0] = this->rho_ext;
+					w_B[1] = this->rho_ext * this->v1_ext;
+					w_B[2] = this->rho_ext * this->v2_ext;
+					w_B[3] = this->energy_ext;
 
-				for (unsigned int ai = 0; ai < 4; ai++)
-					for (unsigned int aj = 0; aj < 4; aj++)
-						alpha[ai] += T_inv[ai][aj] * num_flux->get_q()[aj];
+					num_flux->Q(q_ji_star, w_B, e->nx[point_i], e->ny[point_i]);
 
-				for (unsigned int bi = 0; bi < 4; bi++)
-					for (unsigned int bj = 0; bj < 4; bj++)
-						beta[bi] += T_inv[bi][bj] * q_ji_star[bj];
+					for (unsigned int ai = 0; ai < 4; ai++)
+						for (unsigned int aj = 0; aj < 4; aj++)
+							alpha[ai] += T_inv[ai][aj] * num_flux->get_q()[aj];
 
-				for (unsigned int si = 0; si < 4; si++)
-					for (unsigned int sj = 0; sj < 4; sj++)
-						if (eigenvalues[sj] < 0)
-							q_ji[si] += beta[sj] * T[si][sj];
-						else
-							q_ji[si] += alpha[sj] * T[si][sj];
+					for (unsigned int bi = 0; bi < 4; bi++)
+						for (unsigned int bj = 0; bj < 4; bj++)
+							beta[bi] += T_inv[bi][bj] * q_ji_star[bj];
 
-				num_flux->Q_inv(w_ji, q_ji, e->nx[point_i], e->ny[point_i]);
+					for (unsigned int si = 0; si < 4; si++)
+						for (unsigned int sj = 0; sj < 4; sj++)
+							if (eigenvalues[sj] < 0)
+								q_ji[si] += beta[sj] * T[si][sj];
+							else
+								q_ji[si] += alpha[sj] * T[si][sj];
 
-				double P_minus[4];
+					num_flux->Q_inv(w_ji, q_ji, e->nx[point_i], e->ny[point_i]);
 
-				double w_temp[4];
-				w_temp[0] = (w_ji[0] + w_L[0]) / 2;
-				w_temp[1] = (w_ji[1] + w_L[1]) / 2;
-				w_temp[2] = (w_ji[2] + w_L[2]) / 2;
-				w_temp[3] = (w_ji[3] + w_L[3]) / 2;
+					double w_temp[4];
+					w_temp[0] = (w_ji[0] + w_L[0]) / 2;
+					w_temp[1] = (w_ji[1] + w_L[1]) / 2;
+					w_temp[2] = (w_ji[2] + w_L[2]) / 2;
+					w_temp[3] = (w_ji[3] + w_L[3]) / 2;
 
-				num_flux->P_minus(P_minus, w_temp, w_ji, e->nx[point_i], e->ny[point_i]);
+					double P_minus[4];
+					num_flux->P_minus(P_minus, w_temp, w_ji, e->nx[point_i], e->ny[point_i]);
+					for (int k = 0; k < 4; k++)
+						cache.flux[k][point_i] = P_minus[k];
+				}
 
-				result += wt[point_i] * (P_minus[i]) * v->val[point_i];
+				cache.ready = true;
 			}
 
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * cache.flux[i][point_i] * v->val[point_i];
+
 			return -result * wf->get_current_time_step();
 		}
 
@@ -778,30 +818,38 @@ public:
 		{
 			double result = 0.;
 
-			for (int point_i = 0; point_i < n; point_i++)
+			// The matrix P is calculated by the first of the 16 forms on the edge, stored column by column as in EdgeJacobianCache.
+			EdgeJacobianCache& cache = static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->cacheSurf;
+			if (!cache.is_ready(n))
 			{
-				double rho = ext[0]->val[point_i];
-				double v_1 = ext[1]->val[point_i] / rho;
-				double v_2 = ext[2]->val[point_i] / rho;
-
-				double P[4][4];
-				for (unsigned int P_i = 0; P_i < 4; P_i++)
-					for (unsigned int P_j = 0; P_j < 4; P_j++)
-						P[P_i][P_j] = 0.0;
-
-				P[1][0] = (kappa - 1) * (v_1 * v_1 + v_2 * v_2) * e->nx[point_i] / 2;
-				P[1][1] = (kappa - 1) * (-v_1) * e->nx[point_i];
-				P[1][2] = (kappa - 1) * (-v_2) * e->nx[point_i];
-				P[1][3] = (kappa - 1) * e->nx[point_i];
-
-				P[2][0] = (kappa - 1) * (v_1 * v_1 + v_2 * v_2) * e->ny[point_i] / 2;
-				P[2][1] = (kappa - 1) * (-v_1) * e->ny[point_i];
-				P[2][2] = (kappa - 1) * (-v_2) * e->ny[point_i];
-				P[2][3] = (kappa - 1) * e->ny[point_i];
-
-				result += wt[point_i] * P[i][j] * u->val[point_i] * v->val[point_i];
+				cache.reserve(n);
+				for (int point_i = 0; point_i < n; point_i++)
+				{
+					double rho = ext[0]->val[point_i];
+					double v_1 = ext[1]->val[point_i] / rho;
+					double v_2 = ext[2]->val[point_i] / rho;
+
+					double* P = cache.P_plus_at(point_i);
+					for (unsigned int P_i = 0; P_i < 16; P_i++)
+						P[P_i] = 0.0;
+
+					P[0 * 4 + 1] = (kappa - 1) * (v_1 * v_1 + v_2 * v_2) * e->nx[point_i] / 2;
+					P[1 * 4 + 1] = (kappa - 1) * (-v_1) * e->nx[point_i];
+					P[2 * 4 + 1] = (kappa - 1) * (-v_2) * e->nx[point_i];
+					P[3 * 4 + 1] = (kappa - 1) * e->nx[point_i];
+
+					P[0 * 4 + 2] = (kappa - 1) * (v_1 * v_1 + v_2 * v_2) * e->ny[point_i] / 2;
+					P[1 * 4 + 2] = (kappa - 1) * (-v_1) * e->ny[point_i];
+					P[2 * 4 + 2] = (kappa - 1) * (-v_2) * e->ny[point_i];
+					P[3 * 4 + 2] = (kappa - 1) * e->ny[point_i];
+				}
+				cache.ready = true;
 			}
 
+			int index = j * 4 + i;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * cache.P_plus_at(point_i)[index] * u->val[point_i] * v->val[point_i];
+
 			return result * wf->get_current_time_step();
 		}
 
@@ -830,7 +878,7 @@ public:
 			GeomVol<double> *e, Func<double>* *ext) const
 		{
 			double result = 0.;
-			if (static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator[e->id])
+			if ((*static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator)[e->id])
 				result = int_grad_u_grad_v<double, double>(n, wt, u, v);
 			return result * nu_1 * e->get_diam_approximation(n);
 		}
@@ -860,7 +908,7 @@ public:
 		{
 			double result = 0.;
 
-			if (static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator[e->central_el->id] && static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator[e->neighb_el->id])
+			if ((*static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator)[e->central_el->id] && (*static_cast<EulerEquationsWeakFormSemiImplicit*>(wf)->discreteIndicator)[e->neighb_el->id])
 			{
 				if (u->val == NULL)
 					if (v->val == NULL)
@@ -890,4 +938,766 @@ public:
 
 		double nu_2;
 	};
-};
\ No newline at end of file
+};
+/// Residual of the DG discretization of the Euler equations, i.e. R(w) in M dw/dt = R(w),
+/// with the state w given by the ext functions (prev_density, ...).
+/// Used by the explicit time integration (SSPRungeKutta in euler_util.h), there is no time derivative and no time step in the forms
+/// - except with local time stepping, where every term is multiplied by the time step of its element (interface).
+/// For the local time stepping on finite volumes, it also provides the fluxes of its forms (LocalTimeSteppingFluxes).
+class EulerEquationsWeakFormExplicit : public WeakForm < double >, public LocalTimeSteppingFluxes
+{
+public:
+	double kappa;
+	std::vector<std::string> solid_wall_markers;
+	std::vector<std::string> inlet_markers;
+	std::vector<std::string> outlet_markers;
+
+	MeshFunctionSharedPtr<double> prev_density;
+	MeshFunctionSharedPtr<double> prev_density_vel_x;
+	MeshFunctionSharedPtr<double> prev_density_vel_y;
+	MeshFunctionSharedPtr<double> prev_energy;
+
+	// External state.
+	std::vector<double> rho_ext;
+	std::vector<double> v1_ext;
+	std::vector<double> v2_ext;
+	std::vector<double> pressure_ext;
+	std::vector<double> energy_ext;
+
+	EdgeFluxCache cacheDG;
+	EdgeFluxCache cacheSurf;
+
+	/// If set, the terms are weighted by the (local) time steps of the elements, see LocalTimeStepping in euler_util.h.
+	LocalTimeStepping* local_time_stepping;
+
+	void set_local_time_stepping(LocalTimeStepping* local_time_stepping)
+	{
+		this->local_time_stepping = local_time_stepping;
+	}
+
+	double element_weight(int element_id) const
+	{
+		return this->local_time_stepping ? this->local_time_stepping->element_weight(element_id) : 1.;
+	}
+
+	double interface_weight(int element_id, int neighbor_id) const
+	{
+		return this->local_time_stepping ? this->local_time_stepping->interface_weight(element_id, neighbor_id) : 1.;
+	}
+
+	/// The numerical flux of the forms, for LocalTimeSteppingFluxes.
+	VijayasundaramNumericalFlux* num_flux;
+
+	void interface_flux(double result[4], double w_L[4], double w_R[4], double nx, double ny)
+	{
+		this->num_flux->numerical_flux(result, w_L, w_R, nx, ny);
+	}
+
+	/// 0 for the solid wall, 1 + the index of the external state for an inlet / outlet, as in the constructor.
+	int boundary_condition(const std::string& marker) const
+	{
+		for (unsigned int marker_i = 0; marker_i < solid_wall_markers.size(); marker_i++)
+			if (solid_wall_markers[marker_i] == marker)
+				return 0;
+		for (unsigned int inlet_i = 0; inlet_i < inlet_markers.size(); inlet_i++)
+			if (inlet_markers[inlet_i] == marker)
+				return 1 + inlet_i;
+		for (unsigned int outlet_i = 0; outlet_i < outlet_markers.size(); outlet_i++)
+			if (outlet_markers[outlet_i] == marker)
+				return 1 + ((rho_ext.size() >= outlet_markers.size() + inlet_markers.size()) ? inlet_markers.size() + outlet_i : 0);
+		return -1;
+	}
+
+	void boundary_flux(double result[4], double w_L[4], double nx, double ny, int condition)
+	{
+		if (condition == 0)
+		{
+			this->num_flux->numerical_flux_solid_wall(result, w_L, nx, ny);
+			return;
+		}
+
+		int ext_i = condition - 1;
+		double w_B[4] = { rho_ext[ext_i], rho_ext[ext_i] * v1_ext[ext_i], rho_ext[ext_i] * v2_ext[ext_i], energy_ext[ext_i] };
+		this->num_flux->numerical_flux_inlet(result, w_L, w_B, nx, ny);
+	}
+
+	EulerEquationsWeakFormExplicit(double kappa,
+		std::vector<double> rho_ext, std::vector<double> v1_ext, std::vector<double> v2_ext, std::vector<double> pressure_ext,
+		std::vector<std::string> solid_wall_markers, std::vector<std::string> inlet_markers, std::vector<std::string> outlet_markers,
+		MeshFunctionSharedPtr<double> prev_density, MeshFunctionSharedPtr<double> prev_density_vel_x, MeshFunctionSharedPtr<double> prev_density_vel_y, MeshFunctionSharedPtr<double> prev_energy,
+		int num_of_equations = 4) :
+		WeakForm<double>(num_of_equations),
+		kappa(kappa), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), pressure_ext(pressure_ext),
+		solid_wall_markers(solid_wall_markers), inlet_markers(inlet_markers), outlet_markers(outlet_markers),
+		prev_density(prev_density), prev_density_vel_x(prev_density_vel_x), prev_density_vel_y(prev_density_vel_y), prev_energy(prev_energy),
+		local_time_stepping(NULL), num_flux(new VijayasundaramNumericalFlux(kappa))
+	{
+		for (unsigned int inlet_i = 0; inlet_i < inlet_markers.size(); inlet_i++)
+			energy_ext.push_back(QuantityCalculator::calc_energy(rho_ext[inlet_i], rho_ext[inlet_i] * v1_ext[inlet_i], rho_ext[inlet_i] * v2_ext[inlet_i], pressure_ext[inlet_i], kappa));
+		// Outlets with their own ext values.
+		for (unsigned int outlet_i = 0; outlet_i < outlet_markers.size() && inlet_markers.size() + outlet_i < rho_ext.size(); outlet_i++)
+		{
+			int ext_i = inlet_markers.size() + outlet_i;
+			energy_ext.push_back(QuantityCalculator::calc_energy(rho_ext[ext_i], rho_ext[ext_i] * v1_ext[ext_i], rho_ext[ext_i] * v2_ext[ext_i], pressure_ext[ext_i], kappa));
+		}
+
+		for (int form_i = 0; form_i < 4; form_i++)
+		{
+			add_vector_form(new EulerEquationsVectorFormVolExplicit(form_i, kappa));
+
+			add_vector_form_DG(new EulerEquationsVectorFormDGExplicit(form_i, kappa));
+
+			add_vector_form_surf(new EulerEquationsVectorFormSolidWallExplicit(form_i, solid_wall_markers, kappa));
+
+			for (unsigned int inlet_i = 0; inlet_i < inlet_markers.size(); inlet_i++)
+				add_vector_form_surf(new EulerEquationsVectorFormInletOutletExplicit(form_i, rho_ext[inlet_i], v1_ext[inlet_i], v2_ext[inlet_i], energy_ext[inlet_i], inlet_markers[inlet_i], kappa));
+
+			for (unsigned int outlet_i = 0; outlet_i < outlet_markers.size(); outlet_i++)
+			{
+				// If we specified ext values also for outlets.
+				if (rho_ext.size() >= outlet_markers.size() + inlet_markers.size())
+					add_vector_form_surf(new EulerEquationsVectorFormInletOutletExplicit(form_i, rho_ext[outlet_i + inlet_markers.size()], v1_ext[outlet_i + inlet_markers.size()], v2_ext[outlet_i + inlet_markers.size()], energy_ext[outlet_i + inlet_markers.size()], outlet_markers[outlet_i], kappa));
+				// Otherwise take the first ext value.
+				else
+					add_vector_form_surf(new EulerEquationsVectorFormInletOutletExplicit(form_i, rho_ext[0], v1_ext[0], v2_ext[0], energy_ext[0], outlet_markers[outlet_i], kappa));
+			}
+		}
+
+		this->set_ext({ prev_density, prev_density_vel_x, prev_density_vel_y, prev_energy });
+	};
+
+	virtual ~EulerEquationsWeakFormExplicit()
+	{
+		delete this->num_flux;
+	}
+
+	void set_active_edge_state(Element** e, unsigned char isurf)
+	{
+		this->cacheSurf.invalidate();
+	}
+
+	void set_active_DG_state(Element** e, unsigned char isurf)
+	{
+		this->cacheDG.invalidate();
+	}
+
+	WeakForm<double>* clone() const
+	{
+		EulerEquationsWeakFormExplicit* wf = new EulerEquationsWeakFormExplicit(this->kappa, this->rho_ext, this->v1_ext, this->v2_ext, this->pressure_ext,
+			this->solid_wall_markers, this->inlet_markers, this->outlet_markers, this->prev_density, this->prev_density_vel_x, this->prev_density_vel_y, this->prev_energy, this->neq);
+		wf->local_time_stepping = this->local_time_stepping;
+
+		wf->ext.clear();
+
+		for (unsigned int i = 0; i < this->ext.size(); i++)
+		{
+			MeshFunctionSharedPtr<double> ext = this->ext[i]->clone();
+
+			if (dynamic_cast<Solution<double>*>(this->ext[i].get()))
+			{
+				if ((dynamic_cast<Solution<double>*>(this->ext[i].get()))->get_type() == HERMES_SLN)
+					dynamic_cast<Solution<double>*>(ext.get())->set_type(HERMES_SLN);
+			}
+			wf->ext.push_back(ext);
+		}
+
+		return wf;
+	}
+
+	void cloneMembers(const WeakFormSharedPtr<double>& otherWf)
+	{
+	}
+
+	/// Volume part: the integral of f_1(w) dv/dx + f_2(w) dv/dy.
+	class EulerEquationsVectorFormVolExplicit : public VectorFormVol < double >
+	{
+	public:
+		EulerEquationsVectorFormVolExplicit(int i, double kappa)
+			: VectorFormVol<double>(i), kappa(kappa) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, GeomVol<double> *e,
+			Func<double>* *ext) const
+		{
+			double weight = static_cast<EulerEquationsWeakFormExplicit*>(wf)->element_weight(e->id);
+			if (weight == 0.)
+				return 0.;
+
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+			{
+				double rho = ext[0]->val[point_i];
+				double rho_v_x = ext[1]->val[point_i];
+				double rho_v_y = ext[2]->val[point_i];
+				double rho_e = ext[3]->val[point_i];
+				double p = QuantityCalculator::calc_pressure(rho, rho_v_x, rho_v_y, rho_e, kappa);
+
+				double f_1 = 0., f_2 = 0.;
+				switch (i)
+				{
+				case 0:
+					f_1 = rho_v_x;
+					f_2 = rho_v_y;
+					break;
+				case 1:
+					f_1 = rho_v_x * rho_v_x / rho + p;
+					f_2 = rho_v_x * rho_v_y / rho;
+					break;
+				case 2:
+					f_1 = rho_v_x * rho_v_y / rho;
+					f_2 = rho_v_y * rho_v_y / rho + p;
+					break;
+				case 3:
+					f_1 = rho_v_x * (rho_e + p) / rho;
+					f_2 = rho_v_y * (rho_e + p) / rho;
+					break;
+				}
+
+				result += wt[point_i] * (f_1 * v->dx[point_i] + f_2 * v->dy[point_i]);
+			}
+
+			return weight * result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormVol<double>* clone() const
+		{
+			EulerEquationsVectorFormVolExplicit* form = new EulerEquationsVectorFormVolExplicit(this->i, this->kappa);
+			form->wf = this->wf;
+			return form;
+		}
+
+		double kappa;
+	};
+
+	/// Inner edges: minus the integral of the numerical flux H(w_L, w_R, n) times v.
+	class EulerEquationsVectorFormDGExplicit : public VectorFormDG < double >
+	{
+	public:
+		EulerEquationsVectorFormDGExplicit(int i, double kappa)
+			: VectorFormDG<double>(i), num_flux(new VijayasundaramNumericalFlux(kappa))
+		{
+		}
+
+		~EulerEquationsVectorFormDGExplicit()
+		{
+			delete num_flux;
+		}
+
+		double value(int n, double *wt, DiscontinuousFunc<double> *u_ext[], Func<double> *v,
+			InterfaceGeom<double> *e, DiscontinuousFunc<double>** ext) const
+		{
+			double weight = static_cast<EulerEquationsWeakFormExplicit*>(wf)->interface_weight(e->central_el->id, e->neighb_el->id);
+			if (weight == 0.)
+				return 0.;
+
+			EdgeFluxCache& cache = static_cast<EulerEquationsWeakFormExplicit*>(wf)->cacheDG;
+			if (!cache.is_ready(n))
+			{
+				cache.reserve(n);
+				const double* w_L[4] = { ext[0]->val, ext[1]->val, ext[2]->val, ext[3]->val };
+				const double* w_R[4] = { ext[0]->val_neighbor, ext[1]->val_neighbor, ext[2]->val_neighbor, ext[3]->val_neighbor };
+				num_flux->numerical_flux_batch(n, cache.flux, w_L, w_R, e->nx, e->ny);
+				cache.ready = true;
+			}
+
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * cache.flux[i][point_i] * v->val[point_i];
+
+			return -weight * result;
+		}
+
+		Ord ord(int n, double *wt, DiscontinuousFunc<Ord> *u_ext[], Func<Ord> *v, InterfaceGeom<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormDG<double>* clone() const
+		{
+			EulerEquationsVectorFormDGExplicit* form = new EulerEquationsVectorFormDGExplicit(this->i, this->num_flux->kappa);
+			form->wf = this->wf;
+			return form;
+		}
+
+		VijayasundaramNumericalFlux* num_flux;
+	};
+
+	class EulerEquationsVectorFormSolidWallExplicit : public VectorFormSurf < double >
+	{
+	public:
+		EulerEquationsVectorFormSolidWallExplicit(int i, std::vector<std::string> markers, double kappa)
+			: VectorFormSurf<double>(i), num_flux(new VijayasundaramNumericalFlux(kappa))
+		{
+			set_areas(markers);
+		}
+
+		~EulerEquationsVectorFormSolidWallExplicit()
+		{
+			delete num_flux;
+		}
+
+		double value(int n, double *wt, Func<double> *u_ext[],
+			Func<double> *v, GeomSurf<double> *e, Func<double>* *ext) const
+		{
+			double weight = static_cast<EulerEquationsWeakFormExplicit*>(wf)->element_weight(e->id);
+			if (weight == 0.)
+				return 0.;
+
+			// The flux (all four components) is calculated by the first of the four forms on the edge.
+			EdgeFluxCache& cache = static_cast<EulerEquationsWeakFormExplicit*>(wf)->cacheSurf;
+			if (!cache.is_ready(n))
+			{
+				cache.reserve(n);
+				double w_L[4], flux[4];
+				for (int point_i = 0; point_i < n; point_i++)
+				{
+					w_L[0] = ext[0]->val[point_i];
+					w_L[1] = ext[1]->val[point_i];
+					w_L[2] = ext[2]->val[point_i];
+					w_L[3] = ext[3]->val[point_i];
+
+					num_flux->numerical_flux_solid_wall(flux, w_L, e->nx[point_i], e->ny[point_i]);
+					for (int k = 0; k < 4; k++)
+						cache.flux[k][point_i] = flux[k];
+				}
+				cache.ready = true;
+			}
+
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * cache.flux[i][point_i] * v->val[point_i];
+
+			return -weight * result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v,
+			GeomSurf<Ord> *e, Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormSurf<double>* clone()  const
+		{
+			EulerEquationsVectorFormSolidWallExplicit* form = new EulerEquationsVectorFormSolidWallExplicit(this->i, this->areas, this->num_flux->kappa);
+			form->wf = this->wf;
+			return form;
+		}
+
+		VijayasundaramNumericalFlux* num_flux;
+	};
+
+	class EulerEquationsVectorFormInletOutletExplicit : public VectorFormSurf < double >
+	{
+	public:
+		EulerEquationsVectorFormInletOutletExplicit(int i, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::string marker, double kappa)
+			: VectorFormSurf<double>(i), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext),
+			num_flux(new VijayasundaramNumericalFlux(kappa))
+		{
+			set_area(marker);
+		}
+		EulerEquationsVectorFormInletOutletExplicit(int i, double rho_ext, double v1_ext, double v2_ext, double energy_ext, std::vector<std::string> markers, double kappa)
+			: VectorFormSurf<double>(i), rho_ext(rho_ext), v1_ext(v1_ext), v2_ext(v2_ext), energy_ext(energy_ext),
+			num_flux(new VijayasundaramNumericalFlux(kappa))
+		{
+			set_areas(markers);
+		}
+
+		~EulerEquationsVectorFormInletOutletExplicit()
+		{
+			delete num_flux;
+		}
+
+		double value(int n, double *wt, Func<double> *u_ext[],
+			Func<double> *v, GeomSurf<double> *e, Func<double>* *ext) const
+		{
+			double weight = static_cast<EulerEquationsWeakFormExplicit*>(wf)->element_weight(e->id);
+			if (weight == 0.)
+				return 0.;
+
+			// The flux (all four components) is calculated by the first of the four forms on the edge.
+			EdgeFluxCache& cache = static_cast<EulerEquationsWeakFormExplicit*>(wf)->cacheSurf;
+			if (!cache.is_ready(n))
+			{
+				cache.reserve(n);
+				double w_L[4], w_B[4], flux[4];
+
+				// "Prescribed" boundary state.
+				w_B[0] = this->rho_ext;
+				w_B[1] = this->rho_ext * this->v1_ext;
+				w_B[2] = this->rho_ext * this->v2_ext;
+				w_B[3] = this->energy_ext;
+
+				for (int point_i = 0; point_i < n; point_i++)
+				{
+					w_L[0] = ext[0]->val[point_i];
+					w_L[1] = ext[1]->val[point_i];
+					w_L[2] = ext[2]->val[point_i];
+					w_L[3] = ext[3]->val[point_i];
+
+					num_flux->numerical_flux_inlet(flux, w_L, w_B, e->nx[point_i], e->ny[point_i]);
+					for (int k = 0; k < 4; k++)
+						cache.flux[k][point_i] = flux[k];
+				}
+				cache.ready = true;
+			}
+
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * cache.flux[i][point_i] * v->val[point_i];
+
+			return -weight * result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v,
+			GeomSurf<Ord> *e, Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormSurf<double>* clone()  const
+		{
+			EulerEquationsVectorFormInletOutletExplicit* form = new EulerEquationsVectorFormInletOutletExplicit(this->i, this->rho_ext, this->v1_ext, this->v2_ext, this->energy_ext, this->areas, this->num_flux->kappa);
+			form->wf = this->wf;
+			return form;
+		}
+
+		double rho_ext;
+		double v1_ext;
+		double v2_ext;
+		double energy_ext;
+		VijayasundaramNumericalFlux* num_flux;
+	};
+};
+
+/// The semi-implicit scheme of the Euler equations coupled with the heat transfer in a temperature field T (on its own mesh,
+/// see HeatEquationWeakFormCoupledWithFlow, the two are solved separately by PartitionedCoupling in euler_util.h).
+/// The gas exchanges heat with the field, the energy equation has the source heat_transfer_coefficient * (T - theta),
+/// theta = p / rho the (dimensionless) temperature of the gas. T is the ext function after the flow state, the source is explicit.
+class EulerEquationsWeakFormSemiImplicitCoupledWithHeat : public EulerEquationsWeakFormSemiImplicit
+{
+public:
+	MeshFunctionSharedPtr<double> temperature;
+	double heat_transfer_coefficient;
+
+	EulerEquationsWeakFormSemiImplicitCoupledWithHeat(double kappa,
+		std::vector<double> rho_ext, std::vector<double> v1_ext, std::vector<double> v2_ext, std::vector<double> pressure_ext,
+		std::vector<std::string> solid_wall_markers, std::vector<std::string> inlet_markers, std::vector<std::string> outlet_markers,
+		MeshFunctionSharedPtr<double> prev_density, MeshFunctionSharedPtr<double> prev_density_vel_x, MeshFunctionSharedPtr<double> prev_density_vel_y, MeshFunctionSharedPtr<double> prev_energy,
+		MeshFunctionSharedPtr<double> temperature, double heat_transfer_coefficient, bool fvm_only = false) :
+		EulerEquationsWeakFormSemiImplicit(kappa, rho_ext, v1_ext, v2_ext, pressure_ext, solid_wall_markers, inlet_markers, outlet_markers,
+		prev_density, prev_density_vel_x, prev_density_vel_y, prev_energy, fvm_only),
+		temperature(temperature), heat_transfer_coefficient(heat_transfer_coefficient)
+	{
+		add_vector_form(new EulerEquationsLinearFormHeatExchange(kappa, heat_transfer_coefficient));
+
+		this->set_ext({ prev_density, prev_density_vel_x, prev_density_vel_y, prev_energy, temperature });
+	}
+
+	WeakForm<double>* clone() const
+	{
+		EulerEquationsWeakFormSemiImplicitCoupledWithHeat* wf = new EulerEquationsWeakFormSemiImplicitCoupledWithHeat(this->kappa, this->rho_ext, this->v1_ext, this->v2_ext, this->pressure_ext,
+			this->solid_wall_markers, this->inlet_markers, this->outlet_markers, this->prev_density, this->prev_density_vel_x, this->prev_density_vel_y, this->prev_energy,
+			this->temperature, this->heat_transfer_coefficient, this->fvm_only);
+
+		wf->ext.clear();
+
+		for (unsigned int i = 0; i < this->ext.size(); i++)
+		{
+			MeshFunctionSharedPtr<double> ext = this->ext[i]->clone();
+
+			if (dynamic_cast<Solution<double>*>(this->ext[i].get()))
+			{
+				if ((dynamic_cast<Solution<double>*>(this->ext[i].get()))->get_type() == HERMES_SLN)
+					dynamic_cast<Solution<double>*>(ext.get())->set_type(HERMES_SLN);
+			}
+			wf->ext.push_back(ext);
+		}
+
+		wf->set_current_time_step(this->get_current_time_step());
+		wf->discreteIndicator = this->discreteIndicator;
+
+		return wf;
+	}
+
+	class EulerEquationsLinearFormHeatExchange : public VectorFormVol < double >
+	{
+	public:
+		EulerEquationsLinearFormHeatExchange(double kappa, double heat_transfer_coefficient)
+			: VectorFormVol<double>(3), kappa(kappa), heat_transfer_coefficient(heat_transfer_coefficient) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, GeomVol<double> *e,
+			Func<double>* *ext) const
+		{
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+			{
+				double rho = ext[0]->val[point_i];
+				double theta = QuantityCalculator::calc_pressure(rho, ext[1]->val[point_i], ext[2]->val[point_i], ext[3]->val[point_i], kappa) / rho;
+				result += wt[point_i] * (ext[4]->val[point_i] - theta) * v->val[point_i];
+			}
+			return result * heat_transfer_coefficient * wf->get_current_time_step();
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormVol<double>* clone() const { return new EulerEquationsLinearFormHeatExchange(this->kappa, this->heat_transfer_coefficient); }
+
+		double kappa;
+		double heat_transfer_coefficient;
+	};
+};
+
+/// Heat transfer in the temperature field T coupled with the flow (EulerEquationsWeakFormSemiImplicitCoupledWithHeat): T is advected
+/// by the flow velocity, diffuses and exchanges heat with the gas,
+///   heat_capacity * (dT/dt + v . grad T) - lambda * laplace T = -heat_transfer_coefficient * (T - theta),
+/// by the implicit Euler method, with the flow state (the ext functions after the previous time level temperature) taken as given.
+class HeatEquationWeakFormCoupledWithFlow : public WeakForm < double >
+{
+public:
+	double kappa;
+	double lambda;
+	double heat_capacity;
+	double heat_transfer_coefficient;
+
+	MeshFunctionSharedPtr<double> prev_temperature;
+	MeshFunctionSharedPtr<double> density;
+	MeshFunctionSharedPtr<double> density_vel_x;
+	MeshFunctionSharedPtr<double> density_vel_y;
+	MeshFunctionSharedPtr<double> energy;
+
+	HeatEquationWeakFormCoupledWithFlow(double kappa, double lambda, double heat_capacity, double heat_transfer_coefficient, MeshFunctionSharedPtr<double> prev_temperature,
+		MeshFunctionSharedPtr<double> density, MeshFunctionSharedPtr<double> density_vel_x, MeshFunctionSharedPtr<double> density_vel_y, MeshFunctionSharedPtr<double> energy) :
+		WeakForm<double>(1), kappa(kappa), lambda(lambda), heat_capacity(heat_capacity), heat_transfer_coefficient(heat_transfer_coefficient),
+		prev_temperature(prev_temperature), density(density), density_vel_x(density_vel_x), density_vel_y(density_vel_y), energy(energy)
+	{
+		add_matrix_form(new HeatEquationBilinearForm(lambda, heat_capacity, heat_transfer_coefficient));
+		add_vector_form(new HeatEquationLinearForm(kappa, heat_capacity, heat_transfer_coefficient));
+
+		this->set_ext({ prev_temperature, density, density_vel_x, density_vel_y, energy });
+	}
+
+	WeakForm<double>* clone() const
+	{
+		HeatEquationWeakFormCoupledWithFlow* wf = new HeatEquationWeakFormCoupledWithFlow(this->kappa, this->lambda, this->heat_capacity, this->heat_transfer_coefficient,
+			this->prev_temperature, this->density, this->density_vel_x, this->density_vel_y, this->energy);
+
+		wf->ext.clear();
+
+		for (unsigned int i = 0; i < this->ext.size(); i++)
+		{
+			MeshFunctionSharedPtr<double> ext = this->ext[i]->clone();
+
+			if (dynamic_cast<Solution<double>*>(this->ext[i].get()))
+			{
+				if ((dynamic_cast<Solution<double>*>(this->ext[i].get()))->get_type() == HERMES_SLN)
+					dynamic_cast<Solution<double>*>(ext.get())->set_type(HERMES_SLN);
+			}
+			wf->ext.push_back(ext);
+		}
+
+		wf->set_current_time_step(this->get_current_time_step());
+
+		return wf;
+	}
+
+	class HeatEquationBilinearForm : public MatrixFormVol < double >
+	{
+	public:
+		HeatEquationBilinearForm(double lambda, double heat_capacity, double heat_transfer_coefficient)
+			: MatrixFormVol<double>(0, 0), lambda(lambda), heat_capacity(heat_capacity), heat_transfer_coefficient(heat_transfer_coefficient) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *u, Func<double> *v,
+			GeomVol<double> *e, Func<double>* *ext) const
+		{
+			double time_step = wf->get_current_time_step();
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+			{
+				double v_1 = ext[2]->val[point_i] / ext[1]->val[point_i];
+				double v_2 = ext[3]->val[point_i] / ext[1]->val[point_i];
+				double advection = heat_capacity * (v_1 * u->dx[point_i] + v_2 * u->dy[point_i]) * v->val[point_i];
+				double diffusion = lambda * (u->dx[point_i] * v->dx[point_i] + u->dy[point_i] * v->dy[point_i]);
+				result += wt[point_i] * ((heat_capacity + time_step * heat_transfer_coefficient) * u->val[point_i] * v->val[point_i] + time_step * (advection + diffusion));
+			}
+			return result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *u, Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return u->val[0] * v->val[0] * Ord(2);
+		}
+
+		MatrixFormVol<double>* clone() const { return new HeatEquationBilinearForm(this->lambda, this->heat_capacity, this->heat_transfer_coefficient); }
+
+		double lambda;
+		double heat_capacity;
+		double heat_transfer_coefficient;
+	};
+
+	class HeatEquationLinearForm : public VectorFormVol < double >
+	{
+	public:
+		HeatEquationLinearForm(double kappa, double heat_capacity, double heat_transfer_coefficient)
+			: VectorFormVol<double>(0), kappa(kappa), heat_capacity(heat_capacity), heat_transfer_coefficient(heat_transfer_coefficient) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, GeomVol<double> *e,
+			Func<double>* *ext) const
+		{
+			double time_step = wf->get_current_time_step();
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+			{
+				double rho = ext[1]->val[point_i];
+				double theta = QuantityCalculator::calc_pressure(rho, ext[2]->val[point_i], ext[3]->val[point_i], ext[4]->val[point_i], kappa) / rho;
+				result += wt[point_i] * (heat_capacity * ext[0]->val[point_i] + time_step * heat_transfer_coefficient * theta) * v->val[point_i];
+			}
+			return result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return Ord(10);
+		}
+
+		VectorFormVol<double>* clone() const { return new HeatEquationLinearForm(this->kappa, this->heat_capacity, this->heat_transfer_coefficient); }
+
+		double kappa;
+		double heat_capacity;
+		double heat_transfer_coefficient;
+	};
+};
+
+/// The concentration c of a substance transported by the flow, on its own mesh, with its own (continuous) space,
+///   dc/dt + v . grad c - epsilon * laplace c = 0,
+/// by the implicit Euler method, with the flow state taken as given. Zero diffusive flux where no Dirichlet condition is prescribed.
+/// The concentration does not act back on the flow, so the two can be advanced with their own time steps (see MultirateTimeStepping
+/// in euler_util.h): the flow is given at the start (prev_density, ...) and at the end (density, ...) of the flow time step, and
+/// the concentration time step ends in between, at the time interpolation parameter theta, where the flow is interpolated linearly.
+class ConcentrationEquationWeakFormCoupledWithFlow : public WeakForm < double >
+{
+public:
+	double epsilon;
+
+	MeshFunctionSharedPtr<double> prev_concentration;
+	MeshFunctionSharedPtr<double> prev_density;
+	MeshFunctionSharedPtr<double> prev_density_vel_x;
+	MeshFunctionSharedPtr<double> prev_density_vel_y;
+	MeshFunctionSharedPtr<double> density;
+	MeshFunctionSharedPtr<double> density_vel_x;
+	MeshFunctionSharedPtr<double> density_vel_y;
+
+	ConcentrationEquationWeakFormCoupledWithFlow(double epsilon, MeshFunctionSharedPtr<double> prev_concentration,
+		MeshFunctionSharedPtr<double> prev_density, MeshFunctionSharedPtr<double> prev_density_vel_x, MeshFunctionSharedPtr<double> prev_density_vel_y,
+		MeshFunctionSharedPtr<double> density, MeshFunctionSharedPtr<double> density_vel_x, MeshFunctionSharedPtr<double> density_vel_y) :
+		WeakForm<double>(1), epsilon(epsilon), prev_concentration(prev_concentration),
+		prev_density(prev_density), prev_density_vel_x(prev_density_vel_x), prev_density_vel_y(prev_density_vel_y),
+		density(density), density_vel_x(density_vel_x), density_vel_y(density_vel_y), time_interpolation(1.)
+	{
+		add_matrix_form(new ConcentrationEquationBilinearForm(epsilon));
+		add_vector_form(new ConcentrationEquationLinearForm());
+
+		this->set_ext({ prev_concentration, prev_density, prev_density_vel_x, prev_density_vel_y, density, density_vel_x, density_vel_y });
+	}
+
+	/// The flow is taken at prev + theta * (current - prev), 1 (the end of the flow time step) by default.
+	void set_time_interpolation(double theta) { this->time_interpolation = theta; }
+	double get_time_interpolation() const { return this->time_interpolation; }
+
+	WeakForm<double>* clone() const
+	{
+		ConcentrationEquationWeakFormCoupledWithFlow* wf = new ConcentrationEquationWeakFormCoupledWithFlow(this->epsilon, this->prev_concentration,
+			this->prev_density, this->prev_density_vel_x, this->prev_density_vel_y, this->density, this->density_vel_x, this->density_vel_y);
+
+		wf->ext.clear();
+
+		for (unsigned int i = 0; i < this->ext.size(); i++)
+		{
+			MeshFunctionSharedPtr<double> ext = this->ext[i]->clone();
+
+			if (dynamic_cast<Solution<double>*>(this->ext[i].get()))
+			{
+				if ((dynamic_cast<Solution<double>*>(this->ext[i].get()))->get_type() == HERMES_SLN)
+					dynamic_cast<Solution<double>*>(ext.get())->set_type(HERMES_SLN);
+			}
+			wf->ext.push_back(ext);
+		}
+
+		wf->set_current_time_step(this->get_current_time_step());
+		wf->time_interpolation = this->time_interpolation;
+
+		return wf;
+	}
+
+	class ConcentrationEquationBilinearForm : public MatrixFormVol < double >
+	{
+	public:
+		ConcentrationEquationBilinearForm(double epsilon) : MatrixFormVol<double>(0, 0), epsilon(epsilon) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *u, Func<double> *v,
+			GeomVol<double> *e, Func<double>* *ext) const
+		{
+			double time_step = wf->get_current_time_step();
+			double theta = static_cast<ConcentrationEquationWeakFormCoupledWithFlow*>(wf)->time_interpolation;
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+			{
+				// The conservative variables are interpolated, the velocity is calculated from them.
+				double rho = (1. - theta) * ext[1]->val[point_i] + theta * ext[4]->val[point_i];
+				double v_1 = ((1. - theta) * ext[2]->val[point_i] + theta * ext[5]->val[point_i]) / rho;
+				double v_2 = ((1. - theta) * ext[3]->val[point_i] + theta * ext[6]->val[point_i]) / rho;
+				double advection = (v_1 * u->dx[point_i] + v_2 * u->dy[point_i]) * v->val[point_i];
+				double diffusion = epsilon * (u->dx[point_i] * v->dx[point_i] + u->dy[point_i] * v->dy[point_i]);
+				result += wt[point_i] * (u->val[point_i] * v->val[point_i] + time_step * (advection + diffusion));
+			}
+			return result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *u, Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return u->val[0] * v->val[0] * Ord(2);
+		}
+
+		MatrixFormVol<double>* clone() const { return new ConcentrationEquationBilinearForm(this->epsilon); }
+
+		double epsilon;
+	};
+
+	class ConcentrationEquationLinearForm : public VectorFormVol < double >
+	{
+	public:
+		ConcentrationEquationLinearForm() : VectorFormVol<double>(0) {}
+
+		double value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, GeomVol<double> *e,
+			Func<double>* *ext) const
+		{
+			double result = 0.;
+			for (int point_i = 0; point_i < n; point_i++)
+				result += wt[point_i] * ext[0]->val[point_i] * v->val[point_i];
+			return result;
+		}
+
+		Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, GeomVol<Ord> *e,
+			Func<Ord>* *ext) const
+		{
+			return ext[0]->val[0] * v->val[0];
+		}
+
+		VectorFormVol<double>* clone() const { return new ConcentrationEquationLinearForm(); }
+	};
+
+protected:
+	double time_interpolation;
+};
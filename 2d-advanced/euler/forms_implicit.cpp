@@ -813,25 +813,19 @@ protected:
         w_L[3] = u_ext[3]->get_val_central(i);
         w_R[3] = u_ext[3]->get_val_neighbor(i);
 
-        double P_plus_1[4] = {1, 0, 0, 0};
-        double P_plus_2[4] = {0, 1, 0, 0};
-        double P_plus_3[4] = {0, 0, 1, 0};
-        double P_plus_4[4] = {0, 0, 0, 1};
-
-        double P_minus_1[4] = {1, 0, 0, 0};
-        double P_minus_2[4] = {0, 1, 0, 0};
-        double P_minus_3[4] = {0, 0, 1, 0};
-        double P_minus_4[4] = {0, 0, 0, 1};
-
-        num_flux->P_plus(P_plus_1, w_L, P_plus_1, e->nx[i], e->ny[i]);
-        num_flux->P_plus(P_plus_2, w_L, P_plus_2, e->nx[i], e->ny[i]);
-        num_flux->P_plus(P_plus_3, w_L, P_plus_3, e->nx[i], e->ny[i]);
-        num_flux->P_plus(P_plus_4, w_L, P_plus_4, e->nx[i], e->ny[i]);
-
-        num_flux->P_minus(P_minus_1, w_R, P_minus_1, e->nx[i], e->ny[i]);
-        num_flux->P_minus(P_minus_2, w_R, P_minus_2, e->nx[i], e->ny[i]);
-        num_flux->P_minus(P_minus_3, w_R, P_minus_3, e->nx[i], e->ny[i]);
-        num_flux->P_minus(P_minus_4, w_R, P_minus_4, e->nx[i], e->ny[i]);
+        // Columns of P^+(w_L) and P^-(w_R), i.e. their actions on the unit vectors.
+        double P_plus[16], P_minus[16];
+        num_flux->P_matrices(P_plus, w_L, P_minus, w_R, e->nx[i], e->ny[i]);
+
+        double* P_plus_1 = P_plus;
+        double* P_plus_2 = P_plus + 4;
+        double* P_plus_3 = P_plus + 8;
+        double* P_plus_4 = P_plus + 12;
+
+        double* P_minus_1 = P_minus;
+        double* P_minus_2 = P_minus + 4;
+        double* P_minus_3 = P_minus + 8;
+        double* P_minus_4 = P_minus + 12;
 
         result_0_0 += wt[i] * (P_plus_1[0] * u->get_val_central(i) + P_minus_1[0] 
         * u->get_val_neighbor(i)) * (v->get_val_central(i) - v->get_val_neighbor(i));
@@ -1071,29 +1065,40 @@ protected:
     }
   };
 
+  // Computes the numerical flux in all quadrature points of the edge in one call (see NumericalFlux::numerical_flux_batch())
+  // and scatters the four components to the four equations.
   class EulerEquationsLinearFormInterface : public MultiComponentVectorFormSurf<double>
   {
   public:
-    EulerEquationsLinearFormInterface({coordinates, H2D_DG_INNER_EDGE}, num_flux(num_flux) {}
+    EulerEquationsLinearFormInterface(std::vector<unsigned int> coordinates, NumericalFlux* num_flux) 
+      : MultiComponentVectorFormSurf<double>(coordinates, H2D_DG_INNER_EDGE), num_flux(num_flux) {}
 
     void value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, 
-      Geom<double> *e, ExtData<double> *ext,{int i = 0;i < n;i++} {
-        w_L[0] = u_ext[0]->get_val_central(i);
-        w_R[0] = u_ext[0]->get_val_neighbor(i);
-
-        w_L[1] = u_ext[1]->get_val_central(i);
-        w_R[1] = u_ext[1]->get_val_neighbor(i);
-
-        w_L[2] = u_ext[2]->get_val_central(i);
-        w_R[2] = u_ext[2]->get_val_neighbor(i);
-
-        w_L[3] = u_ext[3]->get_val_central(i);
-        w_R[3] = u_ext[3]->get_val_neighbor(i);
+      Geom<double> *e, ExtData<double> *ext, std::vector<double>& result) const
+    {
+      // States and fluxes, one array of length n per quantity, in the form's own storage (every assembling thread has its own clone).
+      if ((int)buffer.size() < 12 * n)
+        buffer.resize(12 * n);
+      double* states_L[4];
+      double* states_R[4];
+      double* flux[4];
+      for(unsigned int k = 0;k < 4;k++) {
+        states_L[k] = &buffer[k * n];
+        states_R[k] = &buffer[(4 + k) * n];
+        flux[k] = &buffer[(8 + k) * n];
+        for (int i = 0;i < n;i++) {
+          states_L[k][i] = u_ext[k]->get_val_central(i);
+          states_R[k][i] = u_ext[k]->get_val_neighbor(i);
+        }
+      }
 
-        double flux[4];
-        num_flux->numerical_flux(flux, w_L, w_R, e->nx[i], e->ny[i]);
+      num_flux->numerical_flux_batch(n, flux, states_L, states_R, e->nx, e->ny);
 
+      double result_0 = 0, result_1 = 0, result_2 = 0, result_3 = 0;
+      for (int i = 0;i < n;i++) {
 #ifdef H2D_EULER_NUM_FLUX_TESTING
+        double w_L[4] = { states_L[0][i], states_L[1][i], states_L[2][i], states_L[3][i] };
+        double w_R[4] = { states_R[0][i], states_R[1][i], states_R[2][i], states_R[3][i] };
         double flux_testing_num_flux[4];
         double flux_testing_num_flux_conservativity_1[4];
         double flux_testing_num_flux_conservativity_2[4];
@@ -1138,15 +1143,17 @@ protected:
               info("Flux is not consistent.");
 #endif
 
-        result_0 -= wt[i] * v->val[i] * flux[0];
-        result_1 -= wt[i] * v->val[i] * flux[1];
-        result_2 -= wt[i] * v->val[i] * flux[2];
-        result_3 -= wt[i] * v->val[i] * flux[3];
+        result_0 -= wt[i] * v->val[i] * flux[0][i];
+        result_1 -= wt[i] * v->val[i] * flux[1][i];
+        result_2 -= wt[i] * v->val[i] * flux[2][i];
+        result_3 -= wt[i] * v->val[i] * flux[3][i];
       }
-      result.push_back(result_0 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_1 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_2 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_3 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
+
+      double tau = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->get_tau();
+      result.push_back(result_0 * tau);
+      result.push_back(result_1 * tau);
+      result.push_back(result_2 * tau);
+      result.push_back(result_3 * tau);
     }
 
     Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, Geom<Ord> *e, ExtData<Ord> *ext) const
@@ -1156,16 +1163,24 @@ protected:
 
     // Members.
     NumericalFlux* num_flux;
+    // Grows with the number of quadrature points, reused by all the edges.
+    mutable std::vector<double> buffer;
   };
 
+  // The flux vector is computed once per point and scattered to the four equations.
   class EulerEquationsLinearFormSolidWall : public MultiComponentVectorFormSurf<double>
   {
   public:
-    EulerEquationsLinearFormSolidWall({coordinates, marker}, num_flux(num_flux) {}
+    EulerEquationsLinearFormSolidWall(std::vector<unsigned int> coordinates, std::string marker, NumericalFlux* num_flux) 
+      : MultiComponentVectorFormSurf<double>(coordinates, marker), num_flux(num_flux) {}
 
     void value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, Geom<double> *e, 
-      ExtData<double> *ext,{int i = 0;i < n;i++} {
-        double w_L[4];
+      ExtData<double> *ext, std::vector<double>& result) const
+    {
+      double result_0 = 0, result_1 = 0, result_2 = 0, result_3 = 0;
+      double w_L[4];
+      for (int i = 0;i < n;i++) {
+        // Left (inner) state from the previous time level solution.
         w_L[0] = u_ext[0]->val[i];
         w_L[1] = u_ext[1]->val[i];
         w_L[2] = u_ext[2]->val[i];
@@ -1179,10 +1194,12 @@ protected:
         result_2 -= wt[i] * v->val[i] * flux[2];
         result_3 -= wt[i] * v->val[i] * flux[3];
       }
-      result.push_back(result_0 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_1 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_2 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_3 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
+
+      double tau = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->get_tau();
+      result.push_back(result_0 * tau);
+      result.push_back(result_1 * tau);
+      result.push_back(result_2 * tau);
+      result.push_back(result_3 * tau);
     }
 
     Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, Geom<Ord> *e, ExtData<Ord> *ext) const
@@ -1194,26 +1211,34 @@ protected:
     NumericalFlux* num_flux;
   };
 
+  // The flux vector is computed once per point and scattered to the four equations.
   class EulerEquationsLinearFormInlet : public MultiComponentVectorFormSurf<double>
   {
   public:
-    EulerEquationsLinearFormInlet({coordinates, marker}, num_flux(num_flux) {}
+    EulerEquationsLinearFormInlet(std::vector<unsigned int> coordinates, std::string marker, NumericalFlux* num_flux) 
+      : MultiComponentVectorFormSurf<double>(coordinates, marker), num_flux(num_flux) {}
 
     void value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, Geom<double> *e, 
-      ExtData<double> *ext,{int i = 0;i < n;i++} {
+      ExtData<double> *ext, std::vector<double>& result) const
+    {
+      double result_0 = 0, result_1 = 0, result_2 = 0, result_3 = 0;
+      double w_L[4], w_B[4];
+
+      // Boundary state, the same in all points.
+      w_B[0] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext;
+      w_B[1] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext 
+        * static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->v1_ext;
+      w_B[2] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext 
+        * static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->v2_ext;
+      w_B[3] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->energy_ext;
+
+      for (int i = 0;i < n;i++) {
         // Left (inner) state from the previous time level solution.
         w_L[0] = u_ext[0]->val[i];
         w_L[1] = u_ext[1]->val[i];
         w_L[2] = u_ext[2]->val[i];
         w_L[3] = u_ext[3]->val[i];
 
-        w_B[0] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext;
-        w_B[1] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext 
-          * static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->v1_ext;
-        w_B[2] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->rho_ext 
-          * static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->v2_ext;
-        w_B[3] = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->energy_ext;
-
         double flux[4];
         num_flux->numerical_flux_inlet(flux, w_L, w_B, e->nx[i], e->ny[i]);
 
@@ -1222,10 +1247,12 @@ protected:
         result_2 -= wt[i] * v->val[i] * flux[2];
         result_3 -= wt[i] * v->val[i] * flux[3];
       }
-      result.push_back(result_0 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_1 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_2 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_3 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
+
+      double tau = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->get_tau();
+      result.push_back(result_0 * tau);
+      result.push_back(result_1 * tau);
+      result.push_back(result_2 * tau);
+      result.push_back(result_3 * tau);
     }
 
     Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, Geom<Ord> *e, ExtData<Ord> *ext) const
@@ -1237,31 +1264,40 @@ protected:
     NumericalFlux* num_flux;
   };
 
+  // The flux vector is computed once per point and scattered to the four equations.
   class EulerEquationsLinearFormOutlet : public MultiComponentVectorFormSurf<double>
   {
   public:
-    EulerEquationsLinearFormOutlet({coordinates, marker}, num_flux(num_flux) {}
+    EulerEquationsLinearFormOutlet(std::vector<unsigned int> coordinates, std::string marker, NumericalFlux* num_flux) 
+      : MultiComponentVectorFormSurf<double>(coordinates, marker), num_flux(num_flux) {}
 
     void value(int n, double *wt, Func<double> *u_ext[], Func<double> *v, Geom<double> *e, 
-      ExtData<double> *ext,{int i = 0;i < n;i++} {
+      ExtData<double> *ext, std::vector<double>& result) const
+    {
+      double result_0 = 0, result_1 = 0, result_2 = 0, result_3 = 0;
+      double w_L[4];
+      double pressure_ext = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->pressure_ext;
+      for (int i = 0;i < n;i++) {
+        // Left (inner) state from the previous time level solution.
         w_L[0] = u_ext[0]->val[i];
         w_L[1] = u_ext[1]->val[i];
         w_L[2] = u_ext[2]->val[i];
         w_L[3] = u_ext[3]->val[i];
 
         double flux[4];
-        num_flux->numerical_flux_outlet(flux, w_L, 
-          static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->pressure_ext, e->nx[i], e->ny[i]);
+        num_flux->numerical_flux_outlet(flux, w_L, pressure_ext, e->nx[i], e->ny[i]);
+
         result_0 -= wt[i] * v->val[i] * flux[0];
         result_1 -= wt[i] * v->val[i] * flux[1];
         result_2 -= wt[i] * v->val[i] * flux[2];
         result_3 -= wt[i] * v->val[i] * flux[3];
       }
 
-      result.push_back(result_0 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_1 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_2 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
-      result.push_back(result_3 * static_cast<EulerEquationsWeakFormImplicit*>(wf)->get_tau());
+      double tau = static_cast<EulerEquationsWeakFormImplicitMultiComponent*>(wf)->get_tau();
+      result.push_back(result_0 * tau);
+      result.push_back(result_1 * tau);
+      result.push_back(result_2 * tau);
+      result.push_back(result_3 * tau);
     }
 
     Ord ord(int n, double *wt, Func<Ord> *u_ext[], Func<Ord> *v, Geom<Ord> *e, ExtData<Ord> *ext) const
@@ -1272,7 +1308,6 @@ protected:
     // Members.
     NumericalFlux* num_flux;
   };
-
   // Members.
   double rho_ext;
   double v1_ext;
@@ -25,6 +25,12 @@ const bool HERMES_VISUALIZATION = true;
 const bool VTK_VISUALIZATION = false;
 // Set visual output for every nth step.
 const unsigned int EVERY_NTH_STEP = 1;
+
+// Checkpointing (file checkpoint.dat) every nth step / every n seconds, 0 switches either off.
+const int CHECKPOINT_EVERY_NTH_STEP = 0;
+const double CHECKPOINT_EVERY_N_SECONDS = 0.;
+// Set to "true" to continue from the checkpoint (if there is one).
+const bool CHECKPOINT_RESTART = false;
 // Shock capturing.
 enum shockCapturingType
 {
@@ -51,6 +57,23 @@ const int INIT_REF_NUM_STEP = 2;
 double CFL_NUMBER = 0.25;
 // Initial time step.
 double time_step_n = 1E-6;
+// Time integration: 0 - semi-implicit (a linear system with the flux Jacobians is solved in each time step),
+// 1, 2, 3 - explicit SSP Runge-Kutta of this order (much cheaper time steps, but a smaller CFL_NUMBER is needed).
+const int SSP_RK_ORDER = 0;
+// Steady state by implicit pseudo time stepping with the Jacobian-free Newton-Krylov method (NewtonKrylovSolver in euler_util.h)
+// instead of the time stepping above, see euler-time-loop-implicit.cpp.
+const bool NEWTON_KRYLOV = false;
+// The pseudo time steps are local (per element), their CFL number starts at NEWTON_KRYLOV_CFL_NUMBER and is ramped
+// according to the decrease of the residual (switched evolution relaxation) up to NEWTON_KRYLOV_MAX_CFL_NUMBER.
+const double NEWTON_KRYLOV_CFL_NUMBER = 5.;
+const double NEWTON_KRYLOV_MAX_CFL_NUMBER = 1E5;
+// Relative tolerance of Newton's method in a pseudo time step, maximum number of its iterations, relative tolerance of GMRES.
+const double NEWTON_TOLERANCE = 1E-3;
+const int NEWTON_MAX_ITER = 10;
+const double GMRES_TOLERANCE = 1E-2;
+// The pseudo time stepping stops when the density residual has dropped by this many orders of magnitude, or after the maximum number of steps.
+const double STEADY_STATE_RESIDUAL_ORDERS = 6.;
+const int STEADY_STATE_MAX_STEPS = 2000;
 
 // Equation parameters.
 // Exterior pressure (dimensionless).
@@ -103,11 +126,6 @@ int main(int argc, char* argv[])
     }
     spaces[i]->assign_dofs();
   }
-  for_all_active_elements_fast(mesh)
-  {
-    space_stabilization->set_element_order(e->id, 0);
-  }
-  space_stabilization->assign_dofs();
 
   // Set initial conditions.
   MeshFunctionSharedPtr<double> prev_rho(new ConstantSolution<double>(mesh, RHO_EXT));
@@ -121,7 +139,25 @@ int main(int argc, char* argv[])
   std::vector<std::string> inlet_markers({ BDY_INLET });
   std::vector<std::string> outlet_markers({ BDY_OUTLET });
 
-  WeakFormSharedPtr<double> wf(new EulerEquationsWeakFormSemiImplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
-    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, (P_INIT == 0)));
+  // With NEWTON_KRYLOV, the semi-implicit weak form is the preconditioner.
+  WeakFormSharedPtr<double> wf(SSP_RK_ORDER == 0 || NEWTON_KRYLOV ?
+    (WeakForm<double>*)new EulerEquationsWeakFormSemiImplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, (P_INIT == 0)) :
+    (WeakForm<double>*)new EulerEquationsWeakFormExplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e));
+  if (NEWTON_KRYLOV)
+  {
+    // The residual for the Newton-Krylov solver.
+    WeakFormSharedPtr<double> wf_residual(new EulerEquationsWeakFormExplicit(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers,
+      inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e));
+#include "../euler-time-loop-implicit.cpp"
+  }
+  else if (SSP_RK_ORDER == 0)
+  {
 #include "../euler-time-loop.cpp"
+  }
+  else
+  {
+#include "../euler-time-loop-explicit.cpp"
+  }
 }
\ No newline at end of file
@@ -24,6 +24,12 @@ const bool VTK_VISUALIZATION = true;
 // Set visual output for every nth step.
 const unsigned int EVERY_NTH_STEP = 100;
 
+// Checkpointing (file checkpoint.dat) every nth step / every n seconds, 0 switches either off.
+const int CHECKPOINT_EVERY_NTH_STEP = 0;
+const double CHECKPOINT_EVERY_N_SECONDS = 0.;
+// Set to "true" to continue from the checkpoint (if there is one).
+const bool CHECKPOINT_RESTART = false;
+
 // Shock capturing.
 enum shockCapturingType
 {
@@ -47,6 +53,20 @@ const int INIT_REF_NUM = 4;
 double CFL_NUMBER = 0.8;
 // Initial time step.
 double time_step_n = 1E-6;
+// Steady state by implicit pseudo time stepping with the Jacobian-free Newton-Krylov method (NewtonKrylovSolver in euler_util.h)
+// instead of the semi-implicit time stepping, see euler-time-loop-implicit.cpp.
+const bool NEWTON_KRYLOV = false;
+// The pseudo time steps are local (per element), their CFL number starts at NEWTON_KRYLOV_CFL_NUMBER and is ramped
+// according to the decrease of the residual (switched evolution relaxation) up to NEWTON_KRYLOV_MAX_CFL_NUMBER.
+const double NEWTON_KRYLOV_CFL_NUMBER = 10.;
+const double NEWTON_KRYLOV_MAX_CFL_NUMBER = 1E6;
+// Relative tolerance of Newton's method in a pseudo time step, maximum number of its iterations, relative tolerance of GMRES.
+const double NEWTON_TOLERANCE = 1E-3;
+const int NEWTON_MAX_ITER = 10;
+const double GMRES_TOLERANCE = 1E-2;
+// The pseudo time stepping stops when the density residual has dropped by this many orders of magnitude, or after the maximum number of steps.
+const double STEADY_STATE_RESIDUAL_ORDERS = 8.;
+const int STEADY_STATE_MAX_STEPS = 1000;
 
 // Equation parameters.
 // Exterior pressure (dimensionless).
@@ -96,7 +116,17 @@ int main(int argc, char* argv[])
   // Weak formulation.
   WeakFormSharedPtr<double> wf(new EulerEquationsWeakFormSemiImplicit(KAPPA, { RHO_EXT }, { V1_EXT }, { V2_EXT }, { P_EXT }, solid_wall_markers,
     inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, (P_INIT == 0)));
+  // The residual for the Newton-Krylov solver, wf is then its preconditioner.
+  WeakFormSharedPtr<double> wf_residual(new EulerEquationsWeakFormExplicit(KAPPA, { RHO_EXT }, { V1_EXT }, { V2_EXT }, { P_EXT }, solid_wall_markers,
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e));
 #pragma endregion
 
+  if (NEWTON_KRYLOV)
+  {
+#include "../euler-time-loop-implicit.cpp"
+  }
+  else
+  {
 #include "../euler-time-loop.cpp"
+  }
 }
\ No newline at end of file
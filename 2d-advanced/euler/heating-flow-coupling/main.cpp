@@ -55,6 +55,16 @@ const double KAPPA = 1.4;
 const double LAMBDA = 1e2;
 // heat_capacity.
 const double C_P = 1e-2;
+// Heat transfer coefficient between the gas and the temperature field.
+const double HEAT_TRANSFER_COEFFICIENT = 1e-1;
+
+// Partitioned coupling: the flow and the heat transfer are solved as two systems.
+// Solved concurrently on two threads with UMFPACK, sequentially with the other matrix solver backends (see PartitionedCoupling).
+const bool CONCURRENT_SOLVE = true;
+// Number of fixed-point sub-iterations per time step (0 - staggered, one solve of each system), and their tolerance
+// (relative change of the solution vectors).
+const int MAX_SUB_ITERATIONS = 0;
+const double SUB_ITERATION_TOLERANCE = 1e-6;
 
 // CFL value.
 const double CFL_NUMBER = 0.1;                               
@@ -99,7 +109,7 @@ int main(int argc, char* argv[])
   // Initialize boundary condition types and spaces with default shapesets.
   Hermes2D::DefaultEssentialBCConst<double> bc_temp_zero("Solid", 0.0);
   Hermes2D::DefaultEssentialBCConst<double> bc_temp_nonzero("Inlet", 1.0);
-  std::vector<Hermes2D::EssentialBoundaryCondition<double>*> bc_vector(&bc_temp_zero, &bc_temp_nonzero);
+  std::vector<Hermes2D::EssentialBoundaryCondition<double>*> bc_vector({&bc_temp_zero, &bc_temp_nonzero});
   EssentialBCs<double> bcs(bc_vector);
 
   SpaceSharedPtr<double> space_rho(new L2Space<double>(mesh, P_INIT_FLOW));
@@ -107,6 +117,7 @@ int main(int argc, char* argv[])
   SpaceSharedPtr<double> space_rho_v_y(new L2Space<double>(mesh, P_INIT_FLOW));
   SpaceSharedPtr<double> space_e(new L2Space<double>(mesh, P_INIT_FLOW));
   SpaceSharedPtr<double> space_temp(new H1Space<double>(mesh_heat, &bcs, P_INIT_HEAT));
+  std::vector<SpaceSharedPtr<double> > flow_spaces({space_rho, space_rho_v_x, space_rho_v_y, space_e});
   int ndof = Space<double>::get_num_dofs({space_rho, space_rho_v_x, space_rho_v_y, space_e, space_temp});
   Hermes::Mixins::Loggable::Static::info("ndof: %d", ndof);
 
@@ -116,6 +127,21 @@ int main(int argc, char* argv[])
   MeshFunctionSharedPtr<double> prev_rho_v_y(new ConstantSolution<double> (mesh, 0.0));
   MeshFunctionSharedPtr<double> prev_e(new InitialSolutionLinearProgress (mesh, QuantityCalculator::calc_energy(RHO_INITIAL_HIGH, RHO_INITIAL_HIGH * V1_EXT, RHO_INITIAL_HIGH * V2_EXT, P_INITIAL_HIGH, KAPPA), QuantityCalculator::calc_energy(RHO_INITIAL_LOW, RHO_INITIAL_LOW * V1_EXT, RHO_INITIAL_LOW * V2_EXT, P_INITIAL_LOW, KAPPA), MESH_SIZE));
   MeshFunctionSharedPtr<double> prev_temp(new ConstantSolution<double> (mesh_heat, 0.0));
+  std::vector<MeshFunctionSharedPtr<double> > prev_flow_slns({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e});
+
+  // The solutions of the current time step, which are the coupling fields: the heat transfer is driven by the flow ones,
+  // the flow by the temperature. Before the first time step, the initial conditions.
+  MeshFunctionSharedPtr<double> sln_rho(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> sln_rho_v_x(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> sln_rho_v_y(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> sln_e(new Solution<double>(mesh));
+  MeshFunctionSharedPtr<double> sln_temp(new Solution<double>(mesh_heat));
+  std::vector<MeshFunctionSharedPtr<double> > flow_slns({sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e});
+  OGProjection<double> ogProjection;
+  double* initial_vector = new double[ndof];
+  ogProjection.project_global({space_rho, space_rho_v_x, space_rho_v_y, space_e, space_temp}, {prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, prev_temp}, initial_vector);
+  Solution<double>::vector_to_solutions(initial_vector, {space_rho, space_rho_v_x, space_rho_v_y, space_e, space_temp}, {sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e, sln_temp});
+  delete [] initial_vector;
   
   // Filters for visualization of Mach number, pressure and entropy.
   MeshFunctionSharedPtr<double> pressure(new PressureFilter({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e}, KAPPA));
@@ -127,12 +153,6 @@ int main(int argc, char* argv[])
   ScalarView density_view("Density", new WinGeom(500, 0, 400, 300));
   ScalarView temperature_view("Temperature", new WinGeom(500, 400, 400, 300));
 
-  // Set up the solver, matrix, and rhs according to the solver selection.
-  SparseMatrix<double>* matrix = create_matrix<double>();
-  Vector<double>* rhs = create_vector<double>();
-  Vector<double>* rhs_stabilization = create_vector<double>();
-  Hermes::Solvers::LinearMatrixSolver<double>* solver = create_linear_solver<double>( matrix, rhs);
-
   // Set up stability calculation class.
   CFLCalculation CFL(CFL_NUMBER, KAPPA);
   ADEStabilityCalculation ADES(ADVECTION_STABILITY_CONSTANT, DIFFUSION_STABILITY_CONSTANT, LAMBDA);
@@ -147,62 +167,63 @@ int main(int argc, char* argv[])
   inlet_markers.push_back(BDY_INLET);
   std::vector<std::string> outlet_markers;
 
-  EulerEquationsWeakFormSemiImplicitCoupledWithHeat wf(KAPPA, RHO_EXT, V1_EXT, V2_EXT, P_EXT, solid_wall_markers, 
-    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, prev_temp, LAMBDA, C_P);
-  
-  // Initialize the FE problem.
-  std::vector<SpaceSharedPtr<double> > spaces(space_rho, space_rho_v_x, space_rho_v_y, space_e, space_temp);
-  Space<double>::assign_dofs(spaces);
-  DiscreteProblem<double> dp(wf, spaces);
-  dp.set_linear();
+  // The flow and the heat transfer, each one on its own mesh, with its own system.
+  WeakFormSharedPtr<double> wf_flow(new EulerEquationsWeakFormSemiImplicitCoupledWithHeat(KAPPA, {RHO_EXT}, {V1_EXT}, {V2_EXT}, {P_EXT}, solid_wall_markers, 
+    inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, sln_temp, HEAT_TRANSFER_COEFFICIENT));
+  WeakFormSharedPtr<double> wf_heat(new HeatEquationWeakFormCoupledWithFlow(KAPPA, LAMBDA, C_P, HEAT_TRANSFER_COEFFICIENT, prev_temp,
+    sln_rho, sln_rho_v_x, sln_rho_v_y, sln_e));
+
+  // Every one of the two systems is solved with the other one's solution of the previous (sub-)iteration.
+  PartitionedCoupling coupling(wf_flow, flow_spaces, flow_slns, wf_heat, {space_temp}, {sln_temp});
+  coupling.set_sub_iterations(MAX_SUB_ITERATIONS, SUB_ITERATION_TOLERANCE);
+  coupling.set_concurrent(CONCURRENT_SOLVE);
+
+  // Created in the first time step and re-used, the detector keeps its data about the mesh.
+  FluxLimiter* flux_limiter = NULL;
 
   // Time stepping loop.
   for(; ; t += time_step)
   {
     Hermes::Mixins::Loggable::Static::info("---- Time step %d, time %3.5f.", iteration++, t);
 
-    // Set the current time step.
-    wf.set_current_time_step(time_step);
-
-    // Assemble the stiffness matrix and rhs.
-    Hermes::Mixins::Loggable::Static::info("Assembling the stiffness matrix and right-hand side vector.");
-    dp.assemble(matrix, rhs);
-
-    // Solve the matrix problem.
-    Hermes::Mixins::Loggable::Static::info("Solving the matrix problem.");
-    solver->solve();
+    // Solve the flow and the heat transfer.
+    Hermes::Mixins::Loggable::Static::info("Solving the flow and the heat transfer.");
+    int sub_iterations = coupling.solve(time_step);
+    if(MAX_SUB_ITERATIONS > 0)
+      Hermes::Mixins::Loggable::Static::info("Sub-iterations: %d, relative change: %g.", sub_iterations, coupling.get_change());
+    double* flow_vector = coupling.get_sln_vector(0);
   
-    if(!SHOCK_CAPTURING)
-    {
-      Solution<double>::vector_to_solutions(solver->get_sln_vector(),{space_rho, space_rho_v_x, 
-        space_rho_v_y, space_e, space_temp},{prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, prev_temp});
-    }
-    else
+    if(SHOCK_CAPTURING)
     {
-      FluxLimiter* flux_limiter;
-      if(SHOCK_CAPTURING_TYPE == KUZMIN)
-        flux_limiter = new FluxLimiter(FluxLimiter::Kuzmin, solver->get_sln_vector(),{space_rho, space_rho_v_x, 
-        space_rho_v_y, space_e}, true);
+      if(!flux_limiter)
+      {
+        if(SHOCK_CAPTURING_TYPE == KUZMIN)
+          flux_limiter = new FluxLimiter(FluxLimiter::Kuzmin, flow_vector, flow_spaces, true);
+        else
+          flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, flow_vector, flow_spaces);
+      }
       else
-        flux_limiter = new FluxLimiter(FluxLimiter::Krivodonova, solver->get_sln_vector(),{space_rho, space_rho_v_x, 
-        space_rho_v_y, space_e});
+        flux_limiter->set_solution_vector(flow_vector);
 
       if(SHOCK_CAPTURING_TYPE == KUZMIN)
         flux_limiter->limit_second_orders_according_to_detector();
 
       flux_limiter->limit_according_to_detector();
 
-      flux_limiter->get_limited_solutions({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e});
-
-      Solution<double>::vector_to_solution(solver->get_sln_vector() + Space<double>::get_num_dofs({space_rho, space_rho_v_x, 
-        space_rho_v_y, space_e}), space_temp, prev_temp);
+      // The limited flow is also the coupling field of the next time step.
+      Solution<double>::vector_to_solutions(flow_vector, flow_spaces, flow_slns);
     }
 
-    CFL.calculate_semi_implicit({prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e}, mesh, time_step);
+    // The new time level.
+    Solution<double>::vector_to_solutions(flow_vector, flow_spaces, prev_flow_slns);
+    Solution<double>::vector_to_solution(coupling.get_sln_vector(1), space_temp, prev_temp);
+
+    // The limiters work in place on the flow vector, the time steps are calculated from its element means.
+    CFL.calculate_semi_implicit(flow_spaces, flow_vector, time_step);
 
     double util_time_step = time_step;
 
-    ADES.calculate({prev_rho, prev_rho_v_x, prev_rho_v_y}, mesh, util_time_step);
+    ADES.calculate({space_rho, space_rho_v_x, space_rho_v_y}, flow_vector, util_time_step);
 
     if(util_time_step < time_step)
       time_step = util_time_step;
@@ -237,6 +258,7 @@ int main(int argc, char* argv[])
   velocity_view.close();
   density_view.close();
   temperature_view.close();
-  
+
+  delete flux_limiter;
   return 0;
 }
@@ -25,6 +25,12 @@ const bool HERMES_VISUALIZATION = true;
 const bool VTK_VISUALIZATION = false;
 // Set visual output for every nth step.
 const unsigned int EVERY_NTH_STEP = 1;
+
+// Checkpointing (file checkpoint.dat) every nth step / every n seconds, 0 switches either off.
+const int CHECKPOINT_EVERY_NTH_STEP = 0;
+const double CHECKPOINT_EVERY_N_SECONDS = 0.;
+// Set to "true" to continue from the checkpoint (if there is one).
+const bool CHECKPOINT_RESTART = false;
 // Shock capturing.
 enum shockCapturingType
 {
@@ -49,10 +55,18 @@ const int INIT_REF_NUM = 1;
 double CFL_NUMBER = 0.1;
 // Initial time step.
 double time_step_n = 1E-6;
+// Local time stepping (explicit, first order in time): every element is advanced by the largest time step
+// (a power-of-two fraction of the global one) its own CFL condition allows, so that the small refined elements
+// do not dictate the time step of the whole mesh.
+const bool LOCAL_TIME_STEPPING = false;
+// Number of time step levels, the finest elements make 2^(LTS_LEVELS - 1) substeps per time step.
+const int LTS_LEVELS = 4;
 double TIME_INTERVAL_LENGTH = 20.;
 
-// Every UNREF_FREQth time step the mesh is unrefined.
+// Every UNREF_FREQth time step the mesh is unrefined where it is not needed anymore: the sons of an element
+// are merged (and the orders lowered) if their error indicators relative to the average one sum below DEREFINEMENT_THRESHOLD.
 const int UNREF_FREQ = 5;
+const double DEREFINEMENT_THRESHOLD = 0.1;
 
 // Number of mesh refinements between two unrefinements.
 // The mesh is not unrefined unless there has been a refinement since
@@ -68,6 +82,12 @@ const double THRESHOLD = 0.3;
 // H2D_HP_ANISO_H, H2D_HP_ANISO_P, H2D_HP_ANISO.
 CandList CAND_LIST = H2D_HP_ANISO;
 
+// Adaptivity without the reference solution: the elements marked by the discontinuity detector are refined, the orders
+// follow the smoothness of the coarse solution, and the time step is made on the coarse mesh only.
+const bool DETECTOR_ADAPTIVITY = false;
+// The maximum number of refinements of an initial element in that case.
+const int MAX_REFINEMENT_LEVEL = 4;
+
 // Maximum polynomial degree used. -1 for unlimited.
 // See User Documentation for details.
 const int MAX_P_ORDER = 1;
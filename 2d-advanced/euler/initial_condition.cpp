@@ -2,9 +2,8 @@
 class ConcentrationTimedepEssentialBC : public EssentialBoundaryCondition<double> {
 public:
   ConcentrationTimedepEssentialBC(std::string marker, double constant, double startup_time) 
-           : EssentialBoundaryCondition<double>(std::vector<std::string>()), startup_time(startup_time), constant(constant)
+           : EssentialBoundaryCondition<double>(marker), startup_time(startup_time), constant(constant)
   {
-    markers.push_back(marker);
   }
 
   ~ConcentrationTimedepEssentialBC() {};
@@ -13,7 +12,7 @@ public:
     return BC_FUNCTION; 
   }
 
-  virtual double value(double x, double y, double n_x, double n_y, double t_x, double t_y) const
+  virtual double value(double x, double y) const
   {
     if(this->get_current_time() < startup_time)
       return 0.0;
@@ -1,4 +1,5 @@
 #include "numerical_flux.h"
+#include <algorithm>
 
 NumericalFlux::NumericalFlux(double kappa) : kappa(kappa)
 {
@@ -32,6 +33,104 @@ void NumericalFlux::f_1(double result[4], double state[4])
   result[3] = (state[1] / state[0]) * (state[3] + QuantityCalculator::calc_pressure(state[0], state[1], state[2], state[3], kappa));
 }
 
+void NumericalFlux::numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+  const double* nx, const double* ny)
+{
+  double w_L_point[4], w_R_point[4], result_point[4];
+  for (int point = 0; point < n; point++)
+  {
+    for (unsigned int k = 0; k < 4; k++)
+    {
+      w_L_point[k] = w_L[k][point];
+      w_R_point[k] = w_R[k][point];
+    }
+    numerical_flux(result_point, w_L_point, w_R_point, nx[point], ny[point]);
+    for (unsigned int k = 0; k < 4; k++)
+      result[k][point] = result_point[k];
+  }
+}
+
+// Calculates A^+(q) * p (for plus == true), or A^-(q) * p, where q, p are already rotated into the local coordinate system.
+// This is the same as P_plus / P_minus, only without the member state and without assembling T, T^{-1}:
+// the eigenvalue u is double, so its part of T * Lambda * T^{-1} is u times the complement of the two acoustic projections.
+// There are no branches, so that loops calling this can be vectorized over the points.
+static inline void steger_warming_split(double& result_0, double& result_1, double& result_2, double& result_3,
+  double q_0, double q_1, double q_2, double q_3, double p_0, double p_1, double p_2, double p_3, double kappa, bool plus)
+{
+  double u = q_1 / q_0;
+  double v = q_2 / q_0;
+  double V = u*u + v*v;
+
+  // Speed of sound, limited as in QuantityCalculator.
+  double pressure = (kappa - 1.0) * (q_3 - q_0 * V / 2.0);
+  pressure = pressure < 1E-12 ? 1E-12 : pressure;
+  double a = std::sqrt(kappa * pressure / q_0);
+  a = a < 1E-12 ? 1E-12 : a;
+
+  double lambda_1 = plus ? std::max(u - a, 0.0) : std::min(u - a, 0.0);
+  double lambda_2 = plus ? std::max(u, 0.0) : std::min(u, 0.0);
+  double lambda_4 = plus ? std::max(u + a, 0.0) : std::min(u + a, 0.0);
+
+  // Projections of p onto the acoustic eigenvectors (first and last row of T^{-1}).
+  double a_sqr_inv = 1.0 / (a * a);
+  double alpha_1 = a_sqr_inv * (0.5 * (((kappa - 1.0) * V / 2.0) + u * a) * p_0 - ((a + u * (kappa - 1.0)) / 2.0) * p_1
+    - (v * (kappa - 1.0) / 2.0) * p_2 + ((kappa - 1.0) / 2.0) * p_3);
+  double alpha_4 = a_sqr_inv * (0.5 * (((kappa - 1.0) * V / 2.0) - u * a) * p_0 + ((a - u * (kappa - 1.0)) / 2.0) * p_1
+    - (v * (kappa - 1.0) / 2.0) * p_2 + ((kappa - 1.0) / 2.0) * p_3);
+
+  double coeff_1 = (lambda_1 - lambda_2) * alpha_1;
+  double coeff_4 = (lambda_4 - lambda_2) * alpha_4;
+  double enthalpy = (V / 2.0) + (a * a / (kappa - 1.0));
+
+  result_0 = lambda_2 * p_0 + coeff_1 + coeff_4;
+  result_1 = lambda_2 * p_1 + coeff_1 * (u - a) + coeff_4 * (u + a);
+  result_2 = lambda_2 * p_2 + (coeff_1 + coeff_4) * v;
+  result_3 = lambda_2 * p_3 + coeff_1 * (enthalpy - u * a) + coeff_4 * (enthalpy + u * a);
+}
+
+// Calculates the matrix P^+(w) = Q^{-1} A^+(Q w) Q (for plus == true), or P^-(w), in closed form.
+// A^{+/-} = lambda_2 I + (lambda_1 - lambda_2) r_1 l_1^T + (lambda_4 - lambda_2) r_4 l_4^T, where r_1, r_4 (l_1, l_4) are the acoustic
+// columns of T (rows of T^{-1}), see steger_warming_split(). The rotation is applied to r_1, r_4, l_1, l_4 directly,
+// so the velocity, speed of sound and enthalpy are calculated only once.
+// The matrix is stored column by column: result[4 * j + i] is the entry (i, j).
+static inline void steger_warming_split_matrix(double result[16], const double w[4], double nx, double ny, double kappa, bool plus)
+{
+  double v_x = w[1] / w[0];
+  double v_y = w[2] / w[0];
+  double V = v_x*v_x + v_y*v_y;
+  // Normal velocity (= u in the local coordinate system).
+  double u = nx * v_x + ny * v_y;
+
+  // Speed of sound, limited as in QuantityCalculator.
+  double pressure = (kappa - 1.0) * (w[3] - w[0] * V / 2.0);
+  pressure = pressure < 1E-12 ? 1E-12 : pressure;
+  double a = std::sqrt(kappa * pressure / w[0]);
+  a = a < 1E-12 ? 1E-12 : a;
+
+  double lambda_1 = plus ? std::max(u - a, 0.0) : std::min(u - a, 0.0);
+  double lambda_2 = plus ? std::max(u, 0.0) : std::min(u, 0.0);
+  double lambda_4 = plus ? std::max(u + a, 0.0) : std::min(u + a, 0.0);
+
+  // The factor 1 / a^2 of T^{-1} is included here.
+  double coeff_1 = (lambda_1 - lambda_2) / (a * a);
+  double coeff_4 = (lambda_4 - lambda_2) / (a * a);
+  double enthalpy = (V / 2.0) + (a * a / (kappa - 1.0));
+
+  double r_1[4] = { 1.0, v_x - a * nx, v_y - a * ny, enthalpy - u * a };
+  double r_4[4] = { 1.0, v_x + a * nx, v_y + a * ny, enthalpy + u * a };
+  double l_1[4] = { 0.5 * (((kappa - 1.0) * V / 2.0) + u * a), -(a * nx + (kappa - 1.0) * v_x) / 2.0, -(a * ny + (kappa - 1.0) * v_y) / 2.0, (kappa - 1.0) / 2.0 };
+  double l_4[4] = { 0.5 * (((kappa - 1.0) * V / 2.0) - u * a), (a * nx - (kappa - 1.0) * v_x) / 2.0, (a * ny - (kappa - 1.0) * v_y) / 2.0, (kappa - 1.0) / 2.0 };
+
+  for (unsigned int j = 0; j < 4; j++)
+  {
+    double l_1_j = coeff_1 * l_1[j];
+    double l_4_j = coeff_4 * l_4[j];
+    for (unsigned int i = 0; i < 4; i++)
+      result[4 * j + i] = r_1[i] * l_1_j + r_4[i] * l_4_j;
+    result[4 * j + j] += lambda_2;
+  }
+}
+
 VijayasundaramNumericalFlux::VijayasundaramNumericalFlux(double kappa) : StegerWarmingNumericalFlux(kappa), fluxes(EulerFluxes(kappa))
 {
 }
@@ -39,55 +138,8 @@ VijayasundaramNumericalFlux::VijayasundaramNumericalFlux(double kappa) : StegerW
 void VijayasundaramNumericalFlux::numerical_flux(double result[4], double w_L[4], double w_R[4],
   double nx, double ny)
 {
+  // A^+(w_L + w_R) * w_L + A^-(w_L + w_R) * w_R.
   double result_temp[4];
-  double result_1, result_2;
-  double w[4];
-  w[0] = w_L[0];
-  w[1] = w_L[1];
-  w[2] = w_L[2];
-  w[3] = w_L[3];
-
-  result_1 = fluxes.A_1_0_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_0_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_0_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_0_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_0_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_0_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_0_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_0_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[0] = result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_1_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_1_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_1_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_1_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_1_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_1_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_1_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_1_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[1] = result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_2_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_2_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_2_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_2_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_2_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_2_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_2_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_2_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[2] = result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_3_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_3_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_3_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_3_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_3_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_3_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_3_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_3_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[3] = result_1 * nx + result_2 * ny;
-
-  //////////////
-  w[0] = w_R[0];
-  w[1] = w_R[1];
-  w[2] = w_R[2];
-  w[3] = w_R[3];
-
-  result_1 = fluxes.A_1_0_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_0_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_0_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_0_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_0_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_0_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_0_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_0_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[0] += result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_1_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_1_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_1_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_1_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_1_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_1_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_1_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_1_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[1] += result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_2_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_2_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_2_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_2_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_2_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_2_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_2_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_2_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[2] += result_1 * nx + result_2 * ny;
-
-  result_1 = fluxes.A_1_3_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_1_3_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_1_3_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_1_3_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_2 = fluxes.A_2_3_0(w[0], w[1], w[2], w[3]) * w[0] + fluxes.A_2_3_1(w[0], w[1], w[2], w[3]) * w[1] + fluxes.A_2_3_2(w[0], w[1], w[2], w[3]) * w[2] + fluxes.A_2_3_3(w[0], w[1], w[2], w[3]) * w[3];
-  result_temp[3] += result_1 * nx + result_2 * ny;
-
-  for (unsigned int i = 0; i < 4; i++)
-    result[i] = result_temp[i] / 2.;
-
   double w_mean[4];
   w_mean[0] = w_L[0] + w_R[0];
   w_mean[1] = w_L[1] + w_R[1];
@@ -99,6 +151,42 @@ void VijayasundaramNumericalFlux::numerical_flux(double result[4], double w_L[4]
     result[i] += result_temp[i];
 }
 
+void VijayasundaramNumericalFlux::numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+  const double* nx, const double* ny)
+{
+  // A^+(w_L + w_R) * w_L + A^-(w_L + w_R) * w_R, as in numerical_flux().
+  // Local copies, so that the compiler knows these do not change in the loop.
+  const double *rho_L = w_L[0], *rho_v_x_L = w_L[1], *rho_v_y_L = w_L[2], *e_L = w_L[3];
+  const double *rho_R = w_R[0], *rho_v_x_R = w_R[1], *rho_v_y_R = w_R[2], *e_R = w_R[3];
+  double *result_0 = result[0], *result_1 = result[1], *result_2 = result[2], *result_3 = result[3];
+  double kappa = this->kappa;
+
+#pragma omp simd
+  for (int point = 0; point < n; point++)
+  {
+    double q_L_0 = rho_L[point];
+    double q_L_1 = nx[point] * rho_v_x_L[point] + ny[point] * rho_v_y_L[point];
+    double q_L_2 = -ny[point] * rho_v_x_L[point] + nx[point] * rho_v_y_L[point];
+    double q_L_3 = e_L[point];
+    double q_R_0 = rho_R[point];
+    double q_R_1 = nx[point] * rho_v_x_R[point] + ny[point] * rho_v_y_R[point];
+    double q_R_2 = -ny[point] * rho_v_x_R[point] + nx[point] * rho_v_y_R[point];
+    double q_R_3 = e_R[point];
+
+    double plus_0, plus_1, plus_2, plus_3, minus_0, minus_1, minus_2, minus_3;
+    steger_warming_split(plus_0, plus_1, plus_2, plus_3, q_L_0 + q_R_0, q_L_1 + q_R_1, q_L_2 + q_R_2, q_L_3 + q_R_3,
+      q_L_0, q_L_1, q_L_2, q_L_3, kappa, true);
+    steger_warming_split(minus_0, minus_1, minus_2, minus_3, q_L_0 + q_R_0, q_L_1 + q_R_1, q_L_2 + q_R_2, q_L_3 + q_R_3,
+      q_R_0, q_R_1, q_R_2, q_R_3, kappa, false);
+
+    // Rotate back.
+    result_0[point] = plus_0 + minus_0;
+    result_1[point] = nx[point] * (plus_1 + minus_1) - ny[point] * (plus_2 + minus_2);
+    result_2[point] = ny[point] * (plus_1 + minus_1) + nx[point] * (plus_2 + minus_2);
+    result_3[point] = plus_3 + minus_3;
+  }
+}
+
 StegerWarmingNumericalFlux::StegerWarmingNumericalFlux(double kappa) : NumericalFlux(kappa) {};
 
 void StegerWarmingNumericalFlux::numerical_flux(double result[4], double w_L[4], double w_R[4],
@@ -119,124 +207,78 @@ double StegerWarmingNumericalFlux::numerical_flux_i(int component, double w_L[4]
   return result[component];
 }
 
-void StegerWarmingNumericalFlux::P_plus(double* result, double w[4], double param[4],
-  double nx, double ny)
+void StegerWarmingNumericalFlux::numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+  const double* nx, const double* ny)
 {
-  Q(q, w, nx, ny);
-
-  // Initialize the matrices.
-  double T[4][4];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      T[i][j] = 0.0;
-
-  double T_inv[4][4];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      T_inv[i][j] = 0.0;
-
-  // Calculate Lambda^+.
-  Lambda_plus(result);
-
-  // Calculate the necessary rows / columns of T(T_inv).
-  if (result[0] > 0) {
-    T_1(T);
-    T_inv_1(T_inv);
-  }
-  if (result[1] > 0) {
-    T_2(T);
-    T_inv_2(T_inv);
-  }
-  if (result[2] > 0) {
-    T_3(T);
-    T_inv_3(T_inv);
-  }
-  if (result[3] > 0) {
-    T_4(T);
-    T_inv_4(T_inv);
+  // Local copies, so that the compiler knows these do not change in the loop.
+  const double *rho_L = w_L[0], *rho_v_x_L = w_L[1], *rho_v_y_L = w_L[2], *e_L = w_L[3];
+  const double *rho_R = w_R[0], *rho_v_x_R = w_R[1], *rho_v_y_R = w_R[2], *e_R = w_R[3];
+  double *result_0 = result[0], *result_1 = result[1], *result_2 = result[2], *result_3 = result[3];
+  double kappa = this->kappa;
+
+#pragma omp simd
+  for (int point = 0; point < n; point++)
+  {
+    double q_L_0 = rho_L[point];
+    double q_L_1 = nx[point] * rho_v_x_L[point] + ny[point] * rho_v_y_L[point];
+    double q_L_2 = -ny[point] * rho_v_x_L[point] + nx[point] * rho_v_y_L[point];
+    double q_L_3 = e_L[point];
+    double q_R_0 = rho_R[point];
+    double q_R_1 = nx[point] * rho_v_x_R[point] + ny[point] * rho_v_y_R[point];
+    double q_R_2 = -ny[point] * rho_v_x_R[point] + nx[point] * rho_v_y_R[point];
+    double q_R_3 = e_R[point];
+
+    double plus_0, plus_1, plus_2, plus_3, minus_0, minus_1, minus_2, minus_3;
+    steger_warming_split(plus_0, plus_1, plus_2, plus_3, q_L_0, q_L_1, q_L_2, q_L_3,
+      q_L_0, q_L_1, q_L_2, q_L_3, kappa, true);
+    steger_warming_split(minus_0, minus_1, minus_2, minus_3, q_R_0, q_R_1, q_R_2, q_R_3,
+      q_R_0, q_R_1, q_R_2, q_R_3, kappa, false);
+
+    // Rotate back.
+    result_0[point] = plus_0 + minus_0;
+    result_1[point] = nx[point] * (plus_1 + minus_1) - ny[point] * (plus_2 + minus_2);
+    result_2[point] = ny[point] * (plus_1 + minus_1) + nx[point] * (plus_2 + minus_2);
+    result_3[point] = plus_3 + minus_3;
   }
+}
 
-  // The matrix T * Lambda * T^{-1}
-  double diag_inv[4][4];
-  double A_1[4][4];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      diag_inv[i][j] = result[i] * T_inv[i][j];
+void StegerWarmingNumericalFlux::P_plus(double* result, double w[4], double param[4],
+  double nx, double ny)
+{
+  double P[16];
+  steger_warming_split_matrix(P, w, nx, ny, kappa, true);
+  // result may be the same array as param.
+  double p_0 = param[0], p_1 = param[1], p_2 = param[2], p_3 = param[3];
   for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++) {
-    A_1[i][j] = 0;
-    for (unsigned int k = 0; k < 4; k++)
-      A_1[i][j] += T[i][k] * diag_inv[k][j];
-    }
-
-  // Finale.
-  Q(param, param, nx, ny);
-  for (unsigned int i = 0; i < 4; i++) {
-    result[i] = 0;
-    for (unsigned int j = 0; j < 4; j++)
-      result[i] += A_1[i][j] * param[j];
-  }
-  Q_inv(result, result, nx, ny);
+    result[i] = P[i] * p_0 + P[4 + i] * p_1 + P[8 + i] * p_2 + P[12 + i] * p_3;
 }
 
 void StegerWarmingNumericalFlux::P_minus(double* result, double w[4], double param[4],
   double nx, double ny)
 {
-  Q(q, w, nx, ny);
-
-  // Initialize the matrices.
-  double T[4][4];
+  double P[16];
+  steger_warming_split_matrix(P, w, nx, ny, kappa, false);
+  // result may be the same array as param.
+  double p_0 = param[0], p_1 = param[1], p_2 = param[2], p_3 = param[3];
   for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      T[i][j] = 0.0;
-
-  double T_inv[4][4];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      T_inv[i][j] = 0.0;
-
-  // Calculate Lambda^-.
-  Lambda_minus(result);
+    result[i] = P[i] * p_0 + P[4 + i] * p_1 + P[8 + i] * p_2 + P[12 + i] * p_3;
+}
 
-  // Calculate the necessary rows / columns of T(T_inv).
-  if (result[0] < 0) {
-    T_1(T);
-    T_inv_1(T_inv);
-  }
-  if (result[1] < 0) {
-    T_2(T);
-    T_inv_2(T_inv);
-  }
-  if (result[2] < 0) {
-    T_3(T);
-    T_inv_3(T_inv);
-  }
-  if (result[3] < 0) {
-    T_4(T);
-    T_inv_4(T_inv);
-  }
+void StegerWarmingNumericalFlux::P_plus_matrix(double result[16], double w[4], double nx, double ny)
+{
+  steger_warming_split_matrix(result, w, nx, ny, kappa, true);
+}
 
-  // The matrix T * Lambda * T^{-1}
-  double diag_inv[4][4];
-  double A_1[4][4];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++)
-      diag_inv[i][j] = result[i] * T_inv[i][j];
-  for (unsigned int i = 0; i < 4; i++)
-    for (unsigned int j = 0; j < 4; j++) {
-    A_1[i][j] = 0;
-    for (unsigned int k = 0; k < 4; k++)
-      A_1[i][j] += T[i][k] * diag_inv[k][j];
-    }
+void StegerWarmingNumericalFlux::P_minus_matrix(double result[16], double w[4], double nx, double ny)
+{
+  steger_warming_split_matrix(result, w, nx, ny, kappa, false);
+}
 
-  // Finale.
-  Q(param, param, nx, ny);
-  for (unsigned int i = 0; i < 4; i++) {
-    result[i] = 0;
-    for (unsigned int j = 0; j < 4; j++)
-      result[i] += A_1[i][j] * param[j];
-  }
-  Q_inv(result, result, nx, ny);
+void StegerWarmingNumericalFlux::P_matrices(double P_plus_result[16], double w_L[4], double P_minus_result[16], double w_R[4],
+  double nx, double ny)
+{
+  steger_warming_split_matrix(P_plus_result, w_L, nx, ny, kappa, true);
+  steger_warming_split_matrix(P_minus_result, w_R, nx, ny, kappa, false);
 }
 
 void StegerWarmingNumericalFlux::Lambda_plus(double result[4])
@@ -899,6 +941,24 @@ double OsherSolomonNumericalFlux::numerical_flux_i(int component, double w_L[4],
   return result[component];
 }
 
+void OsherSolomonNumericalFlux::numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+  const double* nx, const double* ny)
+{
+  double w_L_point[4], w_R_point[4], result_point[4];
+  for (int point = 0; point < n; point++)
+  {
+    for (unsigned int k = 0; k < 4; k++)
+    {
+      w_L_point[k] = w_L[k][point];
+      w_R_point[k] = w_R[k][point];
+    }
+    // Statically bound call.
+    OsherSolomonNumericalFlux::numerical_flux(result_point, w_L_point, w_R_point, nx[point], ny[point]);
+    for (unsigned int k = 0; k < 4; k++)
+      result[k][point] = result_point[k];
+  }
+}
+
 /*
 double NumericalFlux::f_x(int component, double w0, double w1, double w3, double w4)
 {
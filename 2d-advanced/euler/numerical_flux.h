@@ -17,6 +17,13 @@ public:
   virtual double numerical_flux_i(int component, double w_L[4], double w_R[4],
           double nx, double ny) = 0;
 
+  /// Calculates all components of the flux in n points at once (typically all quadrature points of an edge).
+  /// The states are passed as structure-of-arrays, i.e. w_L[k][point] is the k-th quantity (rho, rho_v_x, rho_v_y, e)
+  /// in the given point, the result is stored in the same layout.
+  /// The default implementation calls numerical_flux() point by point, the descendants provide kernels vectorized over the points.
+  virtual void numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+          const double* nx, const double* ny);
+
   virtual void numerical_flux_solid_wall(double result[4], double w_L[4], double nx, double ny) = 0;
   
   virtual double numerical_flux_solid_wall_i(int component, double w_L[4], double nx, double ny) = 0;
@@ -54,12 +61,29 @@ public:
   virtual double numerical_flux_i(int component, double w_L[4], double w_R[4],
           double nx, double ny);
 
+  virtual void numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+          const double* nx, const double* ny);
+
+  /// Calculates P^+(w) * param, where P^+ is the positive part of the flux Jacobian in the direction (nx, ny).
+  /// param is left untouched.
   void P_plus(double* result, double w[4], double param[4],
           double nx, double ny);
 
+  /// Calculates P^-(w) * param, see P_plus().
   void P_minus(double* result, double w[4], double param[4],
           double nx, double ny);
 
+  /// Calculates the whole matrix P^+(w) in closed form.
+  /// The matrix is stored column by column, i.e. result[4 * j + i] is the entry (i, j).
+  void P_plus_matrix(double result[16], double w[4], double nx, double ny);
+
+  /// Calculates the whole matrix P^-(w), see P_plus_matrix().
+  void P_minus_matrix(double result[16], double w[4], double nx, double ny);
+
+  /// Calculates P^+(w_L) and P^-(w_R) in one call, the layout is as in P_plus_matrix().
+  void P_matrices(double P_plus_result[16], double w_L[4], double P_minus_result[16], double w_R[4],
+          double nx, double ny);
+
   // Also calculates the speed of sound.
   void Lambda_plus(double result[4]);
 
@@ -126,6 +150,9 @@ public:
 
   virtual void numerical_flux(double result[4], double w_L[4], double w_R[4],
           double nx, double ny);
+
+  virtual void numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+          const double* nx, const double* ny);
 };
 
 
@@ -136,10 +163,15 @@ public:
 
   virtual void numerical_flux(double result[4], double w_L[4], double w_R[4],
           double nx, double ny);
-  
+
   virtual double numerical_flux_i(int component, double w_L[4], double w_R[4],
           double nx, double ny);
 
+  /// The Riemann solver table is evaluated branch by branch, so the points are not vectorized,
+  /// but the per-point virtual dispatch is avoided.
+  virtual void numerical_flux_batch(int n, double* result[4], const double* const w_L[4], const double* const w_R[4],
+          const double* nx, const double* ny);
+
   virtual void numerical_flux_solid_wall(double result[4], double w_L[4], double nx, double ny);
   
   virtual double numerical_flux_solid_wall_i(int component, double w_L[4], double nx, double ny);
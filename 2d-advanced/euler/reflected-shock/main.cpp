@@ -27,6 +27,12 @@ const bool VTK_VISUALIZATION = true;
 // Set visual output for every nth step.
 const unsigned int EVERY_NTH_STEP = 1;
 
+// Checkpointing (file checkpoint.dat) every nth step / every n seconds, 0 switches either off.
+const int CHECKPOINT_EVERY_NTH_STEP = 0;
+const double CHECKPOINT_EVERY_N_SECONDS = 0.;
+// Set to "true" to continue from the checkpoint (if there is one).
+const bool CHECKPOINT_RESTART = false;
+
 // Shock capturing.
 enum shockCapturingType
 {
@@ -51,6 +57,9 @@ const int INIT_REF_NUM = 4;
 double CFL_NUMBER = 0.5;
 // Initial time step.
 double time_step_n = 0.01;
+// Time integration: 0 - semi-implicit (a linear system with the flux Jacobians is solved in each time step),
+// 1, 2, 3 - explicit SSP Runge-Kutta of this order (much cheaper time steps, but a smaller CFL_NUMBER is needed).
+const int SSP_RK_ORDER = 0;
 
 double KAPPA = 1.4;
 
@@ -113,8 +122,17 @@ int main(int argc, char* argv[])
 	std::vector<MeshFunctionSharedPtr<double> > prev_slns({ prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e });
 
 	// Weak formulation.
-	WeakFormSharedPtr<double> wf(new EulerEquationsWeakFormSemiImplicit(KAPPA, rho_ext, v1_ext, v2_ext, pressure_ext, solid_wall_markers, inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, (P_INIT == 0)));
+	WeakFormSharedPtr<double> wf(SSP_RK_ORDER == 0 ?
+		(WeakForm<double>*)new EulerEquationsWeakFormSemiImplicit(KAPPA, rho_ext, v1_ext, v2_ext, pressure_ext, solid_wall_markers, inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e, (P_INIT == 0)) :
+		(WeakForm<double>*)new EulerEquationsWeakFormExplicit(KAPPA, rho_ext, v1_ext, v2_ext, pressure_ext, solid_wall_markers, inlet_markers, outlet_markers, prev_rho, prev_rho_v_x, prev_rho_v_y, prev_e));
 #pragma endregion
 
+	if (SSP_RK_ORDER == 0)
+	{
 #include "../euler-time-loop.cpp"
+	}
+	else
+	{
+#include "../euler-time-loop-explicit.cpp"
+	}
 }
\ No newline at end of file
@@ -5,6 +5,11 @@ macro(SET_COMMON_TARGET_PROPERTIES TRGT HERMES_VERSION)
 	target_link_libraries(${TRGT} ${HERMES_COMMON_LIBRARY})
 	target_link_libraries(${TRGT} ${HERMES_LIBRARY} ${MATIO_LIBRARY} ${BSON_LIBRARY})
 	target_link_libraries(${TRGT} ${TESTING_CORE_LIBRARY})
+	# std::thread (background output writers).
+	target_link_libraries(${TRGT} ${PTHREAD_LIBRARY})
+
+	# Is empty if WITH_ZLIB = NO
+	target_link_libraries(${TRGT} ${ZLIB_LIBRARIES})
 
 	# Is empty if WITH_TRILINOS = NO
 	target_link_libraries(${TRGT} ${TRILINOS_LIBRARIES})